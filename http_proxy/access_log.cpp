@@ -0,0 +1,244 @@
+#include <iostream>
+
+extern "C" {
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+}
+
+#include "access_log.h"
+
+using namespace std;
+
+typedef char access_record_size_check[sizeof(AccessRecord) == 128 ? 1 : -1];
+typedef char access_header_size_check[sizeof(AccessLogHeader) == 64 ? 1 : -1];
+
+void access_record_set_addr(uint8_t *addr, const char *ip)
+{
+    memset(addr, 0, 16);
+    if (!ip || !*ip)
+        return;
+    if (strchr(ip, ':')) {
+        inet_pton(AF_INET6, ip, addr);
+        return;
+    }
+    addr[10] = addr[11] = 0xff;
+    inet_pton(AF_INET, ip, addr + 12);
+}
+
+void access_record_set_host(AccessRecord *rec, const char *host)
+{
+    size_t len = host ? strlen(host) : 0;
+    rec->host_len = len > 0xffff ? 0xffff : len;
+    if (len > ACCESS_LOG_HOST_LEN) {
+        len = ACCESS_LOG_HOST_LEN;
+        rec->flags |= ACCESS_LOG_FLAG_HOST_TRUNCATED;
+    }
+    memcpy(rec->host, host, len);
+    if (len < ACCESS_LOG_HOST_LEN)
+        memset(rec->host + len, 0, ACCESS_LOG_HOST_LEN - len);
+}
+
+static void segment_init(AccessLogSegment *seg)
+{
+    seg->fd = -1;
+    seg->base = NULL;
+    seg->path.clear();
+}
+
+AccessLog::AccessLog()
+{
+    segment_size = ACCESS_LOG_SEGMENT_SIZE;
+    max_segments = ACCESS_LOG_MAX_SEGMENTS;
+    opened = false;
+    segment_init(&cur);
+    segment_init(&next);
+    segment_init(&retired);
+    header = NULL;
+    records = NULL;
+    seq = 0;
+    stat_records = stat_rotations = stat_errors = stat_dropped = 0;
+}
+
+AccessLog::~AccessLog()
+{
+    Close();
+}
+
+int AccessLog::Open(const string &path_prefix, size_t seg_size, size_t max_segs)
+{
+    prefix = path_prefix;
+    segment_size = seg_size;
+    max_segments = max_segs > 0 ? max_segs : 1;
+    if (segment_size < sizeof(AccessLogHeader) + sizeof(AccessRecord)) {
+        cout << "access log segment size too small:" << segment_size << endl;
+        return -1;
+    }
+    if (OpenSegment(&next, true) != 0)
+        return -1;
+    UseSegment(&next);
+    opened = true;
+    // 第一次切换也不用等定时器
+    Maintain();
+    return 0;
+}
+
+void AccessLog::Close()
+{
+    CloseSegment(&cur);
+    CloseSegment(&retired);
+    DiscardSegment(&next);
+    header = NULL;
+    records = NULL;
+    opened = false;
+}
+
+void AccessLog::Maintain()
+{
+    if (!opened)
+        return;
+    CloseSegment(&retired);
+    if (!next.base && OpenSegment(&next, false) != 0)
+        stat_errors++;
+}
+
+// 文件名: <prefix>.<创建时间>.<序号>.bin
+// populate: 预先建立页表, 写记录时不会缺页, 但要分配整个分段的内存, 只在启动时使用;
+// 运行中准备的分段按需缺页, 不会让事件循环停顿
+int AccessLog::OpenSegment(AccessLogSegment *seg, bool populate)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s.%ld.%u.bin", prefix.c_str(), (long)time(NULL), seq++);
+
+    int fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open access log");
+        return -1;
+    }
+    if (ftruncate(fd, segment_size) != 0) {
+        perror("ftruncate access log");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    void *p = mmap(NULL, segment_size, PROT_READ|PROT_WRITE, MAP_SHARED|(populate ? MAP_POPULATE : 0), fd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap access log");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    AccessLogHeader *h = (AccessLogHeader *)p;
+    memset(h, 0, sizeof(*h));
+    h->magic = ACCESS_LOG_MAGIC;
+    h->version = ACCESS_LOG_VERSION;
+    h->record_size = sizeof(AccessRecord);
+    h->byte_order = ACCESS_LOG_BYTE_ORDER;
+    h->capacity = (segment_size - sizeof(AccessLogHeader)) / sizeof(AccessRecord);
+    h->count = 0;
+
+    seg->fd = fd;
+    seg->base = (char *)p;
+    seg->path = path;
+    return 0;
+}
+
+// 把准备好的分段换成当前分段, 只改指针和文件头, 可以在写记录时调用
+void AccessLog::UseSegment(AccessLogSegment *seg)
+{
+    cur = *seg;
+    segment_init(seg);
+    header = (AccessLogHeader *)cur.base;
+    records = (AccessRecord *)(cur.base + sizeof(AccessLogHeader));
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    header->create_us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+    segments.push_back(cur.path);
+    while (segments.size() > max_segments) {
+        unlink(segments.front().c_str());
+        segments.pop_front();
+    }
+    cout << "access log segment:" << cur.path << endl;
+}
+
+// 截掉没用到的部分再关闭
+void AccessLog::CloseSegment(AccessLogSegment *seg)
+{
+    if (!seg->base)
+        return;
+
+    AccessLogHeader *h = (AccessLogHeader *)seg->base;
+    size_t used = sizeof(AccessLogHeader) + h->count * sizeof(AccessRecord);
+    munmap(seg->base, segment_size);
+    if (ftruncate(seg->fd, used) != 0)
+        perror("ftruncate access log");
+    close(seg->fd);
+    segment_init(seg);
+}
+
+// 没用过的分段直接删除
+void AccessLog::DiscardSegment(AccessLogSegment *seg)
+{
+    if (!seg->base)
+        return;
+    munmap(seg->base, segment_size);
+    close(seg->fd);
+    unlink(seg->path.c_str());
+    segment_init(seg);
+}
+
+void AccessLog::Write(const AccessRecord &rec)
+{
+    if (!opened)
+        return;
+
+    if (!cur.base || header->count >= header->capacity) {
+        if (cur.base) {
+            // 上一个换下来的还没来得及关闭(一秒内写满了两个分段), 只能在这里关闭
+            CloseSegment(&retired);
+            retired = cur;
+            segment_init(&cur);
+            header = NULL;
+            records = NULL;
+            stat_rotations++;
+        }
+        // 下一个分段还没准备好时丢弃, 等 Maintain 重试
+        if (!next.base) {
+            stat_dropped++;
+            return;
+        }
+        UseSegment(&next);
+    }
+
+    memcpy(&records[header->count], &rec, sizeof(rec));
+    // 记录写完之后再增加计数, 进程崩溃时解析工具不会读到半条记录
+    __atomic_store_n(&header->count, header->count + 1, __ATOMIC_RELEASE);
+    stat_records++;
+}
+
+void AccessLog::DumpStats(struct evbuffer *buf)
+{
+    evbuffer_add_printf(buf, "access_log.enabled %d\n", opened ? 1 : 0);
+    if (!opened)
+        return;
+    evbuffer_add_printf(buf, "access_log.segment %s\n", cur.base ? cur.path.c_str() : "-");
+    evbuffer_add_printf(buf, "access_log.next_ready %d\n", next.base ? 1 : 0);
+    evbuffer_add_printf(buf, "access_log.records %lu\n", (unsigned long)stat_records);
+    evbuffer_add_printf(buf, "access_log.rotations %lu\n", (unsigned long)stat_rotations);
+    evbuffer_add_printf(buf, "access_log.errors %lu\n", (unsigned long)stat_errors);
+    evbuffer_add_printf(buf, "access_log.dropped %lu\n", (unsigned long)stat_dropped);
+    if (header)
+        evbuffer_add_printf(buf, "access_log.segment_used %lu/%lu\n",
+            (unsigned long)header->count, (unsigned long)header->capacity);
+}
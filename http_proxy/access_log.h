@@ -0,0 +1,130 @@
+#ifndef HTTP_PROXY_ACCESS_LOG_H
+#define HTTP_PROXY_ACCESS_LOG_H
+
+#include <string>
+#include <deque>
+
+extern "C" {
+#include <stdint.h>
+#include <stddef.h>
+
+#include <event2/buffer.h>
+}
+
+// 二进制访问日志: 每个结束的请求/隧道写一条定长记录到 mmap 的分段文件里
+// 写满一个分段后切换到新文件, 只保留最近若干个分段; 用 access_log_tool 离线解析
+// 建文件和 munmap 都比较慢, 放在 Maintain 里做: 预先建好下一个分段, 写满时只是换一个指针
+//
+// 分段文件: AccessLogHeader + AccessRecord * count, 直接写内存里的结构体, 整数是写入机器的字节序,
+// 文件头里的 byte_order 记录是哪一种, 解析工具只读和本机相同的
+
+#define ACCESS_LOG_MAGIC (0x4c415048)      // "HPAL"
+#define ACCESS_LOG_VERSION (1)
+#define ACCESS_LOG_SEGMENT_SIZE (64 * 1024 * 1024)
+#define ACCESS_LOG_MAX_SEGMENTS (16)
+#define ACCESS_LOG_HOST_LEN (44)
+#define ACCESS_LOG_MAINTAIN_MS (1000)     // 调用 Maintain 的间隔
+
+#define ACCESS_LOG_LITTLE_ENDIAN (1)
+#define ACCESS_LOG_BIG_ENDIAN (2)
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ACCESS_LOG_BYTE_ORDER ACCESS_LOG_BIG_ENDIAN
+#else
+#define ACCESS_LOG_BYTE_ORDER ACCESS_LOG_LITTLE_ENDIAN
+#endif
+
+enum ACCESS_LOG_TYPE {
+    ACCESS_LOG_HTTP = 1,
+    ACCESS_LOG_TUNNEL
+};
+
+struct AccessLogHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint64_t create_us;
+    uint64_t capacity;      // 最多能写的记录数
+    uint64_t count;         // 已写完的记录数, 记录写完后才更新
+    uint8_t byte_order;     // ACCESS_LOG_LITTLE_ENDIAN/BIG_ENDIAN, 旧版本写的文件为 0
+    uint8_t reserved[31];
+} __attribute__((packed));
+
+// 地址统一按 IPv6 格式保存, IPv4 使用 ::ffff:a.b.c.d
+struct AccessRecord {
+    uint64_t start_us;      // 收到请求的时间(unix 微秒)
+    uint32_t total_us;      // 收到请求到请求/隧道结束
+    uint32_t dns_us;        // dns 解析耗时, 命中缓存为 0
+    uint32_t upstream_us;   // http: 发出请求到收完响应; 隧道: 上游建连耗时
+    uint32_t reserved;
+    uint64_t bytes_up;      // client -> upstream
+    uint64_t bytes_down;    // upstream -> client
+    uint8_t type;           // ACCESS_LOG_TYPE
+    uint8_t flags;          // bit0: host 被截断
+    uint16_t method;        // evhttp_cmd_type
+    uint16_t status;        // 0 表示上游出错
+    uint16_t client_port;
+    uint16_t upstream_port;
+    uint16_t host_len;      // host 原始长度
+    uint8_t client_addr[16];
+    uint8_t upstream_addr[16];
+    char host[ACCESS_LOG_HOST_LEN];
+} __attribute__((packed));
+
+#define ACCESS_LOG_FLAG_HOST_TRUNCATED (0x1)
+
+// 填充地址和 host 字段
+void access_record_set_addr(uint8_t *addr, const char *ip);
+void access_record_set_host(AccessRecord *rec, const char *host);
+
+// 一个 mmap 的分段文件, base 为 NULL 表示没有打开
+struct AccessLogSegment {
+    int fd;
+    char *base;
+    std::string path;
+};
+
+// 每个 worker 一个实例, 只能在所属线程里使用
+class AccessLog
+{
+    private:
+        std::string prefix;
+        size_t segment_size;
+        size_t max_segments;
+        bool opened;
+        AccessLogSegment cur;       // 正在写的分段, 下一个分段没准备好时为空, 记录被丢弃
+        AccessLogSegment next;      // 预先建好的下一个分段
+        AccessLogSegment retired;   // 写满换下来的分段, 等 Maintain 关闭
+        AccessLogHeader *header;
+        AccessRecord *records;
+        uint32_t seq;
+        std::deque<std::string> segments;
+
+        // 统计
+        uint64_t stat_records;
+        uint64_t stat_rotations;
+        uint64_t stat_errors;
+        uint64_t stat_dropped;
+
+        int OpenSegment(AccessLogSegment *seg, bool populate);
+        void CloseSegment(AccessLogSegment *seg);
+        void DiscardSegment(AccessLogSegment *seg);
+        void UseSegment(AccessLogSegment *seg);
+
+    public:
+        AccessLog();
+        ~AccessLog();
+
+        int Open(const std::string &path_prefix, size_t seg_size = ACCESS_LOG_SEGMENT_SIZE,
+            size_t max_segs = ACCESS_LOG_MAX_SEGMENTS);
+        void Close();
+        bool IsOpen() {
+            return opened;
+        }
+        void Write(const AccessRecord &rec);
+        // 由事件循环每 ACCESS_LOG_MAINTAIN_MS 调用一次: 关闭换下来的分段,
+        // 准备下一个分段, 建文件失败时在这里重试
+        void Maintain();
+        void DumpStats(struct evbuffer *buf);
+};
+
+#endif
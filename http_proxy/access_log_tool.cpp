@@ -0,0 +1,319 @@
+// 二进制访问日志解析工具: 解码, 过滤, 聚合 http_proxy -a 写出的分段文件
+//
+// ./access_log_tool /data/log/http_proxy.access.*.bin
+// ./access_log_tool -H example.com -s 500-599 -b 1700000000 /data/log/*.bin
+// ./access_log_tool -g host -n 20 /data/log/*.bin
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+extern "C" {
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+}
+
+#include "access_log.h"
+
+using namespace std;
+
+struct Filter {
+    string host;            // host 子串
+    string client;          // 客户端 IP
+    int status_min;
+    int status_max;
+    int type;               // 0 表示不过滤
+    uint64_t begin_us;
+    uint64_t end_us;
+
+    Filter() : status_min(-1), status_max(-1), type(0), begin_us(0), end_us(UINT64_MAX) {}
+};
+
+struct GroupStat {
+    uint64_t count;
+    uint64_t bytes_up;
+    uint64_t bytes_down;
+    uint64_t errors;
+    vector<uint32_t> total_us;
+
+    GroupStat() : count(0), bytes_up(0), bytes_down(0), errors(0) {}
+};
+
+static const char *method_name(uint16_t method)
+{
+    switch (method) {
+    case 1 << 0: return "GET";
+    case 1 << 1: return "POST";
+    case 1 << 2: return "HEAD";
+    case 1 << 3: return "PUT";
+    case 1 << 4: return "DELETE";
+    case 1 << 5: return "OPTIONS";
+    case 1 << 6: return "TRACE";
+    case 1 << 7: return "CONNECT";
+    case 1 << 8: return "PATCH";
+    default: return "unknown";
+    }
+}
+
+// ::ffff:a.b.c.d 显示成 a.b.c.d
+static string addr_str(const uint8_t *addr)
+{
+    static const uint8_t v4_prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    char buf[INET6_ADDRSTRLEN] = {0};
+    if (memcmp(addr, v4_prefix, sizeof(v4_prefix)) == 0)
+        inet_ntop(AF_INET, addr + 12, buf, sizeof(buf));
+    else
+        inet_ntop(AF_INET6, addr, buf, sizeof(buf));
+    return buf;
+}
+
+static string host_str(const AccessRecord &rec)
+{
+    string host(rec.host, strnlen(rec.host, ACCESS_LOG_HOST_LEN));
+    if (rec.flags & ACCESS_LOG_FLAG_HOST_TRUNCATED)
+        host += "...";
+    return host;
+}
+
+static bool match(const Filter &f, const AccessRecord &rec)
+{
+    if (rec.start_us < f.begin_us || rec.start_us >= f.end_us)
+        return false;
+    if (f.type && rec.type != f.type)
+        return false;
+    if (f.status_min >= 0 && (rec.status < f.status_min || rec.status > f.status_max))
+        return false;
+    if (!f.host.empty() && host_str(rec).find(f.host) == string::npos)
+        return false;
+    if (!f.client.empty() && addr_str(rec.client_addr) != f.client)
+        return false;
+    return true;
+}
+
+static void print_record(const AccessRecord &rec)
+{
+    char ts[32];
+    time_t sec = rec.start_us / 1000000;
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm);
+
+    printf("%s.%06lu %s %s:%u %s %s %s:%u %u up:%lu down:%lu total:%.3fms dns:%.3fms upstream:%.3fms\n",
+        ts, (unsigned long)(rec.start_us % 1000000),
+        rec.type == ACCESS_LOG_TUNNEL ? "tunnel" : "http",
+        addr_str(rec.client_addr).c_str(), rec.client_port,
+        method_name(rec.method), host_str(rec).c_str(),
+        addr_str(rec.upstream_addr).c_str(), rec.upstream_port, rec.status,
+        (unsigned long)rec.bytes_up, (unsigned long)rec.bytes_down,
+        rec.total_us / 1000.0, rec.dns_us / 1000.0, rec.upstream_us / 1000.0);
+}
+
+static string group_key(const string &group, const AccessRecord &rec)
+{
+    if (group == "host")
+        return host_str(rec);
+    if (group == "client")
+        return addr_str(rec.client_addr);
+    if (group == "status")
+        return to_string(rec.status);
+    if (group == "type")
+        return rec.type == ACCESS_LOG_TUNNEL ? "tunnel" : "http";
+    if (group == "minute") {
+        char ts[32];
+        time_t sec = rec.start_us / 1000000;
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M", &tm);
+        return ts;
+    }
+    return "";
+}
+
+// 返回读到的记录数, 出错返回 -1
+static long scan_file(const char *path, const Filter &filter, const string &group,
+    map<string, GroupStat> &groups)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(AccessLogHeader)) {
+        cout << path << ": not an access log" << endl;
+        close(fd);
+        return -1;
+    }
+
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    const AccessLogHeader *header = (const AccessLogHeader *)p;
+    if (header->magic != ACCESS_LOG_MAGIC || header->version != ACCESS_LOG_VERSION ||
+        header->record_size != sizeof(AccessRecord)) {
+        cout << path << ": bad header, magic:" << hex << header->magic << dec
+            << " version:" << header->version << " record_size:" << header->record_size << endl;
+        munmap(p, st.st_size);
+        return -1;
+    }
+    // 记录是按写入机器的字节序保存的, 0 是没有记录字节序的旧文件
+    if (header->byte_order != 0 && header->byte_order != ACCESS_LOG_BYTE_ORDER) {
+        cout << path << ": written with another byte order:" << (int)header->byte_order << endl;
+        munmap(p, st.st_size);
+        return -1;
+    }
+
+    // 正在写的分段文件 count 会继续增长, 以打开时为准
+    uint64_t count = __atomic_load_n(&header->count, __ATOMIC_ACQUIRE);
+    uint64_t max_count = (st.st_size - sizeof(AccessLogHeader)) / sizeof(AccessRecord);
+    if (count > max_count)
+        count = max_count;
+
+    const AccessRecord *records = (const AccessRecord *)((const char *)p + sizeof(AccessLogHeader));
+    for (uint64_t i = 0; i < count; i++) {
+        const AccessRecord &rec = records[i];
+        if (!match(filter, rec))
+            continue;
+        if (group.empty()) {
+            print_record(rec);
+            continue;
+        }
+        GroupStat &g = groups[group_key(group, rec)];
+        g.count++;
+        g.bytes_up += rec.bytes_up;
+        g.bytes_down += rec.bytes_down;
+        if (rec.status == 0 || rec.status >= 500)
+            g.errors++;
+        g.total_us.push_back(rec.total_us);
+    }
+
+    munmap(p, st.st_size);
+    return count;
+}
+
+static double percentile_ms(vector<uint32_t> &v, double pct)
+{
+    if (v.empty())
+        return 0;
+    size_t idx = (size_t)(pct * (v.size() - 1));
+    nth_element(v.begin(), v.begin() + idx, v.end());
+    return v[idx] / 1000.0;
+}
+
+static bool group_cmp(const pair<string, GroupStat *> &a, const pair<string, GroupStat *> &b)
+{
+    uint64_t ba = a.second->bytes_up + a.second->bytes_down;
+    uint64_t bb = b.second->bytes_up + b.second->bytes_down;
+    if (ba != bb)
+        return ba > bb;
+    return a.second->count > b.second->count;
+}
+
+static void print_groups(const string &group, map<string, GroupStat> &groups, size_t top_n)
+{
+    vector<pair<string, GroupStat *> > sorted;
+    for (auto iter = groups.begin(); iter != groups.end(); iter++)
+        sorted.push_back(make_pair(iter->first, &iter->second));
+    sort(sorted.begin(), sorted.end(), group_cmp);
+    if (top_n && sorted.size() > top_n)
+        sorted.resize(top_n);
+
+    printf("%-40s %10s %8s %14s %14s %10s %10s %10s\n", group.c_str(), "count", "errors",
+        "bytes_up", "bytes_down", "p50_ms", "p99_ms", "max_ms");
+    for (size_t i = 0; i < sorted.size(); i++) {
+        GroupStat &g = *sorted[i].second;
+        double p50 = percentile_ms(g.total_us, 0.5);
+        double p99 = percentile_ms(g.total_us, 0.99);
+        double max_ms = *max_element(g.total_us.begin(), g.total_us.end()) / 1000.0;
+        printf("%-40s %10lu %8lu %14lu %14lu %10.3f %10.3f %10.3f\n", sorted[i].first.c_str(),
+            (unsigned long)g.count, (unsigned long)g.errors, (unsigned long)g.bytes_up,
+            (unsigned long)g.bytes_down, p50, p99, max_ms);
+    }
+}
+
+static void usage()
+{
+    cout << "usage: access_log_tool [options] segment.bin..." << endl
+        << "  -H host      host 包含该字符串" << endl
+        << "  -c ip        客户端 IP" << endl
+        << "  -s 200|500-599  状态码或范围, 0 表示上游出错" << endl
+        << "  -t http|tunnel" << endl
+        << "  -b ts -e ts  开始/结束时间(unix 秒)" << endl
+        << "  -g host|client|status|type|minute  按字段聚合, 不指定时逐条输出" << endl
+        << "  -n N         聚合结果只输出流量最大的 N 条" << endl;
+}
+
+int main(int argc, char **argv)
+{
+    Filter filter;
+    string group;
+    size_t top_n = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:c:s:t:b:e:g:n:")) != -1) {
+        switch (opt) {
+        case 'H': filter.host = optarg; break;
+        case 'c': filter.client = optarg; break;
+        case 's':
+            if (sscanf(optarg, "%d-%d", &filter.status_min, &filter.status_max) != 2)
+                filter.status_max = filter.status_min = atoi(optarg);
+            break;
+        case 't':
+            if (string(optarg) == "http") {
+                filter.type = ACCESS_LOG_HTTP;
+            } else if (string(optarg) == "tunnel") {
+                filter.type = ACCESS_LOG_TUNNEL;
+            } else {
+                usage();
+                return 1;
+            }
+            break;
+        case 'b': filter.begin_us = strtoull(optarg, NULL, 10) * 1000000; break;
+        case 'e': filter.end_us = strtoull(optarg, NULL, 10) * 1000000; break;
+        case 'g':
+            group = optarg;
+            if (group != "host" && group != "client" && group != "status" &&
+                group != "type" && group != "minute") {
+                usage();
+                return 1;
+            }
+            break;
+        case 'n': top_n = atoi(optarg); break;
+        default: usage(); return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage();
+        return 1;
+    }
+
+    map<string, GroupStat> groups;
+    uint64_t total = 0;
+    int ret = 0;
+    for (int i = optind; i < argc; i++) {
+        long n = scan_file(argv[i], filter, group, groups);
+        if (n < 0)
+            ret = 1;
+        else
+            total += n;
+    }
+
+    if (!group.empty()) {
+        print_groups(group, groups, top_n);
+        printf("records:%lu\n", (unsigned long)total);
+    }
+    return ret;
+}
@@ -0,0 +1,463 @@
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <event2/util.h>
+}
+
+#include "acl.h"
+
+using namespace std;
+
+#define ACL_EDGE_INIT (1024)        // 边 hash 表的初始大小, 必须是 2 的幂
+
+static const char *action_names[ACL_ACTION_NUM] = {"none", "allow", "deny", "parent", "direct"};
+
+static inline char lower(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// FNV-1a, 按小写计算, 匹配时不用先把 host 转成小写
+static inline uint32_t label_hash(uint32_t parent, const char *label, size_t len)
+{
+    uint32_t h = 2166136261u ^ (parent * 0x9e3779b1u);
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)lower(label[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline bool label_equal(const char *stored, const char *label, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (stored[i] != lower(label[i]))
+            return false;
+    }
+    return true;
+}
+
+// host 是 IP 地址时返回位数(32/128)并填充 addr, 否则返回 0
+static int parse_addr(const char *host, uint8_t *addr)
+{
+    size_t len = strlen(host);
+    if (len == 0)
+        return 0;
+    // 域名的最后一个字符基本不会是数字, 先过滤掉, 不用每次都调用 inet_pton
+    char last = host[len - 1];
+    if (!(last >= '0' && last <= '9') && last != ']' && !strchr(host, ':'))
+        return 0;
+    if (evutil_inet_pton(AF_INET, host, addr) == 1)
+        return 32;
+    if (host[0] == '[' && last == ']') {
+        char buf[INET6_ADDRSTRLEN];
+        if (len - 2 >= sizeof(buf))
+            return 0;
+        memcpy(buf, host + 1, len - 2);
+        buf[len - 2] = '\0';
+        return evutil_inet_pton(AF_INET6, buf, addr) == 1 ? 128 : 0;
+    }
+    return evutil_inet_pton(AF_INET6, host, addr) == 1 ? 128 : 0;
+}
+
+// 80,443,8000-8999
+static int parse_ports(const string &str, vector<uint16_t> *ports)
+{
+    size_t begin = 0;
+    while (begin <= str.size()) {
+        size_t end = str.find(',', begin);
+        if (end == string::npos)
+            end = str.size();
+        string item = str.substr(begin, end - begin);
+        char *p = NULL;
+        long lo = strtol(item.c_str(), &p, 10);
+        long hi = lo;
+        if (p == item.c_str())
+            return -1;
+        if (*p == '-') {
+            const char *q = p + 1;
+            hi = strtol(q, &p, 10);
+            if (p == q)
+                return -1;
+        }
+        if (*p != '\0' || lo < 1 || hi > 65535 || lo > hi)
+            return -1;
+        ports->push_back((uint16_t)lo);
+        ports->push_back((uint16_t)hi);
+        begin = end + 1;
+    }
+    return 0;
+}
+
+static int parse_action(const string &str)
+{
+    for (int i = ACL_ALLOW; i < ACL_ACTION_NUM; i++) {
+        if (str == action_names[i])
+            return i;
+    }
+    return -1;
+}
+
+AclRules::AclRules()
+{
+    refs = 1;
+    edge_mask = ACL_EDGE_INIT - 1;
+    domain_edges.resize(ACL_EDGE_INIT);
+    memset(&domain_edges[0], 0, sizeof(DomainEdge) * domain_edges.size());
+    DomainNode root = {-1, -1};
+    domain_nodes.push_back(root);
+    CidrNode cidr_root = {{0, 0}, -1};
+    cidr_nodes.push_back(cidr_root);
+    cidr_nodes.push_back(cidr_root);
+    default_rule = -1;
+    memset(rule_count, 0, sizeof(rule_count));
+}
+
+AclRules::~AclRules()
+{
+}
+
+void AclRules::Ref()
+{
+    __atomic_add_fetch(&refs, 1, __ATOMIC_RELAXED);
+}
+
+void AclRules::Unref()
+{
+    if (__atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL) == 0)
+        delete this;
+}
+
+// 加在链表末尾, 同一个目标的规则保持文件中的顺序
+int AclRules::AddRule(int action, const vector<uint16_t> &ports, int32_t *head)
+{
+    Rule rule;
+    rule.action = action;
+    rule.ports = port_ranges.size();
+    rule.port_count = ports.size() / 2;
+    rule.next = -1;
+    port_ranges.insert(port_ranges.end(), ports.begin(), ports.end());
+    int32_t index = rules.size();
+    rules.push_back(rule);
+    rule_count[action]++;
+
+    if (*head < 0) {
+        *head = index;
+        return 0;
+    }
+    int32_t tail = *head;
+    while (rules[tail].next >= 0)
+        tail = rules[tail].next;
+    rules[tail].next = index;
+    return 0;
+}
+
+uint32_t AclRules::FindEdge(uint32_t parent, const char *label, size_t len, uint32_t hash) const
+{
+    uint32_t i = hash & edge_mask;
+    for (;;) {
+        const DomainEdge &e = domain_edges[i];
+        if (e.child == 0)
+            return 0;
+        if (e.hash == hash && e.parent == parent && e.label_len == len &&
+            label_equal(&labels[e.label], label, len))
+            return e.child;
+        i = (i + 1) & edge_mask;
+    }
+}
+
+void AclRules::InsertEdge(uint32_t parent, uint32_t child, const char *label, size_t len, uint32_t hash)
+{
+    DomainEdge e;
+    e.parent = parent;
+    e.child = child;
+    e.hash = hash;
+    e.label = labels.size();
+    e.label_len = len;
+    labels.append(label, len);
+
+    uint32_t i = hash & edge_mask;
+    while (domain_edges[i].child != 0)
+        i = (i + 1) & edge_mask;
+    domain_edges[i] = e;
+}
+
+// 装载率保持在一半以下, 查找时探测的次数很少
+void AclRules::GrowEdges()
+{
+    vector<DomainEdge> old;
+    old.swap(domain_edges);
+    domain_edges.resize(old.size() * 2);
+    memset(&domain_edges[0], 0, sizeof(DomainEdge) * domain_edges.size());
+    edge_mask = domain_edges.size() - 1;
+    for (size_t j = 0; j < old.size(); j++) {
+        if (old[j].child == 0)
+            continue;
+        uint32_t i = old[j].hash & edge_mask;
+        while (domain_edges[i].child != 0)
+            i = (i + 1) & edge_mask;
+        domain_edges[i] = old[j];
+    }
+}
+
+int AclRules::AddDomain(const string &domain, int action, const vector<uint16_t> &ports)
+{
+    string name = domain;
+    bool suffix = (name[0] == '.');
+    if (suffix)
+        name = name.substr(1);
+    if (!name.empty() && name[name.size() - 1] == '.')
+        name.erase(name.size() - 1);
+    if (name.empty())
+        return -1;
+    for (size_t i = 0; i < name.size(); i++) {
+        char c = lower(name[i]);
+        if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.'))
+            return -1;
+        name[i] = c;
+    }
+
+    uint32_t node = 0;
+    size_t end = name.size();
+    for (;;) {
+        if (end == 0)
+            return -1;
+        size_t start = name.rfind('.', end - 1);
+        start = (start == string::npos) ? 0 : start + 1;
+        size_t len = end - start;
+        if (len == 0)
+            return -1;
+        uint32_t hash = label_hash(node, &name[start], len);
+        uint32_t child = FindEdge(node, &name[start], len, hash);
+        if (child == 0) {
+            if ((domain_nodes.size() + 1) * 2 > domain_edges.size())
+                GrowEdges();
+            child = domain_nodes.size();
+            DomainNode n = {-1, -1};
+            domain_nodes.push_back(n);
+            InsertEdge(node, child, &name[start], len, hash);
+        }
+        node = child;
+        if (start == 0)
+            break;
+        end = start - 1;
+    }
+    DomainNode &n = domain_nodes[node];
+    return AddRule(action, ports, suffix ? &n.suffix : &n.exact);
+}
+
+int AclRules::AddCidr(const string &cidr, int action, const vector<uint16_t> &ports)
+{
+    string ip = cidr;
+    int prefix = -1;
+    size_t slash = cidr.find('/');
+    if (slash != string::npos) {
+        ip = cidr.substr(0, slash);
+        char *end = NULL;
+        prefix = strtol(cidr.c_str() + slash + 1, &end, 10);
+        if (end == cidr.c_str() + slash + 1 || *end != '\0' || prefix < 0)
+            return -1;
+    }
+
+    uint8_t addr[16];
+    int bits = parse_addr(ip.c_str(), addr);
+    if (bits == 0)
+        return -1;
+    if (prefix < 0)
+        prefix = bits;
+    if (prefix > bits)
+        return -1;
+
+    uint32_t node = (bits == 32) ? 0 : 1;
+    for (int i = 0; i < prefix; i++) {
+        int bit = (addr[i >> 3] >> (7 - (i & 7))) & 1;
+        uint32_t child = cidr_nodes[node].child[bit];
+        if (child == 0) {
+            child = cidr_nodes.size();
+            CidrNode n = {{0, 0}, -1};
+            cidr_nodes.push_back(n);
+            cidr_nodes[node].child[bit] = child;
+        }
+        node = child;
+    }
+    return AddRule(action, ports, &cidr_nodes[node].rule);
+}
+
+int AclRules::ParseLine(const string &line, int lineno)
+{
+    vector<string> fields;
+    size_t pos = 0;
+    size_t end = line.find('#');
+    if (end == string::npos)
+        end = line.size();
+    while (pos < end) {
+        size_t begin = line.find_first_not_of(" \t\r\n", pos);
+        if (begin == string::npos || begin >= end)
+            break;
+        pos = line.find_first_of(" \t\r\n", begin);
+        if (pos == string::npos || pos > end)
+            pos = end;
+        fields.push_back(line.substr(begin, pos - begin));
+    }
+    if (fields.empty())
+        return 0;
+    if (fields.size() > 3) {
+        printf("acl line %d: too many fields\n", lineno);
+        return -1;
+    }
+
+    int action = parse_action(fields[0]);
+    if (action < 0 || fields.size() < 2) {
+        printf("acl line %d: bad action:%s\n", lineno, fields[0].c_str());
+        return -1;
+    }
+    vector<uint16_t> ports;
+    if (fields.size() == 3 && parse_ports(fields[2], &ports) != 0) {
+        printf("acl line %d: bad ports:%s\n", lineno, fields[2].c_str());
+        return -1;
+    }
+
+    const string &target = fields[1];
+    if (target == "*")
+        return AddRule(action, ports, &default_rule);
+
+    uint8_t addr[16];
+    string ip = target.substr(0, target.find('/'));
+    int ret = parse_addr(ip.c_str(), addr) ? AddCidr(target, action, ports) : AddDomain(target, action, ports);
+    if (ret != 0)
+        printf("acl line %d: bad target:%s\n", lineno, target.c_str());
+    return ret;
+}
+
+AclRules *AclRules::Load(const string &path)
+{
+    FILE *fp = fopen(path.c_str(), "r");
+    if (!fp) {
+        printf("open acl file %s failed: %s\n", path.c_str(), strerror(errno));
+        return NULL;
+    }
+
+    AclRules *acl = new AclRules();
+    char *buf = NULL;
+    size_t size = 0;
+    int lineno = 0;
+    int ret = 0;
+    while (getline(&buf, &size, fp) >= 0) {
+        lineno++;
+        if ((ret = acl->ParseLine(buf, lineno)) != 0)
+            break;
+    }
+    free(buf);
+    fclose(fp);
+    if (ret != 0) {
+        acl->Unref();
+        return NULL;
+    }
+    printf("acl %s loaded, rules:%zu domain nodes:%zu cidr nodes:%zu\n", path.c_str(),
+        acl->rules.size(), acl->domain_nodes.size() - 1, acl->cidr_nodes.size() - 2);
+    return acl;
+}
+
+int AclRules::FirstMatch(int32_t rule, int port) const
+{
+    while (rule >= 0) {
+        const Rule &r = rules[rule];
+        if (r.port_count == 0)
+            return rule;
+        const uint16_t *range = &port_ranges[r.ports];
+        for (uint32_t i = 0; i < r.port_count; i++) {
+            if (port >= range[i * 2] && port <= range[i * 2 + 1])
+                return rule;
+        }
+        rule = r.next;
+    }
+    return -1;
+}
+
+// 从最后一个 label 开始往下走, 记住走过的最长的后缀匹配
+int AclRules::MatchDomain(const char *host, size_t len, int port) const
+{
+    if (len > 0 && host[len - 1] == '.')
+        len--;
+    int best = -1;
+    uint32_t node = 0;
+    size_t end = len;
+    while (end > 0) {
+        size_t start = end;
+        while (start > 0 && host[start - 1] != '.')
+            start--;
+        size_t label_len = end - start;
+        if (label_len == 0)
+            break;
+        node = FindEdge(node, host + start, label_len, label_hash(node, host + start, label_len));
+        if (node == 0)
+            break;
+        const DomainNode &n = domain_nodes[node];
+        int r;
+        if (start == 0 && (r = FirstMatch(n.exact, port)) >= 0)
+            return r;
+        if ((r = FirstMatch(n.suffix, port)) >= 0)
+            best = r;
+        if (start == 0)
+            break;
+        end = start - 1;
+    }
+    return best;
+}
+
+int AclRules::MatchCidr(const uint8_t *addr, int bits, int port) const
+{
+    uint32_t node = (bits == 32) ? 0 : 1;
+    int best = FirstMatch(cidr_nodes[node].rule, port);
+    for (int i = 0; i < bits; i++) {
+        node = cidr_nodes[node].child[(addr[i >> 3] >> (7 - (i & 7))) & 1];
+        if (node == 0)
+            break;
+        int r = FirstMatch(cidr_nodes[node].rule, port);
+        if (r >= 0)
+            best = r;
+    }
+    return best;
+}
+
+int AclRules::Match(const char *host, int port, bool *check_addr) const
+{
+    *check_addr = false;
+    uint8_t addr[16];
+    int bits = parse_addr(host, addr);
+    int r = bits ? MatchCidr(addr, bits, port) : MatchDomain(host, strlen(host), port);
+    if (r < 0) {
+        r = FirstMatch(default_rule, port);
+        *check_addr = (bits == 0);
+    }
+    return r >= 0 ? (int)rules[r].action : (int)ACL_NONE;
+}
+
+int AclRules::MatchAddr(const char *ip, int port) const
+{
+    uint8_t addr[16];
+    int bits = parse_addr(ip, addr);
+    if (bits == 0)
+        return ACL_NONE;
+    int r = MatchCidr(addr, bits, port);
+    return r >= 0 ? (int)rules[r].action : (int)ACL_NONE;
+}
+
+void AclRules::DumpStats(struct evbuffer *buf) const
+{
+    evbuffer_add_printf(buf, "acl.rules %zu\n", rules.size());
+    for (int i = ACL_ALLOW; i < ACL_ACTION_NUM; i++)
+        evbuffer_add_printf(buf, "acl.rules.%s %u\n", action_names[i], rule_count[i]);
+    evbuffer_add_printf(buf, "acl.domain_nodes %zu\n", domain_nodes.size() - 1);
+    evbuffer_add_printf(buf, "acl.cidr_nodes %zu\n", cidr_nodes.size() - 2);
+    size_t memory = rules.size() * sizeof(Rule) + port_ranges.size() * sizeof(uint16_t) +
+        domain_nodes.size() * sizeof(DomainNode) + domain_edges.size() * sizeof(DomainEdge) +
+        labels.size() + cidr_nodes.size() * sizeof(CidrNode);
+    evbuffer_add_printf(buf, "acl.memory %zu\n", memory);
+}
@@ -0,0 +1,108 @@
+#ifndef HTTP_PROXY_ACL_H
+#define HTTP_PROXY_ACL_H
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <stdint.h>
+#include <stddef.h>
+
+#include <event2/buffer.h>
+}
+
+// 按目标 host / IP 和端口放行, 拒绝或选择线路, 在 dns 解析之前判断
+// 规则文件每行一条: 动作 目标 [端口], # 之后是注释
+//
+//   deny   .ads.example.com            域名及其子域名
+//   direct internal.example.com        精确匹配
+//   parent .corp.example.com 80,443    只匹配这些端口, 可以写范围 8000-8999
+//   deny   10.0.0.0/8                  CIDR, 也可以是单个 IP, 支持 IPv6
+//   allow  10.1.2.0/24
+//   deny   * 25,465                    其他规则都不匹配时使用
+//
+// 最长匹配: 精确域名优先于后缀, 长的后缀/前缀优先于短的; 同一个目标按文件中的顺序找第一条端口匹配的
+// 最具体的目标没有端口匹配的规则时, 继续找更短的后缀/前缀
+// 域名只和域名规则匹配, IP 地址的 host 只和 CIDR 规则匹配
+// 没有匹配域名规则的请求, 解析出 IP 后再按 CIDR 检查一次, 此时只有 deny 生效
+//
+// 域名按 label 从后往前建 trie, 边放在一张开放寻址的 hash 表里, 匹配时每个 label 查一次表
+// CIDR 是按位的 radix trie, IPv4 和 IPv6 各一棵, 节点放在连续的数组里
+// 加载时编译好, 之后只读, 多个 worker 共享, 重新加载时整体替换, 最后一个引用释放时删除
+
+enum ACL_ACTION {
+    ACL_NONE = 0,               // 没有匹配的规则
+    ACL_ALLOW,
+    ACL_DENY,
+    ACL_PARENT,                 // 经上级代理
+    ACL_DIRECT,                 // 不经上级代理
+    ACL_ACTION_NUM
+};
+
+class AclRules
+{
+    private:
+        struct Rule {
+            uint8_t action;
+            uint32_t ports;         // port_ranges 中的下标, 每个范围两个数
+            uint32_t port_count;    // 0 表示所有端口
+            int32_t next;           // 同一个目标的下一条规则, -1 结束
+        };
+        struct DomainNode {
+            int32_t exact;          // 精确匹配的第一条规则
+            int32_t suffix;         // 后缀匹配的第一条规则
+        };
+        struct DomainEdge {
+            uint32_t parent;
+            uint32_t child;         // 0 表示空位, 根节点不会是 child
+            uint32_t hash;
+            uint32_t label;         // labels 中的偏移
+            uint32_t label_len;
+        };
+        struct CidrNode {
+            uint32_t child[2];      // 0 表示没有, 根节点不会是 child
+            int32_t rule;
+        };
+
+        int refs;
+        std::vector<Rule> rules;
+        std::vector<uint16_t> port_ranges;
+        std::vector<DomainNode> domain_nodes;
+        std::vector<DomainEdge> domain_edges;
+        uint32_t edge_mask;
+        std::string labels;
+        std::vector<CidrNode> cidr_nodes;   // 0 是 IPv4 的根, 1 是 IPv6 的根
+        int32_t default_rule;       // * 的规则
+        uint32_t rule_count[ACL_ACTION_NUM];
+
+        AclRules();
+        ~AclRules();
+
+        int ParseLine(const std::string &line, int lineno);
+        int AddRule(int action, const std::vector<uint16_t> &ports, int32_t *head);
+        int AddDomain(const std::string &domain, int action, const std::vector<uint16_t> &ports);
+        int AddCidr(const std::string &cidr, int action, const std::vector<uint16_t> &ports);
+        uint32_t FindEdge(uint32_t parent, const char *label, size_t len, uint32_t hash) const;
+        void InsertEdge(uint32_t parent, uint32_t child, const char *label, size_t len, uint32_t hash);
+        void GrowEdges();
+        int FirstMatch(int32_t rule, int port) const;
+        int MatchDomain(const char *host, size_t len, int port) const;
+        int MatchCidr(const uint8_t *addr, int bits, int port) const;
+
+    public:
+        // 读取并编译规则文件, 出错时打印行号并返回 NULL, 返回的对象有一个引用
+        static AclRules *Load(const std::string &path);
+        void Ref();
+        void Unref();
+
+        // 返回匹配的动作, host 是域名且没有匹配的域名规则时 check_addr 为 true, 需要在解析后调用 MatchAddr
+        int Match(const char *host, int port, bool *check_addr) const;
+        // 按 CIDR 规则匹配解析出的 IP
+        int MatchAddr(const char *ip, int port) const;
+        uint32_t Count(int action) const {
+            return rule_count[action];
+        }
+        void DumpStats(struct evbuffer *buf) const;
+};
+
+#endif
@@ -0,0 +1,244 @@
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <ctype.h>
+
+#include <event2/keyvalq_struct.h>
+}
+
+#include "compress.h"
+
+using namespace std;
+
+static const char *encoding_name[COMPRESS_ENCODING_NUM] = {"identity", "gzip", "deflate"};
+
+// 可压缩的 Content-Type, 按前缀匹配
+static const char *compressible_types[] = {
+    "text/",
+    "application/json",
+    "application/javascript",
+    "application/x-javascript",
+    "application/xml",
+    "application/xhtml+xml",
+    "application/rss+xml",
+    "application/atom+xml",
+    "image/svg+xml",
+};
+
+static uint64_t thread_cpu_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool is_compressible_type(const char *type)
+{
+    if (!type)
+        return false;
+    for (size_t i = 0; i < sizeof(compressible_types) / sizeof(compressible_types[0]); i++) {
+        if (strncasecmp(type, compressible_types[i], strlen(compressible_types[i])) == 0)
+            return true;
+    }
+    // application/xxx+json, application/xxx+xml
+    const char *end = strchr(type, ';');
+    size_t len = end ? (size_t)(end - type) : strlen(type);
+    return (len > 5 && strncasecmp(type + len - 5, "+json", 5) == 0) ||
+        (len > 4 && strncasecmp(type + len - 4, "+xml", 4) == 0);
+}
+
+// Accept-Encoding 里是否接受该编码, "gzip;q=0" 表示不接受
+static bool accept_encoding(const char *header, const char *name)
+{
+    size_t name_len = strlen(name);
+    const char *p = header;
+    while (p && *p) {
+        while (*p == ' ' || *p == ',')
+            p++;
+        const char *token_end = p;
+        while (*token_end && *token_end != ',' && *token_end != ';' && *token_end != ' ')
+            token_end++;
+        const char *item_end = strchr(p, ',');
+        if (!item_end)
+            item_end = p + strlen(p);
+
+        if ((size_t)(token_end - p) == name_len && strncasecmp(p, name, name_len) == 0) {
+            const char *q = strstr(p, "q=");
+            if (q && q < item_end && atof(q + 2) <= 0)
+                return false;
+            return true;
+        }
+        p = item_end;
+    }
+    return false;
+}
+
+ResponseCompressor::ResponseCompressor()
+{
+    level = -1;
+    min_size = COMPRESS_MIN_SIZE;
+    memset(stream, 0, sizeof(stream));
+    memset(stream_ready, 0, sizeof(stream_ready));
+    stat_responses = stat_skipped = stat_errors = 0;
+    stat_bytes_in = stat_bytes_out = stat_cpu_us = 0;
+}
+
+ResponseCompressor::~ResponseCompressor()
+{
+    for (int i = 0; i < COMPRESS_ENCODING_NUM; i++) {
+        if (stream_ready[i])
+            deflateEnd(&stream[i]);
+    }
+}
+
+void ResponseCompressor::Init(int compress_level, size_t compress_min_size)
+{
+    level = compress_level;
+    min_size = compress_min_size;
+}
+
+int ResponseCompressor::Select(enum evhttp_cmd_type method, struct evkeyvalq *client_headers,
+    struct evhttp_request *proxy_req)
+{
+    if (level < 0)
+        return COMPRESS_NONE;
+    if (method == EVHTTP_REQ_HEAD ||
+        evhttp_request_get_response_code(proxy_req) != HTTP_OK)
+        return COMPRESS_NONE;
+    if (evbuffer_get_length(evhttp_request_get_input_buffer(proxy_req)) < min_size)
+        return COMPRESS_NONE;
+
+    struct evkeyvalq *resp_headers = evhttp_request_get_input_headers(proxy_req);
+    const char *content_encoding = evhttp_find_header(resp_headers, "Content-Encoding");
+    if (content_encoding && strcasecmp(content_encoding, "identity") != 0)
+        return COMPRESS_NONE;
+    if (!is_compressible_type(evhttp_find_header(resp_headers, "Content-Type")))
+        return COMPRESS_NONE;
+    const char *cache_control = evhttp_find_header(resp_headers, "Cache-Control");
+    if (cache_control && strcasestr(cache_control, "no-transform"))
+        return COMPRESS_NONE;
+
+    const char *accept = evhttp_find_header(client_headers, "Accept-Encoding");
+    if (!accept)
+        return COMPRESS_NONE;
+    if (accept_encoding(accept, "gzip"))
+        return COMPRESS_GZIP;
+    if (accept_encoding(accept, "deflate"))
+        return COMPRESS_DEFLATE;
+    return COMPRESS_NONE;
+}
+
+// 逐块读取 in 中的数据, 直接压缩到 out 预留的空间里, 不额外拷贝整个 body
+int ResponseCompressor::Deflate(int encoding, struct evbuffer *in, struct evbuffer *out)
+{
+    z_stream *zs = &stream[encoding];
+    if (!stream_ready[encoding]) {
+        // windowBits 加 16 输出 gzip 格式
+        int window_bits = (encoding == COMPRESS_GZIP) ? 15 + 16 : 15;
+        if (deflateInit2(zs, level, Z_DEFLATED, window_bits, COMPRESS_MEM_LEVEL,
+            Z_DEFAULT_STRATEGY) != Z_OK)
+            return -1;
+        stream_ready[encoding] = true;
+    } else if (deflateReset(zs) != Z_OK) {
+        return -1;
+    }
+
+    int n = evbuffer_peek(in, -1, NULL, NULL, 0);
+    vector<struct evbuffer_iovec> in_vec(n > 0 ? n : 1);
+    n = evbuffer_peek(in, -1, NULL, &in_vec[0], n);
+
+    for (int i = 0; i <= n; i++) {
+        int flush = (i == n) ? Z_FINISH : Z_NO_FLUSH;
+        zs->next_in = (i < n) ? (Bytef *)in_vec[i].iov_base : NULL;
+        zs->avail_in = (i < n) ? in_vec[i].iov_len : 0;
+        do {
+            struct evbuffer_iovec out_vec;
+            if (evbuffer_reserve_space(out, COMPRESS_CHUNK, &out_vec, 1) < 1)
+                return -1;
+            zs->next_out = (Bytef *)out_vec.iov_base;
+            zs->avail_out = out_vec.iov_len;
+            int ret = deflate(zs, flush);
+            if (ret == Z_STREAM_ERROR)
+                return -1;
+            out_vec.iov_len -= zs->avail_out;
+            evbuffer_commit_space(out, &out_vec, 1);
+            if (ret == Z_STREAM_END)
+                return 0;
+        } while (zs->avail_out == 0 || zs->avail_in > 0);
+    }
+    return -1;
+}
+
+int ResponseCompressor::Compress(int encoding, struct evkeyvalq *headers, struct evbuffer *body)
+{
+    uint64_t cpu_start = thread_cpu_us();
+    size_t in_len = evbuffer_get_length(body);
+    struct evbuffer *out = evbuffer_new();
+    if (!out) {
+        stat_errors++;
+        return -1;
+    }
+
+    int ret = Deflate(encoding, body, out);
+    size_t out_len = evbuffer_get_length(out);
+    stat_cpu_us += thread_cpu_us() - cpu_start;
+    if (ret != 0) {
+        stat_errors++;
+        evbuffer_free(out);
+        return -1;
+    }
+    if (out_len >= in_len) {
+        stat_skipped++;
+        evbuffer_free(out);
+        return -1;
+    }
+
+    evbuffer_drain(body, in_len);
+    evbuffer_add_buffer(body, out);
+    evbuffer_free(out);
+
+    // Content-Length 由 evhttp 按压缩后的长度重新生成
+    evhttp_remove_header(headers, "Content-Length");
+    evhttp_remove_header(headers, "Content-Encoding");
+    evhttp_add_header(headers, "Content-Encoding", encoding_name[encoding]);
+    const char *vary = evhttp_find_header(headers, "Vary");
+    if (!vary) {
+        evhttp_add_header(headers, "Vary", "Accept-Encoding");
+    } else if (!strcasestr(vary, "Accept-Encoding")) {
+        string value = string(vary) + ", Accept-Encoding";
+        evhttp_remove_header(headers, "Vary");
+        evhttp_add_header(headers, "Vary", value.c_str());
+    }
+    // 内容变了, 强校验的 ETag 改成弱校验
+    const char *etag = evhttp_find_header(headers, "ETag");
+    if (etag && strncmp(etag, "W/", 2) != 0) {
+        string value = "W/" + string(etag);
+        evhttp_remove_header(headers, "ETag");
+        evhttp_add_header(headers, "ETag", value.c_str());
+    }
+
+    stat_responses++;
+    stat_bytes_in += in_len;
+    stat_bytes_out += out_len;
+    return 0;
+}
+
+void ResponseCompressor::DumpStats(struct evbuffer *buf)
+{
+    evbuffer_add_printf(buf, "compress.level %d\n", level);
+    if (level < 0)
+        return;
+    evbuffer_add_printf(buf, "compress.responses %lu\n", (unsigned long)stat_responses);
+    evbuffer_add_printf(buf, "compress.skipped %lu\n", (unsigned long)stat_skipped);
+    evbuffer_add_printf(buf, "compress.errors %lu\n", (unsigned long)stat_errors);
+    evbuffer_add_printf(buf, "compress.bytes_in %lu\n", (unsigned long)stat_bytes_in);
+    evbuffer_add_printf(buf, "compress.bytes_out %lu\n", (unsigned long)stat_bytes_out);
+    evbuffer_add_printf(buf, "compress.ratio %.3f\n",
+        stat_bytes_in ? (double)stat_bytes_out / stat_bytes_in : 0.0);
+    evbuffer_add_printf(buf, "compress.cpu_us %lu\n", (unsigned long)stat_cpu_us);
+}
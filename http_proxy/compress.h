@@ -0,0 +1,62 @@
+#ifndef HTTP_PROXY_COMPRESS_H
+#define HTTP_PROXY_COMPRESS_H
+
+extern "C" {
+#include <stdint.h>
+#include <zlib.h>
+
+#include <event2/http.h>
+#include <event2/buffer.h>
+}
+
+// 上游返回未压缩的文本类响应, 而客户端支持 gzip/deflate 时, 转发前压缩
+// 每个 worker 一组 z_stream, 处理每个响应前 deflateReset 复用, 不随请求数增长
+
+#define COMPRESS_MIN_SIZE (1024)      // 小于该大小的响应不压缩
+#define COMPRESS_CHUNK (16 * 1024)    // 每次从输出缓冲预留的空间
+#define COMPRESS_MEM_LEVEL (8)
+
+enum COMPRESS_ENCODING {
+    COMPRESS_NONE = 0,
+    COMPRESS_GZIP,
+    COMPRESS_DEFLATE,
+    COMPRESS_ENCODING_NUM
+};
+
+class ResponseCompressor
+{
+    private:
+        int level;              // -1 表示不开启
+        size_t min_size;
+        z_stream stream[COMPRESS_ENCODING_NUM];
+        bool stream_ready[COMPRESS_ENCODING_NUM];
+
+        // 统计
+        uint64_t stat_responses;
+        uint64_t stat_skipped;      // 压缩后没有变小
+        uint64_t stat_errors;
+        uint64_t stat_bytes_in;
+        uint64_t stat_bytes_out;
+        uint64_t stat_cpu_us;
+
+        int Deflate(int encoding, struct evbuffer *in, struct evbuffer *out);
+
+    public:
+        ResponseCompressor();
+        ~ResponseCompressor();
+
+        void Init(int compress_level, size_t compress_min_size);
+        bool IsEnabled() {
+            return level >= 0;
+        }
+
+        // 返回应该使用的编码, 不需要压缩时返回 COMPRESS_NONE
+        // 客户端可能是 HTTP/2 的 stream, 只传方法和请求头
+        int Select(enum evhttp_cmd_type method, struct evkeyvalq *client_headers,
+            struct evhttp_request *proxy_req);
+        // 压缩 body 并修改响应头, 失败或没有变小时保持原样, 返回 0 表示已压缩
+        int Compress(int encoding, struct evkeyvalq *headers, struct evbuffer *body);
+        void DumpStats(struct evbuffer *buf);
+};
+
+#endif
@@ -0,0 +1,207 @@
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include <event2/http.h>
+}
+
+#include "config.h"
+#include "dns_race.h"
+
+using namespace std;
+
+enum CONFIG_VALUE_TYPE {
+    CONFIG_INT = 0,
+    CONFIG_DOUBLE,
+    CONFIG_METHODS
+};
+
+struct RuntimeConfigItem {
+    const char *key;
+    int type;
+    size_t offset;
+    double min;
+    double max;
+};
+
+static const RuntimeConfigItem runtime_items[] = {
+    {"verbose", CONFIG_INT, offsetof(RuntimeConfig, verbose), 0, 1},
+    {"dns_ttl_min", CONFIG_INT, offsetof(RuntimeConfig, dns_ttl_min), 0, 86400},
+    {"dns_ttl_max", CONFIG_INT, offsetof(RuntimeConfig, dns_ttl_max), 1, 86400},
+    {"dns_cache_max", CONFIG_INT, offsetof(RuntimeConfig, dns_cache_max), 0, 10000000},
+    {"dns_clean_interval", CONFIG_INT, offsetof(RuntimeConfig, dns_clean_interval), 1, 86400},
+    {"dns_hedge_min", CONFIG_INT, offsetof(RuntimeConfig, dns_hedge_min), 1, 60000},
+    {"dns_hedge_max", CONFIG_INT, offsetof(RuntimeConfig, dns_hedge_max), 1, 60000},
+    {"dns_race_max", CONFIG_INT, offsetof(RuntimeConfig, dns_race_max), 1, DNS_MAX_RESOLVERS},
+    {"client_timeout", CONFIG_INT, offsetof(RuntimeConfig, client_timeout), 0, 86400},
+    {"upstream_timeout", CONFIG_INT, offsetof(RuntimeConfig, upstream_timeout), 0, 86400},
+    {"max_headers_size", CONFIG_INT, offsetof(RuntimeConfig, max_headers_size), 0, 0x7fffffff},
+    {"max_body_size", CONFIG_INT, offsetof(RuntimeConfig, max_body_size), 0, 0x7fffffff},
+    {"allowed_methods", CONFIG_METHODS, offsetof(RuntimeConfig, allowed_methods), 0, 0},
+    {"warm_max_conn", CONFIG_INT, offsetof(RuntimeConfig, warm_max_conn), 0, 1024},
+    {"warm_idle_time", CONFIG_INT, offsetof(RuntimeConfig, warm_idle_time), 1, 86400},
+    {"warm_min_rate", CONFIG_DOUBLE, offsetof(RuntimeConfig, warm_min_rate), 0, 1e9},
+    {"drain_timeout", CONFIG_INT, offsetof(RuntimeConfig, drain_timeout), 0, 86400},
+};
+
+static const struct {
+    const char *name;
+    int method;
+} method_names[] = {
+    {"GET", EVHTTP_REQ_GET},
+    {"POST", EVHTTP_REQ_POST},
+    {"HEAD", EVHTTP_REQ_HEAD},
+    {"PUT", EVHTTP_REQ_PUT},
+    {"DELETE", EVHTTP_REQ_DELETE},
+    {"OPTIONS", EVHTTP_REQ_OPTIONS},
+    {"TRACE", EVHTTP_REQ_TRACE},
+    {"CONNECT", EVHTTP_REQ_CONNECT},
+    {"PATCH", EVHTTP_REQ_PATCH},
+};
+
+static string trim(const string &str)
+{
+    size_t begin = str.find_first_not_of(" \t\r\n");
+    if (begin == string::npos)
+        return "";
+    size_t end = str.find_last_not_of(" \t\r\n");
+    return str.substr(begin, end - begin + 1);
+}
+
+int load_config_file(const string &path, vector<ConfigEntry> *entries)
+{
+    FILE *fp = fopen(path.c_str(), "r");
+    if (!fp) {
+        printf("open config file %s failed: %s\n", path.c_str(), strerror(errno));
+        return -1;
+    }
+
+    entries->clear();
+    char buf[4096];
+    int line = 0, ret = 0;
+    while (fgets(buf, sizeof(buf), fp)) {
+        line++;
+        string str = buf;
+        size_t comment = str.find('#');
+        if (comment != string::npos)
+            str.resize(comment);
+        str = trim(str);
+        if (str.empty())
+            continue;
+
+        size_t eq = str.find('=');
+        ConfigEntry entry;
+        entry.key = eq == string::npos ? "" : trim(str.substr(0, eq));
+        entry.value = eq == string::npos ? "" : trim(str.substr(eq + 1));
+        entry.line = line;
+        if (entry.key.empty()) {
+            printf("config %s:%d format error: %s\n", path.c_str(), line, str.c_str());
+            ret = -1;
+            break;
+        }
+        entries->push_back(entry);
+    }
+    fclose(fp);
+    return ret;
+}
+
+// "GET,POST,CONNECT"
+static int parse_methods(const string &value, int *methods)
+{
+    int result = 0;
+    size_t pos = 0;
+    while (pos <= value.size()) {
+        size_t end = value.find(',', pos);
+        if (end == string::npos)
+            end = value.size();
+        string name = trim(value.substr(pos, end - pos));
+        size_t i;
+        for (i = 0; i < sizeof(method_names) / sizeof(method_names[0]); i++) {
+            if (strcasecmp(name.c_str(), method_names[i].name) == 0) {
+                result |= method_names[i].method;
+                break;
+            }
+        }
+        if (i == sizeof(method_names) / sizeof(method_names[0]))
+            return -1;
+        pos = end + 1;
+    }
+    *methods = result;
+    return 0;
+}
+
+RuntimeConfig::RuntimeConfig()
+{
+    verbose = 0;
+    dns_ttl_min = 60;
+    dns_ttl_max = 600;
+    dns_cache_max = 0;
+    dns_clean_interval = 600;
+    dns_hedge_min = 20;
+    dns_hedge_max = 1000;
+    dns_race_max = 2;
+    client_timeout = 0;
+    upstream_timeout = 0;
+    max_headers_size = 0;
+    max_body_size = 0;
+    allowed_methods = EVHTTP_REQ_GET|EVHTTP_REQ_POST|EVHTTP_REQ_HEAD|EVHTTP_REQ_PUT|
+        EVHTTP_REQ_DELETE|EVHTTP_REQ_OPTIONS|EVHTTP_REQ_TRACE|EVHTTP_REQ_CONNECT|EVHTTP_REQ_PATCH;
+    warm_max_conn = 8;
+    warm_idle_time = 30;
+    warm_min_rate = 0.5;
+    drain_timeout = 30;
+}
+
+int RuntimeConfig::Set(const string &key, const string &value)
+{
+    for (size_t i = 0; i < sizeof(runtime_items) / sizeof(runtime_items[0]); i++) {
+        const RuntimeConfigItem &item = runtime_items[i];
+        if (key != item.key)
+            continue;
+
+        char *field = (char *)this + item.offset;
+        if (item.type == CONFIG_METHODS)
+            return parse_methods(value, (int *)field) == 0 && *(int *)field != 0 ? 0 : -1;
+
+        char *end = NULL;
+        double v = strtod(value.c_str(), &end);
+        if (value.empty() || *end != '\0' || v < item.min || v > item.max)
+            return -1;
+        if (item.type == CONFIG_INT) {
+            if (v != (int)v)
+                return -1;
+            *(int *)field = (int)v;
+        } else {
+            *(double *)field = v;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+void RuntimeConfig::DumpStats(struct evbuffer *buf) const
+{
+    for (size_t i = 0; i < sizeof(runtime_items) / sizeof(runtime_items[0]); i++) {
+        const RuntimeConfigItem &item = runtime_items[i];
+        const char *field = (const char *)this + item.offset;
+        if (item.type == CONFIG_INT) {
+            evbuffer_add_printf(buf, "config.%s %d\n", item.key, *(const int *)field);
+        } else if (item.type == CONFIG_DOUBLE) {
+            evbuffer_add_printf(buf, "config.%s %g\n", item.key, *(const double *)field);
+        } else {
+            string names;
+            for (size_t j = 0; j < sizeof(method_names) / sizeof(method_names[0]); j++) {
+                if (*(const int *)field & method_names[j].method)
+                    names += string(names.empty() ? "" : ",") + method_names[j].name;
+            }
+            evbuffer_add_printf(buf, "config.%s %s\n", item.key, names.c_str());
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef HTTP_PROXY_CONFIG_H
+#define HTTP_PROXY_CONFIG_H
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <stdint.h>
+
+#include <event2/buffer.h>
+}
+
+// 配置文件格式: 每行一个 key = value, # 之后是注释, 列表类型的 key 可以写多行
+//
+//   listen = 0.0.0.0:18023
+//   workers = 4
+//   unix = /run/http_proxy.sock
+//   dns_ttl_max = 600
+
+struct ConfigEntry {
+    std::string key;
+    std::string value;
+    int line;
+};
+
+// 读出所有配置项, 不检查 key 是否存在, 格式错误返回 -1
+int load_config_file(const std::string &path, std::vector<ConfigEntry> *entries);
+
+// 运行中可以通过 SIGHUP 重新加载的参数, 每个 worker 持有一份拷贝
+// 只包含整数和浮点数, 按名字查表解析
+struct RuntimeConfig {
+    int verbose;                // libevent 调试日志
+    int dns_ttl_min;            // dns 缓存时间的下限/上限(秒), 解析结果的 ttl 被限制在这个范围
+    int dns_ttl_max;
+    int dns_cache_max;          // 每个 worker 最多缓存的域名数, 0 表示不限制
+    int dns_clean_interval;     // 清理过期 dns 缓存的间隔(秒)
+    int dns_hedge_min;          // 向下一个 dns 服务器发对冲请求的等待时间下限/上限(毫秒)
+    int dns_hedge_max;
+    int dns_race_max;           // 一次解析最多同时问几个 dns 服务器, 1 表示只在失败后换服务器
+    int client_timeout;         // 客户端连接的读写超时(秒), 0 表示使用 libevent 默认值
+    int upstream_timeout;       // 上游 http 连接的超时(秒)
+    int max_headers_size;       // 请求/响应头的最大字节数, 0 表示不限制
+    int max_body_size;          // 请求/响应 body 的最大字节数
+    int allowed_methods;        // 允许的请求方法, EVHTTP_REQ_* 的组合
+    int warm_max_conn;          // 每个上游最多保留的热连接数
+    int warm_idle_time;         // 热连接最长空闲时间(秒)
+    double warm_min_rate;       // 每秒请求数低于该值时不做预连接
+    int drain_timeout;          // 退出时等待连接结束的最长时间, 0 表示立即退出
+
+    RuntimeConfig();
+
+    // 0: 成功, -1: 值错误, 1: 不是运行时参数
+    int Set(const std::string &key, const std::string &value);
+    void DumpStats(struct evbuffer *buf) const;
+};
+
+#endif
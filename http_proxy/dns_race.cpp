@@ -0,0 +1,430 @@
+#include <string>
+#include <vector>
+#include <set>
+
+extern "C" {
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <event2/util.h>
+}
+
+#include "dns_race.h"
+
+using namespace std;
+
+// 发给一个服务器的请求
+struct DnsAttempt {
+    DnsRace *race;
+    int resolver;
+    struct evdns_request *req;  // 回调之后为 NULL
+    uint64_t sent_us;
+    bool hedge;
+    bool canceled;              // 别的服务器先回应了
+};
+
+// 一次解析, 所有请求都回调之后才释放, 取消的请求也会回调 DNS_ERR_CANCEL
+struct DnsRace {
+    DnsRacer *racer;
+    string host;
+    dns_race_cb cb;
+    void *arg;
+    struct event *hedge_timer;
+    uint32_t tried;             // 已经问过的服务器, 每个服务器只问一次
+    int attempt_num;
+    int outstanding;            // 还没有回调的请求
+    bool hedged;
+    bool done;                  // 已经回调了调用者
+    DnsAttempt attempts[DNS_MAX_RESOLVERS];
+};
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// ip[:port] 或 [ipv6]:port, 没有端口时用 53
+static int parse_resolver_addr(const string &addr, struct sockaddr_storage *ss, int *len)
+{
+    *len = sizeof(*ss);
+    memset(ss, 0, sizeof(*ss));
+    if (evutil_parse_sockaddr_port(addr.c_str(), (struct sockaddr *)ss, len) != 0)
+        return -1;
+    if (ss->ss_family == AF_INET && ((struct sockaddr_in *)ss)->sin_port == 0)
+        ((struct sockaddr_in *)ss)->sin_port = htons(53);
+    else if (ss->ss_family == AF_INET6 && ((struct sockaddr_in6 *)ss)->sin6_port == 0)
+        ((struct sockaddr_in6 *)ss)->sin6_port = htons(53);
+    return 0;
+}
+
+static string format_resolver_addr(const struct sockaddr *sa)
+{
+    char ip[INET6_ADDRSTRLEN] = "";
+    if (sa->sa_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+        evutil_inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
+        return string(ip) + ":" + to_string(ntohs(sin->sin_port));
+    }
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+    evutil_inet_ntop(AF_INET6, &sin6->sin6_addr, ip, sizeof(ip));
+    return string("[") + ip + "]:" + to_string(ntohs(sin6->sin6_port));
+}
+
+bool dns_resolver_addr_valid(const string &addr)
+{
+    struct sockaddr_storage ss;
+    int len;
+    return parse_resolver_addr(addr, &ss, &len) == 0;
+}
+
+DnsRacer::DnsRacer()
+{
+    base = NULL;
+    hedge_min_ms = 20;
+    hedge_max_ms = 1000;
+    race_max = 2;
+    stat_races = 0;
+    stat_hedged = 0;
+    stat_rescued = 0;
+    stat_retries = 0;
+    stat_failed = 0;
+}
+
+DnsRacer::~DnsRacer()
+{
+    Close();
+}
+
+int DnsRacer::AddResolver(const string &addr)
+{
+    struct sockaddr_storage ss;
+    int len;
+    if (resolvers.size() >= DNS_MAX_RESOLVERS || parse_resolver_addr(addr, &ss, &len) != 0) {
+        printf("dns resolver address error:%s\n", addr.c_str());
+        return -1;
+    }
+
+    // search 域和 ndots 等选项仍然来自 resolv.conf, 只是每个 base 只有一个 nameserver
+    struct evdns_base *dns = evdns_base_new(base, 0);
+    if (!dns)
+        return -1;
+    evdns_base_resolv_conf_parse(dns, DNS_OPTION_SEARCH|DNS_OPTION_MISC, "/etc/resolv.conf");
+    if (evdns_base_nameserver_sockaddr_add(dns, (struct sockaddr *)&ss, len, 0) != 0) {
+        printf("dns resolver add failed:%s\n", addr.c_str());
+        evdns_base_free(dns, 0);
+        return -1;
+    }
+
+    DnsResolver r = DnsResolver();
+    r.name = format_resolver_addr((struct sockaddr *)&ss);
+    r.dns = dns;
+    resolvers.push_back(r);
+    return 0;
+}
+
+int DnsRacer::Init(struct event_base *event_base, const vector<string> &servers)
+{
+    base = event_base;
+
+    vector<string> addrs = servers;
+    if (addrs.empty()) {
+        // 用一个临时的 base 读出 resolv.conf 里的 nameserver
+        struct evdns_base *tmp = evdns_base_new(base, EVDNS_BASE_INITIALIZE_NAMESERVERS);
+        if (!tmp)
+            return -1;
+        int count = evdns_base_count_nameservers(tmp);
+        for (int i = 0; i < count && i < DNS_MAX_RESOLVERS; i++) {
+            struct sockaddr_storage ss;
+            if (evdns_base_get_nameserver_addr(tmp, i, (struct sockaddr *)&ss, sizeof(ss)) > 0)
+                addrs.push_back(format_resolver_addr((struct sockaddr *)&ss));
+        }
+        evdns_base_free(tmp, 0);
+    }
+
+    for (size_t i = 0; i < addrs.size(); i++) {
+        if (AddResolver(addrs[i]) != 0)
+            return -1;
+    }
+    if (resolvers.empty()) {
+        printf("no dns resolver\n");
+        return -1;
+    }
+    // 有多个服务器时由赛跑负责重试, 单个服务器内部不再重发
+    if (resolvers.size() > 1) {
+        for (size_t i = 0; i < resolvers.size(); i++)
+            evdns_base_set_option(resolvers[i].dns, "attempts:", "1");
+    }
+    return 0;
+}
+
+void DnsRacer::Close()
+{
+    // 不回调, 由调用者在 event_base 释放前调用
+    for (auto iter = races.begin(); iter != races.end(); iter++) {
+        event_free((*iter)->hedge_timer);
+        delete *iter;
+    }
+    races.clear();
+    for (size_t i = 0; i < resolvers.size(); i++)
+        evdns_base_free(resolvers[i].dns, 0);
+    resolvers.clear();
+}
+
+// 没问过的服务器里, 健康的按 srtt 从小到大, 都不健康时选最早恢复的
+int DnsRacer::PickNext(const DnsRace *race, uint64_t now) const
+{
+    int best = -1, down = -1;
+    uint64_t best_rtt = 0;
+    for (size_t i = 0; i < resolvers.size(); i++) {
+        const DnsResolver &r = resolvers[i];
+        if (race->tried & (1u << i))
+            continue;
+        if (r.down_until_us > now) {
+            if (down < 0 || r.down_until_us < resolvers[down].down_until_us)
+                down = i;
+            continue;
+        }
+        uint64_t rtt = r.has_rtt ? r.srtt_us : DNS_RTT_INIT_US;
+        if (best < 0 || rtt < best_rtt) {
+            best = i;
+            best_rtt = rtt;
+        }
+    }
+    return best >= 0 ? best : down;
+}
+
+uint64_t DnsRacer::HedgeDelay(int idx) const
+{
+    const DnsResolver &r = resolvers[idx];
+    uint64_t delay = r.has_rtt ? r.srtt_us + 4 * r.rttvar_us : DNS_RTT_INIT_US;
+    if (delay < (uint64_t)hedge_min_ms * 1000)
+        delay = (uint64_t)hedge_min_ms * 1000;
+    if (delay > (uint64_t)hedge_max_ms * 1000)
+        delay = (uint64_t)hedge_max_ms * 1000;
+    return delay;
+}
+
+void DnsRacer::Sample(DnsResolver &r, uint64_t rtt_us)
+{
+    if (!r.has_rtt) {
+        r.srtt_us = rtt_us;
+        r.rttvar_us = rtt_us / 2;
+        r.has_rtt = true;
+        return;
+    }
+    uint64_t diff = r.srtt_us > rtt_us ? r.srtt_us - rtt_us : rtt_us - r.srtt_us;
+    r.rttvar_us = (3 * r.rttvar_us + diff) / 4;
+    r.srtt_us = (7 * r.srtt_us + rtt_us) / 8;
+}
+
+void DnsRacer::MarkFailure(DnsResolver &r, uint64_t now)
+{
+    r.failures++;
+    r.fails++;
+    // 暂停期间陆续回来的失败不再延长暂停时间
+    if (r.fails < DNS_DOWN_FAILURES || r.down_until_us > now)
+        return;
+    r.down_ms = r.down_ms ? r.down_ms * 2 : DNS_DOWN_MIN_MS;
+    if (r.down_ms > DNS_DOWN_MAX_MS)
+        r.down_ms = DNS_DOWN_MAX_MS;
+    r.down_until_us = now + (uint64_t)r.down_ms * 1000;
+    r.downs++;
+    printf("dns resolver %s down for %dms, %d failures\n", r.name.c_str(), r.down_ms, r.fails);
+}
+
+// 发给第 idx 个服务器, 失败时该服务器也算问过了
+int DnsRacer::Send(DnsRace *race, int idx, bool hedge)
+{
+    DnsResolver &r = resolvers[idx];
+    DnsAttempt *a = &race->attempts[race->attempt_num];
+    a->race = race;
+    a->resolver = idx;
+    a->sent_us = now_us();
+    a->hedge = hedge;
+    a->canceled = false;
+    race->tried |= 1u << idx;
+
+    r.queries++;
+    a->req = evdns_base_resolve_ipv4(r.dns, race->host.c_str(), 0, attempt_cb, a);
+    if (!a->req) {
+        MarkFailure(r, a->sent_us);
+        return -1;
+    }
+    if (hedge)
+        r.hedges++;
+    r.inflight++;
+    race->attempt_num++;
+    race->outstanding++;
+    return 0;
+}
+
+// 最近发出的请求在 srtt + 4 * rttvar 内没有回应就发下一个
+void DnsRacer::ArmHedge(DnsRace *race)
+{
+    if (race->done || race->attempt_num == 0 || race->outstanding >= race_max ||
+        race->attempt_num >= (int)resolvers.size())
+        return;
+    uint64_t delay = HedgeDelay(race->attempts[race->attempt_num - 1].resolver);
+    struct timeval tv = {(time_t)(delay / 1000000), (suseconds_t)(delay % 1000000)};
+    evtimer_add(race->hedge_timer, &tv);
+}
+
+void DnsRacer::Finish(DnsRace *race, int result, char type, int count, int ttl, void *addrs)
+{
+    race->done = true;
+    evtimer_del(race->hedge_timer);
+    for (int i = 0; i < race->attempt_num; i++) {
+        DnsAttempt *a = &race->attempts[i];
+        if (a->req) {
+            a->canceled = true;
+            evdns_cancel_request(resolvers[a->resolver].dns, a->req);
+        }
+    }
+    race->cb(result, type, count, ttl, addrs, race->arg);
+}
+
+void DnsRacer::hedge_cb(evutil_socket_t fd, short events, void *arg)
+{
+    DnsRace *race = (DnsRace *)arg;
+    DnsRacer *racer = race->racer;
+    if (race->done || race->outstanding >= racer->race_max)
+        return;
+
+    uint64_t now = now_us();
+    int idx;
+    while ((idx = racer->PickNext(race, now)) >= 0) {
+        if (racer->Send(race, idx, true) == 0)
+            break;
+    }
+    if (idx >= 0 && !race->hedged) {
+        race->hedged = true;
+        racer->stat_hedged++;
+    }
+    racer->ArmHedge(race);
+}
+
+void DnsRacer::attempt_cb(int result, char type, int count, int ttl, void *addrs, void *arg)
+{
+    DnsAttempt *a = (DnsAttempt *)arg;
+    DnsRace *race = a->race;
+    DnsRacer *racer = race->racer;
+    DnsResolver &r = racer->resolvers[a->resolver];
+    uint64_t now = now_us();
+    uint64_t rtt = now - a->sent_us;
+
+    a->req = NULL;
+    race->outstanding--;
+    r.inflight--;
+
+    if (result == DNS_ERR_CANCEL || result == DNS_ERR_SHUTDOWN) {
+        // 输给了别的服务器, 已经等待的时间是 RTT 的下限, 变慢的服务器排序会往后移
+        if (a->canceled && (!r.has_rtt || rtt > r.srtt_us))
+            racer->Sample(r, rtt);
+    } else if (result == DNS_ERR_NONE || result == DNS_ERR_NOTEXIST || result == DNS_ERR_NODATA) {
+        r.answers++;
+        racer->Sample(r, rtt);
+        if (r.down_until_us)
+            printf("dns resolver %s up\n", r.name.c_str());
+        r.fails = 0;
+        r.down_ms = 0;
+        r.down_until_us = 0;
+        if (!race->done) {
+            r.wins++;
+            if (a->hedge)
+                racer->stat_rescued++;
+            racer->Finish(race, result, type, count, ttl, addrs);
+        }
+    } else {
+        if (result == DNS_ERR_TIMEOUT)
+            r.timeouts++;
+        racer->MarkFailure(r, now);
+        if (!race->done) {
+            // 立即换下一个服务器, 不等对冲定时器
+            int idx;
+            while ((idx = racer->PickNext(race, now)) >= 0) {
+                if (racer->Send(race, idx, false) == 0)
+                    break;
+            }
+            if (idx >= 0) {
+                racer->stat_retries++;
+                racer->ArmHedge(race);
+            } else if (race->outstanding == 0) {
+                racer->stat_failed++;
+                racer->Finish(race, result, type, count, ttl, addrs);
+            }
+        }
+    }
+
+    if (race->done && race->outstanding == 0) {
+        racer->races.erase(race);
+        event_free(race->hedge_timer);
+        delete race;
+    }
+}
+
+int DnsRacer::Resolve(const char *host, dns_race_cb cb, void *arg)
+{
+    if (resolvers.empty())
+        return -1;
+
+    DnsRace *race = new DnsRace;
+    race->racer = this;
+    race->host = host;
+    race->cb = cb;
+    race->arg = arg;
+    race->hedge_timer = evtimer_new(base, hedge_cb, race);
+    race->tried = 0;
+    race->attempt_num = 0;
+    race->outstanding = 0;
+    race->hedged = false;
+    race->done = false;
+
+    uint64_t now = now_us();
+    int idx;
+    while ((idx = PickNext(race, now)) >= 0) {
+        if (Send(race, idx, false) == 0)
+            break;
+    }
+    if (race->outstanding == 0) {
+        event_free(race->hedge_timer);
+        delete race;
+        return -1;
+    }
+    races.insert(race);
+    stat_races++;
+    ArmHedge(race);
+    return 0;
+}
+
+void DnsRacer::DumpStats(struct evbuffer *buf)
+{
+    uint64_t now = now_us();
+    evbuffer_add_printf(buf, "dns.race.count %lu\n", (unsigned long)stat_races);
+    evbuffer_add_printf(buf, "dns.race.hedged %lu\n", (unsigned long)stat_hedged);
+    evbuffer_add_printf(buf, "dns.race.rescued %lu\n", (unsigned long)stat_rescued);
+    evbuffer_add_printf(buf, "dns.race.retries %lu\n", (unsigned long)stat_retries);
+    evbuffer_add_printf(buf, "dns.race.failed %lu\n", (unsigned long)stat_failed);
+    evbuffer_add_printf(buf, "dns.race.live %zu\n", races.size());
+    for (size_t i = 0; i < resolvers.size(); i++) {
+        const DnsResolver &r = resolvers[i];
+        evbuffer_add_printf(buf, "dns.resolver.%zu.addr %s\n", i, r.name.c_str());
+        evbuffer_add_printf(buf, "dns.resolver.%zu.healthy %d\n", i, r.down_until_us > now ? 0 : 1);
+        evbuffer_add_printf(buf, "dns.resolver.%zu.srtt_us %lu\n", i, (unsigned long)r.srtt_us);
+        evbuffer_add_printf(buf, "dns.resolver.%zu.rttvar_us %lu\n", i, (unsigned long)r.rttvar_us);
+        evbuffer_add_printf(buf, "dns.resolver.%zu.hedge_delay_us %lu\n", i, (unsigned long)HedgeDelay(i));
+        evbuffer_add_printf(buf, "dns.resolver.%zu.inflight %d\n", i, r.inflight);
+        evbuffer_add_printf(buf, "dns.resolver.%zu.queries %lu\n", i, (unsigned long)r.queries);
+        evbuffer_add_printf(buf, "dns.resolver.%zu.answers %lu\n", i, (unsigned long)r.answers);
+        evbuffer_add_printf(buf, "dns.resolver.%zu.failures %lu\n", i, (unsigned long)r.failures);
+        evbuffer_add_printf(buf, "dns.resolver.%zu.timeouts %lu\n", i, (unsigned long)r.timeouts);
+        evbuffer_add_printf(buf, "dns.resolver.%zu.hedges %lu\n", i, (unsigned long)r.hedges);
+        evbuffer_add_printf(buf, "dns.resolver.%zu.wins %lu\n", i, (unsigned long)r.wins);
+        evbuffer_add_printf(buf, "dns.resolver.%zu.downs %lu\n", i, (unsigned long)r.downs);
+    }
+}
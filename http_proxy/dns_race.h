@@ -0,0 +1,107 @@
+#ifndef HTTP_PROXY_DNS_RACE_H
+#define HTTP_PROXY_DNS_RACE_H
+
+#include <string>
+#include <vector>
+#include <set>
+
+extern "C" {
+#include <stdint.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/dns.h>
+}
+
+// 多个 dns 服务器赛跑: 每个服务器一个 evdns_base, 各自统计 RTT 和失败次数
+// 先问最快的健康服务器, 超过 srtt + 4 * rttvar 还没有回应时再问下一个, 第一个回应生效, 其他的取消
+// 失败(超时, SERVFAIL 等)立即换下一个, NXDOMAIN 也是有效回应
+// 连续失败 DNS_DOWN_FAILURES 次后暂停使用, 暂停时间从 1 秒开始每次翻倍, 到期后重新参与排序作为探测
+// 没有配置服务器时使用 resolv.conf 里的 nameserver
+
+#define DNS_MAX_RESOLVERS (16)
+#define DNS_RTT_INIT_US (100 * 1000)    // 还没有样本时的 RTT 估计
+#define DNS_DOWN_FAILURES (3)
+#define DNS_DOWN_MIN_MS (1000)
+#define DNS_DOWN_MAX_MS (30 * 1000)
+
+typedef void (*dns_race_cb)(int result, char type, int count, int ttl, void *addrs, void *arg);
+
+struct DnsRace;
+
+struct DnsResolver {
+    std::string name;           // ip:port
+    struct evdns_base *dns;
+    uint64_t srtt_us;           // 平滑后的 RTT 和偏差, 算法同 TCP (RFC 6298)
+    uint64_t rttvar_us;
+    bool has_rtt;
+    int fails;                  // 连续失败次数
+    int down_ms;                // 下次暂停的时间, 成功后复位
+    uint64_t down_until_us;     // 暂停到这个时间, 0 表示健康
+    int inflight;
+
+    // 统计
+    uint64_t queries;
+    uint64_t answers;
+    uint64_t failures;
+    uint64_t timeouts;
+    uint64_t hedges;            // 作为对冲请求发出
+    uint64_t wins;              // 赛跑中第一个回应
+    uint64_t downs;             // 被暂停的次数
+};
+
+// 每个 worker 一个实例, 只在 worker 线程里使用
+class DnsRacer
+{
+    friend struct DnsRace;
+
+    private:
+        struct event_base *base;
+        std::vector<DnsResolver> resolvers;
+        std::set<DnsRace *> races;
+        int hedge_min_ms;           // 对冲延迟的下限/上限
+        int hedge_max_ms;
+        int race_max;               // 一次解析同时进行的最大请求数
+
+        // 统计
+        uint64_t stat_races;
+        uint64_t stat_hedged;       // 发出过对冲请求的解析
+        uint64_t stat_rescued;      // 由后发的请求赢得的解析
+        uint64_t stat_retries;      // 失败后换服务器重试
+        uint64_t stat_failed;       // 所有服务器都失败
+
+        int AddResolver(const std::string &addr);
+        int PickNext(const DnsRace *race, uint64_t now) const;
+        uint64_t HedgeDelay(int idx) const;
+        int Send(DnsRace *race, int idx, bool hedge);
+        void ArmHedge(DnsRace *race);
+        void Finish(DnsRace *race, int result, char type, int count, int ttl, void *addrs);
+        void Sample(DnsResolver &r, uint64_t rtt_us);
+        void MarkFailure(DnsResolver &r, uint64_t now);
+
+        static void attempt_cb(int result, char type, int count, int ttl, void *addrs, void *arg);
+        static void hedge_cb(evutil_socket_t fd, short events, void *arg);
+
+    public:
+        DnsRacer();
+        ~DnsRacer();
+
+        // servers 为空时读取 resolv.conf
+        int Init(struct event_base *event_base, const std::vector<std::string> &servers);
+        void SetHedge(int min_ms, int max_ms, int max_race) {
+            hedge_min_ms = min_ms;
+            hedge_max_ms = max_ms > min_ms ? max_ms : min_ms;
+            race_max = max_race;
+        }
+
+        // 解析 IPv4 地址, 回调参数和 evdns_callback_type 一样, 失败返回 -1 且不会回调
+        int Resolve(const char *host, dns_race_cb cb, void *arg);
+        // 正在进行的解析直接丢弃, 不回调
+        void Close();
+        void DumpStats(struct evbuffer *buf);
+};
+
+// 检查 ip[:port] 格式, 命令行解析时使用
+bool dns_resolver_addr_valid(const std::string &addr);
+
+#endif
@@ -0,0 +1,245 @@
+// 本地 dns 测试服务器, 测试多个 dns 服务器赛跑和健康检查
+// 所有 A 查询都回答同一个地址, 其他类型回答空结果, .invalid 结尾的域名回答 NXDOMAIN
+// 可以设置回应延迟, 丢弃(模拟超时)和 SERVFAIL 的比例, 每隔一段时间打印收到的查询数
+//
+// ./dns_stub -l 127.0.0.1:5301 -d 5 &
+// ./dns_stub -l 127.0.0.1:5302 -d 300 -j 100 -D 20 &
+// ./http_proxy 127.0.0.1 18023 -N 127.0.0.1:5301 -N 127.0.0.1:5302
+#include <iostream>
+#include <string>
+#include <map>
+
+extern "C" {
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+}
+
+using namespace std;
+
+#define DNS_HEADER_SIZE (12)
+#define DNS_PACKET_MAX (512)
+
+struct StubReply {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    string data;
+};
+
+struct StubStats {
+    uint64_t queries;
+    uint64_t answers;
+    uint64_t dropped;
+    uint64_t servfails;
+    uint64_t nxdomains;
+    uint64_t errors;        // 格式错误
+};
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 只处理一个问题, 返回问题部分的长度, 格式错误返回 -1
+static int parse_question(const unsigned char *pkt, int len, string *name, int *qtype)
+{
+    int pos = DNS_HEADER_SIZE;
+    name->clear();
+    while (pos < len && pkt[pos] != 0) {
+        int label = pkt[pos];
+        if (label > 63 || pos + 1 + label > len)
+            return -1;
+        if (!name->empty())
+            name->push_back('.');
+        name->append((const char *)pkt + pos + 1, label);
+        pos += 1 + label;
+    }
+    if (pos + 5 > len)
+        return -1;
+    pos++;
+    *qtype = (pkt[pos] << 8) | pkt[pos + 1];
+    pos += 4;
+    return pos - DNS_HEADER_SIZE;
+}
+
+static bool has_suffix(const string &name, const char *suffix)
+{
+    size_t n = strlen(suffix);
+    return name.size() >= n && strcasecmp(name.c_str() + name.size() - n, suffix) == 0;
+}
+
+static void put16(string *out, int v)
+{
+    out->push_back((char)(v >> 8));
+    out->push_back((char)v);
+}
+
+// rcode: 0 正常, 2 SERVFAIL, 3 NXDOMAIN
+static string make_reply(const unsigned char *pkt, int question_len, int rcode, bool answer,
+    const struct in_addr &ip, int ttl)
+{
+    string out((const char *)pkt, DNS_HEADER_SIZE + question_len);
+    out[2] = (char)(0x80 | (pkt[2] & 0x79));    // QR, 保留 opcode 和 RD
+    out[3] = (char)(0x80 | rcode);              // RA
+    out[4] = 0;
+    out[5] = 1;
+    out[6] = 0;
+    out[7] = answer ? 1 : 0;
+    memset(&out[8], 0, 4);
+    if (answer) {
+        put16(&out, 0xc000 | DNS_HEADER_SIZE);  // 指向问题里的域名
+        put16(&out, 1);                         // A
+        put16(&out, 1);                         // IN
+        put16(&out, ttl >> 16);
+        put16(&out, ttl & 0xffff);
+        put16(&out, 4);
+        out.append((const char *)&ip, 4);
+    }
+    return out;
+}
+
+static void usage()
+{
+    cout << "usage: dns_stub [options]" << endl
+        << "  -l ip:port   监听地址, 默认 127.0.0.1:5353" << endl
+        << "  -a ip        A 记录的地址, 默认 127.0.0.1" << endl
+        << "  -t ttl       默认 60" << endl
+        << "  -d ms        回应延迟, 默认 0" << endl
+        << "  -j ms        延迟的随机抖动, 默认 0" << endl
+        << "  -D pct       丢弃的查询比例, 默认 0" << endl
+        << "  -S pct       回答 SERVFAIL 的比例, 默认 0" << endl
+        << "  -i seconds   输出间隔, 默认 5, 0 表示不输出" << endl;
+}
+
+int main(int argc, char **argv)
+{
+    string listen_addr = "127.0.0.1:5353";
+    string answer_ip = "127.0.0.1";
+    int ttl = 60;
+    int delay_ms = 0;
+    int jitter_ms = 0;
+    int drop_pct = 0;
+    int servfail_pct = 0;
+    int interval = 5;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "l:a:t:d:j:D:S:i:")) != -1) {
+        switch (opt) {
+        case 'l': listen_addr = optarg; break;
+        case 'a': answer_ip = optarg; break;
+        case 't': ttl = atoi(optarg); break;
+        case 'd': delay_ms = atoi(optarg); break;
+        case 'j': jitter_ms = atoi(optarg); break;
+        case 'D': drop_pct = atoi(optarg); break;
+        case 'S': servfail_pct = atoi(optarg); break;
+        case 'i': interval = atoi(optarg); break;
+        default: usage(); return 1;
+        }
+    }
+
+    struct in_addr ip;
+    size_t colon = listen_addr.rfind(':');
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (colon == string::npos || inet_pton(AF_INET, listen_addr.substr(0, colon).c_str(), &addr.sin_addr) != 1 ||
+        inet_pton(AF_INET, answer_ip.c_str(), &ip) != 1 || delay_ms < 0 || jitter_ms < 0 || ttl < 0) {
+        usage();
+        return 1;
+    }
+    addr.sin_port = htons(atoi(listen_addr.c_str() + colon + 1));
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("bind");
+        return 1;
+    }
+    printf("listen %s, answer %s, delay %dms+%dms, drop %d%%, servfail %d%%\n", listen_addr.c_str(),
+        answer_ip.c_str(), delay_ms, jitter_ms, drop_pct, servfail_pct);
+
+    unsigned int seed = (unsigned int)now_us();
+    multimap<uint64_t, StubReply> pending;    // 按发送时间排序
+    StubStats stats, last;
+    memset(&stats, 0, sizeof(stats));
+    memset(&last, 0, sizeof(last));
+    uint64_t next_print = now_us() + (uint64_t)interval * 1000000;
+
+    while (true) {
+        uint64_t now = now_us();
+        while (!pending.empty() && pending.begin()->first <= now) {
+            StubReply &r = pending.begin()->second;
+            sendto(fd, r.data.data(), r.data.size(), 0, (struct sockaddr *)&r.addr, r.addr_len);
+            pending.erase(pending.begin());
+        }
+        if (interval > 0 && now >= next_print) {
+            printf("queries:%lu answers:%lu nxdomain:%lu servfail:%lu dropped:%lu errors:%lu pending:%zu\n",
+                (unsigned long)(stats.queries - last.queries), (unsigned long)(stats.answers - last.answers),
+                (unsigned long)(stats.nxdomains - last.nxdomains), (unsigned long)(stats.servfails - last.servfails),
+                (unsigned long)(stats.dropped - last.dropped), (unsigned long)(stats.errors - last.errors),
+                pending.size());
+            fflush(stdout);
+            last = stats;
+            next_print = now + (uint64_t)interval * 1000000;
+        }
+
+        int timeout = interval > 0 ? (int)((next_print - now) / 1000) + 1 : -1;
+        if (!pending.empty()) {
+            int due = (int)((pending.begin()->first - now) / 1000) + 1;
+            if (timeout < 0 || due < timeout)
+                timeout = due;
+        }
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, timeout) <= 0)
+            continue;
+
+        while (true) {
+            unsigned char pkt[DNS_PACKET_MAX];
+            StubReply r;
+            r.addr_len = sizeof(r.addr);
+            int len = recvfrom(fd, pkt, sizeof(pkt), 0, (struct sockaddr *)&r.addr, &r.addr_len);
+            if (len < 0)
+                break;
+            stats.queries++;
+
+            string name;
+            int qtype = 0;
+            int question_len = len >= DNS_HEADER_SIZE && pkt[4] == 0 && pkt[5] == 1 ?
+                parse_question(pkt, len, &name, &qtype) : -1;
+            if (question_len < 0) {
+                stats.errors++;
+                continue;
+            }
+            if ((int)(rand_r(&seed) % 100) < drop_pct) {
+                stats.dropped++;
+                continue;
+            }
+            if ((int)(rand_r(&seed) % 100) < servfail_pct) {
+                r.data = make_reply(pkt, question_len, 2, false, ip, ttl);
+                stats.servfails++;
+            } else if (has_suffix(name, ".invalid")) {
+                r.data = make_reply(pkt, question_len, 3, false, ip, ttl);
+                stats.nxdomains++;
+            } else {
+                r.data = make_reply(pkt, question_len, 0, qtype == 1, ip, ttl);
+                stats.answers++;
+            }
+
+            uint64_t delay = (uint64_t)delay_ms * 1000;
+            if (jitter_ms > 0)
+                delay += rand_r(&seed) % ((uint64_t)jitter_ms * 1000);
+            pending.insert(make_pair(now_us() + delay, r));
+        }
+    }
+    return 0;
+}
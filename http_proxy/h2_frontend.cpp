@@ -0,0 +1,943 @@
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+
+#include <event2/util.h>
+}
+
+#include "h2_frontend.h"
+
+using namespace std;
+
+bool h2_supported()
+{
+#ifdef HTTP_PROXY_HTTP2
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Upgrade 是逗号分隔的协议列表, 比如 "h2c" 或 "websocket, h2c"
+bool H2Frontend::IsUpgrade(struct evhttp_request *req)
+{
+    struct evkeyvalq *headers = evhttp_request_get_input_headers(req);
+    const char *upgrade = evhttp_find_header(headers, "Upgrade");
+    if (!upgrade || !evhttp_find_header(headers, "HTTP2-Settings") ||
+        evhttp_request_get_command(req) == EVHTTP_REQ_CONNECT)
+        return false;
+
+    const char *p = upgrade;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        size_t len = strcspn(p, " \t,");
+        if (len == 3 && strncasecmp(p, "h2c", 3) == 0)
+            return true;
+        p += len;
+    }
+    return false;
+}
+
+void h2_stream_release(H2Stream *stream)
+{
+    if (--stream->refs > 0)
+        return;
+    evhttp_clear_headers(&stream->headers);
+    if (stream->body)
+        evbuffer_free(stream->body);
+    if (stream->out)
+        evbuffer_free(stream->out);
+    delete stream;
+}
+
+#ifdef HTTP_PROXY_HTTP2
+
+extern "C" {
+#include <nghttp2/nghttp2.h>
+}
+
+// 逐跳的头部, 只对一个连接有效, HTTP/2 里不允许出现
+static const char *hop_headers[] = {
+    "connection",
+    "proxy-connection",
+    "keep-alive",
+    "transfer-encoding",
+    "upgrade",
+    "http2-settings",
+};
+
+static const char *pseudo_headers[] = {
+    ":method",
+    ":scheme",
+    ":authority",
+    ":path",
+    ":protocol",
+};
+
+static const struct {
+    const char *name;
+    enum evhttp_cmd_type method;
+} h2_methods[] = {
+    {"GET", EVHTTP_REQ_GET},
+    {"POST", EVHTTP_REQ_POST},
+    {"HEAD", EVHTTP_REQ_HEAD},
+    {"PUT", EVHTTP_REQ_PUT},
+    {"DELETE", EVHTTP_REQ_DELETE},
+    {"OPTIONS", EVHTTP_REQ_OPTIONS},
+    {"TRACE", EVHTTP_REQ_TRACE},
+    {"CONNECT", EVHTTP_REQ_CONNECT},
+    {"PATCH", EVHTTP_REQ_PATCH},
+};
+
+static bool is_hop_header(const char *name)
+{
+    for (size_t i = 0; i < sizeof(hop_headers) / sizeof(hop_headers[0]); i++) {
+        if (strcasecmp(name, hop_headers[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+static nghttp2_nv h2_nv(const char *name, const char *value)
+{
+    nghttp2_nv nv;
+    nv.name = (uint8_t *)name;
+    nv.value = (uint8_t *)value;
+    nv.namelen = strlen(name);
+    nv.valuelen = strlen(value);
+    nv.flags = NGHTTP2_NV_FLAG_NONE;
+    return nv;
+}
+
+// host[:port] 或 [v6]:port, 没有端口时 port 为 -1
+static int parse_authority(const char *authority, string *host, int *port)
+{
+    string str = authority;
+    size_t colon = str.rfind(':');
+    size_t bracket = str.rfind(']');
+    *port = -1;
+    if (colon != string::npos && (bracket == string::npos || colon > bracket)) {
+        char *end = NULL;
+        long value = strtol(str.c_str() + colon + 1, &end, 10);
+        if (*end != '\0' || value <= 0 || value > 65535)
+            return -1;
+        *port = (int)value;
+        str.resize(colon);
+    }
+    if (str.size() > 2 && str[0] == '[' && str[str.size() - 1] == ']')
+        str = str.substr(1, str.size() - 2);
+    if (str.empty())
+        return -1;
+    *host = str;
+    return 0;
+}
+
+// HTTP2-Settings 是 base64url 编码的 SETTINGS 帧内容, 没有填充
+static int base64url_decode(const char *in, string *out)
+{
+    static const char *table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    uint32_t acc = 0;
+    int bits = 0;
+    out->clear();
+    for (const char *p = in; *p && *p != '='; p++) {
+        const char *pos = strchr(table, *p);
+        if (!pos)
+            return -1;
+        acc = (acc << 6) | (uint32_t)(pos - table);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out->push_back((char)((acc >> bits) & 0xff));
+        }
+    }
+    return 0;
+}
+
+// 一条客户端连接
+struct H2Session {
+    H2Frontend *frontend;
+    nghttp2_session *ng;
+    struct bufferevent *bev;
+    struct event *send_event;       // 回调里只登记, 回到事件循环再统一生成帧
+    void *arg;
+    h2_free_bev_cb free_bev;
+    string client_ip;
+    uint16_t client_port;
+    set<H2Stream *> streams;
+    vector<H2Stream *> ready;       // 本次读到的完整请求, 处理完输入后再交给转发逻辑
+
+    H2Session(H2Frontend *f, struct bufferevent *b, void *a, h2_free_bev_cb free_cb,
+        const string &ip, uint16_t port) : frontend(f), ng(NULL), bev(b), send_event(NULL),
+        arg(a), free_bev(free_cb), client_ip(ip), client_port(port) {}
+
+    int Init();
+    void Start();
+    H2Stream *NewStream(int32_t id);
+    void DetachStream(H2Stream *stream, bool reset = false);
+    int ParseRequest(H2Stream *stream);
+    void Reject(H2Stream *stream, int code);
+    void RequestReady(H2Stream *stream);
+    void DispatchReady();
+    void ScheduleSend();
+    bool Send();
+    void Free();
+};
+
+static void h2_send_event_cb(evutil_socket_t fd, short what, void *arg)
+{
+    ((H2Session *)arg)->Send();
+}
+
+static void h2_readcb(struct bufferevent *bev, void *ctx)
+{
+    H2Session *s = (H2Session *)ctx;
+    struct evbuffer *input = bufferevent_get_input(bev);
+    while (evbuffer_get_length(input) > 0) {
+        struct evbuffer_iovec v;
+        evbuffer_peek(input, -1, NULL, &v, 1);
+        ssize_t n = nghttp2_session_mem_recv(s->ng, (const uint8_t *)v.iov_base, v.iov_len);
+        if (n < 0) {
+            printf("h2 session recv error:%s\n", nghttp2_strerror((int)n));
+            s->Free();
+            return;
+        }
+        evbuffer_drain(input, n);
+    }
+    s->DispatchReady();
+    s->Send();
+}
+
+static void h2_writecb(struct bufferevent *bev, void *ctx)
+{
+    ((H2Session *)ctx)->Send();
+}
+
+static void h2_eventcb(struct bufferevent *bev, short what, void *ctx)
+{
+    H2Session *s = (H2Session *)ctx;
+    if (what & BEV_EVENT_TIMEOUT) {
+        // 只有没有 stream 的空闲连接才因为超时关闭, 超时后 libevent 停止了读, 重新打开
+        if (s->streams.empty()) {
+            s->Free();
+        } else {
+            bufferevent_enable(bev, EV_READ);
+        }
+        return;
+    }
+    if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR))
+        s->Free();
+}
+
+static ssize_t h2_send_callback(nghttp2_session *ng, const uint8_t *data, size_t length,
+    int flags, void *user_data)
+{
+    H2Session *s = (H2Session *)user_data;
+    struct evbuffer *output = bufferevent_get_output(s->bev);
+    if (evbuffer_get_length(output) >= H2_OUTPUT_HIGH)
+        return NGHTTP2_ERR_WOULDBLOCK;
+    if (evbuffer_add(output, data, length) != 0)
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+    return length;
+}
+
+static int h2_begin_headers_callback(nghttp2_session *ng, const nghttp2_frame *frame, void *user_data)
+{
+    H2Session *s = (H2Session *)user_data;
+    if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+        return 0;
+    H2Stream *stream = s->NewStream(frame->hd.stream_id);
+    nghttp2_session_set_stream_user_data(ng, frame->hd.stream_id, stream);
+    return 0;
+}
+
+static int h2_header_callback(nghttp2_session *ng, const nghttp2_frame *frame,
+    const uint8_t *name, size_t namelen, const uint8_t *value, size_t valuelen,
+    uint8_t flags, void *user_data)
+{
+    // trailer 不转发
+    if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+        return 0;
+    H2Stream *stream = (H2Stream *)nghttp2_session_get_stream_user_data(ng, frame->hd.stream_id);
+    if (!stream)
+        return 0;
+
+    string key((const char *)name, namelen);
+    string val((const char *)value, valuelen);
+    // HTTP/2 的 cookie 可以拆成多个头部, 转成 HTTP/1.1 时合并成一个
+    if (key == "cookie") {
+        const char *old = evhttp_find_header(&stream->headers, "cookie");
+        if (old) {
+            val = string(old) + "; " + val;
+            evhttp_remove_header(&stream->headers, "cookie");
+        }
+    }
+    if (evhttp_add_header(&stream->headers, key.c_str(), val.c_str()) != 0)
+        return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+    return 0;
+}
+
+static int h2_frame_recv_callback(nghttp2_session *ng, const nghttp2_frame *frame, void *user_data)
+{
+    H2Session *s = (H2Session *)user_data;
+    if (frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA)
+        return 0;
+    H2Stream *stream = (H2Stream *)nghttp2_session_get_stream_user_data(ng, frame->hd.stream_id);
+    if (!stream)
+        return 0;
+
+    if (frame->hd.type == NGHTTP2_HEADERS && frame->headers.cat == NGHTTP2_HCAT_REQUEST) {
+        int code = s->ParseRequest(stream);
+        if (code != 0) {
+            s->Reject(stream, code);
+            return 0;
+        }
+        // CONNECT 不等 END_STREAM, 隧道建立前收到的数据先放在 body 里
+        if (stream->method == EVHTTP_REQ_CONNECT)
+            s->RequestReady(stream);
+    }
+
+    if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) {
+        stream->client_eof = true;
+        if (stream->method != EVHTTP_REQ_CONNECT) {
+            s->RequestReady(stream);
+        } else if (stream->upstream &&
+            evbuffer_get_length(bufferevent_get_output(stream->upstream)) == 0) {
+            shutdown(bufferevent_getfd(stream->upstream), SHUT_WR);
+        }
+    }
+    return 0;
+}
+
+static int h2_data_chunk_recv_callback(nghttp2_session *ng, uint8_t flags, int32_t stream_id,
+    const uint8_t *data, size_t len, void *user_data)
+{
+    H2Stream *stream = (H2Stream *)nghttp2_session_get_stream_user_data(ng, stream_id);
+    // 隧道的数据发给上游之后才更新接收窗口, 上游慢时客户端跟着减速
+    if (stream && stream->method == EVHTTP_REQ_CONNECT && stream->handled && !stream->out_eof) {
+        stream->unconsumed += len;
+        if (stream->upstream) {
+            stream->bytes_up += len;
+            bufferevent_write(stream->upstream, data, len);
+        } else {
+            evbuffer_add(stream->body, data, len);
+        }
+        return 0;
+    }
+
+    // 已经回应过的请求不再需要 body
+    if (stream && !stream->replied)
+        evbuffer_add(stream->body, data, len);
+    nghttp2_session_consume(ng, stream_id, len);
+    return 0;
+}
+
+static int h2_stream_close_callback(nghttp2_session *ng, int32_t stream_id, uint32_t error_code,
+    void *user_data)
+{
+    H2Session *s = (H2Session *)user_data;
+    H2Stream *stream = (H2Stream *)nghttp2_session_get_stream_user_data(ng, stream_id);
+    if (!stream)
+        return 0;
+    s->DetachStream(stream, error_code != NGHTTP2_NO_ERROR);
+    return 0;
+}
+
+static ssize_t h2_data_read_callback(nghttp2_session *ng, int32_t stream_id, uint8_t *buf,
+    size_t length, uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+    H2Stream *stream = (H2Stream *)source->ptr;
+    int n = evbuffer_remove(stream->out, buf, length);
+    if (n < 0)
+        return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+
+    size_t remain = evbuffer_get_length(stream->out);
+    if (stream->throttled && remain < H2_STREAM_BUFFER / 2) {
+        stream->throttled = false;
+        if (stream->upstream)
+            bufferevent_enable(stream->upstream, EV_READ);
+    }
+    if (remain == 0) {
+        if (stream->out_eof)
+            *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+        else if (n == 0)
+            return NGHTTP2_ERR_DEFERRED;
+    }
+    return n;
+}
+
+// 客户端发给上游的数据写出去之后更新接收窗口, 客户端关闭了发送方向时随后关闭上游的写
+static void h2_upstream_output_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info, void *arg)
+{
+    H2Stream *stream = (H2Stream *)arg;
+    if (info->n_deleted == 0)
+        return;
+    // 经上级代理时 CONNECT 请求行也在这个缓冲里, 不能多算
+    size_t n = info->n_deleted < stream->unconsumed ? info->n_deleted : stream->unconsumed;
+    stream->unconsumed -= n;
+    if (n > 0 && stream->session) {
+        nghttp2_session_consume(stream->session->ng, stream->id, n);
+        stream->session->ScheduleSend();
+    }
+    if (stream->client_eof && stream->upstream && evbuffer_get_length(buf) == 0)
+        shutdown(bufferevent_getfd(stream->upstream), SHUT_WR);
+}
+
+int H2Session::Init()
+{
+    frontend->sessions.insert(this);
+    frontend->stat_sessions++;
+    send_event = event_new(frontend->base, -1, 0, h2_send_event_cb, this);
+    if (!send_event || nghttp2_session_server_new2(&ng, frontend->callbacks, this, frontend->option) != 0) {
+        printf("h2 session init failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+// 先发自己的 SETTINGS, 再处理已经收到的数据
+void H2Session::Start()
+{
+    nghttp2_settings_entry iv[] = {
+        {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, H2_MAX_STREAMS},
+        {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, H2_WINDOW_SIZE},
+    };
+    nghttp2_submit_settings(ng, NGHTTP2_FLAG_NONE, iv, sizeof(iv) / sizeof(iv[0]));
+    // 连接级别的窗口默认只有 64KB, 多个 stream 共用, 调大避免互相等待
+    nghttp2_session_set_local_window_size(ng, NGHTTP2_FLAG_NONE, 0, H2_CONN_WINDOW_SIZE);
+
+    bufferevent_setcb(bev, h2_readcb, h2_writecb, h2_eventcb, this);
+    bufferevent_setwatermark(bev, EV_WRITE, H2_OUTPUT_HIGH / 2, 0);
+    // 升级来的连接上还有 evhttp 设置的超时
+    if (frontend->timeout > 0) {
+        struct timeval tv = {frontend->timeout, 0};
+        bufferevent_set_timeouts(bev, &tv, NULL);
+    } else {
+        bufferevent_set_timeouts(bev, NULL, NULL);
+    }
+    bufferevent_enable(bev, EV_READ|EV_WRITE);
+    h2_readcb(bev, this);
+}
+
+H2Stream *H2Session::NewStream(int32_t id)
+{
+    H2Stream *stream = new H2Stream();
+    stream->session = this;
+    stream->id = id;
+    stream->refs = 1;
+    stream->method = EVHTTP_REQ_GET;
+    stream->port = -1;
+    TAILQ_INIT(&stream->headers);
+    stream->body = evbuffer_new();
+    stream->out = evbuffer_new();
+    stream->client_ip = client_ip;
+    stream->client_port = client_port;
+    streams.insert(stream);
+    frontend->stat_streams++;
+    return stream;
+}
+
+// stream 关闭或者连接断开: 隧道交给调用者释放, 然后放掉连接持有的引用
+void H2Session::DetachStream(H2Stream *stream, bool reset)
+{
+    if (reset)
+        frontend->stat_resets++;
+    streams.erase(stream);
+    nghttp2_session_set_stream_user_data(ng, stream->id, NULL);
+    if (stream->unconsumed > 0) {
+        nghttp2_session_consume_connection(ng, stream->unconsumed);
+        stream->unconsumed = 0;
+    }
+    stream->session = NULL;
+    if (stream->tunnel_close) {
+        void (*close_cb)(void *) = stream->tunnel_close;
+        stream->tunnel_close = NULL;
+        close_cb(stream->tunnel_arg);
+    }
+    h2_stream_release(stream);
+}
+
+// 把伪头部转换成转发需要的字段, 返回 0 或者应该回应的错误码
+int H2Session::ParseRequest(H2Stream *stream)
+{
+    struct evkeyvalq *headers = &stream->headers;
+    const char *method = evhttp_find_header(headers, ":method");
+    const char *scheme = evhttp_find_header(headers, ":scheme");
+    const char *authority = evhttp_find_header(headers, ":authority");
+    const char *path = evhttp_find_header(headers, ":path");
+    // 扩展 CONNECT(RFC 8441) 承载的是 websocket 之类的协议, 需要和源站做协议转换, 不支持
+    if (evhttp_find_header(headers, ":protocol"))
+        return HTTP_NOTIMPLEMENTED;
+    if (!method)
+        return HTTP_BADREQUEST;
+
+    size_t i;
+    for (i = 0; i < sizeof(h2_methods) / sizeof(h2_methods[0]); i++) {
+        if (strcmp(method, h2_methods[i].name) == 0)
+            break;
+    }
+    if (i == sizeof(h2_methods) / sizeof(h2_methods[0]))
+        return HTTP_NOTIMPLEMENTED;
+    stream->method = h2_methods[i].method;
+
+    if (!authority)
+        authority = evhttp_find_header(headers, "host");
+    if (!authority || parse_authority(authority, &stream->host, &stream->port) != 0)
+        return HTTP_BADREQUEST;
+
+    if (stream->method == EVHTTP_REQ_CONNECT) {
+        if (scheme || path)
+            return HTTP_BADREQUEST;
+        stream->uri = authority;
+    } else {
+        if (!scheme || !path || !*path)
+            return HTTP_BADREQUEST;
+        // 只转发明文 http, https 由客户端用 CONNECT 建隧道
+        if (strcmp(scheme, "http") != 0)
+            return HTTP_NOTIMPLEMENTED;
+        stream->uri = path;
+        if (!evhttp_find_header(headers, "host"))
+            evhttp_add_header(headers, "Host", authority);
+    }
+
+    for (i = 0; i < sizeof(pseudo_headers) / sizeof(pseudo_headers[0]); i++) {
+        while (evhttp_remove_header(headers, pseudo_headers[i]) == 0)
+            ;
+    }
+    return 0;
+}
+
+void H2Session::Reject(H2Stream *stream, int code)
+{
+    printf("h2 stream:%d rejected:%d\n", stream->id, code);
+    frontend->stat_rejected++;
+    stream->handled = true;
+    h2_stream_reply(stream, code, NULL, NULL);
+}
+
+// 转发逻辑持有一份引用, 交出去之前由 ready 列表持有
+void H2Session::RequestReady(H2Stream *stream)
+{
+    if (stream->handled)
+        return;
+    stream->handled = true;
+    stream->refs++;
+    ready.push_back(stream);
+}
+
+void H2Session::DispatchReady()
+{
+    vector<H2Stream *> list;
+    list.swap(ready);
+    for (size_t i = 0; i < list.size(); i++) {
+        if (list[i]->session)
+            frontend->request_cb(list[i], arg);
+        else
+            h2_stream_release(list[i]);
+    }
+}
+
+void H2Session::ScheduleSend()
+{
+    event_active(send_event, EV_WRITE, 0);
+}
+
+// 返回 false 表示连接已经释放
+bool H2Session::Send()
+{
+    int rv = nghttp2_session_send(ng);
+    if (rv != 0) {
+        printf("h2 session send error:%s\n", nghttp2_strerror(rv));
+        Free();
+        return false;
+    }
+    if (evbuffer_get_length(bufferevent_get_output(bev)) > 0)
+        return true;
+    // 缓冲发完以后: 双方都不再需要这条连接, 或者退出时已经没有 stream 了
+    if ((!nghttp2_session_want_read(ng) && !nghttp2_session_want_write(ng)) ||
+        (frontend->draining && streams.empty())) {
+        Free();
+        return false;
+    }
+    return true;
+}
+
+void H2Session::Free()
+{
+    frontend->sessions.erase(this);
+    for (size_t i = 0; i < ready.size(); i++)
+        h2_stream_release(ready[i]);
+    ready.clear();
+    if (ng) {
+        while (!streams.empty())
+            DetachStream(*streams.begin());
+        nghttp2_session_del(ng);
+    }
+    if (send_event)
+        event_free(send_event);
+    if (bev) {
+        if (free_bev)
+            free_bev(bev);
+        else
+            bufferevent_free(bev);
+    }
+    delete this;
+}
+
+int h2_stream_reply(H2Stream *stream, int code, struct evkeyvalq *headers, struct evbuffer *body)
+{
+    H2Session *s = stream->session;
+    if (!s || stream->replied)
+        return -1;
+    stream->replied = true;
+    stream->handled = true;
+
+    // HTTP/2 的头部名字必须是小写, nghttp2 会复制, 字符串只需要在调用期间有效
+    vector<pair<string, const char *> > fields;
+    if (headers) {
+        for (struct evkeyval *header = headers->tqh_first; header; header = header->next.tqe_next) {
+            if (is_hop_header(header->key))
+                continue;
+            string name = header->key;
+            for (size_t i = 0; i < name.size(); i++)
+                name[i] = tolower((unsigned char)name[i]);
+            fields.push_back(make_pair(name, header->value));
+        }
+    }
+    string status = to_string(code);
+    vector<nghttp2_nv> nva;
+    nva.push_back(h2_nv(":status", status.c_str()));
+    for (size_t i = 0; i < fields.size(); i++)
+        nva.push_back(h2_nv(fields[i].first.c_str(), fields[i].second));
+
+    if (body)
+        evbuffer_add_buffer(stream->out, body);
+    stream->out_eof = true;
+    nghttp2_data_provider data;
+    data.source.ptr = stream;
+    data.read_callback = h2_data_read_callback;
+    int rv = nghttp2_submit_response(s->ng, stream->id, &nva[0], nva.size(),
+        evbuffer_get_length(stream->out) > 0 ? &data : NULL);
+    if (rv != 0) {
+        printf("h2 submit response error:%s\n", nghttp2_strerror(rv));
+        return -1;
+    }
+    s->ScheduleSend();
+    return 0;
+}
+
+int h2_stream_tunnel(H2Stream *stream, struct bufferevent *upstream,
+    void (*close_cb)(void *arg), void *arg)
+{
+    H2Session *s = stream->session;
+    if (!s || stream->replied)
+        return -1;
+    stream->upstream = upstream;
+    stream->tunnel_close = close_cb;
+    stream->tunnel_arg = arg;
+    stream->replied = true;
+
+    struct evbuffer *output = bufferevent_get_output(upstream);
+    evbuffer_add_cb(output, h2_upstream_output_cb, stream);
+    stream->bytes_up += evbuffer_get_length(stream->body);
+    evbuffer_add_buffer(output, stream->body);
+    if (stream->client_eof && evbuffer_get_length(output) == 0)
+        shutdown(bufferevent_getfd(upstream), SHUT_WR);
+
+    nghttp2_nv status = h2_nv(":status", "200");
+    nghttp2_data_provider data;
+    data.source.ptr = stream;
+    data.read_callback = h2_data_read_callback;
+    int rv = nghttp2_submit_response(s->ng, stream->id, &status, 1, &data);
+    if (rv != 0) {
+        printf("h2 submit tunnel response error:%s\n", nghttp2_strerror(rv));
+        return -1;
+    }
+    s->frontend->stat_tunnels++;
+    s->ScheduleSend();
+    return 0;
+}
+
+void h2_stream_send(H2Stream *stream, struct evbuffer *data)
+{
+    H2Session *s = stream->session;
+    if (!s || stream->out_eof) {
+        evbuffer_drain(data, evbuffer_get_length(data));
+        return;
+    }
+    evbuffer_add_buffer(stream->out, data);
+    if (evbuffer_get_length(stream->out) >= H2_STREAM_BUFFER && stream->upstream && !stream->throttled) {
+        stream->throttled = true;
+        bufferevent_disable(stream->upstream, EV_READ);
+    }
+    nghttp2_session_resume_data(s->ng, stream->id);
+    s->ScheduleSend();
+}
+
+void h2_stream_end(H2Stream *stream)
+{
+    if (stream->upstream) {
+        evbuffer_remove_cb(bufferevent_get_output(stream->upstream), h2_upstream_output_cb, stream);
+        stream->upstream = NULL;
+    }
+    stream->tunnel_close = NULL;
+
+    H2Session *s = stream->session;
+    if (!s)
+        return;
+    // 还没发给上游的数据不会再发了
+    if (stream->unconsumed > 0) {
+        nghttp2_session_consume(s->ng, stream->id, stream->unconsumed);
+        stream->unconsumed = 0;
+    }
+    if (!stream->replied) {
+        h2_stream_reply(stream, 502, NULL, NULL);
+        return;
+    }
+    stream->out_eof = true;
+    nghttp2_session_resume_data(s->ng, stream->id);
+    s->ScheduleSend();
+}
+
+H2Frontend::H2Frontend()
+{
+    base = NULL;
+    request_cb = NULL;
+    callbacks = NULL;
+    option = NULL;
+    timeout = 0;
+    draining = false;
+    stat_sessions = 0;
+    stat_upgrades = 0;
+    stat_streams = 0;
+    stat_tunnels = 0;
+    stat_rejected = 0;
+    stat_resets = 0;
+}
+
+H2Frontend::~H2Frontend()
+{
+    Close();
+    if (callbacks)
+        nghttp2_session_callbacks_del(callbacks);
+    if (option)
+        nghttp2_option_del(option);
+}
+
+int H2Frontend::Init(struct event_base *event_base, h2_request_cb cb)
+{
+    base = event_base;
+    request_cb = cb;
+
+    nghttp2_session_callbacks *cbs = NULL;
+    if (nghttp2_session_callbacks_new(&cbs) != 0 || nghttp2_option_new(&option) != 0) {
+        if (cbs)
+            nghttp2_session_callbacks_del(cbs);
+        printf("nghttp2 init failed\n");
+        return -1;
+    }
+    nghttp2_session_callbacks_set_send_callback(cbs, h2_send_callback);
+    nghttp2_session_callbacks_set_on_begin_headers_callback(cbs, h2_begin_headers_callback);
+    nghttp2_session_callbacks_set_on_header_callback(cbs, h2_header_callback);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(cbs, h2_frame_recv_callback);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(cbs, h2_data_chunk_recv_callback);
+    nghttp2_session_callbacks_set_on_stream_close_callback(cbs, h2_stream_close_callback);
+    // 接收窗口由这里按数据实际发出的进度更新
+    nghttp2_option_set_no_auto_window_update(option, 1);
+    callbacks = cbs;
+    return 0;
+}
+
+int H2Frontend::Accept(evutil_socket_t fd, const struct sockaddr *addr, void *arg)
+{
+    struct bufferevent *bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+    if (!bev) {
+        evutil_closesocket(fd);
+        return -1;
+    }
+
+    char ip[INET6_ADDRSTRLEN] = {0};
+    uint16_t port = 0;
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+        evutil_inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
+        port = ntohs(sin->sin_port);
+    } else if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+        evutil_inet_ntop(AF_INET6, &sin6->sin6_addr, ip, sizeof(ip));
+        port = ntohs(sin6->sin6_port);
+    }
+
+    H2Session *s = new H2Session(this, bev, arg, NULL, ip, port);
+    if (s->Init() != 0) {
+        s->Free();
+        return -1;
+    }
+    s->Start();
+    return 0;
+}
+
+int H2Frontend::Upgrade(struct bufferevent *bev, struct evhttp_request *req, void *arg,
+    h2_free_bev_cb free_bev)
+{
+    struct evkeyvalq *headers = evhttp_request_get_input_headers(req);
+    string settings;
+    if (base64url_decode(evhttp_find_header(headers, "HTTP2-Settings"), &settings) != 0) {
+        printf("h2c upgrade bad HTTP2-Settings\n");
+        return -1;
+    }
+
+    char *address = NULL;
+    ev_uint16_t port = 0;
+    evhttp_connection_get_peer(evhttp_request_get_connection(req), &address, &port);
+    H2Session *s = new H2Session(this, bev, arg, free_bev, address ? address : "", port);
+    if (s->Init() != 0) {
+        s->bev = NULL;
+        s->Free();
+        return -1;
+    }
+
+    // 升级请求成为 stream 1, 请求已经收完, 只等回应
+    H2Stream *stream = s->NewStream(1);
+    int rv = nghttp2_session_upgrade2(s->ng, (const uint8_t *)settings.data(), settings.size(),
+        evhttp_request_get_command(req) == EVHTTP_REQ_HEAD, stream);
+    if (rv != 0) {
+        printf("h2c upgrade failed:%s\n", nghttp2_strerror(rv));
+        s->bev = NULL;
+        s->Free();
+        return -1;
+    }
+
+    stream->method = evhttp_request_get_command(req);
+    stream->uri = evhttp_request_get_uri(req);
+    const char *host = evhttp_find_header(headers, "Host");
+    if (stream->uri[0] == '/' && host) {
+        parse_authority(host, &stream->host, &stream->port);
+    } else if (evhttp_request_get_host(req)) {
+        stream->host = evhttp_request_get_host(req);
+        stream->port = evhttp_uri_get_port(evhttp_request_get_evhttp_uri(req));
+    }
+    for (struct evkeyval *header = headers->tqh_first; header; header = header->next.tqe_next) {
+        if (!is_hop_header(header->key))
+            evhttp_add_header(&stream->headers, header->key, header->value);
+    }
+    evbuffer_add_buffer(stream->body, evhttp_request_get_input_buffer(req));
+    stream->client_eof = true;
+    stat_upgrades++;
+
+    s->RequestReady(stream);
+    s->Start();
+    return 0;
+}
+
+void H2Frontend::StartDrain()
+{
+    draining = true;
+    for (set<H2Session *>::iterator iter = sessions.begin(); iter != sessions.end(); iter++) {
+        H2Session *s = *iter;
+        nghttp2_submit_goaway(s->ng, NGHTTP2_FLAG_NONE, nghttp2_session_get_last_proc_stream_id(s->ng),
+            NGHTTP2_NO_ERROR, NULL, 0);
+        s->ScheduleSend();
+    }
+}
+
+void H2Frontend::Close()
+{
+    while (!sessions.empty())
+        (*sessions.begin())->Free();
+}
+
+void H2Frontend::DumpStats(struct evbuffer *buf)
+{
+    size_t streams = 0;
+    for (set<H2Session *>::iterator iter = sessions.begin(); iter != sessions.end(); iter++)
+        streams += (*iter)->streams.size();
+    evbuffer_add_printf(buf, "h2.sessions %zu\n", sessions.size());
+    evbuffer_add_printf(buf, "h2.streams %zu\n", streams);
+    evbuffer_add_printf(buf, "h2.total_sessions %lu\n", (unsigned long)stat_sessions);
+    evbuffer_add_printf(buf, "h2.total_upgrades %lu\n", (unsigned long)stat_upgrades);
+    evbuffer_add_printf(buf, "h2.total_streams %lu\n", (unsigned long)stat_streams);
+    evbuffer_add_printf(buf, "h2.total_tunnels %lu\n", (unsigned long)stat_tunnels);
+    evbuffer_add_printf(buf, "h2.rejected %lu\n", (unsigned long)stat_rejected);
+    evbuffer_add_printf(buf, "h2.resets %lu\n", (unsigned long)stat_resets);
+}
+
+#else
+
+// 没有编译 nghttp2 时只保留接口, Init 失败, 不会产生 stream
+
+int h2_stream_reply(H2Stream *stream, int code, struct evkeyvalq *headers, struct evbuffer *body)
+{
+    return -1;
+}
+
+int h2_stream_tunnel(H2Stream *stream, struct bufferevent *upstream,
+    void (*close_cb)(void *arg), void *arg)
+{
+    return -1;
+}
+
+void h2_stream_send(H2Stream *stream, struct evbuffer *data)
+{
+}
+
+void h2_stream_end(H2Stream *stream)
+{
+}
+
+H2Frontend::H2Frontend()
+{
+    base = NULL;
+    request_cb = NULL;
+    callbacks = NULL;
+    option = NULL;
+    timeout = 0;
+    draining = false;
+    stat_sessions = stat_upgrades = stat_streams = stat_tunnels = stat_rejected = stat_resets = 0;
+}
+
+H2Frontend::~H2Frontend()
+{
+}
+
+int H2Frontend::Init(struct event_base *event_base, h2_request_cb cb)
+{
+    printf("http_proxy is built without HTTP/2 support\n");
+    return -1;
+}
+
+int H2Frontend::Accept(evutil_socket_t fd, const struct sockaddr *addr, void *arg)
+{
+    evutil_closesocket(fd);
+    return -1;
+}
+
+int H2Frontend::Upgrade(struct bufferevent *bev, struct evhttp_request *req, void *arg,
+    h2_free_bev_cb free_bev)
+{
+    return -1;
+}
+
+void H2Frontend::StartDrain()
+{
+}
+
+void H2Frontend::Close()
+{
+}
+
+void H2Frontend::DumpStats(struct evbuffer *buf)
+{
+}
+
+#endif
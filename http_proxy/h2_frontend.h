@@ -0,0 +1,132 @@
+#ifndef HTTP_PROXY_H2_FRONTEND_H
+#define HTTP_PROXY_H2_FRONTEND_H
+
+#include <string>
+#include <set>
+
+extern "C" {
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/keyvalq_struct.h>
+}
+
+// 面向客户端的 HTTP/2 (h2c) 前端, 基于 nghttp2, 编译时定义 HTTP_PROXY_HTTP2 才开启
+// 两种方式建立: 单独的端口上直接发连接前言(prior knowledge), 或者 HTTP/1.1 请求带 Upgrade: h2c
+// 每个 stream 收齐请求后交给原来的转发逻辑, CONNECT stream 作为隧道, 数据放在 DATA 帧里转发
+// 一个客户端一条连接, 所有请求和隧道在上面多路复用
+
+#define H2_MAX_STREAMS (256)            // SETTINGS_MAX_CONCURRENT_STREAMS
+#define H2_WINDOW_SIZE (1024 * 1024)    // stream 初始接收窗口
+#define H2_CONN_WINDOW_SIZE (4 * 1024 * 1024)   // 连接接收窗口, 所有 stream 共用
+#define H2_OUTPUT_HIGH (256 * 1024)     // 连接的输出缓冲超过后暂停生成帧
+#define H2_STREAM_BUFFER (256 * 1024)   // 隧道积压的下行数据超过后暂停读上游
+
+struct H2Session;
+struct nghttp2_session_callbacks;
+struct nghttp2_option;
+
+// 一个请求或隧道, 连接持有一份引用, 交给转发逻辑后转发逻辑持有一份
+struct H2Stream {
+    H2Session *session;         // stream 关闭后为 NULL, 之后的回应直接丢弃
+    int32_t id;
+    int refs;
+    enum evhttp_cmd_type method;
+    std::string host;
+    int port;                   // 请求里没有端口时为 -1
+    std::string uri;            // 转发给上游的 URI, CONNECT 时是 host:port
+    struct evkeyvalq headers;   // 不包括伪头部, 名字是小写的
+    struct evbuffer *body;      // 请求 body, 隧道建立前收到的数据也先放在这里
+    struct evbuffer *out;       // 还没发给客户端的响应 body / 隧道数据
+    bool handled;               // 已经交给转发逻辑或者直接回了错误
+    bool replied;               // 已经发出响应头
+    bool out_eof;               // out 发完后结束 stream
+    bool client_eof;            // 客户端发完了请求 / 关闭了隧道的发送方向
+    std::string client_ip;
+    uint16_t client_port;
+    // 隧道
+    struct bufferevent *upstream;
+    void (*tunnel_close)(void *arg);
+    void *tunnel_arg;
+    bool throttled;             // 下行积压, 暂停了上游的读
+    size_t unconsumed;          // 收到但还没发给上游的字节数, 发出后才更新接收窗口
+    uint64_t bytes_up;
+};
+
+// 请求收齐后回调, 转发逻辑持有一份引用, 回应或隧道结束后调用 h2_stream_release
+typedef void (*h2_request_cb)(H2Stream *stream, void *arg);
+// 连接关闭时释放 bufferevent, 为 NULL 时直接 bufferevent_free
+typedef void (*h2_free_bev_cb)(struct bufferevent *bev);
+
+// 是否编译了 HTTP/2 支持
+bool h2_supported();
+
+// 回应并结束 stream, headers 可以为 NULL, body 里的数据会被移走
+// 逐跳的头部(Connection 等)不会发出去
+int h2_stream_reply(H2Stream *stream, int code, struct evkeyvalq *headers, struct evbuffer *body);
+// CONNECT 的上游连接建立后调用, 回应 200, 之后客户端的 DATA 直接写进 upstream
+// stream 被客户端关闭或连接断开时调用 close_cb(arg), 由调用者释放隧道
+int h2_stream_tunnel(H2Stream *stream, struct bufferevent *upstream,
+    void (*close_cb)(void *arg), void *arg);
+// 上游发来的数据, 积压过多时暂停读 upstream, 发出去后恢复
+void h2_stream_send(H2Stream *stream, struct evbuffer *data);
+// 上游关闭, 发完剩余数据后结束 stream, 调用之后不会再回调 close_cb
+void h2_stream_end(H2Stream *stream);
+void h2_stream_release(H2Stream *stream);
+
+// 每个 worker 一个实例, 只在 worker 线程里使用
+class H2Frontend
+{
+    friend struct H2Session;
+    friend int h2_stream_tunnel(H2Stream *stream, struct bufferevent *upstream,
+        void (*close_cb)(void *arg), void *arg);
+
+    private:
+        struct event_base *base;
+        h2_request_cb request_cb;
+        nghttp2_session_callbacks *callbacks;
+        nghttp2_option *option;
+        std::set<H2Session *> sessions;
+        int timeout;                // 没有 stream 时的空闲超时(秒), 0 表示不超时
+        bool draining;
+
+        // 统计
+        uint64_t stat_sessions;
+        uint64_t stat_upgrades;
+        uint64_t stat_streams;
+        uint64_t stat_tunnels;
+        uint64_t stat_rejected;     // 请求格式错误或不支持, 直接回了错误
+        uint64_t stat_resets;       // 被 RST_STREAM 关闭的 stream
+
+    public:
+        H2Frontend();
+        ~H2Frontend();
+
+        int Init(struct event_base *event_base, h2_request_cb cb);
+        bool IsReady() {
+            return callbacks != NULL;
+        }
+        void SetTimeout(int seconds) {
+            timeout = seconds;
+        }
+
+        // prior knowledge 端口上接受的连接, arg 原样传给请求回调
+        int Accept(evutil_socket_t fd, const struct sockaddr *addr, void *arg);
+        // 已经回了 101 的 HTTP/1.1 连接, req 成为 stream 1, 失败时 bev 由调用者释放
+        int Upgrade(struct bufferevent *bev, struct evhttp_request *req, void *arg,
+            h2_free_bev_cb free_bev);
+        // 是否是 h2c 升级请求
+        static bool IsUpgrade(struct evhttp_request *req);
+
+        // 发 GOAWAY, 已有的 stream 继续处理, 没有 stream 的连接关闭
+        void StartDrain();
+        // 关闭所有连接
+        void Close();
+        void DumpStats(struct evbuffer *buf);
+};
+
+#endif
@@ -0,0 +1,244 @@
+#include <list>
+
+extern "C" {
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include <event2/event.h>
+}
+
+#include "mem_pool.h"
+
+using namespace std;
+
+#define MEM_POOL_LARGE (0xffffffff)
+
+// 放在每块内存前面, 16 字节保证返回的地址仍然按 16 字节对齐
+struct MemHeader {
+    uint32_t cls;       // 规格下标, MEM_POOL_LARGE 表示直接 malloc
+    uint32_t reserved;
+    uint64_t size;      // 可用大小
+};
+
+struct MemClass {
+    void *free_list;
+    size_t cached;
+    size_t max_cached;
+    uint64_t hit;
+    uint64_t miss;
+    uint64_t release;   // 缓存满了直接还给 malloc 的次数
+};
+
+struct ThreadMemPool {
+    MemClass cls[MEM_POOL_CLASS_NUM];
+    uint64_t large_alloc;
+
+    ThreadMemPool();
+    ~ThreadMemPool();
+};
+
+static bool pool_enabled = false;
+// 所有线程的池, 只在注册/注销和读统计时加锁
+static pthread_mutex_t pool_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static list<ThreadMemPool *> pool_list;
+// 已退出线程的统计
+static uint64_t exited_hit[MEM_POOL_CLASS_NUM];
+static uint64_t exited_miss[MEM_POOL_CLASS_NUM];
+
+// 用 pthread key 在线程退出时释放缓存, 不用 thread_local 对象,
+// 避免进程退出时全局对象析构还在调用 mem_pool_free
+static __thread ThreadMemPool *local_pool = NULL;
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+static void destroy_local_pool(void *arg)
+{
+    delete (ThreadMemPool *)arg;
+    local_pool = NULL;
+}
+
+static void create_pool_key()
+{
+    pthread_key_create(&pool_key, destroy_local_pool);
+}
+
+static inline ThreadMemPool *get_local_pool()
+{
+    if (__builtin_expect(local_pool == NULL, 0)) {
+        pthread_once(&pool_key_once, create_pool_key);
+        local_pool = new ThreadMemPool;
+        pthread_setspecific(pool_key, local_pool);
+    }
+    return local_pool;
+}
+
+ThreadMemPool::ThreadMemPool()
+{
+    memset(cls, 0, sizeof(cls));
+    for (int i = 0; i < MEM_POOL_CLASS_NUM; i++)
+        cls[i].max_cached = MEM_POOL_CACHE_BYTES >> (MEM_POOL_MIN_SHIFT + i);
+    large_alloc = 0;
+
+    pthread_mutex_lock(&pool_list_lock);
+    pool_list.push_back(this);
+    pthread_mutex_unlock(&pool_list_lock);
+}
+
+ThreadMemPool::~ThreadMemPool()
+{
+    pthread_mutex_lock(&pool_list_lock);
+    pool_list.remove(this);
+    for (int i = 0; i < MEM_POOL_CLASS_NUM; i++) {
+        exited_hit[i] += cls[i].hit;
+        exited_miss[i] += cls[i].miss;
+    }
+    pthread_mutex_unlock(&pool_list_lock);
+
+    for (int i = 0; i < MEM_POOL_CLASS_NUM; i++) {
+        while (cls[i].free_list) {
+            void *p = cls[i].free_list;
+            cls[i].free_list = *(void **)p;
+            free((MemHeader *)p - 1);
+        }
+    }
+}
+
+static inline int size_to_class(size_t size)
+{
+    size_t cap = (size_t)1 << MEM_POOL_MIN_SHIFT;
+    for (int i = 0; i < MEM_POOL_CLASS_NUM; i++, cap <<= 1) {
+        if (size <= cap)
+            return i;
+    }
+    return -1;
+}
+
+void *mem_pool_malloc(size_t size)
+{
+    int c = size_to_class(size);
+    if (c < 0) {
+        MemHeader *h = (MemHeader *)malloc(sizeof(MemHeader) + size);
+        if (!h)
+            return NULL;
+        h->cls = MEM_POOL_LARGE;
+        h->size = size;
+        get_local_pool()->large_alloc++;
+        return h + 1;
+    }
+
+    MemClass &mc = get_local_pool()->cls[c];
+    if (mc.free_list) {
+        void *p = mc.free_list;
+        mc.free_list = *(void **)p;
+        mc.cached--;
+        mc.hit++;
+        return p;
+    }
+
+    size_t cap = (size_t)1 << (MEM_POOL_MIN_SHIFT + c);
+    MemHeader *h = (MemHeader *)malloc(sizeof(MemHeader) + cap);
+    if (!h)
+        return NULL;
+    h->cls = c;
+    h->size = cap;
+    mc.miss++;
+    return h + 1;
+}
+
+// 放回当前线程的空闲链表, 不要求和分配在同一个线程
+void mem_pool_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    MemHeader *h = (MemHeader *)ptr - 1;
+    if (h->cls == MEM_POOL_LARGE) {
+        free(h);
+        return;
+    }
+
+    MemClass &mc = get_local_pool()->cls[h->cls];
+    if (mc.cached >= mc.max_cached) {
+        mc.release++;
+        free(h);
+        return;
+    }
+    *(void **)ptr = mc.free_list;
+    mc.free_list = ptr;
+    mc.cached++;
+}
+
+void *mem_pool_realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+        return mem_pool_malloc(size);
+    if (size == 0) {
+        mem_pool_free(ptr);
+        return NULL;
+    }
+
+    MemHeader *h = (MemHeader *)ptr - 1;
+    if (h->cls != MEM_POOL_LARGE && size <= h->size)
+        return ptr;
+    if (h->cls == MEM_POOL_LARGE && size_to_class(size) < 0) {
+        MemHeader *nh = (MemHeader *)realloc(h, sizeof(MemHeader) + size);
+        if (!nh)
+            return NULL;
+        nh->size = size;
+        return nh + 1;
+    }
+
+    void *np = mem_pool_malloc(size);
+    if (!np)
+        return NULL;
+    memcpy(np, ptr, h->size < size ? h->size : size);
+    mem_pool_free(ptr);
+    return np;
+}
+
+void mem_pool_hook_libevent()
+{
+    event_set_mem_functions(mem_pool_malloc, mem_pool_realloc, mem_pool_free);
+    pool_enabled = true;
+}
+
+bool mem_pool_enabled()
+{
+    return pool_enabled;
+}
+
+// 各线程的计数只由本线程修改, 这里读到的是近似值
+void mem_pool_dump_stats(struct evbuffer *buf)
+{
+    evbuffer_add_printf(buf, "mem_pool.enabled %d\n", pool_enabled ? 1 : 0);
+    if (!pool_enabled)
+        return;
+
+    pthread_mutex_lock(&pool_list_lock);
+    uint64_t large_alloc = 0;
+    for (int i = 0; i < MEM_POOL_CLASS_NUM; i++) {
+        uint64_t hit = exited_hit[i], miss = exited_miss[i], release = 0;
+        size_t cached = 0;
+        for (auto iter = pool_list.begin(); iter != pool_list.end(); iter++) {
+            MemClass &mc = (*iter)->cls[i];
+            hit += mc.hit;
+            miss += mc.miss;
+            release += mc.release;
+            cached += mc.cached;
+        }
+        size_t cap = (size_t)1 << (MEM_POOL_MIN_SHIFT + i);
+        evbuffer_add_printf(buf, "mem_pool.%zu.hit %lu\n", cap, (unsigned long)hit);
+        evbuffer_add_printf(buf, "mem_pool.%zu.miss %lu\n", cap, (unsigned long)miss);
+        evbuffer_add_printf(buf, "mem_pool.%zu.hit_rate %.3f\n", cap,
+            hit + miss ? (double)hit / (hit + miss) : 0.0);
+        evbuffer_add_printf(buf, "mem_pool.%zu.release %lu\n", cap, (unsigned long)release);
+        evbuffer_add_printf(buf, "mem_pool.%zu.cached %zu\n", cap, cached);
+    }
+    for (auto iter = pool_list.begin(); iter != pool_list.end(); iter++)
+        large_alloc += (*iter)->large_alloc;
+    pthread_mutex_unlock(&pool_list_lock);
+
+    evbuffer_add_printf(buf, "mem_pool.large_alloc %lu\n", (unsigned long)large_alloc);
+}
@@ -0,0 +1,94 @@
+#ifndef HTTP_PROXY_MEM_POOL_H
+#define HTTP_PROXY_MEM_POOL_H
+
+#include <new>
+
+extern "C" {
+#include <stdint.h>
+#include <stddef.h>
+
+#include <event2/buffer.h>
+}
+
+// 按规格分级的内存池, 通过 event_set_mem_functions 接管 libevent 的内存分配
+// 每个线程一组空闲链表, 分配和释放都不加锁; 超过 16KB 的直接走 malloc
+// 注意: 开启后 libevent 返回给调用者释放的内存(如 evbuffer_readln)要用 mem_pool_free 释放
+
+#define MEM_POOL_MIN_SHIFT (5)                    // 最小规格 32 字节
+#define MEM_POOL_CLASS_NUM (10)                   // 32B ~ 16KB
+#define MEM_POOL_CACHE_BYTES (4 * 1024 * 1024)    // 每个线程每个规格最多缓存的字节数
+
+void *mem_pool_malloc(size_t size);
+void *mem_pool_realloc(void *ptr, size_t size);
+void mem_pool_free(void *ptr);
+
+// 必须在调用任何 libevent 接口之前调用
+void mem_pool_hook_libevent();
+bool mem_pool_enabled();
+void mem_pool_dump_stats(struct evbuffer *buf);
+
+// 固定类型的对象池, 每个 worker 一个实例, 只能在所属线程里使用
+template <class T, size_t MAX_CACHED = 4096>
+class ObjectPool
+{
+    private:
+        const char *name;
+        void *free_list;
+        size_t cached;
+        size_t live;        // 已分配还没释放的对象数
+        uint64_t hit;
+        uint64_t miss;
+
+    public:
+        ObjectPool(const char *pool_name) : name(pool_name), free_list(NULL),
+            cached(0), live(0), hit(0), miss(0) {}
+        ~ObjectPool() {
+            while (free_list) {
+                void *p = free_list;
+                free_list = *(void **)p;
+                mem_pool_free(p);
+            }
+        }
+
+        T *New() {
+            void *p = free_list;
+            if (p) {
+                free_list = *(void **)p;
+                cached--;
+                hit++;
+            } else {
+                p = mem_pool_malloc(sizeof(T) > sizeof(void *) ? sizeof(T) : sizeof(void *));
+                if (!p)
+                    return NULL;
+                miss++;
+            }
+            live++;
+            return new (p) T();
+        }
+
+        void Delete(T *obj) {
+            obj->~T();
+            live--;
+            if (cached < MAX_CACHED) {
+                *(void **)obj = free_list;
+                free_list = obj;
+                cached++;
+            } else {
+                mem_pool_free(obj);
+            }
+        }
+
+        void DumpStats(struct evbuffer *buf) {
+            evbuffer_add_printf(buf, "object_pool.%s.hit %lu\n", name, (unsigned long)hit);
+            evbuffer_add_printf(buf, "object_pool.%s.miss %lu\n", name, (unsigned long)miss);
+            evbuffer_add_printf(buf, "object_pool.%s.hit_rate %.3f\n", name,
+                hit + miss ? (double)hit / (hit + miss) : 0.0);
+            evbuffer_add_printf(buf, "object_pool.%s.cached %zu\n", name, cached);
+            evbuffer_add_printf(buf, "object_pool.%s.live %zu\n", name, live);
+        }
+        size_t Live() {
+            return live;
+        }
+};
+
+#endif
@@ -0,0 +1,3283 @@
+#include <iostream>
+#include <string>
+#include <map>
+#include <list>
+#include <set>
+#include <vector>
+
+extern "C" {
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <stdio.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <semaphore.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <endian.h>
+#include <sched.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <sys/queue.h>
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/listener.h>
+#include <event2/buffer.h>
+#include <event2/util.h>
+#include <event2/keyvalq_struct.h>
+#include <event2/bufferevent.h>
+#include <event2/dns.h>
+}
+
+#include "uring_tunnel.h"
+#include "mem_pool.h"
+#include "traffic_topk.h"
+#include "access_log.h"
+#include "compress.h"
+#include "config.h"
+#include "stats.h"
+#include "h2_frontend.h"
+#include "acl.h"
+#include "dns_race.h"
+#include "proxy_server.h"
+
+using namespace std;
+
+// 按过期时间排序的索引, 淘汰时取最早过期的一条, 已经过期的总是排在最前面
+typedef multimap<time_t, string> DnsExpireIndex;
+
+struct CacheDns {
+    string ip;
+    time_t expire;          // 过期的绝对时间
+    DnsExpireIndex::iterator expire_iter;   // 在 dns_expire 里的位置
+};
+
+enum HEADER_COPY_TYPE {
+	CLIENT_TO_PROXY = 1,
+	PROXY_TO_CLIENT
+};
+
+#define DNS_SNAPSHOT_TIME (60)
+
+// dns缓存快照文件格式: 文件头 + 若干条记录, 整数均为小端(读写时用 htole/letoh 转换)
+// 记录: int64 过期时间(绝对时间) | uint8 host长度 | uint8 地址个数 | host | 地址(IPv4网络序)*N
+#define DNS_SNAPSHOT_MAGIC (0x53445048) // "HPDS"
+#define DNS_SNAPSHOT_VERSION (1)
+
+struct DnsSnapshotHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t count;
+} __attribute__((packed));
+
+// 上游预连接池: 每个 ip:port 按请求速率保留若干条热连接, 连接数上限等参数在 RuntimeConfig 里
+#define WARM_TIMER_MS (1000)
+#define WARM_RATE_DECAY (0.8)      // 请求速率 EWMA 衰减系数
+
+struct WarmHttpConn {
+    struct evhttp_connection *conn;
+    time_t idle_time;
+};
+
+struct WarmTunnel {
+    struct bufferevent *bev;
+    time_t idle_time;
+};
+
+struct UpstreamPool {
+    string ip;
+    int port;
+    double http_rate;      // 每秒 http 请求数(EWMA)
+    double tunnel_rate;    // 每秒 CONNECT 请求数(EWMA)
+    uint32_t http_hits;    // 本周期 http 请求数
+    uint32_t tunnel_hits;  // 本周期 CONNECT 请求数
+    set<struct bufferevent *> connecting;   // 正在建立的预连接, 回调参数指向本池, 删除池之前要释放
+    int inflight;          // 正在使用本池连接的 http 请求数, 不为 0 时不能删除
+    list<WarmHttpConn> idle_http;   // 空闲的 keep-alive 连接
+    list<WarmTunnel> warm_tunnel;   // 已建立好的 CONNECT 预连接
+    bool parent_ok;        // 上级代理在本池上接受过 CONNECT, 之后的 CONNECT 不等响应就回应客户端
+};
+
+// socket 调优参数, -1 表示不设置, 保持系统默认值
+// 监听socket上设置的参数会被accept出来的连接继承
+struct SockTuning {
+    int nodelay;        // TCP_NODELAY
+    int fastopen;       // 监听: TCP_FASTOPEN 队列长度; 上游: TCP_FASTOPEN_CONNECT
+    int defer_accept;   // TCP_DEFER_ACCEPT 秒数, 只对监听有效
+    int rcvbuf;         // SO_RCVBUF
+    int sndbuf;         // SO_SNDBUF
+    int notsent_lowat;  // TCP_NOTSENT_LOWAT
+    int backlog;        // listen backlog, 只对监听有效
+    int keepidle;       // SO_KEEPALIVE + TCP_KEEPIDLE/TCP_KEEPINTVL/TCP_KEEPCNT
+    int keepintvl;
+    int keepcnt;
+
+    SockTuning() : nodelay(-1), fastopen(-1), defer_accept(-1), rcvbuf(-1),
+        sndbuf(-1), notsent_lowat(-1), backlog(-1), keepidle(-1),
+        keepintvl(-1), keepcnt(-1) {}
+};
+
+#define LISTEN_BACKLOG (128)
+#define PARENT_HEADER_MAX (8192)   // 上级代理 CONNECT 响应头的最大长度
+#define DRAIN_CHECK_MS (100)
+
+// 多个 worker 时监听socket的分流方式
+enum LISTEN_STEER {
+    STEER_NONE = 0,         // SO_REUSEPORT 默认的四元组 hash
+    STEER_INCOMING_CPU,     // SO_INCOMING_CPU, 优先选择绑定在收包 cpu 上的 worker
+    STEER_BPF               // SO_ATTACH_REUSEPORT_CBPF, 按收包 cpu 选择 worker
+};
+
+// 命令行和配置文件的参数, 所有 worker 共用, 启动后只读
+// 运行时参数在 runtime 里, 重新加载后 worker 使用自己的拷贝, 不再读这里
+struct ProxyOptions {
+    string config_file;
+    string ip;
+    int port;
+    string dns_snapshot_file;
+    SockTuning listen_tuning;
+    SockTuning upstream_tuning;
+    bool use_uring;
+    bool use_mem_pool;      // 库默认关闭, http_proxy 通过 EnableMemPool 默认开启
+    string access_log_prefix;
+    int workers;
+    vector<int> cpus;       // 每个 worker 绑定的 cpu, 为空时不绑核
+    bool numa;              // worker 的内存优先从所在 NUMA 节点分配
+    int steer;
+    int compress_level;     // 响应压缩级别, -1 表示不压缩
+    size_t compress_min_size;
+    vector<string> unix_paths;  // 同机客户端使用的 unix socket 监听路径
+    string parent_ip;           // 上级代理, 为空时直连
+    int parent_port;
+    vector<string> parent_rules;    // 走上级代理的 host 规则, 为空时全部走上级代理
+    string h2_listen;           // HTTP/2 prior knowledge 的监听地址, 设置后普通监听上也支持 h2c 升级
+    string acl_file;            // 目标地址的访问控制/选路规则, 重新加载时一起更新
+    vector<string> resolvers;   // 赛跑的 dns 服务器, 为空时使用 resolv.conf
+    RuntimeConfig runtime;
+
+    ProxyOptions() : port(0), use_uring(false), use_mem_pool(false),
+        workers(1), numa(false), steer(STEER_NONE),
+        compress_level(-1), compress_min_size(COMPRESS_MIN_SIZE), parent_port(0) {}
+};
+
+// getopt 的状态是全局的, 多个实例同时解析参数时需要加锁
+static pthread_mutex_t ParseLock = PTHREAD_MUTEX_INITIALIZER;
+// 每个实例的统计在单独的组里
+static int NextStatsGroup = 0;
+
+class LibeventContext;
+
+// 一个 worker 一个线程和一个 event_base, 线程之间不共享连接
+struct ProxyWorker {
+    ProxyServer *server;
+    int id;
+    int cpu;                    // -1 表示不绑核
+    int numa_node;
+    evutil_socket_t listen_fd;  // 主线程按顺序创建好
+    vector<evutil_socket_t> unix_fds;   // 每个 worker 一份 dup, 共享同一个监听socket
+    evutil_socket_t h2_fd;      // HTTP/2 监听socket的 dup, -1 表示没有开启
+    int exit_fd;                // eventfd, 其他线程通过它通知退出
+    int reload_fd;              // eventfd, 通知重新读取运行时参数
+    pthread_t tid;
+    LibeventContext *ctx;       // 在 worker 线程里创建, 内存在本地节点上
+    sem_t init_done;            // worker 初始化结束(不管成功失败)后通知 Start
+    int init_ret;               // InitLibevent 的返回值
+};
+
+#define STATS_PUBLISH_MS (1000)   // worker 发布统计快照的间隔
+
+// 一个监听地址, 每个 listener 一个 evhttp, 回调参数就是 listener, 按监听地址统计
+// HTTP/2 的监听没有 evhttp, 连接直接交给 H2Frontend
+struct ProxyListener {
+    string name;                // tcp:ip:port, unix:path 或 h2:ip:port
+    struct evhttp *http;
+    struct evhttp_bound_socket *handle;
+    struct evconnlistener *raw; // HTTP/2 监听
+    uint64_t requests;
+    uint64_t tunnels;
+    uint64_t errors;            // 上游出错或返回 5xx
+    uint64_t bytes_up;
+    uint64_t bytes_down;
+    uint64_t total_us;          // http 请求的总耗时, 不包括隧道
+
+    ProxyListener() : http(NULL), handle(NULL), raw(NULL), requests(0), tunnels(0), errors(0),
+        bytes_up(0), bytes_down(0), total_us(0) {}
+};
+
+// 客户端的一个请求, HTTP/1.1 的来自 evhttp, HTTP/2 的是一个 stream, 只有一个不为 NULL
+struct ClientReq {
+    struct evhttp_request *req;
+    H2Stream *stream;
+};
+
+// 一次 http 代理请求的上下文
+struct HttpProxyReq {
+    ClientReq client_req;
+    struct evhttp_connection *proxy_conn;
+    UpstreamPool *pool;
+    ProxyListener *listener;
+    TrafficKey host;
+    TrafficKey client;
+    size_t req_bytes;
+    struct timeval start;       // 收到客户端请求的时间
+    AccessRecord log;           // 开启访问日志时才填充
+};
+
+// CONNECT 隧道的上下文, 两个方向的回调共用, 隧道结束时释放
+// HTTP/2 的隧道 client 为 NULL, 客户端一侧是 stream
+struct TunnelCtx {
+    struct bufferevent *client;
+    struct bufferevent *upstream;
+    H2Stream *stream;
+    ProxyListener *listener;
+    TrafficKey host;
+    TrafficKey client_ip;
+    struct timeval start;       // 收到 CONNECT 请求的时间
+    uint64_t bytes[2];          // 0: client -> upstream, 1: upstream -> client
+    bool parent_pending;        // 经过上级代理, 还没收到 CONNECT 的响应头
+    bool reply_pending;         // 等上级代理的响应, 还没回应客户端, 客户端一侧不属于隧道
+    ClientReq client_req;       // reply_pending 时回应客户端用
+    AccessRecord log;
+};
+
+// 经过上级代理的请求数, 每个 worker 一份
+struct ParentStats {
+    uint64_t http;
+    uint64_t tunnel;
+    uint64_t errors;            // CONNECT 被上级代理拒绝或响应头错误
+
+    ParentStats() : http(0), tunnel(0), errors(0) {}
+};
+
+// 异步 dns 解析期间保存请求的上下文
+struct DnsLookup {
+    ClientReq client_req;
+    ProxyListener *listener;
+    struct timeval start;
+    bool acl_check_addr;        // 解析出 IP 后按 CIDR 规则再检查一次
+};
+
+static void tunnel_free(TunnelCtx *tunnel);
+static int ParseOpts(int argc, char **argv, ProxyOptions *opts);
+static void h2_stream_cb(H2Stream *stream, void *arg);
+static void h2_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+	struct sockaddr *addr, int socklen, void *arg);
+
+class LibeventContext
+{
+    private:
+        ProxyServer *server;
+        const ProxyOptions &options;
+        ProxyWorker *worker;
+        struct event_base *base;
+        DnsRacer resolver;
+		struct event *evtimer;
+		struct event *dns_snapshot_timer;
+		struct event *warm_timer;
+		struct event *stats_timer;
+		struct event *access_log_timer;
+		struct event *exit_event;
+		struct event *drain_timer;
+		struct event *reload_event;
+		struct event *sighup_event;
+		bool draining;
+		time_t drain_deadline;
+        vector<ProxyListener> listeners;    // 第一个是 tcp 监听
+        UringTunnelEngine uring;
+        ObjectPool<HttpProxyReq> http_req_pool;
+        ObjectPool<TunnelCtx> tunnel_ctx_pool;
+        ObjectPool<DnsLookup> dns_lookup_pool;
+        TrafficSketch traffic;
+        // 给其他 worker 的统计接口读, 只在发布时加锁
+        pthread_mutex_t snapshot_lock;
+        TrafficSketch traffic_snapshot;
+        map<string, pair<string, time_t> > dns_published;  // host -> (ip, 过期时间), 保存快照时合并
+        AccessLog access_log;
+        ResponseCompressor compressor;
+        H2Frontend h2;
+        ParentStats parent_stats;
+        RuntimeConfig config;
+        AclRules *acl;
+        uint64_t reloads;
+        set<TunnelCtx *> live_tunnels;
+        map<string, CacheDns> dns_cache;
+        DnsExpireIndex dns_expire;
+		map<struct bufferevent *, struct evhttp_connection *> map_conn;
+		map<string, UpstreamPool> upstream_pool;
+
+    public:
+        LibeventContext(ProxyWorker *w);
+        ~LibeventContext();
+
+		void AddConn(struct bufferevent *bufev, struct evhttp_connection *conn) {
+            map_conn[bufev] = conn;
+        }
+		bool FreeConn(struct bufferevent *bufev) {
+            auto iter = map_conn.find(bufev);
+			if (iter != map_conn.end()) {
+				evhttp_connection_free(iter->second);
+				map_conn.erase(iter);
+				return true;
+			}
+			return false;
+        }
+
+        // 缓存时间取解析结果的 ttl, 限制在 dns_ttl_min ~ dns_ttl_max 之间
+        void InsertDns(string host, string ip, int ttl) {
+            if (ttl > config.dns_ttl_max)
+                ttl = config.dns_ttl_max;
+            if (ttl < config.dns_ttl_min)
+                ttl = config.dns_ttl_min;
+            if (ttl <= 0)
+                return;
+            PutDns(host, ip, time(NULL) + ttl);
+            stats_gauge_set(STAT_DNS_CACHE_SIZE, dns_cache.size());
+        }
+        // 缓存满了先淘汰最早过期的一条(有过期的就是过期的), 不等定时清理
+        void PutDns(const string &host, const string &ip, time_t expire) {
+            auto iter = dns_cache.find(host);
+            if (iter != dns_cache.end()) {
+                dns_expire.erase(iter->second.expire_iter);
+            } else {
+                if (config.dns_cache_max > 0 && (int)dns_cache.size() >= config.dns_cache_max)
+                    TrimDns(config.dns_cache_max - 1);
+                iter = dns_cache.insert(make_pair(host, CacheDns())).first;
+            }
+            iter->second.ip = ip;
+            iter->second.expire = expire;
+            iter->second.expire_iter = dns_expire.insert(make_pair(expire, host));
+        }
+        // 淘汰到最多剩下 max 条
+        void TrimDns(size_t max) {
+            while (dns_cache.size() > max) {
+                dns_cache.erase(dns_expire.begin()->second);
+                dns_expire.erase(dns_expire.begin());
+                stats_inc(STAT_DNS_CACHE_EVICT);
+            }
+        }
+        string GetDns(string host) {
+            auto iter = dns_cache.find(host);
+            if (iter != dns_cache.end()) {
+                time_t now; time(&now);
+                if (now < iter->second.expire) {
+                    stats_inc(STAT_DNS_CACHE_HIT);
+                    return iter->second.ip;
+                }
+            }
+            stats_inc(STAT_DNS_CACHE_MISS);
+            return "";
+        }
+        void CleanDns() {
+            time_t now; time(&now);
+            cout << "begin clean dns cache:" << dns_cache.size() << endl;
+            while (!dns_expire.empty() && now >= dns_expire.begin()->first) {
+                auto iter = dns_expire.begin();
+                cout << "cache time out " << "host:" << iter->second
+                    << " expire time:" << iter->first
+                    << " now time:" << now << endl;
+                dns_cache.erase(iter->second);
+                dns_expire.erase(iter);
+            }
+            cout << "end clean dns cache:" << dns_cache.size() << endl;
+            stats_gauge_set(STAT_DNS_CACHE_SIZE, dns_cache.size());
+        }
+
+        void PublishDns();
+        int SaveDnsSnapshot();
+        int LoadDnsSnapshot();
+
+        UpstreamPool *GetUpstreamPool(const string &ip, int port);
+        struct evhttp_connection *GetHttpConn(UpstreamPool *pool);
+        void PutHttpConn(UpstreamPool *pool, struct evhttp_connection *conn, bool reuse);
+        struct bufferevent *GetWarmTunnel(UpstreamPool *pool);
+        void RemoveWarmTunnel(UpstreamPool *pool, struct bufferevent *bev);
+        void AddWarmTunnel(UpstreamPool *pool, struct bufferevent *bev);
+        void RefreshUpstreamPool();
+        void ClearUpstreamPool();
+
+        struct bufferevent *NewUpstreamBufferevent(const struct sockaddr_in &sin);
+        void TuneUpstreamSocket(evutil_socket_t fd);
+        void DumpStats(struct evbuffer *buf);
+        void PublishStats();
+
+        int AddListener(const string &name, evutil_socket_t fd);
+        int AddH2Listener(const string &name, evutil_socket_t fd);
+        void ApplyConfig();
+        void UpdateConfig();
+        // 没有配置规则时返回NULL
+        const AclRules *GetAcl() {
+            return acl;
+        }
+        const RuntimeConfig &GetConfig() {
+            return config;
+        }
+        void StartDrain();
+        void CheckDrain();
+        bool IsDraining() {
+            return draining;
+        }
+
+        struct event_base *GetEventBase() {
+            return base;
+        }
+        DnsRacer &GetResolver() {
+            return resolver;
+        }
+        ProxyWorker *GetWorker() {
+            return worker;
+        }
+        ProxyServer *GetServer() {
+            return server;
+        }
+        const ProxyOptions &GetOptions() {
+            return options;
+        }
+        // 嵌入方设置的请求检查, 返回 0 继续转发
+        bool HasRequestHook() {
+            return server->request_hook != NULL;
+        }
+        int InspectRequest(const ProxyRequestInfo *info) {
+            return server->request_hook(info, server->request_hook_arg);
+        }
+        HttpProxyReq *NewHttpReq() {
+            stats_gauge_add(STAT_LIVE_HTTP, 1);
+            return http_req_pool.New();
+        }
+        void FreeHttpReq(HttpProxyReq *req) {
+            stats_gauge_add(STAT_LIVE_HTTP, -1);
+            http_req_pool.Delete(req);
+        }
+        TunnelCtx *NewTunnelCtx() {
+            TunnelCtx *ctx = tunnel_ctx_pool.New();
+            live_tunnels.insert(ctx);
+            stats_gauge_add(STAT_LIVE_TUNNEL, 1);
+            return ctx;
+        }
+        void FreeTunnelCtx(TunnelCtx *ctx) {
+            live_tunnels.erase(ctx);
+            stats_gauge_add(STAT_LIVE_TUNNEL, -1);
+            tunnel_ctx_pool.Delete(ctx);
+        }
+        DnsLookup *NewDnsLookup() {
+            return dns_lookup_pool.New();
+        }
+        void FreeDnsLookup(DnsLookup *lookup) {
+            dns_lookup_pool.Delete(lookup);
+        }
+        TrafficSketch &GetTraffic() {
+            return traffic;
+        }
+        ResponseCompressor &GetCompressor() {
+            return compressor;
+        }
+        ParentStats &GetParentStats() {
+            return parent_stats;
+        }
+        // 未开启时返回NULL
+        AccessLog *GetAccessLog() {
+            return access_log.IsOpen() ? &access_log : NULL;
+        }
+        // 没有开启 HTTP/2 时返回NULL
+        H2Frontend *GetH2() {
+            return h2.IsReady() ? &h2 : NULL;
+        }
+        // 未开启或初始化失败时返回NULL, 隧道走libevent
+        UringTunnelEngine *GetUring() {
+            return (options.use_uring && uring.IsReady()) ? &uring : NULL;
+        }
+
+        int InitLibevent();
+		int UninitLibevent();
+		void RegisterHttpHandler();
+};
+
+// 当前线程所属 worker 的上下文, 回调都在 worker 自己的线程里执行
+static __thread LibeventContext *LocalCtx = NULL;
+
+LibeventContext::LibeventContext(ProxyWorker *w) : server(w->server), options(*w->server->options),
+    http_req_pool("http_req"), tunnel_ctx_pool("tunnel"), dns_lookup_pool("dns_lookup")
+{
+    worker = w;
+    base = NULL;
+	evtimer = NULL; 
+	dns_snapshot_timer = NULL;
+	warm_timer = NULL;
+	stats_timer = NULL;
+	access_log_timer = NULL;
+	exit_event = NULL;
+	drain_timer = NULL;
+	reload_event = NULL;
+	sighup_event = NULL;
+	acl = NULL;
+	reloads = 0;
+	draining = false;
+	drain_deadline = 0;
+	pthread_mutex_init(&snapshot_lock, NULL);
+    cout << "LibeventContext worker:" << worker->id << endl;
+}
+
+int LibeventContext::UninitLibevent()
+{
+	// 先关闭 io_uring 上的隧道, 会回调释放对应的 bufferevent
+	uring.Uninit();
+	// 超过等待时间还没结束的 libevent 隧道
+	while (!live_tunnels.empty())
+		tunnel_free(*live_tunnels.begin());
+	// 升级来的 HTTP/2 连接属于 evhttp, 要在 evhttp_free 之前关闭
+	h2.Close();
+
+	if (drain_timer) {
+		event_free(drain_timer);
+		drain_timer = NULL;
+	}
+
+	if (evtimer) {
+		event_free(evtimer);
+		evtimer = NULL; 
+	}
+
+	if (dns_snapshot_timer) {
+		event_free(dns_snapshot_timer);
+		dns_snapshot_timer = NULL;
+	}
+	// 退出前发布一次, 所有 worker 退出后由 ProxyServer::Wait 合并保存
+	PublishDns();
+	if (access_log_timer) {
+		event_free(access_log_timer);
+		access_log_timer = NULL;
+	}
+	access_log.Close();
+
+	if (warm_timer) {
+		event_free(warm_timer);
+		warm_timer = NULL;
+	}
+	ClearUpstreamPool();
+
+	if (stats_timer) {
+		event_free(stats_timer);
+		stats_timer = NULL;
+	}
+
+	if (exit_event) {
+		event_free(exit_event);
+		exit_event = NULL;
+	}
+
+	if (reload_event) {
+		event_free(reload_event);
+		reload_event = NULL;
+	}
+
+	if (sighup_event) {
+		event_free(sighup_event);
+		sighup_event = NULL;
+	}
+
+	if (acl) {
+		acl->Unref();
+		acl = NULL;
+	}
+
+    resolver.Close();
+
+	for (size_t i = 0; i < listeners.size(); i++) {
+		if (listeners[i].http)
+			evhttp_free(listeners[i].http);
+		if (listeners[i].raw)
+			evconnlistener_free(listeners[i].raw);
+	}
+	listeners.clear();
+
+    if (base) {
+		event_base_free(base);
+		base = NULL;
+	}
+
+    cout << "UninitLibevent" << endl;
+	return 0;
+}
+
+LibeventContext::~LibeventContext()
+{
+	pthread_mutex_destroy(&snapshot_lock);
+}
+
+static int set_sockopt_int(evutil_socket_t fd, int level, int name, int value, const char *desc)
+{
+    if (setsockopt(fd, level, name, &value, sizeof(value)) != 0) {
+        printf("setsockopt %s=%d failed: %s\n", desc, value, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// 格式: nodelay=1,fastopen=256,rcvbuf=262144,keepalive=60:10:5
+static int parse_sock_tuning(const char *str, SockTuning *tuning)
+{
+    string opts = str;
+    size_t begin = 0;
+    while (begin < opts.size()) {
+        size_t end = opts.find(',', begin);
+        if (end == string::npos)
+            end = opts.size();
+        string item = opts.substr(begin, end - begin);
+        begin = end + 1;
+
+        size_t eq = item.find('=');
+        if (eq == string::npos) {
+            cout << "socket option format error:" << item << endl;
+            return -1;
+        }
+        string key = item.substr(0, eq);
+        const char *value = item.c_str() + eq + 1;
+
+        if (key == "nodelay") tuning->nodelay = atoi(value);
+        else if (key == "fastopen") tuning->fastopen = atoi(value);
+        else if (key == "defer_accept") tuning->defer_accept = atoi(value);
+        else if (key == "rcvbuf") tuning->rcvbuf = atoi(value);
+        else if (key == "sndbuf") tuning->sndbuf = atoi(value);
+        else if (key == "notsent_lowat") tuning->notsent_lowat = atoi(value);
+        else if (key == "backlog") tuning->backlog = atoi(value);
+        else if (key == "keepalive") {
+            if (sscanf(value, "%d:%d:%d", &tuning->keepidle,
+                &tuning->keepintvl, &tuning->keepcnt) != 3) {
+                cout << "keepalive format error, need idle:intvl:cnt" << endl;
+                return -1;
+            }
+        } else {
+            cout << "unknown socket option:" << key << endl;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void apply_sock_tuning(evutil_socket_t fd, const SockTuning &t, bool listener)
+{
+    if (t.nodelay >= 0)
+        set_sockopt_int(fd, IPPROTO_TCP, TCP_NODELAY, t.nodelay, "TCP_NODELAY");
+    if (t.rcvbuf > 0)
+        set_sockopt_int(fd, SOL_SOCKET, SO_RCVBUF, t.rcvbuf, "SO_RCVBUF");
+    if (t.sndbuf > 0)
+        set_sockopt_int(fd, SOL_SOCKET, SO_SNDBUF, t.sndbuf, "SO_SNDBUF");
+    if (t.notsent_lowat > 0)
+        set_sockopt_int(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, t.notsent_lowat, "TCP_NOTSENT_LOWAT");
+    if (t.keepidle > 0) {
+        set_sockopt_int(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+        set_sockopt_int(fd, IPPROTO_TCP, TCP_KEEPIDLE, t.keepidle, "TCP_KEEPIDLE");
+        set_sockopt_int(fd, IPPROTO_TCP, TCP_KEEPINTVL, t.keepintvl, "TCP_KEEPINTVL");
+        set_sockopt_int(fd, IPPROTO_TCP, TCP_KEEPCNT, t.keepcnt, "TCP_KEEPCNT");
+    }
+
+    if (listener) {
+        if (t.fastopen > 0)
+            set_sockopt_int(fd, IPPROTO_TCP, TCP_FASTOPEN, t.fastopen, "TCP_FASTOPEN");
+        if (t.defer_accept >= 0)
+            set_sockopt_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, t.defer_accept, "TCP_DEFER_ACCEPT");
+    } else {
+#ifdef TCP_FASTOPEN_CONNECT
+        // 必须在 connect 之前设置
+        if (t.fastopen > 0)
+            set_sockopt_int(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, "TCP_FASTOPEN_CONNECT");
+#endif
+    }
+}
+
+// 读取socket当前实际生效的参数
+static void dump_sock_tuning(struct evbuffer *buf, const char *name, evutil_socket_t fd)
+{
+    static const struct {
+        const char *desc;
+        int level;
+        int opt;
+    } opts[] = {
+        {"nodelay", IPPROTO_TCP, TCP_NODELAY},
+        {"fastopen", IPPROTO_TCP, TCP_FASTOPEN},
+        {"defer_accept", IPPROTO_TCP, TCP_DEFER_ACCEPT},
+        {"rcvbuf", SOL_SOCKET, SO_RCVBUF},
+        {"sndbuf", SOL_SOCKET, SO_SNDBUF},
+        {"notsent_lowat", IPPROTO_TCP, TCP_NOTSENT_LOWAT},
+        {"keepalive", SOL_SOCKET, SO_KEEPALIVE},
+        {"keepidle", IPPROTO_TCP, TCP_KEEPIDLE},
+        {"keepintvl", IPPROTO_TCP, TCP_KEEPINTVL},
+        {"keepcnt", IPPROTO_TCP, TCP_KEEPCNT},
+    };
+
+    for (size_t i = 0; i < sizeof(opts) / sizeof(opts[0]); i++) {
+        int value = 0;
+        socklen_t len = sizeof(value);
+        if (getsockopt(fd, opts[i].level, opts[i].opt, &value, &len) == 0)
+            evbuffer_add_printf(buf, "%s.%s %d\n", name, opts[i].desc, value);
+    }
+}
+
+// 配置值, -1 表示系统默认
+static void dump_sock_config(struct evbuffer *buf, const char *name, const SockTuning &t)
+{
+    evbuffer_add_printf(buf, "%s.nodelay %d\n", name, t.nodelay);
+    evbuffer_add_printf(buf, "%s.fastopen %d\n", name, t.fastopen);
+    evbuffer_add_printf(buf, "%s.defer_accept %d\n", name, t.defer_accept);
+    evbuffer_add_printf(buf, "%s.rcvbuf %d\n", name, t.rcvbuf);
+    evbuffer_add_printf(buf, "%s.sndbuf %d\n", name, t.sndbuf);
+    evbuffer_add_printf(buf, "%s.notsent_lowat %d\n", name, t.notsent_lowat);
+    evbuffer_add_printf(buf, "%s.backlog %d\n", name, t.backlog);
+    evbuffer_add_printf(buf, "%s.keepalive %d:%d:%d\n", name, t.keepidle, t.keepintvl, t.keepcnt);
+}
+
+static int display_listen_sock(struct evhttp_bound_socket *handle)
+{
+	struct sockaddr_storage ss;
+	evutil_socket_t fd;
+	ev_socklen_t socklen = sizeof(ss);
+	char addrbuf[128];
+	void *inaddr;
+	const char *addr;
+	int got_port = -1;
+
+	fd = evhttp_bound_socket_get_fd(handle);
+	memset(&ss, 0, sizeof(ss));
+	if (getsockname(fd, (struct sockaddr *)&ss, &socklen)) {
+		perror("getsockname() failed");
+		return 1;
+	}
+
+	if (ss.ss_family == AF_INET) {
+		got_port = ntohs(((struct sockaddr_in*)&ss)->sin_port);
+		inaddr = &((struct sockaddr_in*)&ss)->sin_addr;
+	} else if (ss.ss_family == AF_INET6) {
+		got_port = ntohs(((struct sockaddr_in6*)&ss)->sin6_port);
+		inaddr = &((struct sockaddr_in6*)&ss)->sin6_addr;
+	} else if (ss.ss_family == AF_UNIX) {
+		printf("Listening on unix:%s\n", ((struct sockaddr_un *)&ss)->sun_path);
+		return 0;
+	} else {
+		printf("Weird address family %d\n", ss.ss_family);
+		return 1;
+	}
+
+	addr = evutil_inet_ntop(ss.ss_family, inaddr, addrbuf,
+	    sizeof(addrbuf));
+	if (addr) {
+		printf("Listening on %s:%d\n", addr, got_port);
+	} else {
+		printf("evutil_inet_ntop failed\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static void timer_callback(evutil_socket_t fd, short what, void *arg)
+{
+    LocalCtx->CleanDns();
+}
+
+// 每个 worker 发布自己的缓存, 由 0 号 worker 合并保存
+static void dns_snapshot_callback(evutil_socket_t fd, short what, void *arg)
+{
+    LocalCtx->PublishDns();
+    if (LocalCtx->GetWorker()->id == 0)
+        LocalCtx->SaveDnsSnapshot();
+}
+
+// 每个 worker 的 dns 缓存是独立的, 复制一份给保存快照的线程读
+void LibeventContext::PublishDns()
+{
+    if (options.dns_snapshot_file.empty())
+        return;
+    pthread_mutex_lock(&snapshot_lock);
+    dns_published.clear();
+    for (auto iter = dns_cache.begin(); iter != dns_cache.end(); iter++)
+        dns_published[iter->first] = make_pair(iter->second.ip, iter->second.expire);
+    pthread_mutex_unlock(&snapshot_lock);
+}
+
+// 合并所有 worker 最近一次发布的缓存, 同一个 host 取过期时间最晚的
+// 先写临时文件再rename, 保证快照文件总是完整的
+int LibeventContext::SaveDnsSnapshot()
+{
+    if (options.dns_snapshot_file.empty())
+        return 0;
+
+    map<string, pair<string, time_t> > merged;
+    for (size_t i = 0; i < server->workers.size(); i++) {
+        LibeventContext *ctx = __atomic_load_n(&server->workers[i]->ctx, __ATOMIC_ACQUIRE);
+        if (!ctx)
+            continue;
+        pthread_mutex_lock(&ctx->snapshot_lock);
+        for (auto iter = ctx->dns_published.begin(); iter != ctx->dns_published.end(); iter++) {
+            auto res = merged.insert(*iter);
+            if (!res.second && res.first->second.second < iter->second.second)
+                res.first->second = iter->second;
+        }
+        pthread_mutex_unlock(&ctx->snapshot_lock);
+    }
+
+    string tmp_file = options.dns_snapshot_file + ".tmp";
+    FILE *fp = fopen(tmp_file.c_str(), "wb");
+    if (!fp) {
+        perror("fopen dns snapshot");
+        return -1;
+    }
+
+    time_t now; time(&now);
+    string data;
+    uint32_t count = 0;
+    for (auto iter = merged.begin(); iter != merged.end(); iter++) {
+        int64_t expire = iter->second.second;
+        struct in_addr addr;
+        if (expire <= now || iter->first.size() > 255 ||
+            evutil_inet_pton(AF_INET, iter->second.first.c_str(), &addr) != 1)
+            continue;
+
+        uint8_t host_len = iter->first.size();
+        uint8_t addr_count = 1;
+        uint64_t expire_le = htole64((uint64_t)expire);
+        data.append((const char *)&expire_le, sizeof(expire_le));
+        data.append((const char *)&host_len, sizeof(host_len));
+        data.append((const char *)&addr_count, sizeof(addr_count));
+        data.append(iter->first);
+        data.append((const char *)&addr, sizeof(addr));
+        count++;
+    }
+
+    struct DnsSnapshotHeader header;
+    header.magic = htole32(DNS_SNAPSHOT_MAGIC);
+    header.version = htole16(DNS_SNAPSHOT_VERSION);
+    header.reserved = 0;
+    header.count = htole32(count);
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        (!data.empty() && fwrite(data.data(), data.size(), 1, fp) != 1)) {
+        perror("fwrite dns snapshot");
+        fclose(fp);
+        unlink(tmp_file.c_str());
+        return -1;
+    }
+    if (fclose(fp) != 0 || rename(tmp_file.c_str(), options.dns_snapshot_file.c_str()) != 0) {
+        perror("save dns snapshot");
+        unlink(tmp_file.c_str());
+        return -1;
+    }
+
+    printf("save dns snapshot:%s count:%u\n", options.dns_snapshot_file.c_str(), count);
+    return 0;
+}
+
+// 加载快照, 跳过已经过期的记录, 文件损坏时保留已读出的部分
+int LibeventContext::LoadDnsSnapshot()
+{
+    if (options.dns_snapshot_file.empty())
+        return 0;
+
+    FILE *fp = fopen(options.dns_snapshot_file.c_str(), "rb");
+    if (!fp) {
+        printf("no dns snapshot:%s\n", options.dns_snapshot_file.c_str());
+        return 0;
+    }
+
+    struct DnsSnapshotHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        le32toh(header.magic) != DNS_SNAPSHOT_MAGIC || le16toh(header.version) != DNS_SNAPSHOT_VERSION) {
+        printf("dns snapshot format error:%s\n", options.dns_snapshot_file.c_str());
+        fclose(fp);
+        return -1;
+    }
+
+    time_t now; time(&now);
+    uint32_t loaded = 0, expired = 0, i;
+    uint32_t count = le32toh(header.count);
+    for (i = 0; i < count; i++) {
+        int64_t expire;
+        uint8_t host_len, addr_count;
+        char host[256];
+        struct in_addr addr;
+        char buf[32] = {0};
+
+        if (fread(&expire, sizeof(expire), 1, fp) != 1 ||
+            fread(&host_len, sizeof(host_len), 1, fp) != 1 ||
+            fread(&addr_count, sizeof(addr_count), 1, fp) != 1 ||
+            addr_count == 0 ||
+            (host_len && fread(host, host_len, 1, fp) != 1) ||
+            fread(&addr, sizeof(addr), 1, fp) != 1 ||
+            fseek(fp, (long)(addr_count - 1) * sizeof(addr), SEEK_CUR) != 0) {
+            printf("dns snapshot truncated at record:%u\n", i);
+            break;
+        }
+        expire = (int64_t)le64toh((uint64_t)expire);
+
+        if (expire <= now || host_len == 0) {
+            expired++;
+            continue;
+        }
+
+        // 按当前的上限截断, 快照可能是用更长的 ttl 保存的
+        if (expire > now + config.dns_ttl_max)
+            expire = now + config.dns_ttl_max;
+        // 快照可能是用更大的 dns_cache_max 保存的, 和 InsertDns 一样超过上限时淘汰
+        PutDns(string(host, host_len), evutil_inet_ntop(AF_INET, &addr, buf, sizeof(buf)), expire);
+        loaded++;
+    }
+    fclose(fp);
+
+    stats_gauge_set(STAT_DNS_CACHE_SIZE, dns_cache.size());
+    printf("load dns snapshot:%s loaded:%u expired:%u cached:%zu\n",
+        options.dns_snapshot_file.c_str(), loaded, expired, dns_cache.size());
+    return 0;
+}
+
+static void free_http_conn_cb(evutil_socket_t fd, short what, void *arg)
+{
+    evhttp_connection_free((struct evhttp_connection *)arg);
+}
+
+// 请求回调里不能直接释放连接, 放到下一轮事件循环
+static void defer_free_http_conn(struct event_base *base, struct evhttp_connection *conn)
+{
+    struct timeval tv = {0, 0};
+    if (event_base_once(base, -1, EV_TIMEOUT, free_http_conn_cb, conn, &tv) != 0)
+        printf("event_base_once failed, leak http conn:%p\n", conn);
+}
+
+// 预连接池的目标连接数, 随请求速率自适应
+static int warm_target(double rate, const RuntimeConfig &config)
+{
+    if (rate < config.warm_min_rate || config.warm_max_conn == 0)
+        return 0;
+    int target = (int)(rate + 0.5);
+    if (target < 1)
+        target = 1;
+    return target > config.warm_max_conn ? config.warm_max_conn : target;
+}
+
+UpstreamPool *LibeventContext::GetUpstreamPool(const string &ip, int port)
+{
+    string key = ip + ":" + to_string(port);
+    auto iter = upstream_pool.find(key);
+    if (iter != upstream_pool.end())
+        return &iter->second;
+
+    UpstreamPool &pool = upstream_pool[key];
+    pool.ip = ip;
+    pool.port = port;
+    pool.http_rate = 0;
+    pool.tunnel_rate = 0;
+    pool.http_hits = 0;
+    pool.tunnel_hits = 0;
+    pool.inflight = 0;
+    pool.parent_ok = false;
+    return &pool;
+}
+
+// 优先复用空闲的 keep-alive 连接
+struct evhttp_connection *LibeventContext::GetHttpConn(UpstreamPool *pool)
+{
+    pool->http_hits++;
+    if (!pool->idle_http.empty()) {
+        struct evhttp_connection *conn = pool->idle_http.front().conn;
+        pool->idle_http.pop_front();
+        stats_inc(STAT_UPSTREAM_REUSE);
+        printf("reuse warm http conn %s:%d %p\n", pool->ip.c_str(), pool->port, conn);
+        return conn;
+    }
+    stats_inc(STAT_UPSTREAM_NEW);
+
+    struct bufferevent *b_proxy = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+    if (!b_proxy)
+        return NULL;
+
+    struct evhttp_connection *conn = evhttp_connection_base_bufferevent_new(base, NULL, b_proxy,
+        pool->ip.c_str(), pool->port);
+    if (!conn)
+        return NULL;
+    // 连接放回池里之后会继续使用, 参数以创建时为准
+    if (config.upstream_timeout > 0)
+        evhttp_connection_set_timeout(conn, config.upstream_timeout);
+    evhttp_connection_set_max_headers_size(conn, config.max_headers_size > 0 ? config.max_headers_size : -1);
+    evhttp_connection_set_max_body_size(conn, config.max_body_size > 0 ? config.max_body_size : -1);
+    return conn;
+}
+
+void LibeventContext::PutHttpConn(UpstreamPool *pool, struct evhttp_connection *conn, bool reuse)
+{
+    int keep = warm_target(pool->http_rate, config);
+    if (keep < 1)
+        keep = 1;
+
+    if (reuse && (int)pool->idle_http.size() < keep) {
+        WarmHttpConn warm;
+        warm.conn = conn;
+        time(&warm.idle_time);
+        pool->idle_http.push_back(warm);
+        return;
+    }
+    defer_free_http_conn(base, conn);
+}
+
+struct bufferevent *LibeventContext::GetWarmTunnel(UpstreamPool *pool)
+{
+    pool->tunnel_hits++;
+    if (pool->warm_tunnel.empty())
+        return NULL;
+
+    struct bufferevent *bev = pool->warm_tunnel.front().bev;
+    pool->warm_tunnel.pop_front();
+    stats_inc(STAT_WARM_TUNNEL_HIT);
+    printf("use warm tunnel %s:%d %p\n", pool->ip.c_str(), pool->port, bev);
+    return bev;
+}
+
+void LibeventContext::AddWarmTunnel(UpstreamPool *pool, struct bufferevent *bev)
+{
+    WarmTunnel warm;
+    warm.bev = bev;
+    time(&warm.idle_time);
+    pool->warm_tunnel.push_back(warm);
+}
+
+void LibeventContext::RemoveWarmTunnel(UpstreamPool *pool, struct bufferevent *bev)
+{
+    for (auto iter = pool->warm_tunnel.begin(); iter != pool->warm_tunnel.end(); iter++) {
+        if (iter->bev == bev) {
+            pool->warm_tunnel.erase(iter);
+            return;
+        }
+    }
+}
+
+static void
+warm_eventcb(struct bufferevent *bev, short what, void *ctx)
+{
+    UpstreamPool *pool = (UpstreamPool *)ctx;
+    if (what & BEV_EVENT_CONNECTED) {
+        pool->connecting.erase(bev);
+        LocalCtx->AddWarmTunnel(pool, bev);
+        return;
+    }
+
+    if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+        // 连接失败或者热连接被对端关闭
+        if (pool->connecting.erase(bev) == 0)
+            LocalCtx->RemoveWarmTunnel(pool, bev);
+        bufferevent_free(bev);
+    }
+}
+
+// 按请求速率更新每个上游的目标热连接数, 淘汰过期连接并补充预连接
+void LibeventContext::RefreshUpstreamPool()
+{
+    time_t now; time(&now);
+    for (auto iter = upstream_pool.begin(); iter != upstream_pool.end();) {
+        UpstreamPool &pool = iter->second;
+        double period = WARM_TIMER_MS / 1000.0;
+        pool.http_rate = pool.http_rate * WARM_RATE_DECAY + pool.http_hits / period * (1 - WARM_RATE_DECAY);
+        pool.tunnel_rate = pool.tunnel_rate * WARM_RATE_DECAY + pool.tunnel_hits / period * (1 - WARM_RATE_DECAY);
+        pool.http_hits = 0;
+        pool.tunnel_hits = 0;
+
+        // 退出等待期间不再保留空闲连接
+        int http_keep = warm_target(pool.http_rate, config);
+        if (http_keep < 1)
+            http_keep = 1;
+        if (draining)
+            http_keep = 0;
+        while ((int)pool.idle_http.size() > http_keep ||
+            (!pool.idle_http.empty() && now - pool.idle_http.front().idle_time > config.warm_idle_time)) {
+            defer_free_http_conn(base, pool.idle_http.front().conn);
+            pool.idle_http.pop_front();
+        }
+
+        int tunnel_keep = draining ? 0 : warm_target(pool.tunnel_rate, config);
+        while ((int)pool.warm_tunnel.size() > tunnel_keep ||
+            (!pool.warm_tunnel.empty() && now - pool.warm_tunnel.front().idle_time > config.warm_idle_time)) {
+            bufferevent_free(pool.warm_tunnel.front().bev);
+            pool.warm_tunnel.pop_front();
+        }
+
+        while ((int)(pool.warm_tunnel.size() + pool.connecting.size()) < tunnel_keep) {
+            struct sockaddr_in sin;
+            memset(&sin, 0, sizeof(sin));
+            sin.sin_family = AF_INET;
+            sin.sin_port = htons(pool.port);
+            evutil_inet_pton(AF_INET, pool.ip.c_str(), &sin.sin_addr);
+
+            struct bufferevent *bev = NewUpstreamBufferevent(sin);
+            if (!bev)
+                break;
+            bufferevent_setcb(bev, NULL, NULL, warm_eventcb, &pool);
+            bufferevent_enable(bev, EV_READ);
+            pool.connecting.insert(bev);
+        }
+
+        // 冷却下来的上游直接删除
+        if (pool.http_rate < 0.01 && pool.tunnel_rate < 0.01 && pool.connecting.empty() &&
+            pool.inflight == 0 && pool.idle_http.empty() && pool.warm_tunnel.empty()) {
+            iter = upstream_pool.erase(iter);
+        } else {
+            iter++;
+        }
+    }
+}
+
+void LibeventContext::ClearUpstreamPool()
+{
+    for (auto iter = upstream_pool.begin(); iter != upstream_pool.end(); iter++) {
+        for (auto &warm : iter->second.idle_http)
+            evhttp_connection_free(warm.conn);
+        for (auto &warm : iter->second.warm_tunnel)
+            bufferevent_free(warm.bev);
+        // 还没连上的预连接, 回调参数指向的池马上就要释放
+        for (auto bev : iter->second.connecting)
+            bufferevent_free(bev);
+    }
+    upstream_pool.clear();
+}
+
+// 自己创建socket, 才能在 connect 之前设置 TCP_FASTOPEN_CONNECT 等参数
+struct bufferevent *LibeventContext::NewUpstreamBufferevent(const struct sockaddr_in &sin)
+{
+    evutil_socket_t fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return NULL;
+    }
+    apply_sock_tuning(fd, options.upstream_tuning, false);
+
+    struct bufferevent *bev = bufferevent_socket_new(base, fd,
+        BEV_OPT_CLOSE_ON_FREE|BEV_OPT_DEFER_CALLBACKS);
+    if (!bev) {
+        evutil_closesocket(fd);
+        return NULL;
+    }
+
+    if (bufferevent_socket_connect(bev, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+        perror("bufferevent_socket_connect");
+        bufferevent_free(bev);
+        return NULL;
+    }
+    return bev;
+}
+
+// evhttp 连接的socket由libevent在发起请求时创建, 只能在 connect 之后设置
+void LibeventContext::TuneUpstreamSocket(evutil_socket_t fd)
+{
+    if (fd >= 0)
+        apply_sock_tuning(fd, options.upstream_tuning, false);
+}
+
+// 把 top-K 统计复制一份给其他 worker 的统计接口读, 单 worker 时不需要
+void LibeventContext::PublishStats()
+{
+    if (options.workers <= 1)
+        return;
+    pthread_mutex_lock(&snapshot_lock);
+    traffic_snapshot = traffic;
+    pthread_mutex_unlock(&snapshot_lock);
+}
+
+// 连接相关的统计只输出处理本次请求的 worker, top-K 合并所有 worker
+void LibeventContext::DumpStats(struct evbuffer *buf)
+{
+    evbuffer_add_printf(buf, "worker.count %zu\n", server->workers.size());
+    evbuffer_add_printf(buf, "worker.current %d\n", worker->id);
+    for (size_t i = 0; i < server->workers.size(); i++) {
+        evbuffer_add_printf(buf, "worker.%zu.cpu %d\n", i, server->workers[i]->cpu);
+        evbuffer_add_printf(buf, "worker.%zu.numa_node %d\n", i, server->workers[i]->numa_node);
+    }
+
+    // 所有 worker 合并的统计
+    StatsSnapshot snapshot;
+    snapshot.Take(server->stats_group);
+    snapshot.DumpStats(buf);
+
+    evbuffer_add_printf(buf, "config.file %s\n", options.config_file.c_str());
+    evbuffer_add_printf(buf, "config.reloads %lu\n", (unsigned long)reloads);
+    config.DumpStats(buf);
+    if (acl)
+        acl->DumpStats(buf);
+
+    evbuffer_add_printf(buf, "drain.active %d\n", draining ? 1 : 0);
+    evbuffer_add_printf(buf, "drain.http %zu\n", http_req_pool.Live());
+    evbuffer_add_printf(buf, "drain.tunnel %zu\n", live_tunnels.size());
+    evbuffer_add_printf(buf, "drain.dns %zu\n", dns_lookup_pool.Live());
+    evbuffer_add_printf(buf, "dns_cache.size %zu\n", dns_cache.size());
+    evbuffer_add_printf(buf, "tunnel.count %zu\n", map_conn.size());
+
+    size_t idle_http = 0, warm_tunnel = 0, connecting = 0;
+    for (auto iter = upstream_pool.begin(); iter != upstream_pool.end(); iter++) {
+        idle_http += iter->second.idle_http.size();
+        warm_tunnel += iter->second.warm_tunnel.size();
+        connecting += iter->second.connecting.size();
+    }
+    evbuffer_add_printf(buf, "upstream_pool.count %zu\n", upstream_pool.size());
+    evbuffer_add_printf(buf, "upstream_pool.idle_http %zu\n", idle_http);
+    evbuffer_add_printf(buf, "upstream_pool.warm_tunnel %zu\n", warm_tunnel);
+    evbuffer_add_printf(buf, "upstream_pool.connecting %zu\n", connecting);
+
+    for (size_t i = 0; i < listeners.size(); i++) {
+        const ProxyListener &l = listeners[i];
+        evbuffer_add_printf(buf, "listener.%zu.name %s\n", i, l.name.c_str());
+        evbuffer_add_printf(buf, "listener.%zu.requests %lu\n", i, (unsigned long)l.requests);
+        evbuffer_add_printf(buf, "listener.%zu.tunnels %lu\n", i, (unsigned long)l.tunnels);
+        evbuffer_add_printf(buf, "listener.%zu.errors %lu\n", i, (unsigned long)l.errors);
+        evbuffer_add_printf(buf, "listener.%zu.bytes_up %lu\n", i, (unsigned long)l.bytes_up);
+        evbuffer_add_printf(buf, "listener.%zu.bytes_down %lu\n", i, (unsigned long)l.bytes_down);
+        uint64_t http_num = l.requests - l.tunnels;
+        evbuffer_add_printf(buf, "listener.%zu.http_avg_us %lu\n", i,
+            (unsigned long)(http_num ? l.total_us / http_num : 0));
+    }
+
+    if (!options.parent_ip.empty()) {
+        evbuffer_add_printf(buf, "parent.addr %s:%d\n", options.parent_ip.c_str(), options.parent_port);
+        evbuffer_add_printf(buf, "parent.http %lu\n", (unsigned long)parent_stats.http);
+        evbuffer_add_printf(buf, "parent.tunnel %lu\n", (unsigned long)parent_stats.tunnel);
+        evbuffer_add_printf(buf, "parent.errors %lu\n", (unsigned long)parent_stats.errors);
+    }
+
+    dump_sock_config(buf, "listen.config", options.listen_tuning);
+    if (!listeners.empty() && listeners[0].handle)
+        dump_sock_tuning(buf, "listen.current", evhttp_bound_socket_get_fd(listeners[0].handle));
+    dump_sock_config(buf, "upstream.config", options.upstream_tuning);
+
+    if (GetUring())
+        uring.DumpStats(buf);
+
+    mem_pool_dump_stats(buf);
+    http_req_pool.DumpStats(buf);
+    tunnel_ctx_pool.DumpStats(buf);
+    dns_lookup_pool.DumpStats(buf);
+    access_log.DumpStats(buf);
+    compressor.DumpStats(buf);
+    if (GetH2())
+        h2.DumpStats(buf);
+    resolver.DumpStats(buf);
+    if (server->stats_hook)
+        server->stats_hook(buf, server->stats_hook_arg);
+
+    // 其他 worker 用最近一次发布的快照
+    vector<const TrafficSketch *> sketches(1, &traffic);
+    vector<LibeventContext *> locked;
+    for (size_t i = 0; i < server->workers.size(); i++) {
+        LibeventContext *ctx = __atomic_load_n(&server->workers[i]->ctx, __ATOMIC_ACQUIRE);
+        if (!ctx || ctx == this)
+            continue;
+        pthread_mutex_lock(&ctx->snapshot_lock);
+        locked.push_back(ctx);
+        sketches.push_back(&ctx->traffic_snapshot);
+    }
+    TrafficSketch::DumpStats(sketches, buf);
+    for (size_t i = 0; i < locked.size(); i++)
+        pthread_mutex_unlock(&locked[i]->snapshot_lock);
+}
+
+static void warm_timer_callback(evutil_socket_t fd, short what, void *arg)
+{
+    LocalCtx->RefreshUpstreamPool();
+}
+
+static void stats_timer_callback(evutil_socket_t fd, short what, void *arg)
+{
+    LocalCtx->PublishStats();
+}
+
+static void access_log_timer_callback(evutil_socket_t fd, short what, void *arg)
+{
+    if (LocalCtx->GetAccessLog())
+        LocalCtx->GetAccessLog()->Maintain();
+}
+
+static void exit_event_callback(evutil_socket_t fd, short what, void *arg)
+{
+    uint64_t value;
+    if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        perror("read exit eventfd");
+    LocalCtx->StartDrain();
+}
+
+static void drain_timer_callback(evutil_socket_t fd, short what, void *arg)
+{
+    LocalCtx->CheckDrain();
+}
+
+static void reload_event_callback(evutil_socket_t fd, short what, void *arg)
+{
+    uint64_t value;
+    if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        perror("read reload eventfd");
+    LocalCtx->UpdateConfig();
+}
+
+// 上级代理是启动参数, 重新加载时也按正在使用的配置检查
+static AclRules *load_acl(const string &path, const ProxyOptions &opts)
+{
+    AclRules *acl = AclRules::Load(path);
+    if (acl && acl->Count(ACL_PARENT) > 0 && opts.parent_ip.empty()) {
+        printf("acl has parent rules but no parent proxy configured\n");
+        acl->Unref();
+        return NULL;
+    }
+    return acl;
+}
+
+// 0 号 worker 处理信号, 重新加载的过程和 ProxyServer::Reload 一样
+static void sighup_callback(evutil_socket_t fd, short what, void *arg)
+{
+    printf("SIGHUP, reload config\n");
+    LocalCtx->GetServer()->Reload();
+}
+
+void LibeventContext::UpdateConfig()
+{
+    AclRules *old_acl = acl;
+    pthread_mutex_lock(&server->reload_lock);
+    config = server->reloaded_config;
+    acl = server->reloaded_acl;
+    if (acl)
+        acl->Ref();
+    pthread_mutex_unlock(&server->reload_lock);
+    // 最后一个 worker 放掉引用时旧规则才释放
+    if (old_acl)
+        old_acl->Unref();
+    reloads++;
+    ApplyConfig();
+    printf("worker:%d reload config done\n", worker->id);
+}
+
+// 启动和重新加载时调用, 把运行时参数设置到监听的 evhttp 和定时器上
+// 已经建立的连接保持原来的超时和大小限制
+void LibeventContext::ApplyConfig()
+{
+    for (size_t i = 0; i < listeners.size(); i++) {
+        struct evhttp *http = listeners[i].http;
+        if (!http)
+            continue;
+        evhttp_set_allowed_methods(http, config.allowed_methods);
+        evhttp_set_timeout(http, config.client_timeout > 0 ? config.client_timeout : -1);
+        evhttp_set_max_headers_size(http, config.max_headers_size > 0 ? config.max_headers_size : -1);
+        evhttp_set_max_body_size(http, config.max_body_size > 0 ? config.max_body_size : -1);
+    }
+    h2.SetTimeout(config.client_timeout);
+    resolver.SetHedge(config.dns_hedge_min, config.dns_hedge_max, config.dns_race_max);
+    // 调小 dns_cache_max 时立即淘汰到新的上限
+    if (config.dns_cache_max > 0 && (int)dns_cache.size() > config.dns_cache_max) {
+        TrimDns(config.dns_cache_max);
+        stats_gauge_set(STAT_DNS_CACHE_SIZE, dns_cache.size());
+    }
+
+    struct timeval tv = {config.dns_clean_interval, 0};
+    event_add(evtimer, &tv);
+}
+
+// 停止接受新连接, 等正在处理的请求和隧道结束, 超时后直接退出
+void LibeventContext::StartDrain()
+{
+    if (draining)
+        return;
+    draining = true;
+    drain_deadline = time(NULL) + config.drain_timeout;
+
+    // 直接关闭监听socket, 新连接会被拒绝或者分给同端口上新启动的进程
+    for (size_t i = 0; i < listeners.size(); i++) {
+        if (listeners[i].handle) {
+            evhttp_del_accept_socket(listeners[i].http, listeners[i].handle);
+            listeners[i].handle = NULL;
+        }
+        if (listeners[i].raw) {
+            evconnlistener_free(listeners[i].raw);
+            listeners[i].raw = NULL;
+        }
+    }
+    // HTTP/2 连接发 GOAWAY, 客户端之后的请求会换新连接
+    h2.StartDrain();
+    printf("worker:%d start drain, http:%zu tunnel:%zu dns:%zu timeout:%d\n", worker->id,
+        http_req_pool.Live(), live_tunnels.size(), dns_lookup_pool.Live(), config.drain_timeout);
+
+    struct timeval tv = {DRAIN_CHECK_MS / 1000, (DRAIN_CHECK_MS % 1000) * 1000};
+    drain_timer = event_new(base, -1, EV_PERSIST, drain_timer_callback, NULL);
+    event_add(drain_timer, &tv);
+    CheckDrain();
+}
+
+void LibeventContext::CheckDrain()
+{
+    size_t http_num = http_req_pool.Live();
+    size_t tunnel_num = live_tunnels.size();
+    size_t dns_num = dns_lookup_pool.Live();
+    bool timeout = time(NULL) >= drain_deadline;
+    if (!timeout && http_num + tunnel_num + dns_num > 0)
+        return;
+
+    printf("worker:%d drain %s, remaining http:%zu tunnel:%zu dns:%zu\n", worker->id,
+        timeout ? "timeout" : "done", http_num, tunnel_num, dns_num);
+    event_del(drain_timer);
+    event_base_loopbreak(base);
+}
+
+// 每个监听地址一个 evhttp, 共用同一组回调
+int LibeventContext::AddListener(const string &name, evutil_socket_t fd)
+{
+	ProxyListener &l = listeners.back();
+	l.name = name;
+	l.http = evhttp_new(base);
+	if (!l.http) {
+		evutil_closesocket(fd);
+		cout << "couldn't create evhttp. Exiting.\n";
+		return -2;
+	}
+
+	// 监听socket由主线程创建好, 这里只注册到本 worker 的 event_base
+	struct evconnlistener *listener = evconnlistener_new(base, NULL, NULL,
+		LEV_OPT_CLOSE_ON_FREE|LEV_OPT_DISABLED,
+		options.listen_tuning.backlog > 0 ? options.listen_tuning.backlog : LISTEN_BACKLOG, fd);
+	if (!listener) {
+		evutil_closesocket(fd);
+		cout << "couldn't listen on " << name << ". Exiting.\n" ;
+		return -4;
+	}
+
+	l.handle = evhttp_bind_listener(l.http, listener);
+	if (!l.handle) {
+		evconnlistener_free(listener);
+		cout << "couldn't bind to " << name << ". Exiting.\n" ;
+		return -4;
+	}
+	evconnlistener_enable(listener);
+	
+	if (display_listen_sock(l.handle)) {
+		cout << "display_listen_sock error\n" ;
+		return -5;
+	}
+	return 0;
+}
+
+// HTTP/2 的监听不经过 evhttp, accept 之后直接交给 H2Frontend, 回调参数同样是 listener
+int LibeventContext::AddH2Listener(const string &name, evutil_socket_t fd)
+{
+	ProxyListener &l = listeners.back();
+	l.name = name;
+	l.raw = evconnlistener_new(base, h2_accept_cb, &l, LEV_OPT_CLOSE_ON_FREE,
+		options.listen_tuning.backlog > 0 ? options.listen_tuning.backlog : LISTEN_BACKLOG, fd);
+	if (!l.raw) {
+		evutil_closesocket(fd);
+		cout << "couldn't listen on " << name << ". Exiting.\n" ;
+		return -4;
+	}
+	return 0;
+}
+
+int LibeventContext::InitLibevent()
+{
+    int ret = 0;
+
+    struct event_config *cfg = event_config_new();
+	base = event_base_new_with_config(cfg);
+    event_config_free(cfg);
+	if (!base) {
+		cout << "Couldn't create an event_base: exiting\n";
+		return -1;
+	}
+
+    if (resolver.Init(base, options.resolvers) != 0) {
+		cout << "couldn't create dns resolver. Exiting.\n";
+		return -3;
+	}
+
+	// 回调参数指向 listener, 之后不能再改变 vector 的大小
+	listeners.reserve(2 + worker->unix_fds.size());
+	listeners.push_back(ProxyListener());
+	evutil_socket_t listen_fd = worker->listen_fd;
+	worker->listen_fd = -1;
+	ret = AddListener("tcp:" + options.ip + ":" + to_string(options.port), listen_fd);
+	if (ret != 0)
+		return ret;
+
+	// AddListener 失败时会关闭传入的 fd, 先从 worker 里拿走, 剩下没用到的在这里关闭
+	vector<evutil_socket_t> unix_fds;
+	unix_fds.swap(worker->unix_fds);
+	for (size_t i = 0; i < unix_fds.size(); i++) {
+		listeners.push_back(ProxyListener());
+		ret = AddListener("unix:" + options.unix_paths[i], unix_fds[i]);
+		if (ret != 0) {
+			for (size_t j = i + 1; j < unix_fds.size(); j++)
+				evutil_closesocket(unix_fds[j]);
+			return ret;
+		}
+	}
+
+	if (worker->h2_fd >= 0) {
+		evutil_socket_t h2_fd = worker->h2_fd;
+		worker->h2_fd = -1;
+		if (h2.Init(base, h2_stream_cb) != 0) {
+			evutil_closesocket(h2_fd);
+			return -6;
+		}
+		listeners.push_back(ProxyListener());
+		ret = AddH2Listener("h2:" + options.h2_listen, h2_fd);
+		if (ret != 0)
+			return ret;
+	}
+
+    // 初始化 定时器, 间隔由运行时参数决定, 在 ApplyConfig 里添加
+    evtimer = event_new(base, -1, EV_PERSIST, timer_callback, NULL);
+    config = options.runtime;
+    pthread_mutex_lock(&server->reload_lock);
+    acl = server->reloaded_acl;
+    if (acl)
+        acl->Ref();
+    pthread_mutex_unlock(&server->reload_lock);
+    ApplyConfig();
+
+    // 加载dns缓存快照, 每个 worker 定时发布自己的缓存, 0 号 worker 合并保存
+    LoadDnsSnapshot();
+    if (!options.dns_snapshot_file.empty()) {
+        struct timeval snapshot_tv = {DNS_SNAPSHOT_TIME, 0};
+        dns_snapshot_timer = event_new(base, -1, EV_PERSIST, dns_snapshot_callback, NULL);
+        event_add(dns_snapshot_timer, &snapshot_tv);
+    }
+
+    // 每个 worker 写自己的分段文件
+    if (!options.access_log_prefix.empty()) {
+        string prefix = options.access_log_prefix;
+        if (options.workers > 1)
+            prefix += ".w" + to_string(worker->id);
+        if (access_log.Open(prefix) != 0) {
+            cout << "open access log failed:" << prefix << endl;
+        } else {
+            // 切换分段要用的文件在定时器里准备, 不占用处理请求的时间
+            struct timeval log_tv = {ACCESS_LOG_MAINTAIN_MS / 1000, (ACCESS_LOG_MAINTAIN_MS % 1000) * 1000};
+            access_log_timer = event_new(base, -1, EV_PERSIST, access_log_timer_callback, NULL);
+            event_add(access_log_timer, &log_tv);
+        }
+    }
+
+    compressor.Init(options.compress_level, options.compress_min_size);
+
+    if (options.use_uring && uring.Init(base) != 0)
+        cout << "io_uring init failed, tunnels use libevent\n";
+
+    // 预连接池定时器: 统计请求速率, 补充/淘汰热连接
+    struct timeval warm_tv = {WARM_TIMER_MS / 1000, (WARM_TIMER_MS % 1000) * 1000};
+    warm_timer = event_new(base, -1, EV_PERSIST, warm_timer_callback, NULL);
+    event_add(warm_timer, &warm_tv);
+
+    struct timeval stats_tv = {STATS_PUBLISH_MS / 1000, (STATS_PUBLISH_MS % 1000) * 1000};
+    stats_timer = event_new(base, -1, EV_PERSIST, stats_timer_callback, NULL);
+    event_add(stats_timer, &stats_tv);
+
+    exit_event = event_new(base, worker->exit_fd, EV_READ|EV_PERSIST, exit_event_callback, NULL);
+    event_add(exit_event, NULL);
+
+    reload_event = event_new(base, worker->reload_fd, EV_READ|EV_PERSIST, reload_event_callback, NULL);
+    event_add(reload_event, NULL);
+    // 信号只需要一个 event_base 处理, 由 0 号 worker 重新加载后通知其他 worker
+    if (worker->id == 0 && server->handle_signals) {
+        sighup_event = evsignal_new(base, SIGHUP, sighup_callback, NULL);
+        event_add(sighup_event, NULL);
+    }
+
+    return ret;
+}
+
+
+// "0-3,8,10-11"
+static int parse_cpu_list(const char *str, vector<int> *cpus)
+{
+    cpus->clear();
+    string list = str;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == string::npos)
+            end = list.size();
+        string item = list.substr(pos, end - pos);
+        int first = -1, last = -1;
+        if (sscanf(item.c_str(), "%d-%d", &first, &last) != 2)
+            last = first = atoi(item.c_str());
+        if (item.empty() || !isdigit(item[0]) || first < 0 || last < first || last >= CPU_SETSIZE) {
+            cout << "cpu list error:" << str << endl;
+            return -1;
+        }
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus->push_back(cpu);
+        pos = end + 1;
+    }
+    return cpus->empty() ? -1 : 0;
+}
+
+// 配置文件里的 key 和命令行参数一一对应, 共用同一份解析代码
+// 不在这里的 key 是运行时参数(RuntimeConfig), 以及 listen
+static const struct {
+    const char *key;
+    int opt;
+} config_options[] = {
+    {"dns_snapshot", 'd'},
+    {"listen_tuning", 'L'},
+    {"upstream_tuning", 'U'},
+    {"io_engine", 'e'},
+    {"mem_pool", 'm'},
+    {"access_log", 'a'},
+    {"workers", 'w'},
+    {"cpus", 'c'},
+    {"numa", 'n'},
+    {"steer", 's'},
+    {"compress", 'z'},
+    {"unix", 'u'},
+    {"parent", 'P'},
+    {"parent_rule", 'R'},
+    {"h2_listen", 'H'},
+    {"acl", 'A'},
+    {"resolver", 'N'},
+};
+
+static int apply_option(int opt, const char *arg, ProxyOptions *opts)
+{
+    switch (opt) {
+    case 'v': opts->runtime.verbose = 1; break;
+    case 'd': opts->dns_snapshot_file = arg; break;
+    case 'L':
+        if (parse_sock_tuning(arg, &opts->listen_tuning) != 0)
+            return -1;
+        break;
+    case 'U':
+        if (parse_sock_tuning(arg, &opts->upstream_tuning) != 0)
+            return -1;
+        break;
+    case 'e':
+        if (string(arg) == "uring") {
+            opts->use_uring = true;
+        } else if (string(arg) != "libevent") {
+            cout << "unknown io engine:" << arg << endl;
+            return -1;
+        }
+        break;
+    case 'm':
+        opts->use_mem_pool = (string(arg) != "off");
+        break;
+    case 'a': opts->access_log_prefix = arg; break;
+    case 'w':
+        opts->workers = atoi(arg);
+        if (opts->workers < 1) {
+            cout << "worker number error:" << arg << endl;
+            return -1;
+        }
+        break;
+    case 'c':
+        if (parse_cpu_list(arg, &opts->cpus) != 0)
+            return -1;
+        break;
+    // 命令行上不带参数, 配置文件里写 numa = on/off
+    case 'n': opts->numa = (arg == NULL || string(arg) == "on"); break;
+    case 'D':
+        if (opts->runtime.Set("drain_timeout", arg) != 0) {
+            cout << "drain timeout error:" << arg << endl;
+            return -1;
+        }
+        break;
+    case 'z': {
+        int level = -1, min_size = COMPRESS_MIN_SIZE;
+        if (sscanf(arg, "%d:%d", &level, &min_size) < 1 || level < 0 || level > 9 || min_size < 0) {
+            cout << "compress option error:" << arg << endl;
+            return -1;
+        }
+        opts->compress_level = level;
+        opts->compress_min_size = min_size;
+        break;
+    }
+    case 'u':
+        if (strlen(arg) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+            cout << "unix socket path too long:" << arg << endl;
+            return -1;
+        }
+        opts->unix_paths.push_back(arg);
+        break;
+    case 'P': {
+        // 上游连接池只支持 IPv4
+        struct sockaddr_storage ss;
+        int len = sizeof(ss);
+        if (evutil_parse_sockaddr_port(arg, (struct sockaddr *)&ss, &len) != 0 ||
+            ss.ss_family != AF_INET || ((struct sockaddr_in *)&ss)->sin_port == 0) {
+            cout << "parent proxy address error:" << arg << endl;
+            return -1;
+        }
+        char ip[INET_ADDRSTRLEN];
+        evutil_inet_ntop(AF_INET, &((struct sockaddr_in *)&ss)->sin_addr, ip, sizeof(ip));
+        opts->parent_ip = ip;
+        opts->parent_port = ntohs(((struct sockaddr_in *)&ss)->sin_port);
+        break;
+    }
+    case 'R': opts->parent_rules.push_back(arg); break;
+    case 'A': opts->acl_file = arg; break;
+    case 'N':
+        if (!dns_resolver_addr_valid(arg)) {
+            cout << "dns resolver address error:" << arg << endl;
+            return -1;
+        }
+        opts->resolvers.push_back(arg);
+        break;
+    case 'H': {
+        struct sockaddr_storage ss;
+        int len = sizeof(ss);
+        if (!h2_supported()) {
+            cout << "built without HTTP/2 support, rebuild with make HTTP2=1" << endl;
+            return -1;
+        }
+        if (evutil_parse_sockaddr_port(arg, (struct sockaddr *)&ss, &len) != 0) {
+            cout << "h2 listen address error:" << arg << endl;
+            return -1;
+        }
+        opts->h2_listen = arg;
+        break;
+    }
+    case 's':
+        if (string(arg) == "cpu") {
+            opts->steer = STEER_INCOMING_CPU;
+        } else if (string(arg) == "bpf") {
+            opts->steer = STEER_BPF;
+        } else if (string(arg) != "none") {
+            cout << "unknown steer mode:" << arg << endl;
+            return -1;
+        }
+        break;
+    default:
+        cout << "cmd line error!" << endl;
+        return -1;
+    }
+    return 0;
+}
+
+// listen = 0.0.0.0:18023 或 [::]:18023
+static int parse_listen(const string &value, ProxyOptions *opts)
+{
+    size_t pos = value.rfind(':');
+    if (pos == string::npos || pos == 0 || atoi(value.c_str() + pos + 1) <= 0) {
+        cout << "listen address error:" << value << endl;
+        return -1;
+    }
+    string ip = value.substr(0, pos);
+    if (ip.size() > 2 && ip[0] == '[' && ip[ip.size() - 1] == ']')
+        ip = ip.substr(1, ip.size() - 2);
+    opts->ip = ip;
+    opts->port = atoi(value.c_str() + pos + 1);
+    return 0;
+}
+
+static int load_config(const string &path, ProxyOptions *opts)
+{
+    vector<ConfigEntry> entries;
+    if (load_config_file(path, &entries) != 0)
+        return -1;
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        const ConfigEntry &e = entries[i];
+        int ret = 0;
+        if (e.key == "listen") {
+            ret = parse_listen(e.value, opts);
+        } else if ((ret = opts->runtime.Set(e.key, e.value)) == 1) {
+            size_t j;
+            for (j = 0; j < sizeof(config_options) / sizeof(config_options[0]); j++) {
+                if (e.key == config_options[j].key)
+                    break;
+            }
+            if (j == sizeof(config_options) / sizeof(config_options[0])) {
+                cout << "config " << path << ":" << e.line << " unknown key:" << e.key << endl;
+                return -1;
+            }
+            ret = apply_option(config_options[j].opt, e.value.c_str(), opts);
+        }
+        if (ret != 0) {
+            cout << "config " << path << ":" << e.line << " bad value:" << e.key << " = " << e.value << endl;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// ./http_proxy 9.135.8.82 18023 -v -d /tmp/http_proxy.dns
+//      -f /etc/http_proxy.conf   配置文件, 命令行参数优先; 文件里有 listen 时可以省略 ip port
+//                 kill -HUP 重新读取配置文件, 运行时参数(dns ttl, 超时, 大小限制, 连接池等)立即生效
+//      -L nodelay=1,fastopen=256,defer_accept=5,backlog=1024
+//      -U nodelay=1,fastopen=1,notsent_lowat=16384,keepalive=60:10:5
+//      -e uring   CONNECT 隧道使用 io_uring 转发数据
+//      -m off     关闭内存池, libevent 直接使用 malloc; -m on 开启, 嵌入时默认关闭
+//      -a /data/log/http_proxy.access   二进制访问日志的文件名前缀
+//      -w 4 -c 0-3 -n -s bpf   4 个 worker 分别绑定 cpu 0~3, 内存从本地 NUMA 节点分配,
+//                              新连接按收包 cpu 分给对应的 worker (cpu: SO_INCOMING_CPU)
+//      -D 30      /http_proxy_exit 后最多等待 30 秒让已有的请求和隧道结束
+//      -z 6:1024  客户端支持时用 gzip/deflate 压缩大于 1024 字节的文本响应, 级别 6
+//      -u /run/http_proxy.sock  同时监听 unix socket, 可以指定多个
+//      -P 10.0.0.1:3128 -R .example.com -R '!internal.example.com'
+//                 匹配规则的 host 经上级代理转发, 按顺序第一条匹配的规则生效, 没有 -R 时全部转发
+//                 规则: * 全部, .example.com 域名及其子域名, example.com 精确匹配, ! 开头表示直连
+//      -H 0.0.0.0:18024  HTTP/2 监听(prior knowledge), 同时普通监听上接受 Upgrade: h2c, 需要 make HTTP2=1
+//      -A /etc/http_proxy.acl  按目标域名/IP/端口放行, 拒绝或选路, 规则格式见 acl.h, kill -HUP 重新加载
+//      -N 10.0.0.2 -N 10.0.0.3:53  dns 服务器, 可以指定多个, 按 RTT 选最快的, 超时未回应时并发问下一个
+//                 没有 -N 时使用 resolv.conf 里的 nameserver
+static int ParseOpts(int argc, char **argv, ProxyOptions *opts)
+{
+    // ip port 在最前面, 有配置文件时可以省略
+    int first = (argc >= 3 && argv[1][0] != '-') ? 3 : 1;
+    for (int i = first; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0)
+            opts->config_file = argv[i + 1];
+    }
+    if (!opts->config_file.empty() && load_config(opts->config_file, opts) != 0)
+        return -1;
+
+    if (first == 3) {
+        opts->ip = argv[1];
+        opts->port = atoi(argv[2]);
+    }
+    if (opts->ip.empty() || opts->port <= 0) {
+        cout << "cmd line error!" << endl;
+        return -1;
+    }
+
+    int opt;
+    optind = first;
+    while ((opt = getopt(argc, argv, "f:vd:L:U:e:m:a:w:c:ns:D:z:u:P:R:H:A:N:")) != -1) {
+        if (opt == 'f')
+            continue;
+        if (apply_option(opt, opt == 'v' || opt == 'n' ? NULL : optarg, opts) != 0)
+            return -1;
+    }
+    if (opts->runtime.dns_ttl_min > opts->runtime.dns_ttl_max) {
+        cout << "dns_ttl_min is larger than dns_ttl_max" << endl;
+        return -1;
+    }
+    if (opts->runtime.dns_hedge_min > opts->runtime.dns_hedge_max) {
+        cout << "dns_hedge_min is larger than dns_hedge_max" << endl;
+        return -1;
+    }
+    if (opts->resolvers.size() > DNS_MAX_RESOLVERS) {
+        cout << "too many dns resolvers, max " << DNS_MAX_RESOLVERS << endl;
+        return -1;
+    }
+
+    // 按 cpu 分流需要 worker 绑核, 没指定时按顺序绑定
+    if (opts->steer != STEER_NONE && opts->cpus.empty()) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int i = 0; i < opts->workers; i++)
+            opts->cpus.push_back(i % (ncpu > 0 ? ncpu : 1));
+    }
+
+    cout << "ip:" << opts->ip << " port:" << opts->port << " verbose:" << opts->runtime.verbose
+        << " dns_snapshot:" << opts->dns_snapshot_file << " workers:" << opts->workers << endl;
+	return 0;
+}
+
+// 微秒
+static uint64_t elapsed_us(const struct timeval &start)
+{
+	struct timeval now, diff;
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, &start, &diff);
+	return (uint64_t)diff.tv_sec * 1000000 + diff.tv_usec;
+}
+
+// 下面几个函数屏蔽 HTTP/1.1 和 HTTP/2 请求的差别
+static enum evhttp_cmd_type client_command(const ClientReq &client_req)
+{
+	if (client_req.stream)
+		return client_req.stream->method;
+	return evhttp_request_get_command(client_req.req);
+}
+
+static const char *client_host(const ClientReq &client_req)
+{
+	if (client_req.stream)
+		return client_req.stream->host.empty() ? NULL : client_req.stream->host.c_str();
+	return evhttp_request_get_host(client_req.req);
+}
+
+static const char *client_uri(const ClientReq &client_req)
+{
+	if (client_req.stream)
+		return client_req.stream->uri.c_str();
+	return evhttp_request_get_uri(client_req.req);
+}
+
+// 请求里没有端口时返回 -1
+static int client_port(const ClientReq &client_req)
+{
+	if (client_req.stream)
+		return client_req.stream->port;
+	return evhttp_uri_get_port(evhttp_request_get_evhttp_uri(client_req.req));
+}
+
+static struct evkeyvalq *client_headers(const ClientReq &client_req)
+{
+	if (client_req.stream)
+		return &client_req.stream->headers;
+	return evhttp_request_get_input_headers(client_req.req);
+}
+
+static struct evbuffer *client_body(const ClientReq &client_req)
+{
+	if (client_req.stream)
+		return client_req.stream->body;
+	return evhttp_request_get_input_buffer(client_req.req);
+}
+
+static void get_client_ip(const ClientReq &client_req, TrafficKey *key, ev_uint16_t *port)
+{
+	if (client_req.stream) {
+		key->Set(client_req.stream->client_ip);
+		*port = client_req.stream->client_port;
+		return;
+	}
+	char *address = NULL;
+	evhttp_connection_get_peer(evhttp_request_get_connection(client_req.req), &address, port);
+	key->Set(address ? address : "");
+}
+
+// 出错时必须回应客户端, HTTP/2 的 stream 回应后放掉引用
+static void client_send_error(const ClientReq &client_req, int code, const char *reason)
+{
+	if (client_req.stream) {
+		h2_stream_reply(client_req.stream, code, NULL, NULL);
+		h2_stream_release(client_req.stream);
+		return;
+	}
+	evhttp_send_error(client_req.req, code, reason);
+}
+
+// 请求开始时填充访问日志记录中已知的字段
+static void access_log_begin(AccessRecord *rec, uint8_t type, const ClientReq &client_req,
+	const string &client_ip, ev_uint16_t client_port, const string &upstream_ip, int upstream_port,
+	const struct timeval &start, uint32_t dns_us)
+{
+	memset(rec, 0, offsetof(AccessRecord, client_addr));
+	rec->start_us = (uint64_t)start.tv_sec * 1000000 + start.tv_usec;
+	rec->dns_us = dns_us;
+	rec->type = type;
+	rec->method = client_command(client_req);
+	rec->client_port = client_port;
+	rec->upstream_port = upstream_port;
+	access_record_set_addr(rec->client_addr, client_ip.c_str());
+	access_record_set_addr(rec->upstream_addr, upstream_ip.c_str());
+	access_record_set_host(rec, client_host(client_req));
+}
+
+static void uring_handoff(TunnelCtx *tunnel);
+static void readcb(struct bufferevent *bev, void *ctx);
+static void eventcb(struct bufferevent *bev, short what, void *ctx);
+static void h2_tunnel_close(void *arg);
+
+static bool match_parent_rule(const string &rule, const char *host)
+{
+	if (rule == "*")
+		return true;
+	if (rule[0] == '.') {
+		// .example.com 匹配 example.com 和它的子域名
+		size_t host_len = strlen(host);
+		size_t rule_len = rule.size();
+		if (strcasecmp(host, rule.c_str() + 1) == 0)
+			return true;
+		return host_len > rule_len && strcasecmp(host + host_len - rule_len, rule.c_str()) == 0;
+	}
+	return strcasecmp(host, rule.c_str()) == 0;
+}
+
+// 请求里没有端口时按默认端口匹配 acl
+static int acl_port(const ClientReq &client_req)
+{
+	int port = client_port(client_req);
+	if (port == -1)
+		port = (client_command(client_req) == EVHTTP_REQ_CONNECT) ? 443 : 80;
+	return port;
+}
+
+static void acl_deny(const ClientReq &client_req, const char *host)
+{
+	printf("acl deny host:%s port:%d\n", host, acl_port(client_req));
+	stats_inc(STAT_ACL_DENIED);
+	client_send_error(client_req, 403, "Forbidden");
+}
+
+// 填好请求信息交给嵌入方检查, 返回回给客户端的状态码, 0 表示继续转发
+static int inspect_request(const ClientReq &client_req, ProxyListener *listener, const char *host)
+{
+	TrafficKey client_ip;
+	ev_uint16_t peer_port = 0;
+	get_client_ip(client_req, &client_ip, &peer_port);
+
+	ProxyRequestInfo info;
+	info.method = client_command(client_req);
+	info.host = host;
+	info.port = client_port(client_req);
+	info.uri = client_uri(client_req);
+	info.headers = client_headers(client_req);
+	info.client_ip = client_ip.name.c_str();
+	info.client_port = peer_port;
+	info.listener = listener->name.c_str();
+	info.worker = LocalCtx->GetWorker()->id;
+	info.http2 = (client_req.stream != NULL);
+	int code = LocalCtx->InspectRequest(&info);
+	// 不是合法的状态码时按拒绝处理
+	if (code != 0 && (code < 100 || code > 599))
+		code = 403;
+	return code;
+}
+
+// 是否经上级代理转发
+static bool use_parent(const char *host)
+{
+	const ProxyOptions &options = LocalCtx->GetOptions();
+	if (options.parent_ip.empty())
+		return false;
+	if (options.parent_rules.empty())
+		return true;
+	for (size_t i = 0; i < options.parent_rules.size(); i++) {
+		const string &rule = options.parent_rules[i];
+		bool direct = (rule[0] == '!');
+		if (match_parent_rule(direct ? rule.substr(1) : rule, host))
+			return !direct;
+	}
+	return false;
+}
+
+// 解析上级代理对 CONNECT 的响应头
+// 返回 1 表示成功并已从输入缓冲中去掉响应头, 0 表示还没收全, -1 表示失败
+static int parent_connect_response(TunnelCtx *tunnel)
+{
+	struct evbuffer *input = bufferevent_get_input(tunnel->upstream);
+	struct evbuffer_ptr end = evbuffer_search(input, "\r\n\r\n", 4, NULL);
+	if (end.pos < 0)
+		return evbuffer_get_length(input) > PARENT_HEADER_MAX ? -1 : 0;
+
+	char line[64] = {0};
+	evbuffer_copyout(input, line, end.pos < (ev_ssize_t)sizeof(line) - 1 ? end.pos : sizeof(line) - 1);
+	evbuffer_drain(input, end.pos + 4);
+
+	int status = 0;
+	sscanf(line, "HTTP/%*d.%*d %d", &status);
+	const ProxyOptions &options = LocalCtx->GetOptions();
+	UpstreamPool *pool = LocalCtx->GetUpstreamPool(options.parent_ip, options.parent_port);
+	if (status != 200) {
+		printf("parent proxy CONNECT failed: %s\n", line);
+		tunnel->log.status = status;
+		LocalCtx->GetParentStats().errors++;
+		// 上级代理开始拒绝, 之后的 CONNECT 先等响应
+		pool->parent_ok = false;
+		return -1;
+	}
+	pool->parent_ok = true;
+	tunnel->parent_pending = false;
+	return 1;
+}
+
+// 回应客户端 200, 客户端一侧交给隧道, HTTP/2 的 stream 已经被关闭时返回 -1
+static int tunnel_reply(TunnelCtx *tunnel)
+{
+	const ClientReq &client_req = tunnel->client_req;
+	tunnel->reply_pending = false;
+	if (client_req.stream)
+		return h2_stream_tunnel(client_req.stream, tunnel->upstream, h2_tunnel_close, tunnel);
+
+	struct evhttp_connection *client_conn = evhttp_request_get_connection(client_req.req);
+	struct bufferevent *client_bufev = evhttp_connection_get_bufferevent(client_conn);
+	tunnel->client = client_bufev;
+	// CONNECT请求回包
+	evhttp_send_reply(client_req.req, 200, "Connection Established", NULL);
+	LocalCtx->AddConn(client_bufev, client_conn);
+	// 修改client连接的读写回调函数
+	bufferevent_setcb(client_bufev, readcb, NULL, eventcb, tunnel);
+	// 客户端可能没等响应就在 CONNECT 后面发了数据, 已经被 evhttp 读进了输入缓冲
+	if (evbuffer_get_length(bufferevent_get_input(client_bufev)) > 0)
+		readcb(client_bufev, tunnel);
+	return 0;
+}
+
+static void
+readcb(struct bufferevent *bev, void *ctx)
+{
+	TunnelCtx *tunnel = (TunnelCtx *)ctx;
+	struct bufferevent *partner;
+	struct evbuffer *src, *dst;
+	size_t len;
+
+	if (tunnel->parent_pending && bev == tunnel->upstream) {
+		int ret = parent_connect_response(tunnel);
+		if (ret < 0) {
+			tunnel_free(tunnel);
+			return;
+		}
+		if (ret == 0)
+			return;
+		if (tunnel->reply_pending && tunnel_reply(tunnel) != 0) {
+			tunnel_free(tunnel);
+			return;
+		}
+		if (LocalCtx->GetUring() && !tunnel->stream) {
+			uring_handoff(tunnel);
+			return;
+		}
+	}
+
+	// 等响应期间客户端一侧还不属于隧道, 回应客户端之后才有 partner
+	partner = (bev == tunnel->client) ? tunnel->upstream : tunnel->client;
+	src = bufferevent_get_input(bev);
+	len = evbuffer_get_length(src);	
+	//printf("readcb len:%ld\n", len);
+	LocalCtx->GetTraffic().Add(tunnel->host, tunnel->client_ip, TRAFFIC_BYTES, len);
+	tunnel->bytes[bev == tunnel->client ? 0 : 1] += len;
+	if (tunnel->stream) {
+		h2_stream_send(tunnel->stream, src);
+		return;
+	}
+	dst = bufferevent_get_output(partner);
+    evbuffer_add_buffer(dst, src);
+}
+
+// 释放隧道两端的连接
+static void tunnel_free(TunnelCtx *tunnel)
+{
+	// 还没回应客户端, 把上级代理拒绝的状态码转给客户端, 其它错误回 502
+	if (tunnel->reply_pending) {
+		bool reject = (tunnel->log.status >= 400 && tunnel->log.status < 600);
+		if (!reject)
+			tunnel->log.status = 502;
+		client_send_error(tunnel->client_req, tunnel->log.status, reject ? NULL : "Bad Gateway");
+		tunnel->reply_pending = false;
+		tunnel->stream = NULL;
+	}
+	// HTTP/2 隧道上行的数据由 stream 直接写给上游, 不经过 readcb
+	if (tunnel->stream) {
+		tunnel->bytes[0] = tunnel->stream->bytes_up;
+		LocalCtx->GetTraffic().Add(tunnel->host, tunnel->client_ip, TRAFFIC_BYTES, tunnel->bytes[0]);
+	}
+	uint64_t total_us = elapsed_us(tunnel->start);
+	LocalCtx->GetTraffic().Add(tunnel->host, tunnel->client_ip,
+		TRAFFIC_CONN_MS, total_us / 1000);
+	tunnel->listener->bytes_up += tunnel->bytes[0];
+	tunnel->listener->bytes_down += tunnel->bytes[1];
+	stats_inc(STAT_BYTES_UP, tunnel->bytes[0]);
+	stats_inc(STAT_BYTES_DOWN, tunnel->bytes[1]);
+	stats_record(STAT_TUNNEL_US, total_us);
+
+	AccessLog *access_log = LocalCtx->GetAccessLog();
+	if (access_log) {
+		tunnel->log.total_us = total_us > UINT32_MAX ? UINT32_MAX : total_us;
+		tunnel->log.bytes_up = tunnel->bytes[0];
+		tunnel->log.bytes_down = tunnel->bytes[1];
+		access_log->Write(tunnel->log);
+	}
+
+	// 先解除 stream 和上游连接的关联, 再释放上游连接
+	if (tunnel->stream) {
+		h2_stream_end(tunnel->stream);
+		h2_stream_release(tunnel->stream);
+	}
+
+	if (LocalCtx->FreeConn(tunnel->upstream)) {
+		printf(" evhttp_connection_free");
+	} else {
+		bufferevent_free(tunnel->upstream);
+		printf(" bufferevent_free");
+	}
+
+	if (tunnel->stream) {
+		printf(" h2 stream");
+	} else if (!tunnel->client) {
+		printf(" error reply");
+	} else if (LocalCtx->FreeConn(tunnel->client)) {
+		printf(" evhttp_connection_free");
+	} else {
+		bufferevent_free(tunnel->client);
+		printf(" bufferevent_free");
+	}
+	LocalCtx->FreeTunnelCtx(tunnel);
+}
+
+static void
+eventcb(struct bufferevent *bev, short what, void *ctx)
+{
+	TunnelCtx *tunnel = (TunnelCtx *)ctx;
+	printf("eventcb, what:%d tunnel:%p", what, tunnel);
+	if ((what & BEV_EVENT_READING) == BEV_EVENT_READING) {
+		printf(" BEV_EVENT_READING");
+	}
+	if ((what & BEV_EVENT_WRITING) == BEV_EVENT_WRITING) {
+		printf(" BEV_EVENT_WRITING");
+	}
+	if ((what & BEV_EVENT_EOF) == BEV_EVENT_EOF) {
+		printf(" BEV_EVENT_EOF");
+	}
+	if ((what & BEV_EVENT_ERROR) == BEV_EVENT_ERROR) {
+		printf(" BEV_EVENT_ERROR");
+	}
+	if ((what & BEV_EVENT_TIMEOUT) == BEV_EVENT_TIMEOUT) {
+		printf(" BEV_EVENT_TIMEOUT");
+	}
+	if ((what & BEV_EVENT_CONNECTED) == BEV_EVENT_CONNECTED) {
+		printf(" BEV_EVENT_CONNECTED");
+		tunnel->log.upstream_us = elapsed_us(tunnel->start) - tunnel->log.dns_us;
+		stats_record(STAT_TUNNEL_CONNECT_US, tunnel->log.upstream_us);
+	}
+
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		if (what & BEV_EVENT_ERROR) {
+			if (errno) {
+				perror("connection error");
+			}
+		}
+		tunnel_free(tunnel);
+	}
+    printf("\n");
+}
+
+// HTTP/2 的 stream 被客户端关闭, 或者整条连接断开
+static void h2_tunnel_close(void *arg)
+{
+	tunnel_free((TunnelCtx *)arg);
+	printf("\n");
+}
+
+static void uring_tunnel_close(void *arg, const uint64_t *bytes)
+{
+	TunnelCtx *tunnel = (TunnelCtx *)arg;
+	LocalCtx->GetTraffic().Add(tunnel->host, tunnel->client_ip,
+		TRAFFIC_BYTES, bytes[0] + bytes[1]);
+	tunnel->bytes[0] += bytes[0];
+	tunnel->bytes[1] += bytes[1];
+	tunnel_free(tunnel);
+	printf("\n");
+}
+
+// 两端都连接好后, 停掉 bufferevent, 把数据转发交给 io_uring
+static void uring_handoff(TunnelCtx *tunnel)
+{
+	struct bufferevent *client_bufev = tunnel->client;
+	struct bufferevent *b_proxy = tunnel->upstream;
+	bufferevent_disable(client_bufev, EV_READ|EV_WRITE);
+	bufferevent_disable(b_proxy, EV_READ|EV_WRITE);
+
+	// 已经读到但还没转发的数据, 连同还没发出去的数据一起交给 io_uring
+	evbuffer_add_buffer(bufferevent_get_output(client_bufev), bufferevent_get_input(b_proxy));
+	evbuffer_add_buffer(bufferevent_get_output(b_proxy), bufferevent_get_input(client_bufev));
+
+	if (LocalCtx->GetUring()->AddTunnel(bufferevent_getfd(client_bufev), bufferevent_getfd(b_proxy),
+		bufferevent_get_output(client_bufev), bufferevent_get_output(b_proxy),
+		uring_tunnel_close, tunnel) != 0) {
+		printf("uring AddTunnel failed, fallback to libevent\n");
+		bufferevent_setcb(b_proxy, readcb, NULL, eventcb, tunnel);
+		bufferevent_setcb(client_bufev, readcb, NULL, eventcb, tunnel);
+		bufferevent_enable(client_bufev, EV_READ|EV_WRITE);
+		bufferevent_enable(b_proxy, EV_READ|EV_WRITE);
+	}
+}
+
+static void
+uring_connect_eventcb(struct bufferevent *bev, short what, void *ctx)
+{
+	if (what & BEV_EVENT_CONNECTED) {
+		TunnelCtx *tunnel = (TunnelCtx *)ctx;
+		tunnel->log.upstream_us = elapsed_us(tunnel->start) - tunnel->log.dns_us;
+		stats_record(STAT_TUNNEL_CONNECT_US, tunnel->log.upstream_us);
+		uring_handoff(tunnel);
+		return;
+	}
+	eventcb(bev, what, ctx);
+}
+
+static string get_addr(int result, char type, int count, int ttl,
+			  void *addrs, const char *host) {
+    
+    if (count < 1) {
+		printf("%s: No answer (%d)\n", host, result);
+		return "";
+	}
+
+	char buf[32] = {0};
+	if (type == DNS_IPv4_A) {
+		inet_ntop(AF_INET, &((ev_uint32_t*)addrs)[0], buf, sizeof(buf));
+	} else if (type == DNS_PTR) {
+		snprintf(buf, sizeof(buf), "%s", ((char**)addrs)[0]);
+	}
+	printf("DNS %s:%s ttl:%d\n", host, buf, ttl);
+	return string(buf);
+}
+
+static void http_header_copy(struct evkeyvalq *headers, struct evkeyvalq *output_headers,
+	enum HEADER_COPY_TYPE copy_tpe)
+{
+    struct evkeyval *header;
+
+    for (header = headers->tqh_first; header; header = header->next.tqe_next) {
+        string str_key = string(header->key);
+		evhttp_add_header(output_headers, header->key, header->value);
+	}
+
+	if (copy_tpe == CLIENT_TO_PROXY) {
+		evhttp_add_header(output_headers, "Connection", "keep-alive");
+		evhttp_remove_header(output_headers, "Proxy-Connection");
+	}
+
+	if (copy_tpe == PROXY_TO_CLIENT) {
+		evhttp_remove_header(output_headers, "Connection");
+    	evhttp_add_header(output_headers, "Proxy-Connection", "keep-alive");
+	}
+
+	for (header = output_headers->tqh_first; header; header = header->next.tqe_next) {
+        string str_key = string(header->key);
+        printf("%s: %s\n", header->key, header->value);
+	}
+
+    printf("\r\n");
+}
+
+static void
+http_request_done(struct evhttp_request *proxy_req, void *ctx)
+{
+    HttpProxyReq *preq = (HttpProxyReq *)ctx;
+    ClientReq client_req = preq->client_req;
+
+    // 出错的连接不再放回连接池
+    LocalCtx->PutHttpConn(preq->pool, preq->proxy_conn,
+        proxy_req != NULL && evhttp_request_get_response_code(proxy_req) != 0);
+    preq->pool->inflight--;
+
+    TrafficSketch &traffic = LocalCtx->GetTraffic();
+    size_t resp_bytes = proxy_req ? evbuffer_get_length(evhttp_request_get_input_buffer(proxy_req)) : 0;
+    uint64_t total_us = elapsed_us(preq->start);
+    traffic.Add(preq->host, preq->client, TRAFFIC_REQUESTS, 1);
+    traffic.Add(preq->host, preq->client, TRAFFIC_BYTES, preq->req_bytes + resp_bytes);
+    traffic.Add(preq->host, preq->client, TRAFFIC_CONN_MS, total_us / 1000);
+
+    int status = proxy_req ? evhttp_request_get_response_code(proxy_req) : 0;
+    ProxyListener *listener = preq->listener;
+    listener->bytes_up += preq->req_bytes;
+    listener->bytes_down += resp_bytes;
+    listener->total_us += total_us;
+    if (status == 0 || status >= 500) {
+        listener->errors++;
+        stats_inc(STAT_HTTP_ERRORS);
+    }
+    stats_inc(STAT_HTTP_REQUESTS);
+    stats_inc(STAT_BYTES_UP, preq->req_bytes);
+    stats_inc(STAT_BYTES_DOWN, resp_bytes);
+    stats_record(STAT_HTTP_US, total_us);
+
+    AccessLog *access_log = LocalCtx->GetAccessLog();
+    if (access_log) {
+        AccessRecord &rec = preq->log;
+        rec.total_us = total_us > UINT32_MAX ? UINT32_MAX : total_us;
+        rec.upstream_us = rec.total_us - rec.dns_us;
+        rec.bytes_up = preq->req_bytes;
+        rec.bytes_down = resp_bytes;
+        rec.status = status;
+        access_log->Write(rec);
+    }
+    LocalCtx->FreeHttpReq(preq);
+
+    // 连接失败时 proxy_req 不为 NULL, 但是没有响应码
+    if (proxy_req == NULL || status == 0) {
+        printf("http_request_done error\n");
+        // 必须给客户端回应, 直接释放请求会让客户端连接一直挂着
+        client_send_error(client_req, 502, "Bad Gateway");
+        return;
+    }
+
+	printf("Response line: %d %s\n",
+	    evhttp_request_get_response_code(proxy_req),
+	    evhttp_request_get_response_code_line(proxy_req));
+
+	// HTTP/2 的响应头先放在临时列表里, 回应时转换成 HEADERS 帧
+	struct evkeyvalq h2_headers;
+	TAILQ_INIT(&h2_headers);
+	struct evkeyvalq *output_headers = client_req.stream ? &h2_headers :
+		evhttp_request_get_output_headers(client_req.req);
+	http_header_copy(evhttp_request_get_input_headers(proxy_req), output_headers, PROXY_TO_CLIENT);
+	// 退出等待期间让客户端不再复用连接, HTTP/2 连接由 GOAWAY 通知
+	if (LocalCtx->IsDraining() && !client_req.stream) {
+		evhttp_remove_header(output_headers, "Proxy-Connection");
+		evhttp_add_header(output_headers, "Connection", "close");
+	}
+
+	ResponseCompressor &compressor = LocalCtx->GetCompressor();
+	int encoding = compressor.Select(client_command(client_req), client_headers(client_req), proxy_req);
+	if (encoding != COMPRESS_NONE)
+		compressor.Compress(encoding, output_headers, evhttp_request_get_input_buffer(proxy_req));
+
+	if (client_req.stream) {
+		h2_stream_reply(client_req.stream, evhttp_request_get_response_code(proxy_req),
+			output_headers, evhttp_request_get_input_buffer(proxy_req));
+		h2_stream_release(client_req.stream);
+		evhttp_clear_headers(&h2_headers);
+		return;
+	}
+
+	evhttp_send_reply(client_req.req, 
+		evhttp_request_get_response_code(proxy_req), 
+		evhttp_request_get_response_code_line(proxy_req), 
+		evhttp_request_get_input_buffer(proxy_req));
+
+}
+
+// 经上级代理时 ip/port 是上级代理的地址, 不用解析 host
+static void create_https_proxy(const string &ip, const ClientReq &client_req,
+	ProxyListener *listener, const struct timeval &start, uint32_t dns_us, bool via_parent)
+{
+	int port = client_port(client_req);
+	if (port == -1)
+		port = 443;
+	if (via_parent)
+		port = LocalCtx->GetOptions().parent_port;
+
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	evutil_inet_pton(AF_INET, ip.c_str(), &sin.sin_addr);
+
+	// 优先使用预先建立好的连接
+	UpstreamPool *pool = LocalCtx->GetUpstreamPool(ip, port);
+	struct bufferevent *b_proxy = LocalCtx->GetWarmTunnel(pool);
+	bool connected = (b_proxy != NULL);
+	if (!b_proxy) {
+		// 建立 proxy 连接
+		b_proxy = LocalCtx->NewUpstreamBufferevent(sin);
+		if (!b_proxy) {
+			client_send_error(client_req, 502, "Bad Gateway");
+			return;
+		}
+	}
+
+	TunnelCtx *tunnel = LocalCtx->NewTunnelCtx();
+	tunnel->client = NULL;
+	tunnel->upstream = b_proxy;
+	tunnel->stream = client_req.stream;
+	tunnel->listener = listener;
+	listener->tunnels++;
+	stats_inc(STAT_TUNNEL_REQUESTS);
+	tunnel->host.Set(client_host(client_req));
+	ev_uint16_t client_port = 0;
+	get_client_ip(client_req, &tunnel->client_ip, &client_port);
+	tunnel->start = start;
+	tunnel->bytes[0] = tunnel->bytes[1] = 0;
+	tunnel->parent_pending = via_parent;
+	tunnel->reply_pending = false;
+	tunnel->client_req = client_req;
+	if (LocalCtx->GetAccessLog()) {
+		access_log_begin(&tunnel->log, ACCESS_LOG_TUNNEL, client_req, tunnel->client_ip.name,
+			client_port, ip, port, start, dns_us);
+	}
+	tunnel->log.status = 200;
+	LocalCtx->GetTraffic().Add(tunnel->host, tunnel->client_ip, TRAFFIC_REQUESTS, 1);
+
+	if (via_parent) {
+		// 上级代理在这个池上接受过 CONNECT 时不等响应, CONNECT 和客户端随后发来的数据直接排在同一个连接上发出去,
+		// 收到响应头之后才开始向客户端转发, 使用 io_uring 时到那时再交接
+		// 否则等上级代理的响应再回应客户端, 被拒绝(403/407/502)时把状态码转给客户端
+		const char *authority = client_uri(client_req);
+		evbuffer_add_printf(bufferevent_get_output(b_proxy),
+			"CONNECT %s HTTP/1.1\r\nHost: %s\r\n\r\n", authority, authority);
+		LocalCtx->GetParentStats().tunnel++;
+		tunnel->reply_pending = !pool->parent_ok;
+	}
+
+	bufferevent_setcb(b_proxy, readcb, NULL, eventcb, tunnel);
+	if (tunnel->reply_pending) {
+		bufferevent_enable(b_proxy, EV_READ|EV_WRITE);
+		// 预连接上可能已经收到了数据
+		if (evbuffer_get_length(bufferevent_get_input(b_proxy)) > 0)
+			readcb(b_proxy, tunnel);
+		return;
+	}
+
+	// HTTP/2 的隧道数据要封装成 DATA 帧, 不走 io_uring
+	if (client_req.stream) {
+		bufferevent_enable(b_proxy, EV_READ|EV_WRITE);
+		// stream 可能在 dns 解析期间被客户端关闭了
+		if (tunnel_reply(tunnel) != 0) {
+			tunnel_free(tunnel);
+			printf("\n");
+			return;
+		}
+		if (evbuffer_get_length(bufferevent_get_input(b_proxy)) > 0)
+			readcb(b_proxy, tunnel);
+		return;
+	}
+
+	if (LocalCtx->GetUring() && !via_parent) {
+		// 连接建立前客户端发来的数据先放在 b_proxy 的输出缓冲里
+		tunnel_reply(tunnel);
+		if (connected) {
+			uring_handoff(tunnel);
+		} else {
+			bufferevent_setcb(b_proxy, NULL, NULL, uring_connect_eventcb, tunnel);
+			bufferevent_enable(b_proxy, EV_READ|EV_WRITE);
+		}
+		return;
+	}
+
+	bufferevent_enable(b_proxy, EV_READ|EV_WRITE);
+	tunnel_reply(tunnel);
+	// 预连接上可能已经收到了数据
+	if (evbuffer_get_length(bufferevent_get_input(b_proxy)) > 0)
+		readcb(b_proxy, tunnel);
+}
+
+static void
+http_conn_close(struct evhttp_connection *conn, void *ctx)
+{
+	time_t now_time; time(&now_time);
+	time_t conn_time = (time_t)ctx;
+	printf("http conn close:%p now_time:%ld conn_time:%ld %ld\n", conn, now_time, conn_time, (now_time - conn_time));
+}
+
+static void create_http_proxy(const string &ip, const ClientReq &client_req,
+	ProxyListener *listener, const struct timeval &start, uint32_t dns_us, bool via_parent)
+{
+    int port = client_port(client_req);
+    if (port == -1)
+        port = 80;
+    if (via_parent)
+        port = LocalCtx->GetOptions().parent_port;
+
+    // 从连接池取连接, 没有空闲连接时新建
+    UpstreamPool *pool = LocalCtx->GetUpstreamPool(ip, port);
+    struct evhttp_connection *proxy_conn = LocalCtx->GetHttpConn(pool);
+    if (proxy_conn == NULL) {
+        printf("evhttp_connection_base_bufferevent_new failed\n");
+        client_send_error(client_req, 502, "Bad Gateway");
+		return;
+    }
+
+    HttpProxyReq *preq = LocalCtx->NewHttpReq();
+    preq->client_req = client_req;
+    preq->proxy_conn = proxy_conn;
+    preq->pool = pool;
+    pool->inflight++;
+    preq->listener = listener;
+    preq->host.Set(client_host(client_req));
+    ev_uint16_t client_port = 0;
+    get_client_ip(client_req, &preq->client, &client_port);
+    preq->req_bytes = evbuffer_get_length(client_body(client_req));
+    preq->start = start;
+    if (LocalCtx->GetAccessLog())
+        access_log_begin(&preq->log, ACCESS_LOG_HTTP, client_req, preq->client.name,
+            client_port, ip, port, start, dns_us);
+
+    struct evhttp_request *proxy_req = evhttp_request_new(http_request_done, preq);
+    if (proxy_req == NULL) {
+        printf("evhttp_request_new failed\n");
+		LocalCtx->PutHttpConn(pool, proxy_conn, false);
+		pool->inflight--;
+		LocalCtx->FreeHttpReq(preq);
+		client_send_error(client_req, 502, "Bad Gateway");
+		return;
+    }
+
+	time_t now_time; time(&now_time);
+	evhttp_connection_set_closecb(proxy_conn, http_conn_close, (void *)now_time);
+	if (client_req.req)
+		evhttp_connection_set_closecb(evhttp_request_get_connection(client_req.req), http_conn_close, (void *)now_time);
+    
+    // 复制请求头
+    http_header_copy(client_headers(client_req), evhttp_request_get_output_headers(proxy_req), CLIENT_TO_PROXY);
+    // 复制请求体
+    evbuffer_add_buffer(evhttp_request_get_output_buffer(proxy_req), client_body(client_req));
+
+    // 上级代理需要完整的 URI
+    string uri = client_uri(client_req);
+    if (via_parent) {
+        LocalCtx->GetParentStats().http++;
+        if (uri[0] == '/')
+            uri = string("http://") + evhttp_find_header(client_headers(client_req), "Host") + uri;
+    }
+
+    if (evhttp_make_request(proxy_conn, proxy_req, client_command(client_req), uri.c_str()) != 0) {
+        printf("evhttp_make_request failed\n");
+		// 失败时 proxy_req 已经被 libevent 释放
+		LocalCtx->PutHttpConn(pool, proxy_conn, false);
+		pool->inflight--;
+		LocalCtx->FreeHttpReq(preq);
+		client_send_error(client_req, 502, "Bad Gateway");
+		return;
+	}
+
+	LocalCtx->TuneUpstreamSocket(bufferevent_getfd(evhttp_connection_get_bufferevent(proxy_conn)));
+}
+
+static void
+dns_callback(int result, char type, int count, int ttl,
+			  void *addrs, void *orig) {
+
+	DnsLookup *lookup = (DnsLookup *)orig;
+	ClientReq client_req = lookup->client_req;
+	ProxyListener *listener = lookup->listener;
+	struct timeval start = lookup->start;
+	bool acl_check_addr = lookup->acl_check_addr;
+	LocalCtx->FreeDnsLookup(lookup);
+	
+    string ip = get_addr(result, type, count, ttl, addrs, client_host(client_req));
+	if (ip.empty()) {
+		// 解析失败在请求路径上很常见, 只在 verbose 时输出
+		if (LocalCtx->GetConfig().verbose) {
+			const char *host = client_host(client_req);
+			printf("host:%s dns get ip error\n", host ? host : "(null)");
+		}
+		stats_inc(STAT_DNS_ERRORS);
+		client_send_error(client_req, 502, "Bad Gateway");
+		return;
+	}
+
+    LocalCtx->InsertDns(client_host(client_req), ip, ttl);
+    uint32_t dns_us = elapsed_us(start);
+    stats_record(STAT_DNS_US, dns_us);
+    // 重新加载后 acl 可能已经没有了
+    const AclRules *acl = LocalCtx->GetAcl();
+    if (acl_check_addr && acl && acl->MatchAddr(ip.c_str(), acl_port(client_req)) == ACL_DENY) {
+        acl_deny(client_req, client_host(client_req));
+        return;
+    }
+    if (client_command(client_req) == EVHTTP_REQ_CONNECT) {
+        create_https_proxy(ip, client_req, listener, start, dns_us, false);
+    } else {
+        create_http_proxy(ip, client_req, listener, start, dns_us, false);
+    }
+}
+
+// HTTP/1.1 和 HTTP/2 的请求都从这里开始转发
+static void proxy_dispatch(const ClientReq &client_req, ProxyListener *listener)
+{
+	struct timeval start;
+	evutil_gettimeofday(&start, NULL);
+	listener->requests++;
+
+	const char *cmdtype;
+	switch (client_command(client_req)) {
+	case EVHTTP_REQ_GET: cmdtype = "GET"; break;
+	case EVHTTP_REQ_POST: cmdtype = "POST"; break;
+	case EVHTTP_REQ_HEAD: cmdtype = "HEAD"; break;
+	case EVHTTP_REQ_PUT: cmdtype = "PUT"; break;
+	case EVHTTP_REQ_DELETE: cmdtype = "DELETE"; break;
+	case EVHTTP_REQ_OPTIONS: cmdtype = "OPTIONS"; break;
+	case EVHTTP_REQ_TRACE: cmdtype = "TRACE"; break;
+	case EVHTTP_REQ_CONNECT: cmdtype = "CONNECT"; break;
+	case EVHTTP_REQ_PATCH: cmdtype = "PATCH"; break;
+	default: cmdtype = "unknown"; break;
+	}
+
+	const char *host = client_host(client_req);
+	printf("Received a %s request for %s host:%s port:%d%s\n",
+	    cmdtype, client_uri(client_req), host ? host : "(null)", client_port(client_req),
+		client_req.stream ? " h2" : "");
+	
+	if (host == NULL) {
+		printf("error not host\n");
+		client_send_error(client_req, HTTP_BADREQUEST, "Bad Request");
+		return;
+	}
+	bool is_connect = (client_command(client_req) == EVHTTP_REQ_CONNECT);
+
+	if (LocalCtx->HasRequestHook()) {
+		int code = inspect_request(client_req, listener, host);
+		if (code != 0) {
+			printf("host:%s rejected by request hook, code:%d\n", host, code);
+			client_send_error(client_req, code, NULL);
+			return;
+		}
+	}
+
+	// acl 在 dns 解析之前判断, 被拒绝的请求不会触发解析
+	const AclRules *acl = LocalCtx->GetAcl();
+	int action = ACL_NONE;
+	bool acl_check_addr = false;
+	if (acl) {
+		action = acl->Match(host, acl_port(client_req), &acl_check_addr);
+		if (action == ACL_DENY) {
+			acl_deny(client_req, host);
+			return;
+		}
+	}
+
+	// 经上级代理的请求不做 dns 解析, 直接复用到上级代理的连接
+	bool via_parent = (action == ACL_PARENT) || (action != ACL_DIRECT && use_parent(host));
+	if (via_parent) {
+		if (is_connect)
+			create_https_proxy(LocalCtx->GetOptions().parent_ip, client_req, listener, start, 0, true);
+		else
+			create_http_proxy(LocalCtx->GetOptions().parent_ip, client_req, listener, start, 0, true);
+		return;
+	}
+
+	string ip;
+	struct sockaddr sa;
+	int len = sizeof(sa);
+	// host可能就是IP地址，不需要dns解析
+	if (0 == evutil_parse_sockaddr_port(host, &sa, &len)) {
+		ip = host;
+	} else {
+		ip = LocalCtx->GetDns(host);
+	}
+
+    if (!ip.empty()) {
+        printf("get dns cache %s:%s\n", host, ip.c_str());
+        if (acl_check_addr && acl->MatchAddr(ip.c_str(), acl_port(client_req)) == ACL_DENY) {
+            acl_deny(client_req, host);
+            return;
+        }
+        if (is_connect) {
+            create_https_proxy(ip, client_req, listener, start, 0, false);
+        } else {
+            create_http_proxy(ip, client_req, listener, start, 0, false);
+        }
+    } else {
+        // 异步域名解析
+        DnsLookup *lookup = LocalCtx->NewDnsLookup();
+        lookup->client_req = client_req;
+        lookup->listener = listener;
+        lookup->start = start;
+        lookup->acl_check_addr = acl_check_addr;
+        if (LocalCtx->GetResolver().Resolve(host, dns_callback, lookup) != 0) {
+            LocalCtx->FreeDnsLookup(lookup);
+            client_send_error(client_req, 502, "Bad Gateway");
+        }
+    }
+}
+
+static void h2_conn_free(struct bufferevent *bev)
+{
+	if (!LocalCtx->FreeConn(bev))
+		bufferevent_free(bev);
+}
+
+// 回 101 后接管 evhttp 的连接, 升级请求作为 stream 1 继续处理
+static void h2_upgrade(struct evhttp_request *req, ProxyListener *listener)
+{
+	struct evhttp_connection *conn = evhttp_request_get_connection(req);
+	struct bufferevent *bev = evhttp_connection_get_bufferevent(conn);
+	struct evkeyvalq *output_headers = evhttp_request_get_output_headers(req);
+	evhttp_add_header(output_headers, "Connection", "Upgrade");
+	evhttp_add_header(output_headers, "Upgrade", "h2c");
+	evhttp_send_reply(req, 101, "Switching Protocols", NULL);
+
+	LocalCtx->AddConn(bev, conn);
+	if (LocalCtx->GetH2()->Upgrade(bev, req, listener, h2_conn_free) != 0) {
+		printf("h2c upgrade failed, close connection\n");
+		h2_conn_free(bev);
+	}
+}
+
+static void proxy_request_cb(struct evhttp_request *req, void *arg)
+{
+	ProxyListener *listener = (ProxyListener *)arg;
+	if (LocalCtx->GetH2() && !LocalCtx->IsDraining() && H2Frontend::IsUpgrade(req)) {
+		h2_upgrade(req, listener);
+		return;
+	}
+
+	ClientReq client_req = {req, NULL};
+	proxy_dispatch(client_req, listener);
+}
+
+// HTTP/2 的监听不经过 evhttp, 允许的方法在这里检查
+static void h2_stream_cb(H2Stream *stream, void *arg)
+{
+	ClientReq client_req = {NULL, stream};
+	if (!(stream->method & LocalCtx->GetConfig().allowed_methods)) {
+		client_send_error(client_req, HTTP_BADMETHOD, "Method Not Allowed");
+		return;
+	}
+	proxy_dispatch(client_req, (ProxyListener *)arg);
+}
+
+static void h2_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+	struct sockaddr *addr, int socklen, void *arg)
+{
+	LocalCtx->GetH2()->Accept(fd, addr, arg);
+}
+
+static void stats_request_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *buf = evbuffer_new();
+	if (!buf) {
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+		return;
+	}
+
+	LocalCtx->DumpStats(buf);
+	evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/plain");
+	evhttp_send_reply(req, 200, "OK", buf);
+	evbuffer_free(buf);
+}
+
+// 通知所有 worker 退出
+static void exit_request_cb(struct evhttp_request *req, void *arg)
+{
+	evhttp_send_reply(req, 200, "OK", NULL);
+	LocalCtx->GetServer()->Stop();
+	printf("exit_request_cb...\n");
+}
+
+void LibeventContext::RegisterHttpHandler()
+{
+	for (size_t i = 0; i < listeners.size(); i++) {
+		struct evhttp *http = listeners[i].http;
+		// HTTP/2 的监听没有 evhttp
+		if (!http)
+			continue;
+		// 设置HTTP请求默认处理函数
+		evhttp_set_gencb(http, proxy_request_cb, &listeners[i]);
+
+		evhttp_set_cb(http, "/http_proxy_exit", exit_request_cb, NULL);
+		evhttp_set_cb(http, "/http_proxy_stats", stats_request_cb, NULL);
+	}
+
+    cout << "RegisterHttpHandler" << endl;
+}
+
+// 从 sysfs 读取 cpu 所在的 NUMA 节点
+static int cpu_numa_node(int cpu)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR *dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	int node = -1;
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		if (strncmp(ent->d_name, "node", 4) == 0 && isdigit(ent->d_name[4])) {
+			node = atoi(ent->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+// 绑核, 并让之后的内存分配优先使用本地节点; 必须在分配 worker 的内存之前调用
+static void bind_worker(ProxyWorker *worker, const ProxyOptions &options)
+{
+	if (worker->cpu < 0)
+		return;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(worker->cpu, &set);
+	int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (ret != 0) {
+		printf("worker:%d bind cpu:%d error:%s\n", worker->id, worker->cpu, strerror(ret));
+		return;
+	}
+
+	if (options.numa && worker->numa_node >= 0) {
+		unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+		memset(mask, 0, sizeof(mask));
+		mask[worker->numa_node / (8 * sizeof(unsigned long))] |=
+			1UL << (worker->numa_node % (8 * sizeof(unsigned long)));
+		if (syscall(__NR_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8) != 0)
+			perror("set_mempolicy");
+	}
+	printf("worker:%d cpu:%d numa_node:%d\n", worker->id, worker->cpu, worker->numa_node);
+}
+
+void *ProxyServer::RunWorker(void *arg)
+{
+	ProxyWorker *worker = (ProxyWorker *)arg;
+	ProxyServer *server = worker->server;
+	cout << "http_proxy thread start! worker:" << worker->id << endl;
+
+	bind_worker(worker, *server->options);
+	stats_thread_init(server->stats_group);
+	LocalCtx = new LibeventContext(worker);
+	__atomic_store_n(&worker->ctx, LocalCtx, __ATOMIC_RELEASE);
+
+	int ret = LocalCtx->InitLibevent();
+    if (ret != 0) {
+        cout << "InitLibevent error:" << ret << endl;
+		// 释放已经创建的监听和 event_base, Start 看到失败后会让其他 worker 退出
+		LocalCtx->UninitLibevent();
+		worker->init_ret = ret;
+		sem_post(&worker->init_done);
+		return NULL;
+    }
+
+    LocalCtx->RegisterHttpHandler();
+	worker->init_ret = 0;
+	sem_post(&worker->init_done);
+
+    event_base_dispatch(LocalCtx->GetEventBase());
+
+	LocalCtx->UninitLibevent();
+	cout << "http_proxy thread exit! worker:" << worker->id << endl;
+	pthread_exit(NULL);
+}
+
+// 在主线程里按 worker 的顺序创建监听socket, 多个 worker 时通过 SO_REUSEPORT 共享端口
+// reuseport 组里socket的下标就是 listen 的顺序, BPF 分流依赖这一点
+static evutil_socket_t create_listen_socket(const ProxyWorker &worker, const ProxyOptions &options)
+{
+	struct sockaddr_storage listen_addr;
+	int listen_addr_len = sizeof(listen_addr);
+	const string &ip = options.ip;
+	string listen_str = (ip.find(':') != string::npos ? "[" + ip + "]" : ip) + ":" + to_string(options.port);
+	memset(&listen_addr, 0, sizeof(listen_addr));
+	if (evutil_parse_sockaddr_port(listen_str.c_str(),
+		(struct sockaddr *)&listen_addr, &listen_addr_len) != 0) {
+		cout << "listen address error:" << listen_str << ". Exiting.\n" ;
+		return -1;
+	}
+
+	evutil_socket_t listen_fd = socket(listen_addr.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (listen_fd < 0 || evutil_make_listen_socket_reuseable(listen_fd) != 0 ||
+		(options.workers > 1 && evutil_make_listen_socket_reuseable_port(listen_fd) != 0)) {
+		perror("listen socket");
+		if (listen_fd >= 0)
+			evutil_closesocket(listen_fd);
+		return -1;
+	}
+	if (options.steer == STEER_INCOMING_CPU && worker.cpu >= 0)
+		set_sockopt_int(listen_fd, SOL_SOCKET, SO_INCOMING_CPU, worker.cpu, "SO_INCOMING_CPU");
+	// 缓冲区大小要在 listen 之前设置才会影响窗口扩大因子
+	apply_sock_tuning(listen_fd, options.listen_tuning, true);
+	if (bind(listen_fd, (struct sockaddr *)&listen_addr, listen_addr_len) != 0 ||
+		listen(listen_fd, options.listen_tuning.backlog > 0 ? options.listen_tuning.backlog : LISTEN_BACKLOG) != 0) {
+		perror("bind");
+		evutil_closesocket(listen_fd);
+		cout << "couldn't bind to port:" << options.port << ". Exiting.\n" ;
+		return -1;
+	}
+	return listen_fd;
+}
+
+// unix socket 不支持 SO_REUSEPORT 分流, 只创建一个, 所有 worker 一起 accept
+static evutil_socket_t create_unix_listen_socket(const string &path, const ProxyOptions &options)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	// 上次异常退出留下的socket文件
+	struct stat st;
+	if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path.c_str());
+
+	evutil_socket_t fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("unix socket");
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+		listen(fd, options.listen_tuning.backlog > 0 ? options.listen_tuning.backlog : LISTEN_BACKLOG) != 0) {
+		perror("bind unix socket");
+		evutil_closesocket(fd);
+		cout << "couldn't bind to unix:" << path << ". Exiting.\n" ;
+		return -1;
+	}
+	return fd;
+}
+
+// HTTP/2 的连接是长连接, 和 unix socket 一样只创建一个, 所有 worker 一起 accept
+static evutil_socket_t create_h2_listen_socket(const string &addr_str, const ProxyOptions &options)
+{
+	struct sockaddr_storage addr;
+	int addr_len = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	if (evutil_parse_sockaddr_port(addr_str.c_str(), (struct sockaddr *)&addr, &addr_len) != 0) {
+		cout << "invalid h2 listen address:" << addr_str << endl;
+		return -1;
+	}
+
+	evutil_socket_t fd = socket(addr.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (fd < 0 || evutil_make_listen_socket_reuseable(fd) != 0) {
+		perror("h2 socket");
+		if (fd >= 0)
+			evutil_closesocket(fd);
+		return -1;
+	}
+	apply_sock_tuning(fd, options.listen_tuning, true);
+	if (bind(fd, (struct sockaddr *)&addr, addr_len) != 0 ||
+		listen(fd, options.listen_tuning.backlog > 0 ? options.listen_tuning.backlog : LISTEN_BACKLOG) != 0) {
+		perror("bind h2 socket");
+		evutil_closesocket(fd);
+		cout << "couldn't bind to h2:" << addr_str << ". Exiting.\n" ;
+		return -1;
+	}
+	return fd;
+}
+
+// 按收包的 cpu 选择 worker: 和某个 worker 绑定的 cpu 相同时选它, 否则取 cpu % worker数
+static int attach_reuseport_bpf(evutil_socket_t fd, const vector<ProxyWorker *> &workers)
+{
+	vector<struct sock_filter> code;
+	struct sock_filter ld_cpu = BPF_STMT(BPF_LD|BPF_W|BPF_ABS, (__u32)(SKF_AD_OFF + SKF_AD_CPU));
+	code.push_back(ld_cpu);
+	for (size_t i = 0; i < workers.size(); i++) {
+		if (workers[i]->cpu < 0)
+			continue;
+		struct sock_filter jeq = BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, (__u32)workers[i]->cpu, 0, 1);
+		struct sock_filter ret = BPF_STMT(BPF_RET|BPF_K, (__u32)i);
+		code.push_back(jeq);
+		code.push_back(ret);
+	}
+	struct sock_filter mod = BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, (__u32)workers.size());
+	struct sock_filter ret_a = BPF_STMT(BPF_RET|BPF_A, 0);
+	code.push_back(mod);
+	code.push_back(ret_a);
+
+	struct sock_fprog prog;
+	prog.len = code.size();
+	prog.filter = &code[0];
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0) {
+		perror("SO_ATTACH_REUSEPORT_CBPF");
+		return -1;
+	}
+	return 0;
+}
+
+ProxyServer::ProxyServer()
+{
+	options = new ProxyOptions;
+	stats_group = __atomic_fetch_add(&NextStatsGroup, 1, __ATOMIC_RELAXED);
+	handle_signals = false;
+	started = false;
+	request_hook = NULL;
+	request_hook_arg = NULL;
+	stats_hook = NULL;
+	stats_hook_arg = NULL;
+	pthread_mutex_init(&reload_lock, NULL);
+	reloaded_acl = NULL;
+}
+
+void ProxyServer::EnableMemPool()
+{
+	options->use_mem_pool = true;
+}
+
+ProxyServer::~ProxyServer()
+{
+	if (started) {
+		Stop();
+		Wait();
+	}
+	// 线程都退出了, 其他 worker 不会再读 ctx
+	for (size_t i = 0; i < workers.size(); i++) {
+		ProxyWorker *worker = workers[i];
+		// 没有交给 worker 的监听socket
+		if (worker->listen_fd >= 0)
+			evutil_closesocket(worker->listen_fd);
+		for (size_t j = 0; j < worker->unix_fds.size(); j++)
+			evutil_closesocket(worker->unix_fds[j]);
+		if (worker->h2_fd >= 0)
+			evutil_closesocket(worker->h2_fd);
+		if (worker->exit_fd >= 0)
+			close(worker->exit_fd);
+		if (worker->reload_fd >= 0)
+			close(worker->reload_fd);
+		sem_destroy(&worker->init_done);
+		delete worker->ctx;
+		delete worker;
+	}
+	workers.clear();
+	if (reloaded_acl)
+		reloaded_acl->Unref();
+	pthread_mutex_destroy(&reload_lock);
+	delete options;
+}
+
+int ProxyServer::Init(int argc, char **argv)
+{
+	// 保存一份参数, 重新加载时用, getopt 会调整 argv 的顺序
+	args.assign(argv, argv + argc);
+	this->argv.clear();
+	for (size_t i = 0; i < args.size(); i++)
+		this->argv.push_back(&args[i][0]);
+	this->argv.push_back(NULL);
+
+	pthread_mutex_lock(&ParseLock);
+	int ret = ParseOpts(argc, &this->argv[0], options);
+	// 必须在第一次调用 libevent 接口之前设置, 之后的实例不能再改变
+	static bool mem_pool_decided = false;
+	if (ret == 0 && !mem_pool_decided) {
+		if (options->use_mem_pool)
+			mem_pool_hook_libevent();
+		mem_pool_decided = true;
+	}
+	pthread_mutex_unlock(&ParseLock);
+	if (ret != 0) {
+		cout << "ParseOpts error:" << ret << endl;
+		return ret;
+	}
+
+	if (options->runtime.verbose)
+		event_enable_debug_logging(EVENT_DBG_ALL);
+
+	if (!options->acl_file.empty() && (reloaded_acl = load_acl(options->acl_file, *options)) == NULL)
+		return -1;
+	return 0;
+}
+
+int ProxyServer::Start()
+{
+	int ret = 0;
+	// 0 号 worker 注册信号事件之前收到 SIGHUP 不退出
+	if (handle_signals)
+		signal(SIGHUP, SIG_IGN);
+
+	vector<evutil_socket_t> unix_fds;
+	for (size_t i = 0; i < options->unix_paths.size(); i++) {
+		evutil_socket_t fd = create_unix_listen_socket(options->unix_paths[i], *options);
+		if (fd < 0)
+			return -1;
+		unix_fds.push_back(fd);
+	}
+	evutil_socket_t h2_fd = -1;
+	if (!options->h2_listen.empty()) {
+		h2_fd = create_h2_listen_socket(options->h2_listen, *options);
+		if (h2_fd < 0)
+			return -1;
+	}
+
+	for (int i = 0; i < options->workers; i++) {
+		ProxyWorker *worker = new ProxyWorker;
+		sem_init(&worker->init_done, 0, 0);
+		worker->init_ret = 0;
+		workers.push_back(worker);
+		worker->server = this;
+		worker->id = i;
+		worker->cpu = options->cpus.empty() ? -1 : options->cpus[i % options->cpus.size()];
+		worker->numa_node = worker->cpu >= 0 ? cpu_numa_node(worker->cpu) : -1;
+		worker->ctx = NULL;
+		worker->tid = 0;
+		worker->exit_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+		worker->reload_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+		worker->listen_fd = create_listen_socket(*worker, *options);
+		worker->h2_fd = -1;
+		if (worker->exit_fd < 0 || worker->reload_fd < 0 || worker->listen_fd < 0)
+			return -1;
+		for (size_t j = 0; j < unix_fds.size(); j++) {
+			evutil_socket_t fd = fcntl(unix_fds[j], F_DUPFD_CLOEXEC, 0);
+			if (fd < 0) {
+				perror("dup unix socket");
+				return -1;
+			}
+			worker->unix_fds.push_back(fd);
+		}
+		if (h2_fd >= 0) {
+			worker->h2_fd = fcntl(h2_fd, F_DUPFD_CLOEXEC, 0);
+			if (worker->h2_fd < 0) {
+				perror("dup h2 socket");
+				return -1;
+			}
+		}
+	}
+	// 每个 worker 都有了自己的 fd, 全部关闭后监听socket才会关闭
+	for (size_t i = 0; i < unix_fds.size(); i++)
+		evutil_closesocket(unix_fds[i]);
+	if (h2_fd >= 0)
+		evutil_closesocket(h2_fd);
+	if (options->steer == STEER_BPF && options->workers > 1 && attach_reuseport_bpf(workers[0]->listen_fd, workers) != 0)
+		cout << "reuseport bpf not attached, use default hash" << endl;
+
+	for (size_t i = 0; i < workers.size(); i++) {
+		ret = pthread_create(&workers[i]->tid, NULL, RunWorker, workers[i]);
+		if (ret != 0) {
+			cout << "pthread_create error:" << ret << endl;
+			// 已经启动的 worker 退出后再返回
+			NotifyWorkers(true);
+			for (size_t j = 0; j < i; j++)
+				pthread_join(workers[j]->tid, NULL);
+			return ret;
+		}
+	}
+	// 所有 worker 初始化完才返回, 有一个失败就让全部 worker 退出, Start 返回失败
+	for (size_t i = 0; i < workers.size(); i++) {
+		while (sem_wait(&workers[i]->init_done) != 0 && errno == EINTR)
+			;
+		if (workers[i]->init_ret != 0)
+			ret = workers[i]->init_ret;
+	}
+	if (ret != 0) {
+		NotifyWorkers(true);
+		for (size_t i = 0; i < workers.size(); i++)
+			pthread_join(workers[i]->tid, NULL);
+		return ret;
+	}
+	started = true;
+	return 0;
+}
+
+// 规则在这里编译好, worker 只是换一个指针
+int ProxyServer::Reload()
+{
+	ProxyOptions opts;
+	printf("reload config:%s\n", options->config_file.c_str());
+	pthread_mutex_lock(&ParseLock);
+	int ret = ParseOpts(args.size(), &argv[0], &opts);
+	pthread_mutex_unlock(&ParseLock);
+	if (ret != 0) {
+		printf("reload config failed, keep current config\n");
+		return -1;
+	}
+	AclRules *acl = NULL;
+	if (!opts.acl_file.empty() && (acl = load_acl(opts.acl_file, *options)) == NULL) {
+		printf("reload acl failed, keep current config\n");
+		return -1;
+	}
+	event_enable_debug_logging(opts.runtime.verbose ? EVENT_DBG_ALL : EVENT_DBG_NONE);
+
+	pthread_mutex_lock(&reload_lock);
+	reloaded_config = opts.runtime;
+	AclRules *old_acl = reloaded_acl;
+	reloaded_acl = acl;
+	pthread_mutex_unlock(&reload_lock);
+	if (old_acl)
+		old_acl->Unref();
+	NotifyWorkers(false);
+	return 0;
+}
+
+void ProxyServer::NotifyWorkers(bool exit)
+{
+	for (size_t i = 0; i < workers.size(); i++) {
+		uint64_t value = 1;
+		if (write(exit ? workers[i]->exit_fd : workers[i]->reload_fd, &value, sizeof(value)) < 0)
+			perror(exit ? "write exit eventfd" : "write reload eventfd");
+	}
+}
+
+void ProxyServer::Stop()
+{
+	NotifyWorkers(true);
+}
+
+void ProxyServer::Wait()
+{
+	if (!started)
+		return;
+	for (size_t i = 0; i < workers.size(); i++)
+		pthread_join(workers[i]->tid, NULL);
+	// 每个 worker 退出前都发布了自己的 dns 缓存, 合并保存一次, 重启后可以直接使用
+	if (!workers.empty() && workers[0]->ctx)
+		workers[0]->ctx->SaveDnsSnapshot();
+	for (size_t i = 0; i < options->unix_paths.size(); i++)
+		unlink(options->unix_paths[i].c_str());
+	started = false;
+}
+
+void ProxyServer::TakeStats(StatsSnapshot *snapshot) const
+{
+	snapshot->Take(stats_group);
+}
@@ -0,0 +1,123 @@
+#ifndef HTTP_PROXY_PROXY_SERVER_H
+#define HTTP_PROXY_PROXY_SERVER_H
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <stdint.h>
+#include <pthread.h>
+
+#include <event2/http.h>
+#include <event2/buffer.h>
+#include <event2/keyvalq_struct.h>
+}
+
+#include "config.h"
+#include "stats.h"
+
+// 代理的核心, 编译成 libhttpproxy.a, http_proxy 只是在上面加了一个 main
+// 一个 ProxyServer 是一个独立的代理实例: 自己的参数, worker 线程, 监听socket, dns 缓存和连接池
+// 同一个进程里可以运行多个实例, 监听不同的端口, 统计互相独立
+//
+//   ProxyServer server;
+//   const char *args[] = {"proxy", "127.0.0.1", "18023", "-w", "2"};
+//   server.Init(5, (char **)args);
+//   server.SetRequestHook(check_request, NULL);
+//   server.Start();
+//   ...
+//   server.Stop();
+//   server.Wait();
+//
+// 进程级别的设置: 内存池(-m, 见 EnableMemPool)只有第一个实例生效, 必须在第一次调用 libevent 之前开启;
+// libevent 的调试日志(-v)是整个进程共用的, 以最后一次 Init 或 Reload 的设置为准
+
+struct ProxyOptions;
+struct ProxyWorker;
+class AclRules;
+
+// 交给请求检查回调的请求信息, 只在回调期间有效
+struct ProxyRequestInfo {
+    enum evhttp_cmd_type method;
+    const char *host;
+    int port;                   // 请求里没有端口时为 -1
+    const char *uri;
+    struct evkeyvalq *headers;  // 可以增删, 修改后的头部转发给上游; HTTP/2 请求的名字是小写的
+    const char *client_ip;
+    uint16_t client_port;
+    const char *listener;       // 监听的名字, tcp:ip:port, unix:path 或 h2:ip:port
+    int worker;
+    bool http2;
+};
+
+// 在 acl 检查之前调用, 返回 0 继续转发, 否则是直接回给客户端的状态码
+// 在 worker 线程里调用, 多个 worker 会同时调用, 不能阻塞
+typedef int (*proxy_request_hook)(const ProxyRequestInfo *info, void *arg);
+// 统计接口(/http_proxy_stats)输出内置的统计之后调用, 可以追加自己的统计项
+typedef void (*proxy_stats_hook)(struct evbuffer *buf, void *arg);
+
+class ProxyServer
+{
+    friend class LibeventContext;
+
+    private:
+        ProxyOptions *options;      // Init 之后只读
+        std::vector<ProxyWorker *> workers;
+        std::vector<std::string> args;  // 重新加载时重新解析同样的参数
+        std::vector<char *> argv;
+        int stats_group;            // 本实例的 worker 统计分片所在的组
+        bool handle_signals;
+        bool started;
+
+        proxy_request_hook request_hook;
+        void *request_hook_arg;
+        proxy_stats_hook stats_hook;
+        void *stats_hook_arg;
+
+        // 重新加载出来的运行时参数和 acl, worker 收到通知后复制一份
+        pthread_mutex_t reload_lock;
+        RuntimeConfig reloaded_config;
+        AclRules *reloaded_acl;     // 持有一份引用, worker 各自再持有一份
+
+        static void *RunWorker(void *arg);
+        int CreateWorkers();
+        void NotifyWorkers(bool exit);
+
+    public:
+        ProxyServer();
+        ~ProxyServer();
+
+        // 参数和 http_proxy 的命令行一样, argv[0] 是程序名, 可以用 -f 指定配置文件
+        int Init(int argc, char **argv);
+        // 下面几个在 Start 之前设置, 之后不能再修改
+        void SetRequestHook(proxy_request_hook cb, void *arg) {
+            request_hook = cb;
+            request_hook_arg = arg;
+        }
+        void SetStatsHook(proxy_stats_hook cb, void *arg) {
+            stats_hook = cb;
+            stats_hook_arg = arg;
+        }
+        // 默认用内存池接管 libevent 的内存分配(-m off 仍然可以关闭), 在 Init 之前调用
+        // 只有进程里第一个 Init 的实例能开启, 而且在这之前进程里不能调用过任何 libevent 接口,
+        // 开启后嵌入方从 libevent 拿到的要自己释放的内存也必须用 mem_pool_free 释放
+        void EnableMemPool();
+        // 由 0 号 worker 处理 SIGHUP, 一个进程里只能有一个实例开启
+        void HandleSignals() {
+            handle_signals = true;
+        }
+
+        // 创建监听socket和 worker 线程, 返回后开始接受连接
+        int Start();
+        // 重新解析参数和配置文件, 运行时参数和 acl 立即生效, 任何线程都可以调用
+        int Reload();
+        // 通知所有 worker 停止接受新连接, 已有的请求结束后退出, 任何线程都可以调用
+        void Stop();
+        // 等待所有 worker 退出
+        void Wait();
+
+        // 本实例所有 worker 合并的统计, 任何线程都可以调用
+        void TakeStats(StatsSnapshot *snapshot) const;
+};
+
+#endif
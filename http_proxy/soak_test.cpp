@@ -0,0 +1,902 @@
+// 长时间稳定性压测工具: 大量隧道和 keep-alive http 连接不断建立/断开, 检查代理有没有泄漏
+// 内置一个 http 服务作为目标, 客户端按比例混合 CONNECT 隧道和普通 http 请求,
+// 连接结束方式随机: 正常关闭, 请求途中 RST, 发完请求后半关闭; 目标服务也会随机 RST
+// 每隔一段时间停止所有连接做一次检查点, 等代理处理完后采样 fd 数, RSS, 存活的隧道和请求,
+// 和第一个检查点比较, 超出允许范围时失败退出
+//
+// 存活计数来自处理统计请求的那个 worker, 代理要用 -w 1 启动; fd 和 RSS 是整个进程的
+//
+// ulimit -n 300000; ./http_proxy 127.0.0.1 18023 -w 1 &
+// ./soak_test -x 127.0.0.1:18023 -p `pidof http_proxy` -c 100000 -d 3600 -k 300
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+
+extern "C" {
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+}
+
+using namespace std;
+
+#define SOAK_MAX_EVENTS (4096)
+#define SOAK_PORTS_PER_ADDR (20000)     // 每个源地址/目标端口最多使用的连接数, 避免用完临时端口
+#define SOAK_HEADER_MAX (4096)
+
+enum SOAK_TYPE {
+    SOAK_HTTP = 0,          // 通过代理发 http 请求, keep-alive 复用
+    SOAK_TUNNEL             // CONNECT 之后在隧道里发 http 请求
+};
+
+enum SOAK_STATE {
+    SOAK_CONNECTING = 1,    // 等待连接代理
+    SOAK_TUNNEL_WAIT,       // 等待代理返回 200
+    SOAK_RESPONSE,          // 等待响应
+    SOAK_HALF_CLOSED        // 已经 shutdown 写方向, 等响应和对端关闭
+};
+
+// 连接的结束方式
+enum SOAK_END {
+    SOAK_END_CLOSE = 0,     // 请求都完成后正常关闭
+    SOAK_END_RESET,         // 某个请求发出后直接 RST
+    SOAK_END_HALF_CLOSE,    // 最后一个请求发出后 shutdown(SHUT_WR)
+    SOAK_END_NUM
+};
+
+struct SoakConn {
+    int fd;                 // -1 表示空闲
+    uint8_t type;
+    uint8_t state;
+    uint8_t end;
+    uint16_t requests;      // 还要发的请求数
+    int origin_port;
+    int64_t body_left;      // -1 表示还在读响应头
+    uint64_t state_us;      // 进入当前状态的时间
+    string header;
+};
+
+struct OriginConn {
+    int fd;
+    string in;
+    string out;
+};
+
+// 目标服务, 在自己的线程里运行
+static vector<int> origin_ports;
+static vector<int> origin_listen_fds;
+static int origin_body_size = 1024;
+static int origin_reset_pct = 0;
+static volatile uint64_t origin_requests = 0;
+static volatile uint64_t origin_resets = 0;
+
+struct SoakStats {
+    uint64_t opened;
+    uint64_t closed;
+    uint64_t responses;
+    uint64_t resets;            // 客户端主动 RST
+    uint64_t half_closes;
+    uint64_t connect_errors;
+    uint64_t proxy_errors;      // 非 200 响应, 意外断开
+    uint64_t timeouts;
+};
+
+// 一次检查点的采样
+struct SoakSample {
+    long fds;
+    long rss_kb;
+    long live_http;
+    long live_tunnel;
+    long live_dns;
+    long tunnel_conns;          // 代理里还挂着的 client bufferevent
+    long pool_conns;            // 连接池里的空闲/预建连接, 占用 fd 但不算泄漏
+    double rate;                // 上一段时间每秒完成的请求数
+};
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// SO_LINGER 超时为 0 时 close 会发送 RST
+static void reset_close(int fd)
+{
+    struct linger lg = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(fd);
+}
+
+static long proc_fd_count(int pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return -1;
+    long n = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] != '.')
+            n++;
+    }
+    closedir(dir);
+    return n;
+}
+
+static long proc_status_kb(int pid, const char *key)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    char line[256];
+    long value = -1;
+    size_t key_len = strlen(key);
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ':') {
+            value = atol(line + key_len + 1);
+            break;
+        }
+    }
+    fclose(fp);
+    return value;
+}
+
+// 代理进程的 fd 上限
+static long proc_fd_limit(int pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/limits", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    char line[256];
+    long value = -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "Max open files", 14) == 0) {
+            value = atol(line + 14);
+            break;
+        }
+    }
+    fclose(fp);
+    return value;
+}
+
+// 同步请求 /http_proxy_stats, 解析成 key -> value
+static int fetch_proxy_stats(const struct sockaddr_in &proxy_addr, map<string, string> *stats)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    struct timeval tv = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    const char *req = "GET /http_proxy_stats HTTP/1.0\r\nHost: soak\r\n\r\n";
+    if (connect(fd, (struct sockaddr *)&proxy_addr, sizeof(proxy_addr)) != 0 ||
+        write(fd, req, strlen(req)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    string resp;
+    char buf[65536];
+    ssize_t r;
+    while ((r = read(fd, buf, sizeof(buf))) > 0)
+        resp.append(buf, r);
+    close(fd);
+
+    size_t pos = resp.find("\r\n\r\n");
+    if (resp.compare(0, 12, "HTTP/1.0 200") != 0 && resp.compare(0, 12, "HTTP/1.1 200") != 0)
+        return -1;
+    if (pos == string::npos)
+        return -1;
+    pos += 4;
+    while (pos < resp.size()) {
+        size_t eol = resp.find('\n', pos);
+        if (eol == string::npos)
+            eol = resp.size();
+        size_t sp = resp.find(' ', pos);
+        if (sp != string::npos && sp < eol)
+            (*stats)[resp.substr(pos, sp - pos)] = resp.substr(sp + 1, eol - sp - 1);
+        pos = eol + 1;
+    }
+    return 0;
+}
+
+static long stat_long(const map<string, string> &stats, const char *key)
+{
+    auto iter = stats.find(key);
+    return iter == stats.end() ? 0 : atol(iter->second.c_str());
+}
+
+static void origin_close(int ep, OriginConn *conn, bool reset)
+{
+    epoll_ctl(ep, EPOLL_CTL_DEL, conn->fd, NULL);
+    if (reset)
+        reset_close(conn->fd);
+    else
+        close(conn->fd);
+    delete conn;
+}
+
+// 简单的 keep-alive http 服务, 每个请求返回固定大小的 body
+static void *origin_thread(void *arg)
+{
+    int ep = epoll_create1(0);
+    struct epoll_event ev, events[SOAK_MAX_EVENTS];
+    for (size_t i = 0; i < origin_listen_fds.size(); i++) {
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;    // 监听socket用下标, 小于 0x1000 的值不会是指针
+        epoll_ctl(ep, EPOLL_CTL_ADD, origin_listen_fds[i], &ev);
+    }
+
+    char head[128];
+    int head_len = snprintf(head, sizeof(head),
+        "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %d\r\n\r\n",
+        origin_body_size);
+    string response = string(head, head_len) + string(origin_body_size, 'x');
+    unsigned int seed = (unsigned int)now_us();
+
+    char buf[65536];
+    for (;;) {
+        int n = epoll_wait(ep, events, SOAK_MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.u64 < 0x1000) {
+                int listen_fd = origin_listen_fds[events[i].data.u64];
+                int fd;
+                while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+                    int one = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    OriginConn *c = new OriginConn;
+                    c->fd = fd;
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = c;
+                    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+                }
+                continue;
+            }
+
+            OriginConn *conn = (OriginConn *)events[i].data.ptr;
+            bool closed = false;
+            if (events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) {
+                for (;;) {
+                    ssize_t r = read(conn->fd, buf, sizeof(buf));
+                    if (r > 0) {
+                        conn->in.append(buf, r);
+                    } else {
+                        if (r == 0 || (errno != EAGAIN && errno != EINTR))
+                            closed = true;
+                        break;
+                    }
+                }
+            }
+
+            // 请求没有 body, 按空行切分
+            bool reset = false;
+            size_t pos;
+            while (!closed && (pos = conn->in.find("\r\n\r\n")) != string::npos) {
+                conn->in.erase(0, pos + 4);
+                __atomic_add_fetch(&origin_requests, 1, __ATOMIC_RELAXED);
+                if (origin_reset_pct > 0 && (int)(rand_r(&seed) % 100) < origin_reset_pct) {
+                    __atomic_add_fetch(&origin_resets, 1, __ATOMIC_RELAXED);
+                    reset = closed = true;
+                    break;
+                }
+                conn->out += response;
+            }
+            if (closed) {
+                origin_close(ep, conn, reset);
+                continue;
+            }
+
+            if (!conn->out.empty()) {
+                ssize_t w = write(conn->fd, conn->out.data(), conn->out.size());
+                if (w > 0) {
+                    conn->out.erase(0, w);
+                } else if (w < 0 && errno != EAGAIN) {
+                    origin_close(ep, conn, false);
+                    continue;
+                }
+            }
+            ev.events = conn->out.empty() ? EPOLLIN : (EPOLLIN|EPOLLOUT);
+            ev.data.ptr = conn;
+            epoll_ctl(ep, EPOLL_CTL_MOD, conn->fd, &ev);
+        }
+    }
+    return NULL;
+}
+
+static int start_origin_server(int ports)
+{
+    for (int i = 0; i < ports; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+        struct sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 || listen(fd, 65535) != 0) {
+            perror("origin listen");
+            return -1;
+        }
+        socklen_t len = sizeof(sin);
+        getsockname(fd, (struct sockaddr *)&sin, &len);
+        origin_ports.push_back(ntohs(sin.sin_port));
+        origin_listen_fds.push_back(fd);
+    }
+
+    pthread_t tid;
+    return pthread_create(&tid, NULL, origin_thread, NULL);
+}
+
+class SoakClient
+{
+    private:
+        struct sockaddr_in proxy_addr;
+        int source_addrs;           // 源地址个数, 127.0.0.2 开始
+        int max_conns;
+        int tunnel_pct;
+        int max_requests;
+        int end_weight[SOAK_END_NUM];
+        uint64_t timeout_us;
+
+        int ep;
+        vector<SoakConn> conns;
+        vector<int> free_slots;
+        int active;
+        unsigned int seed;
+        uint64_t next_open;
+        int scan;                   // 超时检查的位置, 每轮只检查一部分
+
+        void Open(int slot);
+        void Close(int slot, bool reset);
+        void Fail(int slot, uint64_t *counter);
+        void SendRequest(int slot);
+        void OnConnected(int slot);
+        void OnReadable(int slot);
+        void ResponseDone(int slot);
+
+    public:
+        SoakStats stats;
+
+        SoakClient(const struct sockaddr_in &addr, int conns_num, int tunnel, int requests,
+            const int *weights, int timeout_sec);
+        int Active() {
+            return active;
+        }
+        // 补充连接并处理一轮事件, open 为 false 时不再新建连接
+        void Run(int wait_ms, bool open);
+        void CloseAll();
+};
+
+SoakClient::SoakClient(const struct sockaddr_in &addr, int conns_num, int tunnel, int requests,
+    const int *weights, int timeout_sec)
+{
+    proxy_addr = addr;
+    max_conns = conns_num;
+    source_addrs = conns_num / SOAK_PORTS_PER_ADDR + 1;
+    tunnel_pct = tunnel;
+    max_requests = requests;
+    memcpy(end_weight, weights, sizeof(end_weight));
+    timeout_us = (uint64_t)timeout_sec * 1000000;
+
+    ep = epoll_create1(0);
+    conns.resize(conns_num);
+    for (int i = conns_num - 1; i >= 0; i--) {
+        conns[i].fd = -1;
+        free_slots.push_back(i);
+    }
+    active = 0;
+    seed = (unsigned int)now_us();
+    next_open = 0;
+    scan = 0;
+    memset(&stats, 0, sizeof(stats));
+}
+
+void SoakClient::Open(int slot)
+{
+    SoakConn &c = conns[slot];
+    c.fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (c.fd < 0) {
+        stats.connect_errors++;
+        free_slots.push_back(slot);
+        return;
+    }
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // 连接数超过一个源地址的临时端口数时, 轮流使用 127.0.0.x 作为源地址
+    if (source_addrs > 1 && ntohl(proxy_addr.sin_addr.s_addr) >> 24 == 127) {
+        struct sockaddr_in src;
+        memset(&src, 0, sizeof(src));
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = htonl(0x7f000002 + next_open % source_addrs);
+        setsockopt(c.fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        bind(c.fd, (struct sockaddr *)&src, sizeof(src));
+    }
+    next_open++;
+
+    if (connect(c.fd, (struct sockaddr *)&proxy_addr, sizeof(proxy_addr)) != 0 && errno != EINPROGRESS) {
+        close(c.fd);
+        c.fd = -1;
+        stats.connect_errors++;
+        free_slots.push_back(slot);
+        return;
+    }
+
+    c.type = (int)(rand_r(&seed) % 100) < tunnel_pct ? SOAK_TUNNEL : SOAK_HTTP;
+    c.state = SOAK_CONNECTING;
+    c.requests = 1 + rand_r(&seed) % max_requests;
+    c.origin_port = origin_ports[rand_r(&seed) % origin_ports.size()];
+    c.body_left = -1;
+    c.state_us = now_us();
+    c.header.clear();
+
+    int total = 0;
+    for (int i = 0; i < SOAK_END_NUM; i++)
+        total += end_weight[i];
+    int r = total > 0 ? rand_r(&seed) % total : 0;
+    c.end = SOAK_END_CLOSE;
+    for (int i = 0; i < SOAK_END_NUM; i++) {
+        if (r < end_weight[i]) {
+            c.end = i;
+            break;
+        }
+        r -= end_weight[i];
+    }
+    // RST 发生在随机的某个请求之后, 而不总是最后一个
+    if (c.end == SOAK_END_RESET)
+        c.requests = 1 + rand_r(&seed) % c.requests;
+
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.u32 = slot;
+    epoll_ctl(ep, EPOLL_CTL_ADD, c.fd, &ev);
+    active++;
+    stats.opened++;
+}
+
+void SoakClient::Close(int slot, bool reset)
+{
+    SoakConn &c = conns[slot];
+    epoll_ctl(ep, EPOLL_CTL_DEL, c.fd, NULL);
+    if (reset)
+        reset_close(c.fd);
+    else
+        close(c.fd);
+    c.fd = -1;
+    string().swap(c.header);
+    free_slots.push_back(slot);
+    active--;
+    stats.closed++;
+}
+
+void SoakClient::Fail(int slot, uint64_t *counter)
+{
+    (*counter)++;
+    Close(slot, false);
+}
+
+void SoakClient::SendRequest(int slot)
+{
+    SoakConn &c = conns[slot];
+    char req[256];
+    int len;
+    if (c.type == SOAK_TUNNEL)
+        len = snprintf(req, sizeof(req), "GET /soak HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n", c.origin_port);
+    else
+        len = snprintf(req, sizeof(req), "GET http://127.0.0.1:%d/soak HTTP/1.1\r\nHost: 127.0.0.1:%d\r\nProxy-Connection: keep-alive\r\n\r\n",
+            c.origin_port, c.origin_port);
+    // 请求很小, 刚建立的连接上不会写不进去
+    if (write(c.fd, req, len) != len) {
+        Fail(slot, &stats.proxy_errors);
+        return;
+    }
+    c.requests--;
+    c.body_left = -1;
+    c.header.clear();
+    c.state_us = now_us();
+
+    if (c.requests == 0 && c.end == SOAK_END_RESET) {
+        // 不等响应直接 RST, 代理这时通常还在等上游
+        stats.resets++;
+        Close(slot, true);
+        return;
+    }
+    if (c.requests == 0 && c.end == SOAK_END_HALF_CLOSE) {
+        shutdown(c.fd, SHUT_WR);
+        stats.half_closes++;
+        c.state = SOAK_HALF_CLOSED;
+        return;
+    }
+    c.state = SOAK_RESPONSE;
+}
+
+void SoakClient::OnConnected(int slot)
+{
+    SoakConn &c = conns[slot];
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0) {
+        Fail(slot, &stats.connect_errors);
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = slot;
+    epoll_ctl(ep, EPOLL_CTL_MOD, c.fd, &ev);
+
+    if (c.type == SOAK_TUNNEL) {
+        char req[128];
+        int n = snprintf(req, sizeof(req), "CONNECT 127.0.0.1:%d HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n",
+            c.origin_port, c.origin_port);
+        if (write(c.fd, req, n) != n) {
+            Fail(slot, &stats.proxy_errors);
+            return;
+        }
+        c.state = SOAK_TUNNEL_WAIT;
+        c.state_us = now_us();
+        return;
+    }
+    SendRequest(slot);
+}
+
+void SoakClient::ResponseDone(int slot)
+{
+    SoakConn &c = conns[slot];
+    stats.responses++;
+    if (c.state == SOAK_HALF_CLOSED) {
+        // 继续读, 等代理关闭连接
+        c.body_left = -1;
+        c.header.clear();
+        return;
+    }
+    if (c.requests == 0) {
+        Close(slot, false);
+        return;
+    }
+    SendRequest(slot);
+}
+
+void SoakClient::OnReadable(int slot)
+{
+    char buf[65536];
+    for (;;) {
+        SoakConn &c = conns[slot];
+        if (c.fd < 0)
+            return;
+        ssize_t r = read(c.fd, buf, sizeof(buf));
+        if (r < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (r <= 0) {
+            // 半关闭后对端关闭是正常结束
+            if (c.state == SOAK_HALF_CLOSED && r == 0)
+                Close(slot, false);
+            else
+                Fail(slot, &stats.proxy_errors);
+            return;
+        }
+
+        size_t off = 0;
+        while (off < (size_t)r && c.fd >= 0) {
+            if (c.body_left >= 0) {
+                size_t n = (size_t)c.body_left < r - off ? (size_t)c.body_left : r - off;
+                c.body_left -= n;
+                off += n;
+                if (c.body_left == 0)
+                    ResponseDone(slot);
+                continue;
+            }
+
+            // 读响应头
+            size_t before = c.header.size();
+            c.header.append(buf + off, r - off);
+            size_t pos = c.header.find("\r\n\r\n");
+            if (pos == string::npos) {
+                if (c.header.size() > SOAK_HEADER_MAX)
+                    Fail(slot, &stats.proxy_errors);
+                break;
+            }
+            off += pos + 4 - before;
+            if (c.header.compare(0, 12, "HTTP/1.1 200") != 0 && c.header.compare(0, 12, "HTTP/1.0 200") != 0) {
+                Fail(slot, &stats.proxy_errors);
+                break;
+            }
+            if (c.state == SOAK_TUNNEL_WAIT) {
+                c.header.clear();
+                SendRequest(slot);
+                continue;
+            }
+            const char *cl = strcasestr(c.header.c_str(), "\r\nContent-Length:");
+            c.body_left = cl ? atol(cl + 17) : 0;
+            c.header.clear();
+            if (c.body_left == 0)
+                ResponseDone(slot);
+        }
+    }
+}
+
+void SoakClient::Run(int wait_ms, bool open)
+{
+    // 一次补充太多连接会让代理的 accept 队列溢出, 分批建立
+    for (int i = 0; open && i < 1000 && !free_slots.empty(); i++) {
+        int slot = free_slots.back();
+        free_slots.pop_back();
+        Open(slot);
+    }
+
+    struct epoll_event events[SOAK_MAX_EVENTS];
+    int n = epoll_wait(ep, events, SOAK_MAX_EVENTS, wait_ms);
+    for (int i = 0; i < n; i++) {
+        int slot = events[i].data.u32;
+        if (conns[slot].fd < 0)
+            continue;
+        if (conns[slot].state == SOAK_CONNECTING)
+            OnConnected(slot);
+        else
+            OnReadable(slot);
+    }
+
+    // 超时的连接: 代理丢了请求或者没处理半关闭
+    uint64_t now = now_us();
+    for (int i = 0; i < 1000 && i < max_conns; i++) {
+        scan = (scan + 1) % max_conns;
+        SoakConn &c = conns[scan];
+        if (c.fd >= 0 && now - c.state_us > timeout_us)
+            Fail(scan, &stats.timeouts);
+    }
+}
+
+void SoakClient::CloseAll()
+{
+    for (int i = 0; i < max_conns; i++) {
+        if (conns[i].fd >= 0)
+            Close(i, false);
+    }
+}
+
+static bool take_sample(int pid, const struct sockaddr_in &proxy_addr, SoakSample *s)
+{
+    map<string, string> stats;
+    s->fds = proc_fd_count(pid);
+    s->rss_kb = proc_status_kb(pid, "VmRSS");
+    if (s->fds < 0 || s->rss_kb < 0) {
+        cout << "proxy process " << pid << " is gone" << endl;
+        return false;
+    }
+    if (fetch_proxy_stats(proxy_addr, &stats) != 0) {
+        cout << "fetch /http_proxy_stats failed" << endl;
+        return false;
+    }
+    s->live_http = stat_long(stats, "drain.http");
+    s->live_tunnel = stat_long(stats, "drain.tunnel");
+    s->live_dns = stat_long(stats, "drain.dns");
+    s->tunnel_conns = stat_long(stats, "tunnel.count");
+    s->pool_conns = stat_long(stats, "upstream_pool.idle_http") +
+        stat_long(stats, "upstream_pool.warm_tunnel") + stat_long(stats, "upstream_pool.connecting");
+    return true;
+}
+
+static void usage()
+{
+    cout << "usage: soak_test -x proxy_ip:port -p proxy_pid [options]" << endl
+        << "  -c conns     同时保持的连接数, 默认 1000" << endl
+        << "  -d seconds   总时长, 默认 600" << endl
+        << "  -k seconds   检查点间隔, 默认 60" << endl
+        << "  -i seconds   输出间隔, 默认 5" << endl
+        << "  -t pct       隧道占的比例, 默认 50" << endl
+        << "  -n requests  每个连接最多发的请求数, 默认 20" << endl
+        << "  -e c:r:h     正常关闭/RST/半关闭的权重, 默认 6:2:2" << endl
+        << "  -r pct       目标服务 RST 的请求比例, 默认 1" << endl
+        << "  -s size      响应 body 大小, 默认 1024" << endl
+        << "  -o ports     目标服务监听的端口数, 默认按连接数计算" << endl
+        << "  -q seconds   检查点等待代理处理完的最长时间, 默认 10" << endl
+        << "  -F fds       允许增长的 fd 数, 默认 16" << endl
+        << "  -M MB        允许增长的 RSS, 默认 64" << endl
+        << "  -R pct       请求速率允许下降的比例, 默认 50" << endl;
+}
+
+int main(int argc, char **argv)
+{
+    string proxy;
+    int proxy_pid = 0;
+    int conns = 1000;
+    int duration = 600;
+    int checkpoint = 60;
+    int interval = 5;
+    int tunnel_pct = 50;
+    int max_requests = 20;
+    int end_weight[SOAK_END_NUM] = {6, 2, 2};
+    int origin_port_num = 0;
+    int settle = 10;
+    long fd_slack = 16;
+    long rss_slack_mb = 64;
+    int rate_drop_pct = 50;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "x:p:c:d:k:i:t:n:e:r:s:o:q:F:M:R:")) != -1) {
+        switch (opt) {
+        case 'x': proxy = optarg; break;
+        case 'p': proxy_pid = atoi(optarg); break;
+        case 'c': conns = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'k': checkpoint = atoi(optarg); break;
+        case 'i': interval = atoi(optarg); break;
+        case 't': tunnel_pct = atoi(optarg); break;
+        case 'n': max_requests = atoi(optarg); break;
+        case 'e':
+            if (sscanf(optarg, "%d:%d:%d", &end_weight[0], &end_weight[1], &end_weight[2]) != 3) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'r': origin_reset_pct = atoi(optarg); break;
+        case 's': origin_body_size = atoi(optarg); break;
+        case 'o': origin_port_num = atoi(optarg); break;
+        case 'q': settle = atoi(optarg); break;
+        case 'F': fd_slack = atol(optarg); break;
+        case 'M': rss_slack_mb = atol(optarg); break;
+        case 'R': rate_drop_pct = atoi(optarg); break;
+        default: usage(); return 1;
+        }
+    }
+    size_t colon = proxy.rfind(':');
+    if (proxy.empty() || colon == string::npos || proxy_pid <= 0 || conns <= 0 ||
+        max_requests <= 0 || checkpoint <= 0 || interval <= 0) {
+        usage();
+        return 1;
+    }
+
+    // 客户端和目标服务两端的连接都在本进程里
+    struct rlimit rl = {(rlim_t)conns * 2 + 1024, (rlim_t)conns * 2 + 1024};
+    if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
+        perror("setrlimit, connections may fail");
+    long proxy_limit = proc_fd_limit(proxy_pid);
+    if (proxy_limit > 0 && proxy_limit < (long)conns * 2 + 64)
+        cout << "warning: proxy fd limit " << proxy_limit << " is less than " << conns * 2 + 64 << endl;
+
+    // 代理到目标服务的连接都从 127.0.0.1 发出, 按目标端口分散
+    if (origin_port_num <= 0)
+        origin_port_num = conns / SOAK_PORTS_PER_ADDR + 1;
+    if (start_origin_server(origin_port_num) != 0)
+        return 1;
+
+    struct sockaddr_in proxy_addr;
+    memset(&proxy_addr, 0, sizeof(proxy_addr));
+    proxy_addr.sin_family = AF_INET;
+    proxy_addr.sin_port = htons(atoi(proxy.c_str() + colon + 1));
+    inet_pton(AF_INET, proxy.substr(0, colon).c_str(), &proxy_addr.sin_addr);
+
+    SoakSample base;
+    if (!take_sample(proxy_pid, proxy_addr, &base))
+        return 1;
+    printf("start: fds:%ld rss:%ldKB origin_ports:%d\n", base.fds, base.rss_kb, origin_port_num);
+
+    SoakClient client(proxy_addr, conns, tunnel_pct, max_requests, end_weight, settle + 20);
+    uint64_t start = now_us();
+    uint64_t end = start + (uint64_t)duration * 1000000;
+    uint64_t next_print = start + (uint64_t)interval * 1000000;
+    uint64_t next_checkpoint = start + (uint64_t)checkpoint * 1000000;
+    uint64_t window_start = start, window_responses = 0;
+    SoakStats last = client.stats;
+    uint64_t last_print = start;
+    bool have_baseline = false;
+    SoakSample baseline = SoakSample();
+    int checkpoints = 0;
+    string failure;
+
+    while (failure.empty()) {
+        uint64_t now = now_us();
+        bool finish = now >= end;
+        if (now >= next_checkpoint || finish) {
+            // 检查点: 关闭所有连接, 等代理处理完剩余的请求和隧道, 再采样
+            SoakSample s;
+            s.rate = (client.stats.responses - window_responses) / ((now - window_start) / 1e6);
+            client.CloseAll();
+            // 关闭中的连接释放 fd 需要时间, 还有存活请求, fd 还在减少或超过基准时一直等到 settle 秒
+            uint64_t settle_end = now_us() + (uint64_t)settle * 1000000;
+            long last_fds = -1;
+            bool ok;
+            while ((ok = take_sample(proxy_pid, proxy_addr, &s)) && now_us() < settle_end &&
+                (s.live_http || s.live_tunnel || s.live_dns || s.tunnel_conns ||
+                last_fds < 0 || s.fds < last_fds ||
+                (have_baseline && s.fds - s.pool_conns > baseline.fds - baseline.pool_conns + fd_slack))) {
+                last_fds = s.fds;
+                usleep(200 * 1000);
+            }
+            checkpoints++;
+            if (!ok) {
+                failure = "proxy unavailable";
+                break;
+            }
+
+            long app_fds = s.fds - s.pool_conns;
+            printf("checkpoint %d: fds:%ld (pool:%ld) rss:%ldKB live http:%ld tunnel:%ld dns:%ld"
+                " tunnel_conns:%ld rate:%.0f/s\n", checkpoints, s.fds, s.pool_conns, s.rss_kb,
+                s.live_http, s.live_tunnel, s.live_dns, s.tunnel_conns, s.rate);
+            char reason[256] = {0};
+            if (s.live_http || s.live_tunnel || s.live_dns || s.tunnel_conns) {
+                snprintf(reason, sizeof(reason), "requests/tunnels still alive after %ds", settle);
+            } else if (!have_baseline) {
+                // 第一个检查点之前内存池和连接池都已经热身, 以它为基准
+                baseline = s;
+                have_baseline = true;
+            } else if (app_fds > baseline.fds - baseline.pool_conns + fd_slack) {
+                snprintf(reason, sizeof(reason), "fd drift: %ld -> %ld", baseline.fds - baseline.pool_conns, app_fds);
+            } else if (s.rss_kb > baseline.rss_kb + rss_slack_mb * 1024) {
+                snprintf(reason, sizeof(reason), "rss drift: %ldKB -> %ldKB", baseline.rss_kb, s.rss_kb);
+            } else if (s.rate < baseline.rate * (100 - rate_drop_pct) / 100) {
+                snprintf(reason, sizeof(reason), "request rate drift: %.0f/s -> %.0f/s", baseline.rate, s.rate);
+            }
+            if (reason[0]) {
+                failure = reason;
+                break;
+            }
+            if (finish)
+                break;
+
+            window_start = now_us();
+            window_responses = client.stats.responses;
+            next_checkpoint = window_start + (uint64_t)checkpoint * 1000000;
+            next_print = window_start + (uint64_t)interval * 1000000;
+            last_print = window_start;
+            last = client.stats;
+            continue;
+        }
+
+        client.Run(10, true);
+
+        now = now_us();
+        if (now >= next_print) {
+            SoakSample s;
+            if (!take_sample(proxy_pid, proxy_addr, &s)) {
+                failure = "proxy unavailable";
+                break;
+            }
+            double secs = (now - last_print) / 1e6;
+            const SoakStats &st = client.stats;
+            printf("%4.0fs conns:%d req/s:%.0f open/s:%.0f resets:%lu half_closes:%lu errors:%lu/%lu/%lu"
+                " | proxy fds:%ld rss:%ldKB http:%ld tunnel:%ld\n",
+                (now - start) / 1e6, client.Active(), (st.responses - last.responses) / secs,
+                (st.opened - last.opened) / secs, (unsigned long)(st.resets - last.resets),
+                (unsigned long)(st.half_closes - last.half_closes),
+                (unsigned long)(st.connect_errors - last.connect_errors),
+                (unsigned long)(st.proxy_errors - last.proxy_errors),
+                (unsigned long)(st.timeouts - last.timeouts),
+                s.fds, s.rss_kb, s.live_http, s.live_tunnel);
+            last = st;
+            last_print = now;
+            next_print = now + (uint64_t)interval * 1000000;
+        }
+    }
+
+    const SoakStats &st = client.stats;
+    printf("opened:%lu responses:%lu resets:%lu half_closes:%lu connect_errors:%lu proxy_errors:%lu"
+        " timeouts:%lu origin_requests:%lu origin_resets:%lu checkpoints:%d\n",
+        (unsigned long)st.opened, (unsigned long)st.responses, (unsigned long)st.resets,
+        (unsigned long)st.half_closes, (unsigned long)st.connect_errors, (unsigned long)st.proxy_errors,
+        (unsigned long)st.timeouts, (unsigned long)origin_requests, (unsigned long)origin_resets, checkpoints);
+    if (!failure.empty()) {
+        cout << "FAIL: " << failure << endl;
+        return 1;
+    }
+    cout << "PASS" << endl;
+    return 0;
+}
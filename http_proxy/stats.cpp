@@ -0,0 +1,186 @@
+extern "C" {
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+}
+
+#include "stats.h"
+
+#define STATS_READ_RETRY (1000)     // 超过重试次数时接受不一致的数据, 不能让统计接口卡住
+
+__thread StatsShard *LocalStatsShard = NULL;
+
+static StatsShard *stats_shards[STATS_MAX_THREADS];
+static int stats_shard_groups[STATS_MAX_THREADS];
+static int stats_shard_count = 0;
+static pthread_mutex_t stats_register_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *counter_names[STATS_COUNTER_NUM] = {
+    "http_requests",
+    "http_errors",
+    "tunnel_requests",
+    "bytes_up",
+    "bytes_down",
+    "dns_cache_hit",
+    "dns_cache_miss",
+    "dns_errors",
+    "dns_cache_evict",
+    "upstream_new",
+    "upstream_reuse",
+    "warm_tunnel_hit",
+    "acl_denied",
+};
+
+static const char *gauge_names[STATS_GAUGE_NUM] = {
+    "live_http",
+    "live_tunnel",
+    "dns_cache_size",
+};
+
+static const char *histogram_names[STATS_HISTOGRAM_NUM] = {
+    "http_us",
+    "tunnel_us",
+    "tunnel_connect_us",
+    "dns_us",
+};
+
+int stats_thread_init(int group)
+{
+    if (LocalStatsShard)
+        return 0;
+
+    void *p = NULL;
+    if (posix_memalign(&p, 64, sizeof(StatsShard)) != 0) {
+        printf("alloc stats shard failed\n");
+        return -1;
+    }
+    memset(p, 0, sizeof(StatsShard));
+
+    pthread_mutex_lock(&stats_register_lock);
+    if (stats_shard_count >= STATS_MAX_THREADS) {
+        pthread_mutex_unlock(&stats_register_lock);
+        free(p);
+        printf("too many stats threads\n");
+        return -1;
+    }
+    // 先放好指针再增加个数, 读的一方按个数遍历
+    stats_shards[stats_shard_count] = (StatsShard *)p;
+    stats_shard_groups[stats_shard_count] = group;
+    __atomic_store_n(&stats_shard_count, stats_shard_count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&stats_register_lock);
+
+    LocalStatsShard = (StatsShard *)p;
+    return 0;
+}
+
+// 按 seqlock 的方式复制一个分片, 返回重读的次数
+static int read_shard(const StatsShard *s, StatsShard *out)
+{
+    int retries = 0;
+    for (;;) {
+        uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1) || retries >= STATS_READ_RETRY) {
+            for (int i = 0; i < STATS_COUNTER_NUM; i++)
+                out->counters[i] = __atomic_load_n(&s->counters[i], __ATOMIC_RELAXED);
+            for (int i = 0; i < STATS_GAUGE_NUM; i++)
+                out->gauges[i] = __atomic_load_n(&s->gauges[i], __ATOMIC_RELAXED);
+            for (int i = 0; i < STATS_HISTOGRAM_NUM; i++) {
+                const StatsHistogram &from = s->histograms[i];
+                StatsHistogram &to = out->histograms[i];
+                to.count = __atomic_load_n(&from.count, __ATOMIC_RELAXED);
+                to.sum = __atomic_load_n(&from.sum, __ATOMIC_RELAXED);
+                to.max = __atomic_load_n(&from.max, __ATOMIC_RELAXED);
+                for (int j = 0; j < STATS_HIST_BUCKETS; j++)
+                    to.buckets[j] = __atomic_load_n(&from.buckets[j], __ATOMIC_RELAXED);
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq || retries >= STATS_READ_RETRY)
+                return retries;
+        }
+        retries++;
+        sched_yield();
+    }
+}
+
+void StatsSnapshot::Take(int group)
+{
+    memset(this, 0, sizeof(*this));
+    StatsShard *shard = (StatsShard *)malloc(sizeof(StatsShard));
+    if (!shard)
+        return;
+
+    int n = __atomic_load_n(&stats_shard_count, __ATOMIC_ACQUIRE);
+    for (int t = 0; t < n; t++) {
+        if (group >= 0 && stats_shard_groups[t] != group)
+            continue;
+        threads++;
+        retries += read_shard(stats_shards[t], shard);
+        for (int i = 0; i < STATS_COUNTER_NUM; i++)
+            counters[i] += shard->counters[i];
+        for (int i = 0; i < STATS_GAUGE_NUM; i++)
+            gauges[i] += shard->gauges[i];
+        for (int i = 0; i < STATS_HISTOGRAM_NUM; i++) {
+            StatsHistogram &h = histograms[i];
+            const StatsHistogram &from = shard->histograms[i];
+            h.count += from.count;
+            h.sum += from.sum;
+            if (from.max > h.max)
+                h.max = from.max;
+            for (int j = 0; j < STATS_HIST_BUCKETS; j++)
+                h.buckets[j] += from.buckets[j];
+        }
+    }
+    free(shard);
+}
+
+// 桶的下界, stats_hist_bucket 的逆运算
+static uint64_t bucket_lower(int bucket)
+{
+    int group = bucket >> STATS_HIST_SUB_BITS;
+    uint64_t sub = bucket & (STATS_HIST_SUB - 1);
+    if (group == 0)
+        return sub;
+    return (STATS_HIST_SUB + sub) << (group - 1);
+}
+
+uint64_t StatsSnapshot::Percentile(int id, double pct) const
+{
+    const StatsHistogram &h = histograms[id];
+    if (h.count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(pct * h.count);
+    if (rank >= h.count)
+        rank = h.count - 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+        seen += h.buckets[i];
+        if (seen > rank) {
+            uint64_t upper = i + 1 < STATS_HIST_BUCKETS ? bucket_lower(i + 1) - 1 : UINT64_MAX;
+            return upper < h.max ? upper : h.max;
+        }
+    }
+    return h.max;
+}
+
+void StatsSnapshot::DumpStats(struct evbuffer *buf) const
+{
+    evbuffer_add_printf(buf, "stats.threads %d\n", threads);
+    evbuffer_add_printf(buf, "stats.snapshot_retries %lu\n", (unsigned long)retries);
+    for (int i = 0; i < STATS_COUNTER_NUM; i++)
+        evbuffer_add_printf(buf, "stats.%s %lu\n", counter_names[i], (unsigned long)counters[i]);
+    for (int i = 0; i < STATS_GAUGE_NUM; i++)
+        evbuffer_add_printf(buf, "stats.%s %ld\n", gauge_names[i], (long)gauges[i]);
+    for (int i = 0; i < STATS_HISTOGRAM_NUM; i++) {
+        const StatsHistogram &h = histograms[i];
+        const char *name = histogram_names[i];
+        evbuffer_add_printf(buf, "stats.%s.count %lu\n", name, (unsigned long)h.count);
+        evbuffer_add_printf(buf, "stats.%s.avg %lu\n", name, (unsigned long)(h.count ? h.sum / h.count : 0));
+        evbuffer_add_printf(buf, "stats.%s.p50 %lu\n", name, (unsigned long)Percentile(i, 0.5));
+        evbuffer_add_printf(buf, "stats.%s.p90 %lu\n", name, (unsigned long)Percentile(i, 0.9));
+        evbuffer_add_printf(buf, "stats.%s.p99 %lu\n", name, (unsigned long)Percentile(i, 0.99));
+        evbuffer_add_printf(buf, "stats.%s.max %lu\n", name, (unsigned long)h.max);
+    }
+}
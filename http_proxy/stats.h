@@ -0,0 +1,166 @@
+#ifndef HTTP_PROXY_STATS_H
+#define HTTP_PROXY_STATS_H
+
+extern "C" {
+#include <stdint.h>
+
+#include <event2/buffer.h>
+}
+
+// 每线程统计: 每个 worker 线程只写自己的分片, 读的时候把所有分片合并成一份快照
+// 分片按 cache line 对齐, 只有本线程写, 不需要原子的读改写, 线程之间没有竞争
+// 分片带一个序号(seqlock), 写入前后各加一, 合并时序号变了就重读, 同一个线程的数据是一致的
+
+#define STATS_MAX_THREADS (256)
+
+// 对数线性直方图: 每个 2 的幂区间再等分成 8 份, 误差不超过 12.5%
+#define STATS_HIST_SUB_BITS (3)
+#define STATS_HIST_SUB (1 << STATS_HIST_SUB_BITS)
+#define STATS_HIST_BUCKETS ((64 - STATS_HIST_SUB_BITS + 1) * STATS_HIST_SUB)
+
+// 只增不减的计数
+enum STATS_COUNTER {
+    STAT_HTTP_REQUESTS = 0,
+    STAT_HTTP_ERRORS,           // 上游出错或返回 5xx
+    STAT_TUNNEL_REQUESTS,
+    STAT_BYTES_UP,              // 客户端 -> 上游
+    STAT_BYTES_DOWN,            // 上游 -> 客户端
+    STAT_DNS_CACHE_HIT,
+    STAT_DNS_CACHE_MISS,
+    STAT_DNS_ERRORS,
+    STAT_DNS_CACHE_EVICT,       // 缓存满了被淘汰的记录
+    STAT_UPSTREAM_NEW,          // 新建的上游 http 连接
+    STAT_UPSTREAM_REUSE,        // 复用连接池里的 http 连接
+    STAT_WARM_TUNNEL_HIT,       // 使用预先建立的隧道连接
+    STAT_ACL_DENIED,            // 被 acl 规则拒绝的请求
+    STATS_COUNTER_NUM
+};
+
+// 可增可减的当前值, 合并时求和
+enum STATS_GAUGE {
+    STAT_LIVE_HTTP = 0,
+    STAT_LIVE_TUNNEL,
+    STAT_DNS_CACHE_SIZE,
+    STATS_GAUGE_NUM
+};
+
+// 耗时分布, 单位微秒
+enum STATS_HISTOGRAM {
+    STAT_HTTP_US = 0,           // http 请求总耗时
+    STAT_TUNNEL_US,             // 隧道存活时间
+    STAT_TUNNEL_CONNECT_US,     // CONNECT 到上游连接建立
+    STAT_DNS_US,                // 异步 dns 解析
+    STATS_HISTOGRAM_NUM
+};
+
+struct StatsHistogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[STATS_HIST_BUCKETS];
+};
+
+struct StatsShard {
+    uint64_t seq;               // 奇数表示正在写
+    uint64_t counters[STATS_COUNTER_NUM];
+    int64_t gauges[STATS_GAUGE_NUM];
+    StatsHistogram histograms[STATS_HISTOGRAM_NUM];
+} __attribute__((aligned(64)));
+
+// 当前线程的分片, 没有调用 stats_thread_init 的线程为 NULL, 不统计
+extern __thread StatsShard *LocalStatsShard;
+
+// 在 worker 线程里调用, 分片由本线程第一次写入, 内存在线程所在的 NUMA 节点上
+// 线程退出后分片保留, 累计值不会变小
+// group 区分同一个进程里的多个代理实例, 合并时只合并同一组的分片
+int stats_thread_init(int group = 0);
+
+static inline void stats_write_begin(StatsShard *s)
+{
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void stats_write_end(StatsShard *s)
+{
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+// 只有本线程写, 普通的读加上原子的写, 读的一方不会读到写了一半的值
+static inline void stats_add(uint64_t *p, uint64_t n)
+{
+    __atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+static inline int stats_hist_bucket(uint64_t value)
+{
+    if (value < STATS_HIST_SUB)
+        return (int)value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - STATS_HIST_SUB_BITS;
+    return ((shift + 1) << STATS_HIST_SUB_BITS) + (int)((value >> shift) & (STATS_HIST_SUB - 1));
+}
+
+static inline void stats_inc(int id, uint64_t n = 1)
+{
+    StatsShard *s = LocalStatsShard;
+    if (!s)
+        return;
+    stats_write_begin(s);
+    stats_add(&s->counters[id], n);
+    stats_write_end(s);
+}
+
+static inline void stats_gauge_add(int id, int64_t n)
+{
+    StatsShard *s = LocalStatsShard;
+    if (!s)
+        return;
+    stats_write_begin(s);
+    stats_add((uint64_t *)&s->gauges[id], (uint64_t)n);
+    stats_write_end(s);
+}
+
+static inline void stats_gauge_set(int id, int64_t value)
+{
+    StatsShard *s = LocalStatsShard;
+    if (!s)
+        return;
+    stats_write_begin(s);
+    __atomic_store_n(&s->gauges[id], value, __ATOMIC_RELAXED);
+    stats_write_end(s);
+}
+
+static inline void stats_record(int id, uint64_t value)
+{
+    StatsShard *s = LocalStatsShard;
+    if (!s)
+        return;
+    StatsHistogram *h = &s->histograms[id];
+    stats_write_begin(s);
+    stats_add(&h->count, 1);
+    stats_add(&h->sum, value);
+    if (value > h->max)
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    stats_add(&h->buckets[stats_hist_bucket(value)], 1);
+    stats_write_end(s);
+}
+
+// 所有线程合并后的统计, 读的时候不会阻塞 worker
+class StatsSnapshot
+{
+    public:
+        int threads;
+        uint64_t retries;       // 读到正在写的分片后重读的次数
+        uint64_t counters[STATS_COUNTER_NUM];
+        int64_t gauges[STATS_GAUGE_NUM];
+        StatsHistogram histograms[STATS_HISTOGRAM_NUM];
+
+        // group 为 -1 时合并所有线程
+        void Take(int group = -1);
+        // 返回该百分位所在桶的上界, pct 取值 0~1
+        uint64_t Percentile(int id, double pct) const;
+        void DumpStats(struct evbuffer *buf) const;
+};
+
+#endif
@@ -0,0 +1,252 @@
+#include <algorithm>
+#include <functional>
+
+extern "C" {
+#include <string.h>
+}
+
+#include "traffic_topk.h"
+
+using namespace std;
+
+static const char *dim_name[TRAFFIC_DIM_NUM] = {"host", "client"};
+static const char *metric_name[TRAFFIC_METRIC_NUM] = {"bytes", "requests", "conn_seconds"};
+
+// splitmix64 的混合函数, 让 std::hash 的结果高低位都足够随机
+static inline uint64_t mix_hash(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+void TrafficKey::Set(const string &key)
+{
+    name = key;
+    hash = mix_hash(std::hash<string>()(key));
+}
+
+CountMinSketch::CountMinSketch()
+{
+    memset(table, 0, sizeof(table));
+}
+
+// 用 h1 + i*h2 生成每一行的下标, 一次 hash 得到 CMS_DEPTH 个位置
+#define CMS_INDEX(_hash, _row) \
+    (((uint32_t)(_hash) + (_row) * (uint32_t)((_hash) >> 32)) & (CMS_WIDTH - 1))
+
+void CountMinSketch::Add(uint64_t hash, uint64_t weight)
+{
+    for (int i = 0; i < CMS_DEPTH; i++)
+        table[i][CMS_INDEX(hash, i)] += weight;
+}
+
+uint64_t CountMinSketch::Estimate(uint64_t hash) const
+{
+    uint64_t est = table[0][CMS_INDEX(hash, 0)];
+    for (int i = 1; i < CMS_DEPTH; i++)
+        est = min(est, table[i][CMS_INDEX(hash, i)]);
+    return est;
+}
+
+void CountMinSketch::Merge(const CountMinSketch &other)
+{
+    for (int i = 0; i < CMS_DEPTH; i++)
+        for (int j = 0; j < CMS_WIDTH; j++)
+            table[i][j] += other.table[i][j];
+}
+
+SpaceSaving::SpaceSaving()
+{
+    entries.reserve(TOPK_CAPACITY);
+    heap.reserve(TOPK_CAPACITY);
+    heap_pos.reserve(TOPK_CAPACITY);
+    index.reserve(TOPK_CAPACITY * 2);
+}
+
+void SpaceSaving::Swap(int a, int b)
+{
+    std::swap(heap[a], heap[b]);
+    heap_pos[heap[a]] = a;
+    heap_pos[heap[b]] = b;
+}
+
+void SpaceSaving::SiftUp(int pos)
+{
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (entries[heap[parent]].count <= entries[heap[pos]].count)
+            break;
+        Swap(pos, parent);
+        pos = parent;
+    }
+}
+
+void SpaceSaving::SiftDown(int pos)
+{
+    int n = heap.size();
+    for (;;) {
+        int smallest = pos;
+        int l = pos * 2 + 1, r = pos * 2 + 2;
+        if (l < n && entries[heap[l]].count < entries[heap[smallest]].count)
+            smallest = l;
+        if (r < n && entries[heap[r]].count < entries[heap[smallest]].count)
+            smallest = r;
+        if (smallest == pos)
+            break;
+        Swap(pos, smallest);
+        pos = smallest;
+    }
+}
+
+void SpaceSaving::Add(const TrafficKey &key, uint64_t weight)
+{
+    auto iter = index.find(key.hash);
+    if (iter != index.end()) {
+        entries[iter->second].count += weight;
+        SiftDown(heap_pos[iter->second]);
+        return;
+    }
+
+    if (entries.size() < TOPK_CAPACITY) {
+        int idx = entries.size();
+        Entry e = {key.name, key.hash, weight, 0};
+        entries.push_back(e);
+        heap.push_back(idx);
+        heap_pos.push_back(heap.size() - 1);
+        index[key.hash] = idx;
+        SiftUp(heap.size() - 1);
+        return;
+    }
+
+    // 替换计数最小的 key, 新 key 继承它的计数作为误差
+    int idx = heap[0];
+    Entry &e = entries[idx];
+    index.erase(e.hash);
+    e.name = key.name;
+    e.hash = key.hash;
+    e.error = e.count;
+    e.count += weight;
+    index[key.hash] = idx;
+    SiftDown(0);
+}
+
+TrafficSketch::TrafficSketch()
+{
+    memset(total, 0, sizeof(total));
+}
+
+void TrafficSketch::Add(const TrafficKey &host, const TrafficKey &client, int metric, uint64_t weight)
+{
+    if (weight == 0)
+        return;
+
+    const TrafficKey *keys[TRAFFIC_DIM_NUM] = {&host, &client};
+    for (int d = 0; d < TRAFFIC_DIM_NUM; d++) {
+        if (keys[d]->name.empty())
+            continue;
+        top[d][metric].Add(*keys[d], weight);
+        cms[d][metric].Add(keys[d]->hash, weight);
+        total[d][metric] += weight;
+    }
+}
+
+static bool topk_item_cmp(const TopKItem &a, const TopKItem &b)
+{
+    return a.estimate > b.estimate;
+}
+
+void TrafficSketch::MergeTopK(const vector<const TrafficSketch *> &sketches,
+    int dim, int metric, size_t k, vector<TopKItem> &result)
+{
+    result.clear();
+    if (sketches.empty())
+        return;
+
+    // 单个 worker 时直接用它的 CMS, 避免拷贝
+    CountMinSketch *merged = NULL;
+    const CountMinSketch *cms = &sketches[0]->cms[dim][metric];
+    if (sketches.size() > 1) {
+        merged = new CountMinSketch(*cms);
+        for (size_t i = 1; i < sketches.size(); i++)
+            merged->Merge(sketches[i]->cms[dim][metric]);
+        cms = merged;
+    }
+
+    // 候选 key 为所有 worker 的 Space-Saving 的并集
+    // 上界: 各 worker 的计数之和(没有该 key 的 worker 取其最小计数), 再和 CMS 取较小值
+    // 下界: 各 worker 的 count - error 之和
+    unordered_map<uint64_t, TopKItem> candidates;
+    vector<uint64_t> min_count(sketches.size(), 0);
+    for (size_t i = 0; i < sketches.size(); i++) {
+        const vector<SpaceSaving::Entry> &entries = sketches[i]->top[dim][metric].GetEntries();
+        if (entries.size() >= TOPK_CAPACITY) {
+            min_count[i] = entries[0].count;
+            for (auto iter = entries.begin(); iter != entries.end(); iter++)
+                min_count[i] = min(min_count[i], iter->count);
+        }
+        for (auto iter = entries.begin(); iter != entries.end(); iter++) {
+            TopKItem &item = candidates[iter->hash];
+            item.name = iter->name;
+            item.lower += iter->count - iter->error;
+        }
+    }
+
+    for (auto iter = candidates.begin(); iter != candidates.end(); iter++) {
+        uint64_t upper = 0;
+        for (size_t i = 0; i < sketches.size(); i++) {
+            const vector<SpaceSaving::Entry> &entries = sketches[i]->top[dim][metric].GetEntries();
+            uint64_t count = min_count[i];
+            for (auto e = entries.begin(); e != entries.end(); e++) {
+                if (e->hash == iter->first) {
+                    count = e->count;
+                    break;
+                }
+            }
+            upper += count;
+        }
+        iter->second.estimate = max(min(upper, cms->Estimate(iter->first)), iter->second.lower);
+        result.push_back(iter->second);
+    }
+    delete merged;
+
+    sort(result.begin(), result.end(), topk_item_cmp);
+    if (result.size() > k)
+        result.resize(k);
+}
+
+// 输出格式: topk.<维度>.<指标>.<名次> <key> <估计值> <下界>
+void TrafficSketch::DumpStats(const vector<const TrafficSketch *> &sketches, struct evbuffer *buf)
+{
+    vector<TopKItem> result;
+    for (int d = 0; d < TRAFFIC_DIM_NUM; d++) {
+        for (int m = 0; m < TRAFFIC_METRIC_NUM; m++) {
+            uint64_t sum = 0;
+            for (size_t i = 0; i < sketches.size(); i++)
+                sum += sketches[i]->total[d][m];
+
+            MergeTopK(sketches, d, m, TOPK_REPORT, result);
+            if (m == TRAFFIC_CONN_MS) {
+                evbuffer_add_printf(buf, "topk.%s.%s.total %.3f\n",
+                    dim_name[d], metric_name[m], sum / 1000.0);
+                for (size_t i = 0; i < result.size(); i++) {
+                    evbuffer_add_printf(buf, "topk.%s.%s.%zu %s %.3f %.3f\n",
+                        dim_name[d], metric_name[m], i + 1, result[i].name.c_str(),
+                        result[i].estimate / 1000.0, result[i].lower / 1000.0);
+                }
+                continue;
+            }
+
+            evbuffer_add_printf(buf, "topk.%s.%s.total %lu\n",
+                dim_name[d], metric_name[m], (unsigned long)sum);
+            for (size_t i = 0; i < result.size(); i++) {
+                evbuffer_add_printf(buf, "topk.%s.%s.%zu %s %lu %lu\n",
+                    dim_name[d], metric_name[m], i + 1, result[i].name.c_str(),
+                    (unsigned long)result[i].estimate, (unsigned long)result[i].lower);
+            }
+        }
+    }
+}
@@ -0,0 +1,113 @@
+#ifndef HTTP_PROXY_TRAFFIC_TOPK_H
+#define HTTP_PROXY_TRAFFIC_TOPK_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+extern "C" {
+#include <stdint.h>
+#include <stddef.h>
+
+#include <event2/buffer.h>
+}
+
+// 按目标 host 和客户端 IP 统计流量 Top-K, 内存固定, 不随 key 的数量增长
+// Space-Saving 维护候选的热点 key, Count-Min 用来收紧估计值和多个 worker 合并
+// 每个 worker 一份, 只在所属线程里更新, 热路径上不加锁
+
+#define TOPK_CAPACITY (128)      // 每个 Space-Saving 保留的候选 key 数
+#define TOPK_REPORT (20)         // 统计接口输出的条数
+#define CMS_DEPTH (4)
+#define CMS_WIDTH (2048)         // 必须是 2 的幂
+
+enum TRAFFIC_DIM {
+    TRAFFIC_DIM_HOST = 0,
+    TRAFFIC_DIM_CLIENT,
+    TRAFFIC_DIM_NUM
+};
+
+enum TRAFFIC_METRIC {
+    TRAFFIC_BYTES = 0,
+    TRAFFIC_REQUESTS,
+    TRAFFIC_CONN_MS,             // 连接持续时间, 输出时换算成秒
+    TRAFFIC_METRIC_NUM
+};
+
+// 计算一次, 之后每次更新都直接用 hash, 不再对字符串求 hash
+struct TrafficKey {
+    std::string name;
+    uint64_t hash;
+
+    TrafficKey() : hash(0) {}
+    void Set(const std::string &key);
+};
+
+class CountMinSketch
+{
+    private:
+        uint64_t table[CMS_DEPTH][CMS_WIDTH];
+
+    public:
+        CountMinSketch();
+        void Add(uint64_t hash, uint64_t weight);
+        uint64_t Estimate(uint64_t hash) const;
+        void Merge(const CountMinSketch &other);
+};
+
+// 带权重的 Space-Saving, 用最小堆找到计数最小的 key 进行替换
+class SpaceSaving
+{
+    public:
+        struct Entry {
+            std::string name;
+            uint64_t hash;
+            uint64_t count;     // 估计值上界
+            uint64_t error;     // 被替换时继承的计数, count - error 为下界
+        };
+
+    private:
+        std::vector<Entry> entries;
+        std::vector<int> heap;          // entries 下标, 按 count 组成最小堆
+        std::vector<int> heap_pos;      // entries 下标 -> 在 heap 中的位置
+        std::unordered_map<uint64_t, int> index;
+
+        void SiftDown(int pos);
+        void SiftUp(int pos);
+        void Swap(int a, int b);
+
+    public:
+        SpaceSaving();
+        void Add(const TrafficKey &key, uint64_t weight);
+        const std::vector<Entry> &GetEntries() const {
+            return entries;
+        }
+};
+
+struct TopKItem {
+    std::string name;
+    uint64_t estimate;
+    uint64_t lower;
+
+    TopKItem() : estimate(0), lower(0) {}
+};
+
+class TrafficSketch
+{
+    private:
+        SpaceSaving top[TRAFFIC_DIM_NUM][TRAFFIC_METRIC_NUM];
+        CountMinSketch cms[TRAFFIC_DIM_NUM][TRAFFIC_METRIC_NUM];
+        uint64_t total[TRAFFIC_DIM_NUM][TRAFFIC_METRIC_NUM];
+
+    public:
+        TrafficSketch();
+        void Add(const TrafficKey &host, const TrafficKey &client, int metric, uint64_t weight);
+
+        // 合并多个 worker 的统计, 返回估计值最大的 k 个 key
+        static void MergeTopK(const std::vector<const TrafficSketch *> &sketches,
+            int dim, int metric, size_t k, std::vector<TopKItem> &result);
+        static void DumpStats(const std::vector<const TrafficSketch *> &sketches,
+            struct evbuffer *buf);
+};
+
+#endif
@@ -0,0 +1,318 @@
+// CONNECT 隧道压测工具, 用来对比 libevent 和 io_uring 两种转发方式
+// 内置一个 echo 服务作为目标, 通过代理建立 N 条隧道, 每条隧道循环发送 size 字节并等待回显
+//
+// ./http_proxy 127.0.0.1 18023 -e uring &
+// ./tunnel_bench -x 127.0.0.1:18023 -c 1000 -s 4096 -d 10 -p `pidof http_proxy`
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+}
+
+using namespace std;
+
+#define BENCH_MAX_EVENTS (1024)
+
+enum BENCH_STATE {
+    BENCH_CONNECTING = 1,   // 等待代理返回 200
+    BENCH_RUNNING
+};
+
+struct BenchConn {
+    int fd;
+    int state;
+    size_t sent;
+    size_t recved;
+    string header;
+};
+
+struct EchoConn {
+    int fd;
+    string pending;
+};
+
+static int echo_port = 0;
+static int echo_listen_fd = -1;
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 进程消耗的 cpu 时间(用户态+内核态), 单位 clock tick
+static long proc_cpu_ticks(int pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[n] = 0;
+
+    // 第二个字段可能带空格, 从最后一个 ')' 之后开始数
+    char *p = strrchr(buf, ')');
+    if (!p)
+        return -1;
+    long utime = 0, stime = 0;
+    if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %ld %ld", &utime, &stime) != 2)
+        return -1;
+    return utime + stime;
+}
+
+static void set_nonblock(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void *echo_thread(void *arg)
+{
+    int ep = epoll_create1(0);
+    struct epoll_event ev, events[BENCH_MAX_EVENTS];
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(ep, EPOLL_CTL_ADD, echo_listen_fd, &ev);
+
+    char buf[65536];
+    for (;;) {
+        int n = epoll_wait(ep, events, BENCH_MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            EchoConn *conn = (EchoConn *)events[i].data.ptr;
+            if (!conn) {
+                int fd;
+                while ((fd = accept(echo_listen_fd, NULL, NULL)) >= 0) {
+                    int one = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    set_nonblock(fd);
+                    EchoConn *c = new EchoConn;
+                    c->fd = fd;
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = c;
+                    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+                }
+                continue;
+            }
+
+            bool closed = false;
+            if (events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) {
+                for (;;) {
+                    ssize_t r = read(conn->fd, buf, sizeof(buf));
+                    if (r > 0) {
+                        conn->pending.append(buf, r);
+                    } else {
+                        if (r == 0 || (errno != EAGAIN && errno != EINTR))
+                            closed = true;
+                        break;
+                    }
+                }
+            }
+            if (!closed && !conn->pending.empty()) {
+                ssize_t w = write(conn->fd, conn->pending.data(), conn->pending.size());
+                if (w > 0)
+                    conn->pending.erase(0, w);
+                else if (w < 0 && errno != EAGAIN)
+                    closed = true;
+                ev.events = conn->pending.empty() ? EPOLLIN : (EPOLLIN|EPOLLOUT);
+                ev.data.ptr = conn;
+                epoll_ctl(ep, EPOLL_CTL_MOD, conn->fd, &ev);
+            }
+            if (closed) {
+                close(conn->fd);
+                delete conn;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int start_echo_server()
+{
+    echo_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(echo_listen_fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+        listen(echo_listen_fd, 4096) != 0) {
+        perror("echo listen");
+        return -1;
+    }
+    socklen_t len = sizeof(sin);
+    getsockname(echo_listen_fd, (struct sockaddr *)&sin, &len);
+    echo_port = ntohs(sin.sin_port);
+    set_nonblock(echo_listen_fd);
+
+    pthread_t tid;
+    return pthread_create(&tid, NULL, echo_thread, NULL);
+}
+
+static void usage()
+{
+    cout << "usage: tunnel_bench -x proxy_ip:port [-c conns] [-s size] [-d seconds] [-p proxy_pid]" << endl;
+}
+
+int main(int argc, char **argv)
+{
+    string proxy;
+    int conns = 100;
+    int size = 4096;
+    int duration = 10;
+    int proxy_pid = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "x:c:s:d:p:")) != -1) {
+        switch (opt) {
+        case 'x': proxy = optarg; break;
+        case 'c': conns = atoi(optarg); break;
+        case 's': size = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'p': proxy_pid = atoi(optarg); break;
+        default: usage(); return 1;
+        }
+    }
+    size_t colon = proxy.rfind(':');
+    if (proxy.empty() || colon == string::npos || size <= 0 || conns <= 0) {
+        usage();
+        return 1;
+    }
+
+    struct rlimit rl = {(rlim_t)conns * 2 + 64, (rlim_t)conns * 2 + 64};
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    if (start_echo_server() != 0)
+        return 1;
+
+    struct sockaddr_in proxy_addr;
+    memset(&proxy_addr, 0, sizeof(proxy_addr));
+    proxy_addr.sin_family = AF_INET;
+    proxy_addr.sin_port = htons(atoi(proxy.c_str() + colon + 1));
+    inet_pton(AF_INET, proxy.substr(0, colon).c_str(), &proxy_addr.sin_addr);
+
+    char connect_req[128];
+    snprintf(connect_req, sizeof(connect_req),
+        "CONNECT 127.0.0.1:%d HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n", echo_port, echo_port);
+
+    int ep = epoll_create1(0);
+    vector<BenchConn> bench(conns);
+    for (int i = 0; i < conns; i++) {
+        BenchConn &c = bench[i];
+        c.fd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(c.fd, (struct sockaddr *)&proxy_addr, sizeof(proxy_addr)) != 0) {
+            perror("connect proxy");
+            return 1;
+        }
+        if (write(c.fd, connect_req, strlen(connect_req)) < 0) {
+            perror("write CONNECT");
+            return 1;
+        }
+        set_nonblock(c.fd);
+        c.state = BENCH_CONNECTING;
+        c.sent = c.recved = 0;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, c.fd, &ev);
+    }
+
+    string payload(size, 'x');
+    vector<char> buf(65536);
+    struct epoll_event events[BENCH_MAX_EVENTS];
+    uint64_t round_trips = 0, bytes = 0, errors = 0;
+    int established = 0;
+    uint64_t start = 0, deadline = now_us() + (uint64_t)(duration + 30) * 1000000;
+    long cpu_start = 0;
+
+    while (now_us() < deadline) {
+        int n = epoll_wait(ep, events, BENCH_MAX_EVENTS, 100);
+        for (int i = 0; i < n; i++) {
+            BenchConn &c = bench[events[i].data.u32];
+            ssize_t r = read(c.fd, buf.data(), buf.size());
+            if (r <= 0) {
+                if (r < 0 && errno == EAGAIN)
+                    continue;
+                errors++;
+                epoll_ctl(ep, EPOLL_CTL_DEL, c.fd, NULL);
+                continue;
+            }
+
+            if (c.state == BENCH_CONNECTING) {
+                c.header.append(buf.data(), r);
+                if (c.header.find("\r\n\r\n") == string::npos)
+                    continue;
+                if (c.header.compare(0, 12, "HTTP/1.1 200") != 0 &&
+                    c.header.compare(0, 12, "HTTP/1.0 200") != 0) {
+                    errors++;
+                    epoll_ctl(ep, EPOLL_CTL_DEL, c.fd, NULL);
+                    continue;
+                }
+                c.state = BENCH_RUNNING;
+                if (++established == conns) {
+                    // 所有隧道都建立好后开始计时
+                    start = now_us();
+                    deadline = start + (uint64_t)duration * 1000000;
+                    if (proxy_pid)
+                        cpu_start = proc_cpu_ticks(proxy_pid);
+                    for (int j = 0; j < conns; j++) {
+                        if (bench[j].state == BENCH_RUNNING &&
+                            write(bench[j].fd, payload.data(), size) == size)
+                            bench[j].sent = size;
+                    }
+                }
+                continue;
+            }
+
+            c.recved += r;
+            bytes += r;
+            if (c.recved >= c.sent && c.sent > 0) {
+                round_trips++;
+                c.recved = 0;
+                if (write(c.fd, payload.data(), size) != size)
+                    errors++;
+            }
+        }
+        if (!start && established + (int)errors >= conns && established > 0) {
+            cout << "only " << established << " tunnels established" << endl;
+            return 1;
+        }
+    }
+
+    if (!start) {
+        cout << "tunnels not established: " << established << "/" << conns << endl;
+        return 1;
+    }
+
+    double secs = (now_us() - start) / 1e6;
+    printf("conns:%d size:%d duration:%.1fs errors:%lu\n", conns, size, secs, (unsigned long)errors);
+    printf("round_trips/s:%.0f throughput:%.1f MB/s\n", round_trips / secs, bytes * 2 / secs / 1e6);
+    if (proxy_pid) {
+        long cpu_end = proc_cpu_ticks(proxy_pid);
+        double cpu_secs = (double)(cpu_end - cpu_start) / sysconf(_SC_CLK_TCK);
+        printf("proxy cpu:%.2fs (%.1f%%) cpu_per_round_trip:%.2fus\n", cpu_secs,
+            cpu_secs / secs * 100, round_trips ? cpu_secs * 1e6 / round_trips : 0.0);
+    }
+    return 0;
+}
@@ -0,0 +1,672 @@
+#include <iostream>
+
+extern "C" {
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+}
+
+#include "uring_tunnel.h"
+
+using namespace std;
+
+enum URING_OP_TYPE {
+    URING_OP_RECV = 1,
+    URING_OP_SEND,
+    URING_OP_CANCEL
+};
+
+// user_data: 高32位隧道id, 8~15位操作类型, 低8位方向
+#define URING_USER_DATA(_id, _type, _dir) \
+    (((uint64_t)(_id) << 32) | ((uint64_t)(_type) << 8) | (uint64_t)(_dir))
+#define URING_DATA_ID(_v) ((uint32_t)((_v) >> 32))
+#define URING_DATA_TYPE(_v) ((int)(((_v) >> 8) & 0xff))
+#define URING_DATA_DIR(_v) ((int)((_v) & 0xff))
+
+#define URING_BGID (0)
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_event_cb(evutil_socket_t fd, short what, void *arg)
+{
+    uint64_t value;
+    if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        perror("read eventfd");
+    ((UringTunnelEngine *)arg)->ProcessCompletions();
+}
+
+UringTunnelEngine::UringTunnelEngine()
+{
+    ring_fd = -1;
+    event_fd = -1;
+    ev = NULL;
+    sq_ptr = cq_ptr = NULL;
+    sq_ptr_len = cq_ptr_len = sqes_len = 0;
+    sqes = NULL;
+    buf_ring = NULL;
+    buf_ring_len = 0;
+    buf_base = NULL;
+    buf_count = URING_BUF_COUNT;
+    buf_size = URING_BUF_SIZE;
+    buf_tail = 0;
+    buf_published = 0;
+    buf_in_use = 0;
+    sq_local_tail = sq_submitted = 0;
+    active = 0;
+    stat_enter = stat_cqe = stat_send_chain = stat_starved = stat_throttled = 0;
+    stat_bytes[0] = stat_bytes[1] = 0;
+}
+
+UringTunnelEngine::~UringTunnelEngine()
+{
+    Uninit();
+}
+
+int UringTunnelEngine::Init(struct event_base *base)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER;
+    p.cq_entries = URING_ENTRIES * 4;
+    ring_fd = io_uring_setup(URING_ENTRIES, &p);
+    if (ring_fd < 0 && errno == EINVAL) {
+        // 老内核不支持 SINGLE_ISSUER
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_ENTRIES * 4;
+        ring_fd = io_uring_setup(URING_ENTRIES, &p);
+    }
+    if (ring_fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    sq_ptr_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ptr_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_ptr_len > sq_ptr_len)
+            sq_ptr_len = cq_ptr_len;
+        cq_ptr_len = 0;
+    }
+
+    sq_ptr = mmap(NULL, sq_ptr_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+        ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        sq_ptr = NULL;
+        perror("mmap sq ring");
+        Uninit();
+        return -1;
+    }
+
+    if (cq_ptr_len) {
+        cq_ptr = mmap(NULL, cq_ptr_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+            ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            cq_ptr = NULL;
+            perror("mmap cq ring");
+            Uninit();
+            return -1;
+        }
+    } else {
+        cq_ptr = sq_ptr;
+    }
+
+    sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *)mmap(NULL, sqes_len, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        sqes = NULL;
+        perror("mmap sqes");
+        Uninit();
+        return -1;
+    }
+
+    sq_entries = p.sq_entries;
+    sq_head = (unsigned *)((char *)sq_ptr + p.sq_off.head);
+    sq_tail = (unsigned *)((char *)sq_ptr + p.sq_off.tail);
+    sq_mask = (unsigned *)((char *)sq_ptr + p.sq_off.ring_mask);
+    sq_flags = (unsigned *)((char *)sq_ptr + p.sq_off.flags);
+    sq_array = (unsigned *)((char *)sq_ptr + p.sq_off.array);
+    cq_head = (unsigned *)((char *)cq_ptr + p.cq_off.head);
+    cq_tail = (unsigned *)((char *)cq_ptr + p.cq_off.tail);
+    cq_mask = (unsigned *)((char *)cq_ptr + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)((char *)cq_ptr + p.cq_off.cqes);
+
+    // sqe 下标和 sq 数组一一对应, 之后不再修改
+    for (unsigned i = 0; i < sq_entries; i++)
+        sq_array[i] = i;
+    sq_local_tail = sq_submitted = *sq_tail;
+
+    // 注册 provided buffer ring, 所有隧道共享
+    buf_ring_len = buf_count * sizeof(struct io_uring_buf);
+    buf_ring = (struct io_uring_buf_ring *)mmap(NULL, buf_ring_len, PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (buf_ring == MAP_FAILED) {
+        buf_ring = NULL;
+        perror("mmap buf ring");
+        Uninit();
+        return -1;
+    }
+    if (posix_memalign((void **)&buf_base, 4096, (size_t)buf_count * buf_size) != 0) {
+        buf_base = NULL;
+        printf("alloc uring buffers failed\n");
+        Uninit();
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+    reg.ring_entries = buf_count;
+    reg.bgid = URING_BGID;
+    if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        perror("IORING_REGISTER_PBUF_RING");
+        Uninit();
+        return -1;
+    }
+    buf_tail = 0;
+    buf_published = 0;
+    buf_in_use = buf_count;
+    for (unsigned i = 0; i < buf_count; i++)
+        ReturnBuffer(i);
+    PublishBuffers();
+
+    // 完成事件通过 eventfd 通知 libevent
+    event_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (event_fd < 0 || io_uring_register(ring_fd, IORING_REGISTER_EVENTFD, &event_fd, 1) != 0) {
+        perror("IORING_REGISTER_EVENTFD");
+        Uninit();
+        return -1;
+    }
+    ev = event_new(base, event_fd, EV_READ|EV_PERSIST, uring_event_cb, this);
+    if (!ev || event_add(ev, NULL) != 0) {
+        printf("add uring event failed\n");
+        Uninit();
+        return -1;
+    }
+
+    printf("io_uring tunnel engine ready, entries:%u buffers:%u*%u\n",
+        sq_entries, buf_count, buf_size);
+    return 0;
+}
+
+void UringTunnelEngine::Uninit()
+{
+    if (ring_fd >= 0 && active > 0) {
+        // 关闭所有隧道, 等待所有请求完成后才能释放 buffer
+        for (size_t i = 0; i < tunnels.size(); i++) {
+            if (tunnels[i] && !tunnels[i]->closing)
+                StartClose(tunnels[i]);
+        }
+        for (int retry = 0; active > 0 && retry < 100; retry++) {
+            Submit(1);
+            ProcessCompletions();
+        }
+        if (active > 0)
+            printf("io_uring engine exit with %zu tunnels still active\n", active);
+    }
+
+    if (ev) {
+        event_free(ev);
+        ev = NULL;
+    }
+    if (event_fd >= 0) {
+        close(event_fd);
+        event_fd = -1;
+    }
+    if (sqes) {
+        munmap(sqes, sqes_len);
+        sqes = NULL;
+    }
+    if (cq_ptr && cq_ptr != sq_ptr)
+        munmap(cq_ptr, cq_ptr_len);
+    cq_ptr = NULL;
+    if (sq_ptr) {
+        munmap(sq_ptr, sq_ptr_len);
+        sq_ptr = NULL;
+    }
+    if (ring_fd >= 0) {
+        close(ring_fd);
+        ring_fd = -1;
+    }
+    if (buf_ring) {
+        munmap(buf_ring, buf_ring_len);
+        buf_ring = NULL;
+    }
+    if (buf_base) {
+        free(buf_base);
+        buf_base = NULL;
+    }
+}
+
+// sq 满时先提交一次, 腾出位置
+struct io_uring_sqe *UringTunnelEngine::GetSqe()
+{
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (sq_local_tail - head >= sq_entries) {
+        Submit(0);
+        head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (sq_local_tail - head >= sq_entries)
+            return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &sqes[sq_local_tail & *sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_local_tail++;
+    return sqe;
+}
+
+int UringTunnelEngine::Submit(unsigned wait_nr)
+{
+    unsigned to_submit = sq_local_tail - sq_submitted;
+    if (to_submit == 0 && wait_nr == 0 && !(*sq_flags & IORING_SQ_CQ_OVERFLOW))
+        return 0;
+
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    int ret;
+    do {
+        ret = io_uring_enter(ring_fd, to_submit, wait_nr,
+            (wait_nr || (*sq_flags & IORING_SQ_CQ_OVERFLOW)) ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR);
+    stat_enter++;
+
+    if (ret < 0) {
+        if (errno != EAGAIN && errno != EBUSY)
+            perror("io_uring_enter");
+        return -1;
+    }
+    sq_submitted += ret;
+    return ret;
+}
+
+void UringTunnelEngine::ReturnBuffer(int bid)
+{
+    buf_in_use--;
+    // C++ 下内核头文件里 bufs 的偏移是 8 而不是 0, 直接按数组访问
+    struct io_uring_buf *buf = (struct io_uring_buf *)buf_ring + (buf_tail & (buf_count - 1));
+    buf->addr = (uint64_t)(uintptr_t)(buf_base + (size_t)bid * buf_size);
+    buf->len = buf_size;
+    buf->bid = bid;
+    buf_tail++;
+}
+
+void UringTunnelEngine::PublishBuffers()
+{
+    if (buf_tail == buf_published)
+        return;
+    buf_published = buf_tail;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+void UringTunnelEngine::ReleaseChunk(const UringChunk &chunk)
+{
+    if (chunk.bid >= 0)
+        ReturnBuffer(chunk.bid);
+    else
+        free(chunk.data);
+}
+
+void UringTunnelEngine::ArmRecv(UringTunnel *t, int d)
+{
+    UringDir &dir = t->dir[d];
+    struct io_uring_sqe *sqe = GetSqe();
+    if (!sqe) {
+        StartClose(t);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = dir.from_fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_USER_DATA(t->id, URING_OP_RECV, d);
+    dir.recv_armed = true;
+}
+
+// 同一方向同时只有一条 send 链在执行, 链内用 IOSQE_IO_LINK 保证顺序
+void UringTunnelEngine::FlushDir(UringTunnel *t, int d)
+{
+    UringDir &dir = t->dir[d];
+    if (t->closing || !dir.inflight.empty() || dir.pending.empty())
+        return;
+
+    // 一条链必须在同一次 io_uring_enter 里提交, 先确保 sq 有足够空间
+    unsigned n = dir.pending.size();
+    if (n > URING_SEND_CHAIN_MAX)
+        n = URING_SEND_CHAIN_MAX;
+    if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + n > sq_entries)
+        Submit(0);
+    if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + n > sq_entries) {
+        StartClose(t);
+        return;
+    }
+
+    for (unsigned i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe = GetSqe();
+        UringChunk chunk = dir.pending.front();
+        dir.pending.pop_front();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = dir.to_fd;
+        sqe->addr = (uint64_t)(uintptr_t)chunk.data;
+        sqe->len = chunk.len;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = URING_USER_DATA(t->id, URING_OP_SEND, d);
+        if (i + 1 < n)
+            sqe->flags = IOSQE_IO_LINK;
+        dir.inflight.push_back(chunk);
+    }
+    stat_send_chain++;
+}
+
+// 对端接收慢, 取消 multishot recv, 数据发完后再重新接收
+void UringTunnelEngine::ThrottleDir(UringTunnel *t, int d)
+{
+    UringDir &dir = t->dir[d];
+    if (dir.throttled || !dir.recv_armed ||
+        dir.pending.size() + dir.inflight.size() < URING_DIR_MAX_CHUNKS)
+        return;
+
+    struct io_uring_sqe *sqe = GetSqe();
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = URING_USER_DATA(t->id, URING_OP_RECV, d);
+    sqe->user_data = URING_USER_DATA(t->id, URING_OP_CANCEL, d);
+    t->cancel_inflight++;
+    dir.throttled = true;
+    stat_throttled++;
+}
+
+// shutdown 会让未完成的 recv 返回 0, send 返回 EPIPE
+void UringTunnelEngine::StartClose(UringTunnel *t)
+{
+    if (t->closing)
+        return;
+    t->closing = true;
+
+    shutdown(t->dir[0].from_fd, SHUT_RDWR);
+    shutdown(t->dir[1].from_fd, SHUT_RDWR);
+    for (int d = 0; d < 2; d++) {
+        for (auto &chunk : t->dir[d].pending)
+            ReleaseChunk(chunk);
+        t->dir[d].pending.clear();
+        t->dir[d].starved = false;
+    }
+    TryFinish(t);
+}
+
+void UringTunnelEngine::TryFinish(UringTunnel *t)
+{
+    if (!t->closing || t->cancel_inflight > 0)
+        return;
+    for (int d = 0; d < 2; d++) {
+        if (t->dir[d].recv_armed || !t->dir[d].inflight.empty())
+            return;
+    }
+
+    tunnels[t->id] = NULL;
+    free_ids.push_back(t->id);
+    active--;
+
+    uring_tunnel_close_cb cb = t->close_cb;
+    void *arg = t->arg;
+    uint64_t bytes[2] = {t->bytes[0], t->bytes[1]};
+    delete t;
+    cb(arg, bytes);
+}
+
+void UringTunnelEngine::OnRecv(UringTunnel *t, int d, struct io_uring_cqe *cqe)
+{
+    UringDir &dir = t->dir[d];
+    int res = cqe->res;
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        dir.recv_armed = false;
+
+    if (res > 0) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        buf_in_use++;
+        if (t->closing) {
+            ReturnBuffer(bid);
+        } else {
+            UringChunk chunk;
+            chunk.bid = bid;
+            chunk.data = buf_base + (size_t)bid * buf_size;
+            chunk.len = res;
+            dir.pending.push_back(chunk);
+            stat_bytes[d] += res;
+            t->bytes[d] += res;
+            FlushDir(t, d);
+            ThrottleDir(t, d);
+        }
+    } else if (res == 0) {
+        dir.eof = true;
+    } else if (res == -ENOBUFS) {
+        if (!t->closing && !dir.starved) {
+            dir.starved = true;
+            starved.push_back(URING_USER_DATA(t->id, 0, d));
+            stat_starved++;
+        }
+    } else if (res == -ECANCELED && dir.throttled) {
+        // 主动取消, 等发送完成后重新接收
+    } else if (!t->closing) {
+        if (res != -ECONNRESET)
+            printf("uring recv error:%s\n", strerror(-res));
+        StartClose(t);
+    }
+
+    if (t->closing) {
+        TryFinish(t);
+        return;
+    }
+
+    // 对端关闭后, 把已收到的数据发完再关闭隧道
+    if (dir.eof) {
+        if (dir.pending.empty() && dir.inflight.empty())
+            StartClose(t);
+        return;
+    }
+    if (!dir.recv_armed && !dir.starved && !dir.throttled)
+        ArmRecv(t, d);
+}
+
+void UringTunnelEngine::OnSend(UringTunnel *t, int d, int res)
+{
+    UringDir &dir = t->dir[d];
+    if (dir.inflight.empty()) {
+        printf("uring send completion without request\n");
+        return;
+    }
+
+    UringChunk chunk = dir.inflight.front();
+    dir.inflight.pop_front();
+    ReleaseChunk(chunk);
+
+    if (res < 0 || (uint32_t)res != chunk.len) {
+        if (!t->closing && res != -EPIPE && res != -ECONNRESET)
+            printf("uring send error:%d len:%u\n", res, chunk.len);
+        StartClose(t);
+    }
+
+    if (t->closing) {
+        TryFinish(t);
+        return;
+    }
+
+    if (dir.inflight.empty()) {
+        FlushDir(t, d);
+        if (dir.eof && dir.pending.empty() && dir.inflight.empty()) {
+            StartClose(t);
+            return;
+        }
+    }
+
+    if (dir.throttled && !dir.recv_armed &&
+        dir.pending.size() + dir.inflight.size() <= URING_DIR_MAX_CHUNKS / 2) {
+        dir.throttled = false;
+        if (!dir.eof && !dir.starved)
+            ArmRecv(t, d);
+    }
+}
+
+// buffer 归还后, 重新接收之前因 buffer 不足停下的方向
+void UringTunnelEngine::RearmStarved()
+{
+    if (starved.empty())
+        return;
+
+    vector<uint64_t> list;
+    list.swap(starved);
+    for (size_t i = 0; i < list.size(); i++) {
+        uint32_t id = URING_DATA_ID(list[i]);
+        int d = URING_DATA_DIR(list[i]);
+        UringTunnel *t = id < tunnels.size() ? tunnels[id] : NULL;
+        if (!t || t->closing || !t->dir[d].starved)
+            continue;
+        t->dir[d].starved = false;
+        if (!t->dir[d].recv_armed && !t->dir[d].throttled && !t->dir[d].eof)
+            ArmRecv(t, d);
+    }
+}
+
+void UringTunnelEngine::ProcessCompletions()
+{
+    if (ring_fd < 0)
+        return;
+
+    for (;;) {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+            break;
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            uint64_t data = cqe->user_data;
+            uint32_t id = URING_DATA_ID(data);
+            int d = URING_DATA_DIR(data);
+            UringTunnel *t = id < tunnels.size() ? tunnels[id] : NULL;
+            stat_cqe++;
+
+            if (!t) {
+                // 隧道已经释放, 收到的数据直接归还
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                    buf_in_use++;
+                    ReturnBuffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+                continue;
+            }
+
+            switch (URING_DATA_TYPE(data)) {
+            case URING_OP_RECV:
+                OnRecv(t, d, cqe);
+                break;
+            case URING_OP_SEND:
+                OnSend(t, d, cqe->res);
+                break;
+            case URING_OP_CANCEL:
+                t->cancel_inflight--;
+                TryFinish(t);
+                break;
+            default:
+                break;
+            }
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+        // 这一批有 buffer 归还才重新接收, 否则会马上再次 ENOBUFS
+        uint16_t published = buf_published;
+        PublishBuffers();
+        if (published != buf_published)
+            RearmStarved();
+        // 一批完成事件处理完只提交一次
+        Submit(0);
+    }
+}
+
+int UringTunnelEngine::AddTunnel(int client_fd, int upstream_fd, struct evbuffer *to_client,
+    struct evbuffer *to_upstream, uring_tunnel_close_cb cb, void *arg)
+{
+    if (ring_fd < 0)
+        return -1;
+
+    UringTunnel *t = new UringTunnel;
+    if (free_ids.empty()) {
+        t->id = tunnels.size();
+        tunnels.push_back(t);
+    } else {
+        t->id = free_ids.back();
+        free_ids.pop_back();
+        tunnels[t->id] = t;
+    }
+    active++;
+
+    t->closing = false;
+    t->cancel_inflight = 0;
+    t->bytes[0] = t->bytes[1] = 0;
+    t->close_cb = cb;
+    t->arg = arg;
+    t->dir[0].from_fd = client_fd;
+    t->dir[0].to_fd = upstream_fd;
+    t->dir[1].from_fd = upstream_fd;
+    t->dir[1].to_fd = client_fd;
+
+    struct evbuffer *initial[2] = {to_upstream, to_client};
+    for (int d = 0; d < 2; d++) {
+        UringDir &dir = t->dir[d];
+        dir.recv_armed = dir.throttled = dir.starved = dir.eof = false;
+
+        size_t len = initial[d] ? evbuffer_get_length(initial[d]) : 0;
+        if (len > 0) {
+            UringChunk chunk;
+            chunk.bid = -1;
+            chunk.data = (char *)malloc(len);
+            chunk.len = len;
+            // bufferevent 的输出缓冲头部是冻结的, 不解冻 evbuffer_remove 会失败
+            evbuffer_unfreeze(initial[d], 1);
+            if (chunk.data && evbuffer_remove(initial[d], chunk.data, len) == (int)len)
+                dir.pending.push_back(chunk);
+            else
+                free(chunk.data);
+        }
+    }
+
+    for (int d = 0; d < 2; d++) {
+        FlushDir(t, d);
+        ArmRecv(t, d);
+    }
+    Submit(0);
+    return 0;
+}
+
+void UringTunnelEngine::DumpStats(struct evbuffer *buf)
+{
+    evbuffer_add_printf(buf, "uring.tunnels %zu\n", active);
+    evbuffer_add_printf(buf, "uring.enter %lu\n", (unsigned long)stat_enter);
+    evbuffer_add_printf(buf, "uring.cqe %lu\n", (unsigned long)stat_cqe);
+    evbuffer_add_printf(buf, "uring.send_chain %lu\n", (unsigned long)stat_send_chain);
+    evbuffer_add_printf(buf, "uring.starved %lu\n", (unsigned long)stat_starved);
+    evbuffer_add_printf(buf, "uring.throttled %lu\n", (unsigned long)stat_throttled);
+    evbuffer_add_printf(buf, "uring.bytes_to_upstream %lu\n", (unsigned long)stat_bytes[0]);
+    evbuffer_add_printf(buf, "uring.bytes_to_client %lu\n", (unsigned long)stat_bytes[1]);
+    evbuffer_add_printf(buf, "uring.buffers_in_use %u\n", buf_in_use);
+}
@@ -0,0 +1,137 @@
+#ifndef HTTP_PROXY_URING_TUNNEL_H
+#define HTTP_PROXY_URING_TUNNEL_H
+
+#include <deque>
+#include <vector>
+
+extern "C" {
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+}
+
+// 基于 io_uring 的 CONNECT 隧道数据转发
+// 每个方向一个 multishot recv, 数据收进共享的 provided buffer ring,
+// 再用 IOSQE_IO_LINK 串起来的 send 按顺序发给对端, 发完后 buffer 归还 ring
+
+#define URING_ENTRIES (4096)
+#define URING_BUF_COUNT (4096)        // 必须是 2 的幂, 最大 32768
+#define URING_BUF_SIZE (16 * 1024)
+#define URING_SEND_CHAIN_MAX (16)     // 一次提交的最大 send 链长度
+#define URING_DIR_MAX_CHUNKS (64)     // 单方向积压的 buffer 数超过后暂停接收
+
+// bytes[0]: client -> upstream 字节数, bytes[1]: upstream -> client 字节数
+typedef void (*uring_tunnel_close_cb)(void *arg, const uint64_t *bytes);
+
+struct UringChunk {
+    int bid;            // provided buffer id, -1 表示 malloc 出来的内存
+    char *data;
+    uint32_t len;
+};
+
+struct UringDir {
+    int from_fd;
+    int to_fd;
+    bool recv_armed;
+    bool throttled;     // 发送积压, 已取消接收
+    bool starved;       // buffer ring 用完, 等待归还后重新接收
+    bool eof;
+    std::deque<UringChunk> pending;    // 已收到, 还未提交发送
+    std::deque<UringChunk> inflight;   // 已提交的 send 链, 按顺序完成
+};
+
+struct UringTunnel {
+    uint32_t id;
+    bool closing;
+    int cancel_inflight;
+    UringDir dir[2];    // 0: client -> upstream, 1: upstream -> client
+    uint64_t bytes[2];
+    uring_tunnel_close_cb close_cb;
+    void *arg;
+};
+
+class UringTunnelEngine
+{
+    private:
+        int ring_fd;
+        int event_fd;
+        struct event *ev;
+
+        unsigned sq_entries;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_flags;
+        unsigned *sq_array;
+        unsigned sq_local_tail;
+        unsigned sq_submitted;
+        struct io_uring_sqe *sqes;
+
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        void *sq_ptr;
+        size_t sq_ptr_len;
+        void *cq_ptr;
+        size_t cq_ptr_len;
+        size_t sqes_len;
+
+        struct io_uring_buf_ring *buf_ring;
+        size_t buf_ring_len;
+        char *buf_base;
+        unsigned buf_count;
+        unsigned buf_size;
+        uint16_t buf_tail;
+        uint16_t buf_published;
+        unsigned buf_in_use;
+
+        std::vector<UringTunnel *> tunnels;
+        std::vector<uint32_t> free_ids;
+        std::vector<uint64_t> starved;
+        size_t active;
+
+        // 统计
+        uint64_t stat_enter;
+        uint64_t stat_cqe;
+        uint64_t stat_send_chain;
+        uint64_t stat_starved;
+        uint64_t stat_throttled;
+        uint64_t stat_bytes[2];
+
+        struct io_uring_sqe *GetSqe();
+        int Submit(unsigned wait_nr);
+        void ArmRecv(UringTunnel *t, int d);
+        void FlushDir(UringTunnel *t, int d);
+        void ThrottleDir(UringTunnel *t, int d);
+        void ReleaseChunk(const UringChunk &chunk);
+        void ReturnBuffer(int bid);
+        void PublishBuffers();
+        void StartClose(UringTunnel *t);
+        void TryFinish(UringTunnel *t);
+        void OnRecv(UringTunnel *t, int d, struct io_uring_cqe *cqe);
+        void OnSend(UringTunnel *t, int d, int res);
+        void RearmStarved();
+
+    public:
+        UringTunnelEngine();
+        ~UringTunnelEngine();
+
+        int Init(struct event_base *base);
+        void Uninit();
+        bool IsReady() {
+            return ring_fd >= 0;
+        }
+
+        // 接管一条已建立的隧道, to_client/to_upstream 中尚未发送的数据会先发出去
+        // 隧道结束后调用 cb(arg, bytes), 由调用者释放 socket
+        int AddTunnel(int client_fd, int upstream_fd, struct evbuffer *to_client,
+            struct evbuffer *to_upstream, uring_tunnel_close_cb cb, void *arg);
+        void ProcessCompletions();
+        void DumpStats(struct evbuffer *buf);
+};
+
+#endif
@@ -1,110 +1,137 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
+#include <stdatomic.h>
 #include <sched.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/membarrier.h>
 #include "rqueue.h"
 
-#define RQUEUE_FLAG_HEAD   (0x01)
-#define RQUEUE_FLAG_UPDATE (0x02)
-#define RQUEUE_FLAG_ALL    (0x03)
+#define RQUEUE_MIN_SIZE 4
 
-#define RQUEUE_FLAG_ON(_addr, _flag) (rqueue_page_t *)(((intptr_t) (_addr) & -4) | (_flag))
-#define RQUEUE_FLAG_OFF(_addr, _flag) (rqueue_page_t *)((intptr_t) (_addr) & ~(_flag))
-
-#define RQUEUE_CHECK_FLAG(_addr, _flag) (((intptr_t) (_addr) & (_flag)) == (_flag))
-
-#define RQUEUE_MAX_RETRIES 100
-
-#define RQUEUE_MIN_SIZE 3
-
-#ifdef USE_PACKED_STRUCTURES
-#define PACK_IF_NECESSARY __attribute__((packed))
-#else
-#define PACK_IF_NECESSARY
+// build with -DRQUEUE_CACHE_LINE=8 to get the compact layout back (e.g. to compare)
+#ifndef RQUEUE_CACHE_LINE
+#define RQUEUE_CACHE_LINE 64
 #endif
+#define RQUEUE_CACHE_ALIGNED __attribute__((aligned(RQUEUE_CACHE_LINE)))
+
+// 1 once the process is registered for expedited membarrier, -1 if the kernel can't do it
+static atomic_int rqueue_membarrier_state;
 
-typedef struct _rqueue_page_s {
+/*
+ * Bounded MPMC ring (D. Vyukov): a power-of-two array of slots, each one
+ * carrying a sequence number which tells who owns it.
+ *
+ *   seq == pos              the slot is free, the writer claiming pos may fill it
+ *   seq == pos + 1          the slot holds the value written at pos, readable
+ *   seq == pos + capacity   the value has been consumed, free for the next lap
+ *
+ * Writers claim a position with a single CAS on tail, readers with a single
+ * CAS on head; there is no lock shared between writers, nor between writers
+ * and readers.
+ *
+ * A queue created with rqueue_create_spsc() doesn't use the sequence numbers:
+ * the only writer owns tail and the only reader owns head, each of them keeps
+ * a cached copy of the other index and reloads it only when the queue looks
+ * full (or empty), so most operations don't even touch the other side's line.
+ *
+ * rqueue_read_wait()/rqueue_write_wait() park the caller on a futex only when
+ * the queue is empty/full. A waiter registers itself in read_waiters (or
+ * write_waiters) before checking the queue one last time, and the other side
+ * only enters the kernel when it finds a registered waiter after publishing.
+ * The store-load ordering this needs is made asymmetric: the waiter issues
+ * membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED), which runs a full barrier on
+ * every other thread of the process, so the non-waiting path only needs a
+ * compiler barrier before loading the waiter count. Kernels without expedited
+ * membarrier fall back to a seq_cst fence on both sides.
+ *
+ * Memory ordering: a value is published by a release store (of the slot
+ * sequence number, or of tail for spsc) and picked up by an acquire load of
+ * the same variable; a consumed slot is handed back the same way. Claiming a
+ * position is a relaxed CAS, the slot ownership itself being carried by the
+ * sequence numbers. The only sequentially consistent operations are the
+ * waiter registration and, without membarrier, the fence in rqueue_wake().
+ *
+ * Layout: the descriptor is split in cache lines by who writes them, so the
+ * writers moving tail don't invalidate the line the readers move head on
+ * (and vice versa). The slots follow the descriptor in the same aligned
+ * allocation, a slot never straddles two lines.
+ */
+typedef struct _rqueue_slot_s {
+    _Atomic uint64_t    seq;
     void               *value;
-    struct _rqueue_page_s *next;
-    struct _rqueue_page_s *prev;
-} PACK_IF_NECESSARY rqueue_page_t;
+} rqueue_slot_t;
 
 struct _rqueue_s {
-    rqueue_page_t             *head;
-    rqueue_page_t             *tail;
-    rqueue_page_t             *commit;
-    rqueue_page_t             *reader;
+    // set at creation, only read afterwards
+    rqueue_slot_t             *slots;
+    uint64_t                   mask;
     rqueue_free_value_callback_t free_value_cb;
     size_t                     size;
-    int                     mode;
-    uint64_t                writes;
-    uint64_t                reads;
-    int read_sync;
-    int write_sync;
-    int num_writers;
-} PACK_IF_NECESSARY;
-
-static inline void rqueue_destroy_page(rqueue_page_t *page, rqueue_free_value_callback_t free_value_cb) {
-    if (page->value && free_value_cb)
-        free_value_cb(page->value);
-    free(page);
-}
-
-/*
-static rqueue_page_t *rqueue_create_page() {
-    rqueue_page_t *page = calloc(1, sizeof(rqueue_page_t));
-    return page;
-}
-static void *rqueue_page_value(rqueue_page_t *page) {
-    return page->value;
-}
-*/
+    int                        mode;
+    int                        spsc;
+    int                        membarrier;  // waiters issue the heavy side of the fence
+
+    // writers side
+    _Atomic uint64_t           tail RQUEUE_CACHE_ALIGNED;  // next position to write
+    uint64_t                   head_cache;  // spsc: writer's copy of head
+
+    // readers side
+    _Atomic uint64_t           head RQUEUE_CACHE_ALIGNED;  // next position to read
+    uint64_t                   tail_cache;  // spsc: reader's copy of tail
+
+    // only written on the slow paths, read by the other side on every operation
+    _Atomic uint32_t           read_futex RQUEUE_CACHE_ALIGNED;  // bumped by writers to wake parked readers
+    _Atomic uint32_t           write_futex; // bumped by readers to wake parked writers
+    atomic_int                 read_waiters;
+    atomic_int                 write_waiters;
+    _Atomic uint64_t           overwrites;  // values dropped in overwrite mode
+};
 
 rqueue_t *rqueue_create(size_t size, rqueue_mode_t mode) {
     size_t i;
-    rqueue_t *rb = calloc(1, sizeof(rqueue_t));
-    if (!rb)
-        return NULL;
-    rb->size = (size > RQUEUE_MIN_SIZE) ? size : RQUEUE_MIN_SIZE;
-    rb->mode = mode;
-    for (i = 0; i <= size; i++) { // NOTE : we create one page more than the requested size
-        rqueue_page_t *page = calloc(1, sizeof(rqueue_page_t));
-        if (!page) {
-            free(rb);
-            // TODO - free the pages allocated so far
-            return NULL;
-        }
-        if (!rb->head) {
-            rb->head = rb->tail = page;
-        } else if (rb->tail) {
-            rb->tail->next = page;
-        }
-        page->prev = rb->tail;
-        rb->tail = page;
-    }
+    rqueue_t *rb;
+    void *mem;
 
-    if (!rb->head || !rb->tail) {
-        free(rb);
-        return NULL;
-    }
+    // round up to a power of two so that positions map to slots with a mask
+    size_t capacity = RQUEUE_MIN_SIZE;
+    while (capacity < size)
+        capacity <<= 1;
 
-    // close the ringbuffer
-    rb->head->prev = rb->tail;
-    rb->tail->next = rb->head;
-    rb->tail->next = RQUEUE_FLAG_ON(rb->tail->next, RQUEUE_FLAG_HEAD);
+    // sizeof(rqueue_t) is a multiple of its alignment, the slots start on a new line
+    size_t len = sizeof(rqueue_t) + capacity * sizeof(rqueue_slot_t);
+    if (posix_memalign(&mem, RQUEUE_CACHE_LINE, len) != 0)
+        return NULL;
+    memset(mem, 0, len);
+    rb = mem;
+    rb->slots = (rqueue_slot_t *)(rb + 1);
+    rb->size = capacity;
+    rb->mode = mode;
+    rb->mask = rb->size - 1;
 
-    rb->tail = rb->head;
+    for (i = 0; i < rb->size; i++)
+        atomic_init(&rb->slots[i].seq, i);
 
-    rb->commit = rb->tail;
+    // the registration is per process, racing creators just register twice
+    int state = atomic_load_explicit(&rqueue_membarrier_state, memory_order_relaxed);
+    if (state == 0) {
+        state = syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0 ? 1 : -1;
+        atomic_store_explicit(&rqueue_membarrier_state, state, memory_order_relaxed);
+    }
+    rb->membarrier = (state == 1);
+    return rb;
+}
 
-    // the reader page is out of the ringbuffer
-    rb->reader = calloc(1, sizeof(rqueue_page_t));
-    if (!rb->reader) {
-        free(rb);
+rqueue_t *rqueue_create_spsc(size_t size) {
+    rqueue_t *rb = rqueue_create(size, RQUEUE_MODE_BLOCKING);
+    if (!rb)
         return NULL;
-    }
-    rb->reader->prev = rb->head->prev;
-    rb->reader->next = rb->head;
+    rb->spsc = 1;
     return rb;
 }
 
@@ -113,223 +140,372 @@ void rqueue_set_free_value_callback(rqueue_t *rb, rqueue_free_value_callback_t c
 }
 
 void rqueue_destroy(rqueue_t *rb) {
-    rqueue_page_t *page = rb->head;
-    do {
-        rqueue_page_t *p = page;
-        page = RQUEUE_FLAG_OFF(p->next, RQUEUE_FLAG_ALL);
-        rqueue_destroy_page(p, rb->free_value_cb);
-    } while (__builtin_expect(page != rb->head, 1));
-
-    // release the reader page as well
-    rqueue_destroy_page(rb->reader, rb->free_value_cb);
-
-    // and finally release the ringbuffer descriptor
+    void *v;
+    while ((v = rqueue_read(rb)) != NULL) {
+        if (rb->free_value_cb)
+            rb->free_value_cb(v);
+    }
+    // the slots live in the same allocation
     free(rb);
 }
 
-void *rqueue_read(rqueue_t *rb) {
-    int i;
-    void *v = NULL;
-
-    for (i = 0; i < RQUEUE_MAX_RETRIES; i++) {
+// the heavy side of the waiter fence, see rqueue_wake()
+static void rqueue_wait_fence(rqueue_t *rb) {
+    if (!rb->membarrier || syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) != 0)
+        atomic_thread_fence(memory_order_seq_cst);
+}
 
-        if (__builtin_expect(ATOMIC_CAS(rb->read_sync, 0, 1), 1)) {
-            rqueue_page_t *head = ATOMIC_READ(rb->head);
+// wakes up to count waiters, one per value published (or slot freed)
+static inline void rqueue_wake(rqueue_t *rb, _Atomic uint32_t *futex, atomic_int *waiters, int count) {
+    // pairs with the registration in the wait functions: either the waiter
+    // sees the value we just published or we see the waiter. With membarrier
+    // the waiter forces the barrier on us, we only keep the compiler from
+    // hoisting the load above the publishing store
+    if (rb->membarrier)
+        atomic_signal_fence(memory_order_seq_cst);
+    else
+        atomic_thread_fence(memory_order_seq_cst);
+    if (__builtin_expect(atomic_load_explicit(waiters, memory_order_relaxed) == 0, 1))
+        return;
+    atomic_fetch_add_explicit(futex, 1, memory_order_relaxed);
+    syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
 
-            rqueue_page_t *commit = ATOMIC_READ(rb->commit);
-            //rqueue_page_t *tail = ATOMIC_READ(rb->tail);
-            rqueue_page_t *next = ATOMIC_READ(head->next);
-            rqueue_page_t *old_next = ATOMIC_READ(rb->reader->next);
+// returns -1 once the deadline has passed, 0 when woken up (or the futex had already moved)
+static int rqueue_park(_Atomic uint32_t *futex, uint32_t seq, const struct timespec *deadline) {
+    struct timespec now, ts, *tp = NULL;
+    if (deadline) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ts.tv_sec = deadline->tv_sec - now.tv_sec;
+        ts.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+        if (ts.tv_nsec < 0) {
+            ts.tv_sec--;
+            ts.tv_nsec += 1000000000;
+        }
+        if (ts.tv_sec < 0)
+            return -1;
+        tp = &ts;
+    }
+    if (syscall(SYS_futex, futex, FUTEX_WAIT_PRIVATE, seq, tp, NULL, 0) < 0 && errno == ETIMEDOUT)
+        return -1;
+    return 0;
+}
 
-            if (rb->reader == commit || rqueue_isempty(rb))
-            { // nothing to read
-                ATOMIC_CAS(rb->read_sync, 1, 0);
-                continue;
-            }
+static void rqueue_deadline(struct timespec *deadline, int timeout_ms) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
 
-            // first connect the reader page to the head->next page
-            if (ATOMIC_CAS(rb->reader->next, old_next, RQUEUE_FLAG_ON(next, RQUEUE_FLAG_HEAD))) {
-                rb->reader->prev = head->prev;
-
-                // now connect head->prev->next to the reader page, replacing the head with the reader
-                // in the ringbuffer
-                if (ATOMIC_CAS(head->prev->next, RQUEUE_FLAG_ON(head, RQUEUE_FLAG_HEAD), rb->reader)) {
-                    // now the head is out of the ringbuffer and we can update the pointer
-                    ATOMIC_CAS(rb->head, head, next);
-
-                    next->prev = rb->reader;
-                    rb->reader = head; // the head is the new reader
-                    v = ATOMIC_READ(rb->reader->value);
-                    if (v == NULL) { 
-                        ATOMIC_CAS(rb->read_sync, 1, 0);
-                        continue;
-                    }
-                    ATOMIC_CAS(rb->reader->value, v, NULL);
-                    ATOMIC_INCREMENT(rb->reads);
-                    ATOMIC_CAS(rb->read_sync, 1, 0);
-                    break;
-                } else {
-                    fprintf(stderr, "head swap failed\n");
-                    ATOMIC_SET(rb->reader->next, old_next);
-                    sched_yield();
-                }
-            } else {
-                fprintf(stderr, "reader->next swap failed\n");
-            }
-            ATOMIC_CAS(rb->read_sync, 1, 0);
-        }
+static inline void *rqueue_read_spsc(rqueue_t *rb) {
+    // only this thread writes head
+    uint64_t pos = atomic_load_explicit(&rb->head, memory_order_relaxed);
+    if (pos == rb->tail_cache) {
+        rb->tail_cache = atomic_load_explicit(&rb->tail, memory_order_acquire);
+        if (pos == rb->tail_cache)
+            return NULL;
     }
+    rqueue_slot_t *slot = &rb->slots[pos & rb->mask];
+    void *v = slot->value;
+    slot->value = NULL;
+    // the writer may reuse the slot once it sees the new head
+    atomic_store_explicit(&rb->head, pos + 1, memory_order_release);
+    rqueue_wake(rb, &rb->write_futex, &rb->write_waiters, 1);
     return v;
 }
 
-static inline void
-rqueue_update_value(rqueue_t *rb, rqueue_page_t *page, void *value) {
-    void *old_value = ATOMIC_READ(page->value);
-    ATOMIC_CAS(page->value, old_value, value);
-    if (old_value && rb->free_value_cb)
-        rb->free_value_cb(old_value);
+static inline int rqueue_write_spsc(rqueue_t *rb, void *value) {
+    // only this thread writes tail
+    uint64_t pos = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+    if (pos - rb->head_cache > rb->mask) {
+        rb->head_cache = atomic_load_explicit(&rb->head, memory_order_acquire);
+        if (pos - rb->head_cache > rb->mask)
+            return -2;
+    }
+    rb->slots[pos & rb->mask].value = value;
+    // publish the value to the reader
+    atomic_store_explicit(&rb->tail, pos + 1, memory_order_release);
+    rqueue_wake(rb, &rb->read_futex, &rb->read_waiters, 1);
+    return 0;
 }
 
-int
-rqueue_write(rqueue_t *rb, void *value) {
-    int retries = 0;
-
-    rqueue_page_t *temp_page = NULL;
-    rqueue_page_t *next_page = NULL;
-    rqueue_page_t *tail = NULL;
-    rqueue_page_t *head = NULL;
-    rqueue_page_t *commit;
-    int count = 0;
-    
-    // TODO - get rid of this barrier
-    while (!__builtin_expect(ATOMIC_CAS(rb->write_sync, 0, 1), 1))
-        sched_yield();
-
-    ATOMIC_INCREMENT(rb->num_writers);
-    do {
-        count++;
-        temp_page = ATOMIC_READ(rb->tail);
-        commit = ATOMIC_READ(rb->commit);
-        next_page = RQUEUE_FLAG_OFF(ATOMIC_READ(temp_page->next), RQUEUE_FLAG_ALL);
-        if (!next_page) {
-            ATOMIC_DECREMENT(rb->num_writers);
-            ATOMIC_CAS(rb->write_sync, 1, 0); 
-            return -1;
+void *rqueue_read(rqueue_t *rb) {
+    rqueue_slot_t *slot;
+    uint64_t pos;
+    void *v;
+
+    if (rb->spsc)
+        return rqueue_read_spsc(rb);
+
+    pos = atomic_load_explicit(&rb->head, memory_order_relaxed);
+
+    for (;;) {
+        slot = &rb->slots[pos & rb->mask];
+        int64_t diff = (int64_t)(atomic_load_explicit(&slot->seq, memory_order_acquire) - (pos + 1));
+        if (diff == 0) {
+            // a failed CAS reloads pos
+            if (atomic_compare_exchange_weak_explicit(&rb->head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // the writer of this position hasn't published yet, nothing to read
+            return NULL;
+        } else {
+            // another reader took this position
+            pos = atomic_load_explicit(&rb->head, memory_order_relaxed);
         }
-        head = ATOMIC_READ(rb->head);
+    }
 
-        if (rb->mode == RQUEUE_MODE_BLOCKING && commit == temp_page && temp_page != head && next_page != head) {
-            if (retries++ < RQUEUE_MAX_RETRIES) {
-                ATOMIC_CAS(rb->tail, temp_page, next_page);
-                ATOMIC_DECREMENT(rb->num_writers);
-                ATOMIC_CAS(rb->write_sync, 1, 0);
-                sched_yield();
+    v = slot->value;
+    slot->value = NULL;
+    // hand the slot over to the writer of the next lap
+    atomic_store_explicit(&slot->seq, pos + rb->mask + 1, memory_order_release);
+    rqueue_wake(rb, &rb->write_futex, &rb->write_waiters, 1);
+    return v;
+}
 
-                while (!__builtin_expect(ATOMIC_CAS(rb->write_sync, 0, 1), 1))
-                    sched_yield();
+int rqueue_write(rqueue_t *rb, void *value) {
+    rqueue_slot_t *slot;
+    uint64_t pos;
+
+    if (rb->spsc)
+        return rqueue_write_spsc(rb, value);
+
+    pos = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+
+    for (;;) {
+        slot = &rb->slots[pos & rb->mask];
+        int64_t diff = (int64_t)(atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&rb->tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // the slot still holds the value written one lap ago
+            if (rb->mode == RQUEUE_MODE_BLOCKING)
+                return -2;
 
-                ATOMIC_INCREMENT(rb->num_writers);
-                continue;
+            // overwrite mode: drop the oldest value to make room
+            void *old_value = rqueue_read(rb);
+            if (old_value) {
+                atomic_fetch_add_explicit(&rb->overwrites, 1, memory_order_relaxed);
+                if (rb->free_value_cb)
+                    rb->free_value_cb(old_value);
             } else {
-                ATOMIC_DECREMENT(rb->num_writers);
-                ATOMIC_CAS(rb->write_sync, 1, 0);
-                //fprintf(stderr, "queue full: %s \n", rqueue_stats(rb));
-                return -2;
+                // a reader is still copying the value out of the slot
+                sched_yield();
             }
+            pos = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+        } else {
+            // another writer took this position
+            pos = atomic_load_explicit(&rb->tail, memory_order_relaxed);
         }
+    }
 
-       if (RQUEUE_CHECK_FLAG(ATOMIC_READ(temp_page->next), RQUEUE_FLAG_HEAD) || (next_page == head && !rqueue_isempty(rb))) {
-           /* TODO - FIXME 
-            if (rb->mode == RQUEUE_MODE_BLOCKING) {
-               if (ATOMIC_CAS(rb->read_sync, 0, 1)) { // TODO - it shouldn't be necessary to synchronize with the reader
-                   temp_page = ATOMIC_READ(rb->tail);
-                   head = ATOMIC_READ(rb->head);
-                   if (commit->next == temp_page && RQUEUE_FLAG_OFF(temp_page->next, RQUEUE_FLAG_ALL) == head) {
-                       rqueue_update_value(rb, temp_page, value);
-                       ATOMIC_SET(rb->commit, temp_page);
-                       ATOMIC_INCREMENT(rb->writes);
-                       ATOMIC_DECREMENT(rb->num_writers);
-                       ATOMIC_CAS(rb->read_sync, 1, 0);
-                       ATOMIC_CAS(rb->write_sync, 1, 0);
-                       return 0;
-                   } else {
-                       ATOMIC_DECREMENT(rb->num_writers);
-                       ATOMIC_CAS(rb->read_sync, 1, 0);
-                       ATOMIC_CAS(rb->write_sync, 1, 0);
-                       return -2;
-                   }
-                   ATOMIC_CAS(rb->read_sync, 1, 0);
-               }
-            } else if (rb->mode == RQUEUE_MODE_OVERWRITE && commit == temp_page) { */
-            if (rb->mode == RQUEUE_MODE_OVERWRITE && ATOMIC_READ(commit->next) == temp_page) {  // DELETE ME WHEN FIXED
-               if (ATOMIC_CAS(rb->read_sync, 0, 1)) { // TODO - it shouldn't be necessary to synchronize with the reader
-                    // we need to advance the head if in overwrite mode ...otherwise we must stop
-                    //fprintf(stderr, "Will advance head and overwrite old data\n");
-                    rqueue_page_t *nextpp = RQUEUE_FLAG_OFF(ATOMIC_READ(head->next), RQUEUE_FLAG_ALL);
-                    if (ATOMIC_CAS(head->next, nextpp, RQUEUE_FLAG_ON(nextpp, RQUEUE_FLAG_HEAD))) {
-                        ATOMIC_CAS(temp_page->next, RQUEUE_FLAG_ON(head, RQUEUE_FLAG_HEAD), head);
-                        ATOMIC_SET(rb->head, nextpp);
-                    }
-                   ATOMIC_CAS(rb->read_sync, 1, 0);
-                   continue;
-               }
-            }
-            if (retries++ < RQUEUE_MAX_RETRIES) {
-                ATOMIC_DECREMENT(rb->num_writers);
-                ATOMIC_CAS(rb->write_sync, 1, 0);
-                sched_yield();
+    slot->value = value;
+    // publish the value to the readers
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    rqueue_wake(rb, &rb->read_futex, &rb->read_waiters, 1);
+    return 0;
+}
 
-                while (!__builtin_expect(ATOMIC_CAS(rb->write_sync, 0, 1), 1))
-                    sched_yield();
+static int rqueue_write_batch_spsc(rqueue_t *rb, void **values, int n) {
+    uint64_t pos = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+    uint64_t free_slots = rb->mask + 1 - (pos - rb->head_cache);
+    int i;
 
-                ATOMIC_INCREMENT(rb->num_writers);
-                continue;
-            } else {
-                ATOMIC_DECREMENT(rb->num_writers);
-                ATOMIC_CAS(rb->write_sync, 1, 0);
-                //fprintf(stderr, "queue full: %s \n", rqueue_stats(rb));
-                return -2;
-            }
+    if (free_slots < (uint64_t)n) {
+        rb->head_cache = atomic_load_explicit(&rb->head, memory_order_acquire);
+        free_slots = rb->mask + 1 - (pos - rb->head_cache);
+        if (free_slots < (uint64_t)n)
+            n = (int)free_slots;
+        if (n == 0)
+            return 0;
+    }
+    for (i = 0; i < n; i++)
+        rb->slots[(pos + i) & rb->mask].value = values[i];
+    atomic_store_explicit(&rb->tail, pos + n, memory_order_release);
+    rqueue_wake(rb, &rb->read_futex, &rb->read_waiters, n);
+    return n;
+}
 
-        } 
-       
-        if (!RQUEUE_CHECK_FLAG(ATOMIC_READ(temp_page->next), RQUEUE_FLAG_HEAD)) {
-            tail = ATOMIC_CAS_RETURN(rb->tail, temp_page, next_page);
-        }
-    } while (tail != temp_page && retries++ < RQUEUE_MAX_RETRIES);
+static int rqueue_read_batch_spsc(rqueue_t *rb, void **out, int max) {
+    uint64_t pos = atomic_load_explicit(&rb->head, memory_order_relaxed);
+    int i, n = max;
 
-    if (!tail || tail != temp_page) {
-        ATOMIC_DECREMENT(rb->num_writers);
-        ATOMIC_CAS(rb->write_sync, 1, 0);
-        return -1;
-    } 
+    if (rb->tail_cache - pos < (uint64_t)n) {
+        rb->tail_cache = atomic_load_explicit(&rb->tail, memory_order_acquire);
+        if (rb->tail_cache - pos < (uint64_t)n)
+            n = (int)(rb->tail_cache - pos);
+        if (n == 0)
+            return 0;
+    }
+    for (i = 0; i < n; i++) {
+        rqueue_slot_t *slot = &rb->slots[(pos + i) & rb->mask];
+        out[i] = slot->value;
+        slot->value = NULL;
+    }
+    atomic_store_explicit(&rb->head, pos + n, memory_order_release);
+    rqueue_wake(rb, &rb->write_futex, &rb->write_waiters, n);
+    return n;
+}
 
+int rqueue_write_batch(rqueue_t *rb, void **values, int n) {
+    uint64_t pos;
+    int i, count;
+
+    if (n <= 0)
+        return 0;
+    if (rb->spsc)
+        return rqueue_write_batch_spsc(rb, values, n);
+
+    pos = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+    for (;;) {
+        // count the free slots in a row starting at pos, readers may release them out of order
+        for (count = 0; count < n; count++) {
+            uint64_t seq = atomic_load_explicit(&rb->slots[(pos + count) & rb->mask].seq, memory_order_acquire);
+            if (seq != pos + count)
+                break;
+        }
+        if (count == 0) {
+            int64_t diff = (int64_t)(atomic_load_explicit(&rb->slots[pos & rb->mask].seq, memory_order_acquire) - pos);
+            if (diff < 0)
+                break;  // full
+            // another writer took this position
+            pos = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+            continue;
+        }
+        // claim all of them at once
+        if (atomic_compare_exchange_weak_explicit(&rb->tail, &pos, pos + count,
+                memory_order_relaxed, memory_order_relaxed))
+            break;
+    }
 
-    void *old_value = ATOMIC_READ(tail->value);
-    ATOMIC_CAS(tail->value, old_value, value);
-    if (old_value && rb->free_value_cb)
-        rb->free_value_cb(old_value);
+    for (i = 0; i < count; i++) {
+        rqueue_slot_t *slot = &rb->slots[(pos + i) & rb->mask];
+        slot->value = values[i];
+        atomic_store_explicit(&slot->seq, pos + i + 1, memory_order_release);
+    }
+    if (count > 0)
+        rqueue_wake(rb, &rb->read_futex, &rb->read_waiters, count);
+
+    // overwrite mode: the values which didn't fit drop the oldest ones
+    if (rb->mode == RQUEUE_MODE_OVERWRITE) {
+        for (; count < n; count++) {
+            if (rqueue_write(rb, values[count]) != 0)
+                break;
+        }
+    }
+    return count;
+}
 
+int rqueue_read_batch(rqueue_t *rb, void **out, int max) {
+    uint64_t pos;
+    int i, count;
+
+    if (max <= 0)
+        return 0;
+    if (rb->spsc)
+        return rqueue_read_batch_spsc(rb, out, max);
+
+    pos = atomic_load_explicit(&rb->head, memory_order_relaxed);
+    for (;;) {
+        // count the published values in a row starting at pos
+        for (count = 0; count < max; count++) {
+            uint64_t seq = atomic_load_explicit(&rb->slots[(pos + count) & rb->mask].seq, memory_order_acquire);
+            if (seq != pos + count + 1)
+                break;
+        }
+        if (count == 0) {
+            int64_t diff = (int64_t)(atomic_load_explicit(&rb->slots[pos & rb->mask].seq, memory_order_acquire) - (pos + 1));
+            if (diff < 0)
+                return 0;   // empty
+            // another reader took this position
+            pos = atomic_load_explicit(&rb->head, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&rb->head, &pos, pos + count,
+                memory_order_relaxed, memory_order_relaxed))
+            break;
+    }
 
-    ATOMIC_INCREMENT(rb->writes);
+    for (i = 0; i < count; i++) {
+        rqueue_slot_t *slot = &rb->slots[(pos + i) & rb->mask];
+        out[i] = slot->value;
+        slot->value = NULL;
+        atomic_store_explicit(&slot->seq, pos + i + rb->mask + 1, memory_order_release);
+    }
+    rqueue_wake(rb, &rb->write_futex, &rb->write_waiters, count);
+    return count;
+}
 
-    if (ATOMIC_READ(rb->num_writers) == 1)
-        ATOMIC_CAS(rb->commit, ATOMIC_READ(rb->commit), tail);
-    ATOMIC_DECREMENT(rb->num_writers);
-    ATOMIC_CAS(rb->write_sync, 1, 0);
+void *rqueue_read_wait(rqueue_t *rb, int timeout_ms) {
+    struct timespec deadline;
+    void *v = rqueue_read(rb);
+    if (v || timeout_ms == 0)
+        return v;
+
+    if (timeout_ms > 0)
+        rqueue_deadline(&deadline, timeout_ms);
+    for (;;) {
+        int timedout = 0;
+        uint32_t seq = atomic_load_explicit(&rb->read_futex, memory_order_relaxed);
+        // register before the last check, a writer publishing after it will wake us
+        atomic_fetch_add(&rb->read_waiters, 1);
+        rqueue_wait_fence(rb);
+        v = rqueue_read(rb);
+        if (!v)
+            timedout = rqueue_park(&rb->read_futex, seq, timeout_ms > 0 ? &deadline : NULL);
+        atomic_fetch_sub_explicit(&rb->read_waiters, 1, memory_order_relaxed);
+        if (v)
+            return v;
+        if (timedout)
+            return rqueue_read(rb);
+    }
+}
 
-    return 0;
+int rqueue_write_wait(rqueue_t *rb, void *value, int timeout_ms) {
+    struct timespec deadline;
+    int ret = rqueue_write(rb, value);
+    if (ret != -2 || timeout_ms == 0)
+        return ret;
+
+    if (timeout_ms > 0)
+        rqueue_deadline(&deadline, timeout_ms);
+    for (;;) {
+        int timedout = 0;
+        uint32_t seq = atomic_load_explicit(&rb->write_futex, memory_order_relaxed);
+        // register before the last check, a reader consuming after it will wake us
+        atomic_fetch_add(&rb->write_waiters, 1);
+        rqueue_wait_fence(rb);
+        ret = rqueue_write(rb, value);
+        if (ret == -2)
+            timedout = rqueue_park(&rb->write_futex, seq, timeout_ms > 0 ? &deadline : NULL);
+        atomic_fetch_sub_explicit(&rb->write_waiters, 1, memory_order_relaxed);
+        if (ret != -2)
+            return ret;
+        if (timedout)
+            return rqueue_write(rb, value);
+    }
 }
 
+// every successful write/read moves tail/head by exactly one position
 uint64_t rqueue_write_count(rqueue_t *rb) {
-    return ATOMIC_READ(rb->writes);
+    return atomic_load_explicit(&rb->tail, memory_order_relaxed);
 }
 
 uint64_t rqueue_read_count(rqueue_t *rb) {
-    return ATOMIC_READ(rb->reads);
+    return atomic_load_explicit(&rb->head, memory_order_relaxed) -
+           atomic_load_explicit(&rb->overwrites, memory_order_relaxed);
 }
 
 void rqueue_set_mode(rqueue_t *rb, rqueue_mode_t mode) {
+    if (rb->spsc)
+        return;
     rb->mode = mode;
 }
 
@@ -342,35 +518,43 @@ char *rqueue_stats(rqueue_t *rb) {
     if (!buf)
         return NULL;
 
+    uint64_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+    uint64_t overwrites = atomic_load_explicit(&rb->overwrites, memory_order_relaxed);
     snprintf(buf, 1024,
-           "reader:      %p \n"
-           "head:        %p \n"
-           "tail:        %p \n"
-           "tail_next:   %p \n"
-           "commit:      %p \n"
-           "commit_next: %p \n"
-           "reads:       %"PRId64" \n"
-           "writes:      %"PRId64" \n"
-           "mode:        %s \n",
-           ATOMIC_READ(rb->reader),
-           ATOMIC_READ(rb->head),
-           ATOMIC_READ(rb->tail),
-           ATOMIC_READ(ATOMIC_READ(rb->tail)->next),
-           ATOMIC_READ(rb->commit),
-           ATOMIC_READ(ATOMIC_READ(rb->commit)->next),
-           ATOMIC_READ(rb->reads),
-           ATOMIC_READ(rb->writes),
-           rb->mode == RQUEUE_MODE_BLOCKING ? "blocking" : "overwrite");
+           "size:        %zu \n"
+           "head:        %"PRIu64" \n"
+           "head_seq:    %"PRIu64" \n"
+           "tail:        %"PRIu64" \n"
+           "tail_seq:    %"PRIu64" \n"
+           "reads:       %"PRIu64" \n"
+           "writes:      %"PRIu64" \n"
+           "overwrites:  %"PRIu64" \n"
+           "mode:        %s%s \n",
+           rb->size,
+           head,
+           atomic_load_explicit(&rb->slots[head & rb->mask].seq, memory_order_relaxed),
+           tail,
+           atomic_load_explicit(&rb->slots[tail & rb->mask].seq, memory_order_relaxed),
+           head - overwrites,
+           tail,
+           overwrites,
+           rb->mode == RQUEUE_MODE_BLOCKING ? "blocking" : "overwrite",
+           rb->spsc ? " spsc" : "");
 
     return buf;
 }
 
 int rqueue_isempty(rqueue_t *rb)
 {
-    rqueue_page_t *head = ATOMIC_READ(rb->head);
-    rqueue_page_t *commit = ATOMIC_READ(rb->commit);
-    rqueue_page_t *tail = ATOMIC_READ(rb->tail);
-    return ((rb->reader == commit || (head == tail && commit != tail) || ATOMIC_READ(rb->writes) == 0));
+    // only a hint, no ordering needed: a following read does its own acquire
+    if (rb->spsc)
+        return atomic_load_explicit(&rb->head, memory_order_relaxed) ==
+               atomic_load_explicit(&rb->tail, memory_order_relaxed);
+
+    // empty until the value at head has been published
+    uint64_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+    return atomic_load_explicit(&rb->slots[head & rb->mask].seq, memory_order_relaxed) != head + 1;
 }
 
 size_t rqueue_size(rqueue_t *rb)
@@ -379,4 +563,4 @@ size_t rqueue_size(rqueue_t *rb)
 }
 
 // vim: tabstop=4 shiftwidth=4 expandtab:
-/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
\ No newline at end of file
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -48,7 +48,8 @@ typedef enum {
 /**
  * @brief Create a new ringbuffer descriptor
  * @param size : the size of the ringbuffer
- *               (the maximum number of pointers that can fit in the ringbuffer)
+ *               (the maximum number of pointers that can fit in the ringbuffer,
+ *                rounded up to the next power of two)
  * @param mode : the mode of the ringbuffer
  *               (RQUEUE_MODE_BLOCKING or RQUEUE_MODE_OVERWRITE)
  *               default mode is BLOCKING
@@ -57,6 +58,21 @@ typedef enum {
  */
 rqueue_t *rqueue_create(size_t size, rqueue_mode_t mode);
 
+/**
+ * @brief Create a new single-producer/single-consumer ringbuffer descriptor
+ * @param size : the size of the ringbuffer
+ *               (rounded up to the next power of two)
+ * @return a newly allocated and initialized ringbuffer
+ *
+ * Only one thread may call rqueue_write() and only one thread may call
+ * rqueue_read() on the returned ringbuffer (they can be different threads).
+ * Each side works on its own index and on a cached copy of the other one,
+ * so a write or a read is a plain load and a release store, with no
+ * atomic read-modify-write operation.
+ * The mode is always RQUEUE_MODE_BLOCKING: overwriting would require the
+ * writer to move the reader's index
+ */
+rqueue_t *rqueue_create_spsc(size_t size);
 
 /**
  * @brief Change the mode of an existing ringbuffer
@@ -85,10 +101,57 @@ int rqueue_write(rqueue_t *rb, void *value);
 /**
  * @brief Read the next value in the ringbuffer
  * @param rb : A valid pointer to a rqueue_t structure
- * @return The next value in the ringbuffer
+ * @return The next value in the ringbuffer, NULL if the ringbuffer is empty
  */
 void *rqueue_read(rqueue_t *rb);
 
+/**
+ * @brief Push several values into the ringbuffer
+ * @param rb : A valid pointer to a rqueue_t structure
+ * @param values : The pointers to store in the ringbuffer
+ * @param n : The number of pointers in values
+ * @return The number of values actually stored (0 if the buffer is full
+ *         and the mode is RQUEUE_MODE_BLOCKING)
+ *
+ * The slots are claimed with a single atomic operation, values are stored
+ * in order starting from values[0].
+ */
+int rqueue_write_batch(rqueue_t *rb, void **values, int n);
+
+/**
+ * @brief Read up to max values from the ringbuffer
+ * @param rb : A valid pointer to a rqueue_t structure
+ * @param out : Where to store the values read
+ * @param max : The maximum number of values to read
+ * @return The number of values actually read (0 if the buffer is empty)
+ *
+ * The slots are claimed with a single atomic operation
+ */
+int rqueue_read_batch(rqueue_t *rb, void **out, int max);
+
+/**
+ * @brief Read the next value, waiting for a writer if the ringbuffer is empty
+ * @param rb : A valid pointer to a rqueue_t structure
+ * @param timeout_ms : how long to wait, 0 doesn't wait, a negative value waits forever
+ * @return The next value in the ringbuffer, NULL if nothing has been written before the timeout
+ *
+ * The thread is parked on a futex only while the ringbuffer is empty and is
+ * woken up as soon as a value is written
+ */
+void *rqueue_read_wait(rqueue_t *rb, int timeout_ms);
+
+/**
+ * @brief Push a new value, waiting for a reader if the ringbuffer is full
+ * @param rb : A valid pointer to a rqueue_t structure
+ * @param value : The pointer to store in the ringbuffer
+ * @param timeout_ms : how long to wait, 0 doesn't wait, a negative value waits forever
+ * @return 0 on success, -1 on failure, -2 if the buffer is still full after the timeout
+ *
+ * The thread is parked on a futex only while the ringbuffer is full and is
+ * woken up as soon as a value is read
+ */
+int rqueue_write_wait(rqueue_t *rb, void *value, int timeout_ms);
+
 /**
  * @brief Release all resources associated to the ringbuffer
  * @param rb : A valid pointer to a rqueue_t structure
@@ -124,32 +187,16 @@ uint64_t rqueue_read_count(rqueue_t *rb);
  */
 char *rqueue_stats(rqueue_t *rb);
 
+/**
+ * @brief Returns the capacity of the ringbuffer
+ * @param rb : A valid pointer to a rqueue_t structure
+ * @return The size requested at creation rounded up to the next power of two
+ */
 size_t rqueue_size(rqueue_t *rb);
 
 int rqueue_isempty(rqueue_t *tb);
 
 
-#define ATOMIC_READ(_v) __sync_fetch_and_add(&(_v), 0)
-#define ATOMIC_INCREMENT(_v) (void)__sync_fetch_and_add(&(_v), 1)
-#define ATOMIC_DECREMENT(_v) (void)__sync_fetch_and_sub(&(_v), 1)
-#define ATOMIC_INCREASE(_v, _n) __sync_add_and_fetch(&(_v), (_n))
-#define ATOMIC_DECREASE(_v, _n) __sync_sub_and_fetch(&(_v), (_n))
-#define ATOMIC_CAS(_v, _o, _n) __sync_bool_compare_and_swap(&(_v), (_o), (_n))
-#define ATOMIC_CAS_RETURN(_v, _o, _n) __sync_val_compare_and_swap(&(_v), (_o), (_n))
-
-#define ATOMIC_SET(_v, _n) {\
-    int _b = 0;\
-    do {\
-        _b = ATOMIC_CAS(_v, ATOMIC_READ(_v), _n);\
-    } while (__builtin_expect(!_b, 0));\
-}
-
-#define ATOMIC_SET_IF(_v, _c, _n, _t) {\
-    _t _o = ATOMIC_READ(_v);\
-    while (__builtin_expect((_o _c (_n)) && !ATOMIC_CAS(_v, _o, _n), 0)) \
-        _o = ATOMIC_READ(_v);\
-}
-
 #ifdef __cplusplus
 }
 #endif
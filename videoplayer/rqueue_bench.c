@@ -0,0 +1,317 @@
+// rqueue 的性能测试, 输出每个元素的平均耗时
+// 单线程: 同一个线程里写入一批再读出一批, 测的是队列操作本身的开销
+// 双线程: 一个写线程一个读线程, 队列满/空时 sched_yield, 测的是跨线程交接的开销
+// batch 为 1 时使用 rqueue_write/rqueue_read, 大于 1 时使用 rqueue_write_batch/rqueue_read_batch
+// 最后输出一次 rqueue_isempty 的耗时
+// mpmc 还会检查批量唤醒: 多个线程阻塞在 rqueue_read_wait/rqueue_write_wait 上时,
+// 一次 rqueue_write_batch/rqueue_read_batch 要把它们全部唤醒, 输出最后一个被唤醒的耗时
+// 有多个 cpu 时写线程和读线程绑定在不同的 cpu 上, 这样才能看到缓存行在核之间来回传递的开销,
+// 和 rqueue_bench_compact(不按缓存行对齐的布局)对比伪共享的影响
+//
+// ./rqueue_bench -n 4000000 -s 1024 -b 1,4,16,64 -m spsc
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "rqueue.h"
+
+#define BENCH_MAX_BATCH (1024)
+#define BENCH_WAITERS (3)
+#define BENCH_WAIT_MS (2000)   // 等待超时, 到超时才返回说明没有被唤醒
+
+typedef struct bench_s {
+    rqueue_t *rb;
+    uint64_t items;
+    int batch;
+    uint64_t sum;       // 读线程收到的值之和, 用来检查有没有丢失
+} bench_t;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 只有一个 cpu 时不绑定
+static void bench_pin(int cpu) {
+    cpu_set_t set;
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static rqueue_t *bench_create(int spsc, size_t size) {
+    return spsc ? rqueue_create_spsc(size) : rqueue_create(size, RQUEUE_MODE_BLOCKING);
+}
+
+static int bench_write(bench_t *b, void **values, int n) {
+    if (b->batch == 1)
+        return rqueue_write(b->rb, values[0]) == 0 ? 1 : 0;
+    return rqueue_write_batch(b->rb, values, n);
+}
+
+static int bench_read(bench_t *b, void **out) {
+    if (b->batch == 1) {
+        out[0] = rqueue_read(b->rb);
+        return out[0] ? 1 : 0;
+    }
+    return rqueue_read_batch(b->rb, out, b->batch);
+}
+
+static void *bench_producer(void *arg) {
+    bench_t *b = arg;
+    void *values[BENCH_MAX_BATCH];
+    uint64_t next = 1;
+
+    bench_pin(0);
+    while (next <= b->items) {
+        int i, n = b->batch;
+        if ((uint64_t)n > b->items - next + 1)
+            n = (int)(b->items - next + 1);
+        for (i = 0; i < n; i++)
+            values[i] = (void *)(uintptr_t)(next + i);
+        int done = 0;
+        while (done < n) {
+            int ret = bench_write(b, values + done, n - done);
+            if (ret == 0)
+                sched_yield();
+            done += ret;
+        }
+        next += n;
+    }
+    return NULL;
+}
+
+static void *bench_consumer(void *arg) {
+    bench_t *b = arg;
+    void *out[BENCH_MAX_BATCH];
+    uint64_t count = 0;
+
+    bench_pin(1);
+    while (count < b->items) {
+        int i, n = bench_read(b, out);
+        if (n == 0) {
+            sched_yield();
+            continue;
+        }
+        for (i = 0; i < n; i++)
+            b->sum += (uintptr_t)out[i];
+        count += n;
+    }
+    return NULL;
+}
+
+// 返回每个元素的耗时(ns), 出错返回 -1
+static double bench_single(int spsc, size_t size, uint64_t items, int batch) {
+    bench_t b;
+    void *values[BENCH_MAX_BATCH];
+    void *out[BENCH_MAX_BATCH];
+    uint64_t i, count = 0;
+    int j;
+
+    memset(&b, 0, sizeof(b));
+    b.rb = bench_create(spsc, size);
+    b.batch = batch;
+    for (j = 0; j < batch; j++)
+        values[j] = (void *)(uintptr_t)(j + 1);
+
+    uint64_t start = now_ns();
+    for (i = 0; i < items; i += batch) {
+        int n = 0;
+        while (n < batch)
+            n += bench_write(&b, values + n, batch - n);
+        while (n > 0) {
+            int got = bench_read(&b, out);
+            n -= got;
+            count += got;
+        }
+    }
+    uint64_t cost = now_ns() - start;
+    rqueue_destroy(b.rb);
+    return (double)cost / count;
+}
+
+static double bench_threads(int spsc, size_t size, uint64_t items, int batch) {
+    bench_t b;
+    pthread_t producer, consumer;
+
+    memset(&b, 0, sizeof(b));
+    b.rb = bench_create(spsc, size);
+    b.items = items;
+    b.batch = batch;
+
+    uint64_t start = now_ns();
+    pthread_create(&consumer, NULL, bench_consumer, &b);
+    pthread_create(&producer, NULL, bench_producer, &b);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+    uint64_t cost = now_ns() - start;
+
+    rqueue_destroy(b.rb);
+    if (b.sum != items * (items + 1) / 2) {
+        printf("value lost: sum %lu expect %lu\n", (unsigned long)b.sum, (unsigned long)(items * (items + 1) / 2));
+        return -1;
+    }
+    return (double)cost / items;
+}
+
+// rqueue_isempty 只读不写, 轮询队列状态时的开销
+static double bench_isempty(int spsc, size_t size, uint64_t items) {
+    rqueue_t *rb = bench_create(spsc, size);
+    uint64_t i, empty = 0;
+
+    rqueue_write(rb, (void *)1);
+    uint64_t start = now_ns();
+    for (i = 0; i < items; i++)
+        empty += rqueue_isempty(rb);
+    uint64_t cost = now_ns() - start;
+    rqueue_destroy(rb);
+    return empty == 0 ? (double)cost / items : -1;
+}
+
+typedef struct bench_waiter_s {
+    rqueue_t *rb;
+    int ok;             // 在超时之前拿到了数据(或写入成功)
+    uint64_t wake_ns;
+} bench_waiter_t;
+
+static void *bench_wait_reader(void *arg) {
+    bench_waiter_t *w = arg;
+    w->ok = rqueue_read_wait(w->rb, BENCH_WAIT_MS) != NULL;
+    w->wake_ns = now_ns();
+    return NULL;
+}
+
+static void *bench_wait_writer(void *arg) {
+    bench_waiter_t *w = arg;
+    w->ok = rqueue_write_wait(w->rb, (void *)1, BENCH_WAIT_MS) == 0;
+    w->wake_ns = now_ns();
+    return NULL;
+}
+
+// writer 为 0 时阻塞读线程, 再一次写入 BENCH_WAITERS 个元素;
+// 为 1 时先写满队列再阻塞写线程, 再一次读出 BENCH_WAITERS 个元素
+// 返回最后一个线程被唤醒的耗时(ms), 有线程没被唤醒返回 -1
+static double bench_wakeup(int writer) {
+    rqueue_t *rb = rqueue_create(BENCH_WAITERS, RQUEUE_MODE_BLOCKING);
+    bench_waiter_t waiters[BENCH_WAITERS];
+    pthread_t threads[BENCH_WAITERS];
+    void *values[BENCH_MAX_BATCH];
+    int i, lost = 0;
+
+    for (i = 0; i < BENCH_WAITERS; i++)
+        values[i] = (void *)(uintptr_t)(i + 1);
+    if (writer) {
+        while (rqueue_write(rb, (void *)1) == 0)
+            ;
+    }
+    for (i = 0; i < BENCH_WAITERS; i++) {
+        waiters[i].rb = rb;
+        waiters[i].ok = 0;
+        pthread_create(&threads[i], NULL, writer ? bench_wait_writer : bench_wait_reader, &waiters[i]);
+    }
+    // 等所有线程都阻塞在 futex 上
+    usleep(200000);
+
+    uint64_t start = now_ns(), last = start;
+    int done = 0;
+    while (done < BENCH_WAITERS) {
+        if (writer)
+            done += rqueue_read_batch(rb, values, BENCH_WAITERS - done);
+        else
+            done += rqueue_write_batch(rb, values + done, BENCH_WAITERS - done);
+    }
+    for (i = 0; i < BENCH_WAITERS; i++) {
+        pthread_join(threads[i], NULL);
+        // 超时后的最后一次检查也能拿到数据, 所以还要看返回的时间
+        if (!waiters[i].ok || waiters[i].wake_ns - start >= (uint64_t)BENCH_WAIT_MS / 2 * 1000000)
+            lost++;
+        if (waiters[i].wake_ns > last)
+            last = waiters[i].wake_ns;
+    }
+    rqueue_destroy(rb);
+    if (lost) {
+        printf("%s: %d of %d waiters not woken up\n", writer ? "read_batch" : "write_batch", lost, BENCH_WAITERS);
+        return -1;
+    }
+    return (double)(last - start) / 1000000;
+}
+
+static void usage() {
+    printf("usage: rqueue_bench [options]\n"
+        "  -n items     每项测试的元素个数, 默认 4000000\n"
+        "  -s size      队列大小, 默认 1024\n"
+        "  -b list      批量大小, 逗号分隔, 默认 1,2,4,8,16,32,64\n"
+        "  -m mode      mpmc, spsc 或 all, 默认 all\n");
+}
+
+int main(int argc, char **argv) {
+    uint64_t items = 4000000;
+    size_t size = 1024;
+    const char *batch_list = "1,2,4,8,16,32,64";
+    const char *mode = "all";
+    int batches[64];
+    int nbatch = 0;
+    int opt, spsc;
+
+    while ((opt = getopt(argc, argv, "n:s:b:m:")) != -1) {
+        switch (opt) {
+        case 'n': items = strtoull(optarg, NULL, 10); break;
+        case 's': size = strtoul(optarg, NULL, 10); break;
+        case 'b': batch_list = optarg; break;
+        case 'm': mode = optarg; break;
+        default: usage(); return 1;
+        }
+    }
+
+    const char *p = batch_list;
+    while (*p && nbatch < 64) {
+        int batch = atoi(p);
+        if (batch <= 0 || batch > BENCH_MAX_BATCH || (size_t)batch > size) {
+            printf("invalid batch size %d, must be in [1, min(%d, size)]\n", batch, BENCH_MAX_BATCH);
+            return 1;
+        }
+        batches[nbatch++] = batch;
+        p = strchr(p, ',');
+        if (!p)
+            break;
+        p++;
+    }
+    if (items == 0 || nbatch == 0 || (strcmp(mode, "mpmc") && strcmp(mode, "spsc") && strcmp(mode, "all"))) {
+        usage();
+        return 1;
+    }
+
+    printf("items:%lu size:%zu cpus:%ld\n", (unsigned long)items, size, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-6s %-6s %12s %12s\n", "mode", "batch", "1 thread", "2 threads");
+    for (spsc = 0; spsc <= 1; spsc++) {
+        if (strcmp(mode, "all") && strcmp(mode, spsc ? "spsc" : "mpmc"))
+            continue;
+        int i;
+        for (i = 0; i < nbatch; i++) {
+            double single = bench_single(spsc, size, items, batches[i]);
+            double threads = bench_threads(spsc, size, items, batches[i]);
+            if (threads < 0)
+                return 1;
+            printf("%-6s %-6d %9.2f ns %9.2f ns\n", spsc ? "spsc" : "mpmc", batches[i], single, threads);
+        }
+        printf("%-6s isempty %8.2f ns\n", spsc ? "spsc" : "mpmc", bench_isempty(spsc, size, items));
+        if (spsc)
+            continue;
+        double readers = bench_wakeup(0);
+        double writers = bench_wakeup(1);
+        if (readers < 0 || writers < 0)
+            return 1;
+        printf("%-6s wakeup  %d readers %.2f ms, %d writers %.2f ms\n", "mpmc",
+            BENCH_WAITERS, readers, BENCH_WAITERS, writers);
+    }
+    return 0;
+}
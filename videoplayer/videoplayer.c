@@ -485,10 +485,9 @@ int decode_video(void *arg) {
 
     while (ps->isQuit == false) {
 
-        AVPacket *packet = rqueue_read(ps->packetVideoQueue);
+        // 队列为空时等待写入, 超时后回去检查是否退出
+        AVPacket *packet = rqueue_read_wait(ps->packetVideoQueue, 100);
         if (packet == NULL) {
-            //printf("rqueue_read packetVideoQueue error\n");
-            SDL_Delay(100);
             continue;
         }
 
@@ -529,14 +528,10 @@ int decode_video(void *arg) {
                 }
 
                 video_frame_count++;
-                // 写入环形队列
+                // 写入环形队列, 队列满时等待读出, 超时后检查是否退出
                 do 
                 {
-                    ret = rqueue_write(ps->frameVideoQueue, filt_frame);
-                    if (ret != 0) {
-                        SDL_Delay(100);
-                        //printf("rqueue_write frameVideoQueue error %d:%d\n", ret, video_frame_count);
-                    }
+                    ret = rqueue_write_wait(ps->frameVideoQueue, filt_frame, 100);
                 } while (ret != 0 && ps->isQuit == false);
             }
 
@@ -560,7 +555,8 @@ static void sdl_audio_callback(void *arg, unsigned char *stream, int len) {
 
     while (len > 0) {
         
-        AVFrame *frame = rqueue_read(ps->frameAudioQueue);
+        // 不能在 SDL 的音频线程里长时间等待, 没有数据时剩下的部分输出静音
+        AVFrame *frame = rqueue_read_wait(ps->frameAudioQueue, 10);
         if (frame != NULL) {
 
             printf("frame fmt:%d freq:%d channels:%d\n", 
@@ -604,7 +600,7 @@ static void sdl_audio_callback(void *arg, unsigned char *stream, int len) {
             printf("audio len:%d %d\n", len, data_size);
 
         } else {
-            SDL_Delay(100);
+            break;
         }
     }
 }
@@ -618,10 +614,9 @@ int decode_audio(void *arg) {
 
     while (ps->isQuit == false) {
 
-        AVPacket *packet = rqueue_read(ps->packetAudioQueue);
+        // 队列为空时等待写入, 超时后回去检查是否退出
+        AVPacket *packet = rqueue_read_wait(ps->packetAudioQueue, 100);
         if (packet == NULL) {
-            //printf("rqueue_read packetAudioQueue error\n");
-            SDL_Delay(100);
             continue;
         }
 
@@ -645,14 +640,10 @@ int decode_audio(void *arg) {
             }
             audio_frame_count++;
 
-            // 写入环形队列
+            // 写入环形队列, 队列满时等待读出, 超时后检查是否退出
             do 
             {
-                ret = rqueue_write(ps->frameAudioQueue, frame);
-                if (ret != 0) {
-                    SDL_Delay(100);
-                    //printf("rqueue_write frameAudioQueue error %d:%d\n", ret, audio_frame_count);
-                }
+                ret = rqueue_write_wait(ps->frameAudioQueue, frame, 100);
             } while (ret != 0 && ps->isQuit == false);
         }
     }
@@ -678,25 +669,17 @@ int do_read_file(void *arg) {
             // 如果是视频数据
             if (packet->stream_index == ps->videoIndex) {
                 video_packet_count++;
-                // 写入环形队列
+                // 写入环形队列, 队列满时等待读出, 超时后检查是否退出
                 do 
                 {
-                    ret = rqueue_write(ps->packetVideoQueue, packet);
-                    if (ret != 0) {
-                        SDL_Delay(100);
-                        //printf("rqueue_write packetVideoQueue error %d:%d\n", ret, video_packet_count);
-                    }
+                    ret = rqueue_write_wait(ps->packetVideoQueue, packet, 100);
                 } while (ret != 0 && ps->isQuit == false);
             } else if (packet->stream_index == ps->audioIndex) {
                 audio_packet_count++;
-                // 写入环形队列
+                // 写入环形队列, 队列满时等待读出, 超时后检查是否退出
                 do 
                 {
-                    ret = rqueue_write(ps->packetAudioQueue, packet);
-                    if (ret != 0) {
-                        SDL_Delay(100);
-                        //printf("rqueue_write packetAudioQueue error %d:%d\n", ret, video_packet_count);
-                    }
+                    ret = rqueue_write_wait(ps->packetAudioQueue, packet, 100);
                 } while (ret != 0 && ps->isQuit == false);
             }
         } else {
@@ -835,28 +818,23 @@ void event_loop(playerState *ps) {
             }
         }
 
+        // 队列为空时等待解码线程, 有新帧立即返回, 超时后回去处理窗口事件
         AVFrame *render_frame = NULL;
-        if (rqueue_isempty(ps->frameVideoQueue)) {
-            free_pause_frame(ps);
-            SDL_Delay(100);
-            //printf("frameVideoQueue is empty!\n");
-        } else {
-            if (ps->isPause == true) {
+        if (ps->isPause == true) {
 
-                if (ps->isNext == true) {
-                    free_pause_frame(ps);
-                    ps->isNext = false;
-                }
-
-                if (ps->pPauseFrame == NULL) {
-                    ps->pPauseFrame = rqueue_read(ps->frameVideoQueue);
-                }
-
-                render_frame = ps->pPauseFrame;
-            } else {
+            if (ps->isNext == true) {
                 free_pause_frame(ps);
-                render_frame = rqueue_read(ps->frameVideoQueue);
+                ps->isNext = false;
             }
+
+            if (ps->pPauseFrame == NULL) {
+                ps->pPauseFrame = rqueue_read_wait(ps->frameVideoQueue, 100);
+            }
+
+            render_frame = ps->pPauseFrame;
+        } else {
+            free_pause_frame(ps);
+            render_frame = rqueue_read_wait(ps->frameVideoQueue, 100);
         }
 
         if (render_frame != NULL) {
@@ -900,25 +878,26 @@ int init_playerState(playerState *ps) {
 
     ps->renderFrameCount = 0;
 
-    ps->packetVideoQueue = rqueue_create(QUEUE_BUFF_LEN, RQUEUE_MODE_BLOCKING);
+    // 每个队列只有一个写线程和一个读线程
+    ps->packetVideoQueue = rqueue_create_spsc(QUEUE_BUFF_LEN);
     if (ps->packetVideoQueue == NULL) {
         printf("rqueue_create error\n");
         return __LINE__;
     }
 
-    ps->frameVideoQueue = rqueue_create(QUEUE_BUFF_LEN, RQUEUE_MODE_BLOCKING);
+    ps->frameVideoQueue = rqueue_create_spsc(QUEUE_BUFF_LEN);
     if (ps->frameVideoQueue == NULL) {
         printf("rqueue_create error\n");
         return __LINE__;
     }
 
-    ps->packetAudioQueue = rqueue_create(QUEUE_BUFF_LEN, RQUEUE_MODE_BLOCKING);
+    ps->packetAudioQueue = rqueue_create_spsc(QUEUE_BUFF_LEN);
     if (ps->packetAudioQueue == NULL) {
         printf("rqueue_create error\n");
         return __LINE__;
     }
 
-    ps->frameAudioQueue = rqueue_create(QUEUE_BUFF_LEN, RQUEUE_MODE_BLOCKING);
+    ps->frameAudioQueue = rqueue_create_spsc(QUEUE_BUFF_LEN);
     if (ps->frameAudioQueue == NULL) {
         printf("rqueue_create error\n");
         return __LINE__;